@@ -8,6 +8,7 @@
         "./vendor/efsw/src/efsw/DirWatcherGeneric.cpp",
         "./vendor/efsw/src/efsw/DirectorySnapshot.cpp",
         "./vendor/efsw/src/efsw/DirectorySnapshotDiff.cpp",
+        "./vendor/efsw/src/efsw/FileActionBatch.cpp",
         "./vendor/efsw/src/efsw/FileInfo.cpp",
         "./vendor/efsw/src/efsw/FileSystem.cpp",
         "./vendor/efsw/src/efsw/FileWatcher.cpp",
@@ -15,14 +16,21 @@
         "./vendor/efsw/src/efsw/FileWatcherFSEvents.cpp",
         "./vendor/efsw/src/efsw/FileWatcherGeneric.cpp",
         "./vendor/efsw/src/efsw/FileWatcherImpl.cpp",
+        "./vendor/efsw/src/efsw/FileWatcherFanotify.cpp",
         "./vendor/efsw/src/efsw/FileWatcherInotify.cpp",
         "./vendor/efsw/src/efsw/FileWatcherKqueue.cpp",
+        "./vendor/efsw/src/efsw/FileWatcherUsnJournal.cpp",
         "./vendor/efsw/src/efsw/FileWatcherWin32.cpp",
+        "./vendor/efsw/src/efsw/InternedPath.cpp",
         "./vendor/efsw/src/efsw/Log.cpp",
         "./vendor/efsw/src/efsw/Mutex.cpp",
+        "./vendor/efsw/src/efsw/PathFilter.cpp",
+        "./vendor/efsw/src/efsw/Probes.cpp",
+        "./vendor/efsw/src/efsw/ScanScheduler.cpp",
         "./vendor/efsw/src/efsw/String.cpp",
         "./vendor/efsw/src/efsw/System.cpp",
         "./vendor/efsw/src/efsw/Thread.cpp",
+        "./vendor/efsw/src/efsw/Trace.cpp",
         "./vendor/efsw/src/efsw/Watcher.cpp",
         "./vendor/efsw/src/efsw/WatcherFSEvents.cpp",
         "./vendor/efsw/src/efsw/WatcherGeneric.cpp",
@@ -41,6 +49,7 @@
             "./vendor/efsw/src/efsw/WatcherFSEvents.cpp",
             "./vendor/efsw/src/efsw/WatcherInotify.cpp",
             "./vendor/efsw/src/efsw/FileWatcherKqueue.cpp",
+            "./vendor/efsw/src/efsw/FileWatcherFanotify.cpp",
             "./vendor/efsw/src/efsw/FileWatcherInotify.cpp",
             "./vendor/efsw/src/efsw/FileWatcherFSEvents.cpp"
           ],
@@ -66,21 +75,21 @@
             "./vendor/efsw/src/efsw/WatcherFSEvents.cpp",
             "./vendor/efsw/src/efsw/WatcherWin32.cpp",
             "./vendor/efsw/src/efsw/FileWatcherKqueue.cpp",
+            "./vendor/efsw/src/efsw/FileWatcherUsnJournal.cpp",
             "./vendor/efsw/src/efsw/FileWatcherWin32.cpp",
             "./vendor/efsw/src/efsw/FileWatcherFSEvents.cpp"
           ],
           "libraries": [
             "-lpthread"
-          ],
-          "defines": [
-            "EFSW_VERBOSE"
           ]
         }],
         ["OS==\"mac\"", {
           "sources!": [
             "./vendor/efsw/src/efsw/WatcherInotify.cpp",
             "./vendor/efsw/src/efsw/WatcherWin32.cpp",
+            "./vendor/efsw/src/efsw/FileWatcherFanotify.cpp",
             "./vendor/efsw/src/efsw/FileWatcherInotify.cpp",
+            "./vendor/efsw/src/efsw/FileWatcherUsnJournal.cpp",
             "./vendor/efsw/src/efsw/FileWatcherWin32.cpp"
           ],
           "defines": [
@@ -111,8 +120,18 @@
         "VCCLCompilerTool": {"ExceptionHandling": 1},
       },
       "sources": [
+        "lib/change-log.cc",
+        "lib/change-log.h",
         "lib/core.cc",
-        "lib/core.h"
+        "lib/core.h",
+        "lib/digest.cc",
+        "lib/digest.h",
+        "lib/event-subject.cc",
+        "lib/event-subject.h",
+        "lib/handle-index.cc",
+        "lib/handle-index.h",
+        "lib/tree-index.cc",
+        "lib/tree-index.h"
       ],
       "include_dirs": [
         "<!(node -p \"require('node-addon-api').include_dir\")",
@@ -122,7 +141,9 @@
         ['OS=="mac"', {
           "sources+": [
             "lib/platform/FSEventsFileWatcher.cpp",
-            "lib/platform/KqueueFileWatcher.cpp"
+            "lib/platform/KqueueFileWatcher.cpp",
+            "lib/platform/MacFileWatcher.cpp",
+            "lib/platform/PathTrie.cpp"
           ],
           "defines+": [
             "USE_KQUEUE"
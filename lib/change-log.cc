@@ -0,0 +1,80 @@
+#include "change-log.h"
+#include "include/efsw/MemoryCost.hpp"
+#include <algorithm>
+
+ChangeLog::ChangeLog(size_t capacity, uint64_t startedAt)
+    : capacity(std::max<size_t>(capacity, 1)), forgottenThrough(startedAt) {}
+
+void ChangeLog::Record(const std::string &path, uint64_t sequence) {
+  latest[path] = sequence;
+  entries.push_back({sequence, path});
+
+  // A file written over and over leaves a trail of replaced entries behind
+  // it. Clearing them out first means only real changes count against the
+  // capacity.
+  if (entries.size() > capacity && latest.size() <= capacity / 2)
+    Compact();
+
+  while (entries.size() > capacity) {
+    const Entry &oldest = entries.front();
+    auto it = latest.find(oldest.path);
+    if (it != latest.end() && it->second == oldest.sequence) {
+      // Whoever hasn't seen this one yet has to start over.
+      latest.erase(it);
+      forgottenThrough = oldest.sequence;
+    }
+    entries.pop_front();
+  }
+}
+
+void ChangeLog::Reset(uint64_t sequence) {
+  entries.clear();
+  latest.clear();
+  forgottenThrough = sequence;
+}
+
+void ChangeLog::Compact() {
+  std::deque<Entry> kept;
+  for (auto &entry : entries) {
+    auto it = latest.find(entry.path);
+    if (it != latest.end() && it->second == entry.sequence)
+      kept.push_back(std::move(entry));
+  }
+  entries.swap(kept);
+}
+
+ChangeSet ChangeLog::Since(uint64_t cursor, uint64_t now,
+                           size_t maxPaths) const {
+  ChangeSet result;
+  result.cursor = now;
+  if (cursor < forgottenThrough) {
+    result.freshInstance = true;
+    return result;
+  }
+
+  auto first = std::partition_point(
+      entries.begin(), entries.end(),
+      [cursor](const Entry &entry) { return entry.sequence <= cursor; });
+  for (auto it = first; it != entries.end(); ++it) {
+    auto found = latest.find(it->path);
+    if (found == latest.end() || found->second != it->sequence)
+      continue;
+    if (maxPaths > 0 && result.paths.size() == maxPaths) {
+      // There's more. Pick up right after the last one we're returning.
+      result.cursor = latest.at(result.paths.back());
+      break;
+    }
+    result.paths.push_back(it->path);
+  }
+  return result;
+}
+
+size_t ChangeLog::MemoryUsage() const {
+  size_t bytes = efsw::MemoryCost::deque(entries) +
+                 efsw::MemoryCost::hash(latest);
+  for (auto &entry : entries)
+    bytes += efsw::MemoryCost::string(entry.path);
+  for (auto &it : latest)
+    bytes += efsw::MemoryCost::string(it.first);
+  return bytes;
+}
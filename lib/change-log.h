@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// What `ChangeLog::Since` found.
+struct ChangeSet {
+  // Every path that changed after the cursor, each of them once, in the order
+  // of their latest changes.
+  std::vector<std::string> paths;
+  // The cursor to ask with next time.
+  uint64_t cursor = 0;
+  // Set when the log can't say what changed since the cursor, because it
+  // started after it or has forgotten some of what came after it. The caller
+  // has to look at everything again.
+  bool freshInstance = false;
+};
+
+// A bounded record of the paths that changed under one watch, for consumers
+// that would rather ask what changed now and then than hear about every
+// event. Each change is stamped with a sequence number from a counter the
+// caller shares between its logs, so that a cursor from one log is never
+// mistaken for a position in another. Not thread-safe.
+class ChangeLog {
+public:
+  // `startedAt` is a sequence number taken as the log starts; no cursor
+  // before it can be answered, so a cursor of `0` never can.
+  ChangeLog(size_t capacity, uint64_t startedAt);
+
+  void Record(const std::string &path, uint64_t sequence);
+  // Forgets everything, as of `sequence`, because changes went by that the
+  // log never heard about.
+  void Reset(uint64_t sequence);
+  // Gathers the paths that changed after `cursor`, or only the first
+  // `maxPaths` of them when that's nonzero. `now` is the latest sequence
+  // number handed out, which becomes the cursor once everything is returned.
+  ChangeSet Since(uint64_t cursor, uint64_t now, size_t maxPaths) const;
+  // Roughly how many bytes the entries and their paths hold.
+  size_t MemoryUsage() const;
+
+private:
+  // Drops the entries that a later change to the same path has replaced.
+  void Compact();
+
+  struct Entry {
+    uint64_t sequence;
+    std::string path;
+  };
+  size_t capacity;
+  // In order of `sequence`, including replaced entries until `Compact` gets
+  // to them.
+  std::deque<Entry> entries;
+  // The sequence number of each path's latest change.
+  std::unordered_map<std::string, uint64_t> latest;
+  // Cursors before this can't be answered.
+  uint64_t forgottenThrough;
+};
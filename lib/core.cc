@@ -1,42 +1,148 @@
 #include "core.h"
+#include "digest.h"
+#include "tree-index.h"
+#include "include/efsw/MemoryCost.hpp"
+#include "include/efsw/Probes.hpp"
+#include "include/efsw/Trace.hpp"
 #include "include/efsw/efsw.hpp"
 #include "napi.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <uv.h>
 
 #ifdef DEBUG
 #include <iostream>
 #endif
 
-#ifdef __APPLE__
+// On Windows, `uv.h` brings in `windows.h` for us.
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #endif
 
 #ifdef _WIN32
-// Stub out this function on Windows. For now we don't have a need to compare
-// watcher start times to file creation/modification times, so this isn't
-// necessary. (Likewise, we're careful to conceal `PredatesWatchStart` calls
-// behind `#ifdef`s, so we don’t need to define it at all.)
-static int Now() { return 0; }
-#else
+static std::wstring ToWide(const std::string &path) {
+  int length = MultiByteToWideChar(CP_UTF8, 0, path.data(),
+                                   static_cast<int>(path.size()), nullptr, 0);
+  std::wstring result(length, L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()),
+                      &result[0], length);
+  return result;
+}
+#endif
 
-// Returns the current Unix timestamp.
-static timeval Now() {
-  struct timeval tv;
-  gettimeofday(&tv, nullptr);
-  return tv;
+// Feeds a file to `hasher` a chunk at a time. Returns 0, or the `errno` (a
+// Win32 error code on Windows) that got in the way.
+template <typename Hasher>
+static int HashFile(const std::string &path, Hasher &hasher) {
+  static const size_t kChunkSize = 64 * 1024;
+  std::unique_ptr<uint8_t[]> chunk(new uint8_t[kChunkSize]);
+#ifdef _WIN32
+  HANDLE file = CreateFileW(
+      ToWide(path).c_str(), GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return GetLastError();
+  int error = 0;
+  for (;;) {
+    DWORD count = 0;
+    if (!ReadFile(file, chunk.get(), static_cast<DWORD>(kChunkSize), &count,
+                  nullptr)) {
+      error = GetLastError();
+      break;
+    }
+    if (count == 0)
+      break;
+    hasher.Update(chunk.get(), count);
+  }
+  CloseHandle(file);
+#else
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+  int error = 0;
+  for (;;) {
+    ssize_t count = read(fd, chunk.get(), kChunkSize);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      error = errno;
+      break;
+    }
+    if (count == 0)
+      break;
+    hasher.Update(chunk.get(), static_cast<size_t>(count));
+  }
+  close(fd);
+#endif
+  return error;
 }
 
-// Given a Unix timestamp and a file `timespec`, decides whether the file’s
-// timestamp predates the Unix timestamp. Used to compare creation/modification
-// times to arbitrary points in time.
-static bool PredatesWatchStart(struct timespec fileSpec, timeval startTime) {
-  bool fileEventOlder = fileSpec.tv_sec < startTime.tv_sec ||
-                        ((fileSpec.tv_sec == startTime.tv_sec) &&
-                         ((fileSpec.tv_nsec / 1000) < startTime.tv_usec));
-  return fileEventOlder;
+// Puts the SHA-1 digest of a file, as hex, in `digest`. Returns what
+// `HashFile` does.
+static int DigestFile(const std::string &path, std::string &digest) {
+  Sha1 sha1;
+  int error = HashFile(path, sha1);
+  if (error == 0)
+    digest = sha1.HexDigest();
+  return error;
 }
+
+static bool ReadFingerprint(const std::string &path,
+                            FileFingerprint &fingerprint) {
+#ifdef _WIN32
+  HANDLE file = CreateFileW(
+      ToWide(path).c_str(), 0,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      OPEN_EXISTING, 0, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+  BY_HANDLE_FILE_INFORMATION info;
+  bool ok = GetFileInformationByHandle(file, &info) &&
+            !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+  CloseHandle(file);
+  if (!ok)
+    return false;
+  // `FILETIME`s count in hundreds of nanoseconds.
+  auto toNs = [](FILETIME time) {
+    return static_cast<int64_t>((uint64_t(time.dwHighDateTime) << 32) |
+                                time.dwLowDateTime) *
+           100;
+  };
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  fingerprint.size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+  fingerprint.modifiedNs = toNs(info.ftLastWriteTime);
+  fingerprint.inode =
+      (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+  fingerprint.takenNs = toNs(now);
+#else
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+    return false;
+#ifdef __APPLE__
+  const struct timespec &modified = info.st_mtimespec;
+#else
+  const struct timespec &modified = info.st_mtim;
 #endif
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  fingerprint.size = static_cast<uint64_t>(info.st_size);
+  fingerprint.modifiedNs =
+      int64_t(modified.tv_sec) * 1000000000LL + modified.tv_nsec;
+  fingerprint.inode = static_cast<uint64_t>(info.st_ino);
+  fingerprint.takenNs = int64_t(now.tv_sec) * 1000000000LL + now.tv_nsec;
+#endif
+  return true;
+}
 
 static Napi::BigInt WatcherHandleToBigInt(Napi::Env env, efsw::WatchID handle) {
   int64_t handleAsInt64 = static_cast<int64_t>(handle);
@@ -53,21 +159,59 @@ static efsw::WatchID BigIntToWatcherHandle(Napi::BigInt value) {
   return handle;
 }
 
-static std::string EventType(efsw::Action action, bool isChild) {
+// Whether `value` could be a handle we gave JavaScript: a `BigInt`, or a
+// number with `smallHandles`.
+static bool IsHandle(Napi::Value value) {
+  return value.IsBigInt() || value.IsNumber();
+}
+
+// Every event name we send to JavaScript. Packed batches refer to these by
+// index, so `PACKED_EVENT_NAMES` in `src/main.js` must list them in the same
+// order, as must the codes in `event-subject.h`.
+static const char *const kEventNames[] = {
+    "unknown",      "create",   "child-create", "delete",
+    "child-delete", "change",   "child-change", "rename",
+    "child-rename", "overflow", "armed",        "throttled"};
+
+static uint32_t EventCode(efsw::Action action, bool isChild) {
+  if (action == OverflowAction)
+    return kOverflowEvent;
+  if (action == ArmedAction)
+    return kArmedEvent;
+  if (action == ThrottledAction)
+    return kThrottledEvent;
   switch (action) {
   case efsw::Actions::Add:
-    return isChild ? "child-create" : "create";
+    return isChild ? kChildCreateEvent : kCreateEvent;
   case efsw::Actions::Delete:
-    return isChild ? "child-delete" : "delete";
+    return isChild ? kChildDeleteEvent : kDeleteEvent;
   case efsw::Actions::Modified:
-    return isChild ? "child-change" : "change";
+    return isChild ? kChildChangeEvent : kChangeEvent;
   case efsw::Actions::Moved:
-    return isChild ? "child-rename" : "rename";
+    return isChild ? kChildRenameEvent : kRenameEvent;
   default:
-    return "unknown";
+    return kUnknownEvent;
   }
 }
 
+static std::string EventType(efsw::Action action, bool isChild) {
+  return kEventNames[EventCode(action, isChild)];
+}
+
+// Why an event was dropped on purpose, as the `drop` probe tells it (see
+// `efsw/Probes.hpp`).
+enum DropReason : uint32_t {
+  // It didn't pass a path filter or the watch's patterns.
+  kDropFiltered = 1,
+  // Its file hashed or fingerprinted the same as before.
+  kDropUnchanged = 2,
+  // Nothing on disk matched it (see `IsFalsePositive`).
+  kDropFalsePositive = 3,
+  // A queue on its way to JavaScript was full, so it's summed up by an
+  // overflow.
+  kDropQueueFull = 4
+};
+
 // This is a bit hacky, but it allows us to stop invoking callbacks more
 // quickly when the environment is terminating.
 static bool EnvIsStopping(Napi::Env env) {
@@ -75,11 +219,8 @@ static bool EnvIsStopping(Napi::Env env) {
   return pw->isStopping;
 }
 
-// Ensure a given path has a trailing separator for comparison purposes.
-static std::string NormalizePath(std::string path) {
-  if (path.back() == PATH_SEPARATOR)
-    return path;
-  return path + PATH_SEPARATOR;
+static const HandleIndex *SmallHandles(Napi::Env env) {
+  return env.GetInstanceData<PathWatcher>()->SmallHandles();
 }
 
 static void StripTrailingSlashFromPath(std::string &path) {
@@ -88,461 +229,5046 @@ static void StripTrailingSlashFromPath(std::string &path) {
   path.pop_back();
 }
 
-static bool PathsAreEqual(std::string pathA, std::string pathB) {
-  return NormalizePath(pathA) == NormalizePath(pathB);
+// Does the given span name the same path as `path`? Trailing separators are
+// ignored on both sides.
+static bool SpanIsPath(const char *data, size_t length,
+                       const std::string &path) {
+  size_t pathLength = path.size();
+  while (length > 0 && data[length - 1] == PATH_SEPARATOR)
+    length--;
+  while (pathLength > 0 && path[pathLength - 1] == PATH_SEPARATOR)
+    pathLength--;
+  return length == pathLength && path.compare(0, pathLength, data, length) == 0;
 }
 
-// This is the main-thread function that receives all `ThreadSafeFunction`
-// calls. It converts the `PathWatcherEvent` struct into JS values before
-// invoking our callback.
-static void ProcessEvent(Napi::Env env, Napi::Function callback,
-                         PathWatcherEvent *event) {
-  // Translate the event type to the expected event name in the JS code.
-  //
-  // NOTE: This library previously envisioned that some platforms would allow
-  // watching of files directly and some would require watching of a file's
-  // parent folder. EFSW uses the parent-folder approach on all platforms, so
-  // in practice we're not using half of the event names we used to use. That's
-  // why the second argument below is `true`.
-  //
-  // There might be some edge cases that we need to handle here; for instance,
-  // if we're watching a directory and that directory itself is deleted, then
-  // that should be `delete` rather than `child-delete`. Right now we deal with
-  // that in JavaScript, but we could handle it here instead.
-  if (EnvIsStopping(env))
-    return;
-
-  std::string newPath;
-  std::string oldPath;
+void PathWatcherEventBatch::Add(efsw::Action type, efsw::WatchID handle,
+                                const std::string &dir,
+                                const std::string &filename,
+                                const std::string &oldFilename,
+                                const std::string &watcherPath) {
+  PathWatcherEvent event;
+  event.type = type;
+  event.handle = handle;
 
-  if (!event->new_path.empty()) {
-    newPath.assign(event->new_path.begin(), event->new_path.end());
-  }
+  event.newPathOffset = static_cast<uint32_t>(pathData.size());
+  pathData.append(dir).append(filename);
+  event.newPathLength =
+      static_cast<uint32_t>(pathData.size()) - event.newPathOffset;
 
-  if (!event->old_path.empty()) {
-    oldPath.assign(event->old_path.begin(), event->old_path.end());
+  event.oldPathOffset = static_cast<uint32_t>(pathData.size());
+  if (!oldFilename.empty()) {
+    pathData.append(dir).append(oldFilename);
   }
+  event.oldPathLength =
+      static_cast<uint32_t>(pathData.size()) - event.oldPathOffset;
 
   // Since we watch directories, most sorts of events will only happen to files
-  // within the directories…
-  bool isChildEvent = true;
-  if (PathsAreEqual(newPath, event->watcher_path)) {
-    // …but the `delete` event can happen to the directory itself, in which
-    // case we should report it as `delete` rather than `child-delete`.
-    isChildEvent = false;
-  }
+  // within the directories… but the `delete` event can happen to the
+  // directory itself, in which case we should report it as `delete` rather
+  // than `child-delete`.
+  event.isChild = !SpanIsPath(PathAt(event.newPathOffset),
+                              event.newPathLength, watcherPath);
 
-  std::string eventName = EventType(event->type, isChildEvent);
+  // Renames stay within one directory, so the old path (if any) has the same
+  // root as the new one.
+  size_t rootLength = watcherPath.size() + 1;
+  bool underRoot =
+      event.isChild && event.newPathLength > rootLength &&
+      memcmp(PathAt(event.newPathOffset), watcherPath.data(),
+             watcherPath.size()) == 0 &&
+      PathAt(event.newPathOffset)[watcherPath.size()] == PATH_SEPARATOR;
+  event.rootLength = underRoot ? static_cast<uint32_t>(rootLength) : 0;
 
-  try {
-    callback.Call({Napi::String::New(env, eventName),
-                   WatcherHandleToBigInt(env, event->handle),
-                   Napi::String::New(env, newPath),
-                   Napi::String::New(env, oldPath)});
-  } catch (const Napi::Error &e) {
-    // TODO: Unsure why this would happen.
-    Napi::TypeError::New(env, "Unknown error handling filesystem event")
-        .ThrowAsJavaScriptException();
-  }
+  events.push_back(event);
 }
 
-PathWatcherListener::PathWatcherListener(Napi::Env env,
-                                         Napi::ThreadSafeFunction tsfn)
-    : tsfn(tsfn) {}
+void PathWatcherEventBatch::AddOverflow(efsw::WatchID handle,
+                                        const std::string &watcherPath) {
+  PathWatcherEvent event;
+  event.type = OverflowAction;
+  event.handle = handle;
+  event.isChild = false;
+  event.rootLength = 0;
+  event.newPathOffset = static_cast<uint32_t>(pathData.size());
+  event.newPathLength = static_cast<uint32_t>(watcherPath.size());
+  event.oldPathOffset = event.newPathOffset + event.newPathLength;
+  event.oldPathLength = 0;
+  pathData.append(watcherPath);
+  events.push_back(event);
+}
 
-void PathWatcherListener::Stop() {
-  if (isShuttingDown)
-    return;
-  // Prevent responders from acting while we shut down.
-  std::lock_guard<std::mutex> lock(shutdownMutex);
-  if (isShuttingDown)
-    return;
-  isShuttingDown = true;
+void PathWatcherEventBatch::AddThrottled(efsw::WatchID handle,
+                                         const std::string &watcherPath,
+                                         size_t count) {
+  AddOverflow(handle, watcherPath);
+  PathWatcherEvent &event = events.back();
+  event.type = ThrottledAction;
+  std::string countStr = std::to_string(count);
+  event.oldPathLength = static_cast<uint32_t>(countStr.size());
+  pathData.append(countStr);
 }
 
-void PathWatcherListener::Stop(FileWatcher *fileWatcher) {
-  for (auto &it : paths) {
-    fileWatcher->removeWatch(it.first);
-  }
-  paths.clear();
-  Stop();
+void PathWatcherEventBatch::Clear() {
+  // `clear` keeps the capacity we've already allocated, which is the point.
+  events.clear();
+  pathData.clear();
 }
 
-// Correlate a watch ID to a path/timestamp pair.
-void PathWatcherListener::AddPath(PathTimestampPair pair,
-                                  efsw::WatchID handle) {
-  std::lock_guard<std::mutex> lock(pathsMutex);
-  paths[handle] = pair;
-  pathsToHandles[pair.path] = handle;
+PathWatcherEventPool::PathWatcherEventPool(size_t capacity)
+    : capacity(capacity) {}
+
+PathWatcherEventPool::~PathWatcherEventPool() {
+  for (auto batch : freeBatches) {
+    delete batch;
+  }
 }
 
-// Remove metadata for a given watch ID.
-void PathWatcherListener::RemovePath(efsw::WatchID handle) {
-  std::string path;
-  if (isShuttingDown)
-    return;
+PathWatcherEventBatch *PathWatcherEventPool::Acquire() {
+  PathWatcherEventBatch *batch = nullptr;
   {
-    std::lock_guard<std::mutex> lock(pathsMutex);
-    auto it = paths.find(handle);
-#ifdef DEBUG
-    std::cout << "Unwatching handle: [" << handle << "] path: ["
-              << it->second.path << "]" << std::endl;
-#endif
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!freeBatches.empty()) {
+      batch = freeBatches.back();
+      freeBatches.pop_back();
+    } else {
+      stats.allocated++;
+    }
+    stats.inUse++;
+    stats.inUseHighWater = std::max(stats.inUseHighWater, stats.inUse);
+  }
+  if (!batch) {
+    batch = new PathWatcherEventBatch();
+  }
+  batch->pool = shared_from_this();
+  return batch;
+}
 
-    if (it == paths.end())
-      return;
-    path = it->second.path;
-    paths.erase(it);
+void PathWatcherEventPool::Recycle(PathWatcherEventBatch *batch) {
+  // Hold a reference to ourselves until we're done, since the batch might
+  // hold the last one.
+  std::shared_ptr<PathWatcherEventPool> self = std::move(batch->pool);
+  std::unique_lock<std::mutex> lock(mutex);
+  stats.inUse--;
+  stats.eventsHighWater =
+      std::max(stats.eventsHighWater, batch->events.size());
+  stats.pathBytesHighWater =
+      std::max(stats.pathBytesHighWater, batch->pathData.size());
+  if (freeBatches.size() >= capacity) {
+    lock.unlock();
+    delete batch;
+    return;
   }
+  batch->Clear();
+  batch->queuedCount.reset();
+  batch->inFlight.reset();
+  batch->stats.reset();
+  freeBatches.push_back(batch);
+}
 
+void PathWatcherEventPool::SetCapacity(size_t newCapacity) {
+  std::vector<PathWatcherEventBatch *> excess;
   {
-    std::lock_guard<std::mutex> lock(pathsToHandlesMutex);
-    auto itp = pathsToHandles.find(path);
-    if (itp == pathsToHandles.end())
-      return;
-    pathsToHandles.erase(itp);
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = newCapacity;
+    while (freeBatches.size() > capacity) {
+      excess.push_back(freeBatches.back());
+      freeBatches.pop_back();
+    }
+  }
+  for (auto batch : excess) {
+    delete batch;
   }
 }
 
-bool PathWatcherListener::HasPath(std::string path) {
-  std::lock_guard<std::mutex> lock(pathsToHandlesMutex);
-  auto it = pathsToHandles.find(path);
-  return it != pathsToHandles.end();
+PathWatcherEventPoolStats PathWatcherEventPool::Stats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
 }
 
-efsw::WatchID PathWatcherListener::GetHandleForPath(std::string path) {
-  std::lock_guard<std::mutex> lock(pathsToHandlesMutex);
-  auto it = pathsToHandles.find(path);
-  return it->second;
+// What a batch and its buffers take.
+static size_t BatchBytes(const PathWatcherEventBatch &batch) {
+  return sizeof(PathWatcherEventBatch) +
+         efsw::MemoryCost::buffer(batch.events) +
+         efsw::MemoryCost::string(batch.pathData);
 }
 
-bool PathWatcherListener::IsEmpty() {
-  std::lock_guard<std::mutex> lock(pathsMutex);
-  return paths.empty();
+size_t PathWatcherEventPool::IdleBytes() {
+  std::lock_guard<std::mutex> lock(mutex);
+  size_t bytes = efsw::MemoryCost::buffer(freeBatches);
+  for (auto batch : freeBatches)
+    bytes += BatchBytes(*batch);
+  return bytes;
 }
 
-void PathWatcherListener::handleFileAction(efsw::WatchID watchId,
-                                           const std::string &dir,
-                                           const std::string &filename,
-                                           efsw::Action action,
-                                           std::string oldFilename) {
-#ifdef DEBUG
-  std::cout << "PathWatcherListener::handleFileAction dir: " << dir
-            << " filename: " << filename << " oldFilename: " << filename
-            << " action: " << EventType(action, true) << std::endl;
-#endif
-  // Don't try to proceed if we've already started the shutdown process…
-  if (isShuttingDown)
-    return;
+void LatencyHistogram::Record(std::chrono::steady_clock::duration duration) {
+  uint64_t us = static_cast<uint64_t>(std::max<int64_t>(
+      0, std::chrono::duration_cast<std::chrono::microseconds>(duration)
+             .count()));
+  size_t bucket = 0;
+  while (bucket < kBuckets - 1 && (uint64_t(1) << bucket) <= us)
+    bucket++;
+  buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  totalUs.fetch_add(us, std::memory_order_relaxed);
+  uint64_t previous = maxUs.load(std::memory_order_relaxed);
+  while (us > previous &&
+         !maxUs.compare_exchange_weak(previous, us, std::memory_order_relaxed))
+    ;
+}
 
-  // …but if we haven't, make sure that shutdown doesn’t happen until we’re
-  // done.
-  std::lock_guard<std::mutex> lock(shutdownMutex);
-  if (isShuttingDown)
-    return;
+LatencyHistogram::Summary LatencyHistogram::Summarize() const {
+  Summary summary;
+  uint64_t counts[kBuckets];
+  for (size_t i = 0; i < kBuckets; i++) {
+    counts[i] = buckets[i].load(std::memory_order_relaxed);
+    summary.count += counts[i];
+  }
+  summary.maxUs = maxUs.load(std::memory_order_relaxed);
+  if (summary.count == 0)
+    return summary;
+  summary.meanUs =
+      static_cast<double>(totalUs.load(std::memory_order_relaxed)) /
+      summary.count;
 
-  // Extract the expected watcher path and (on macOS) the start time of the
-  // watcher.
-  PathTimestampPair pair;
-  std::string realPath;
-#ifdef __APPLE__
-  timeval startTime;
-#endif
-  {
-    std::lock_guard<std::mutex> lock(pathsMutex);
-    auto it = paths.find(watchId);
-    if (it == paths.end()) {
-      // Couldn't find watcher. Assume it's been removed.
-      return;
+  // Walk the buckets until each percentile's share of the samples is covered.
+  uint64_t *targets[] = {&summary.p50Us, &summary.p90Us, &summary.p99Us};
+  double fractions[] = {0.5, 0.9, 0.99};
+  size_t next = 0;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets && next < 3; i++) {
+    seen += counts[i];
+    while (next < 3 && seen >= fractions[next] * summary.count) {
+      *targets[next++] = std::min(uint64_t(1) << i, summary.maxUs);
     }
-    pair = it->second;
-    realPath = pair.path;
-#ifdef __APPLE__
-    startTime = pair.timestamp;
-#endif
   }
+  return summary;
+}
 
-  std::string newPathStr = dir + filename;
-  std::vector<char> newPath(newPathStr.begin(), newPathStr.end());
+void PathWatcherStats::CountHandleEvent(efsw::WatchID handle) {
+  std::lock_guard<std::mutex> lock(handleEventsMutex);
+  handleEvents[handle]++;
+}
 
-#ifdef __APPLE__
-  // macOS seems to think that lots of file creations happen that aren't
-  // actually creations; for instance, multiple successive writes to the same
-  // file will sometimes nonsensically produce a `child-create` event preceding
-  // each `child-change` event.
-  //
-  // Luckily, we can easily check whether or not a file has actually been
-  // created on macOS: we can compare creation time to modification time. This
-  // weeds out most of the false positives.
-  {
-    struct stat file;
-    if (stat(newPathStr.c_str(), &file) != 0 &&
-        action != efsw::Action::Delete) {
-      // If this was a delete action, the file is _expected_ not to exist
-      // anymore. Otherwise it's a strange outcome and it means we should
-      // ignore this event.
-      return;
+void PathWatcherStats::ForgetHandle(efsw::WatchID handle) {
+  std::lock_guard<std::mutex> lock(handleEventsMutex);
+  handleEvents.erase(handle);
+}
+
+// One event as JavaScript hears it: a native event as the backend reported
+// it, for subscriber `0`, or as the subject of the subscriber `subscriber`
+// translated it.
+struct JsEvent {
+  uint32_t code;
+  uint32_t subscriber;
+  SubjectPath path;
+  bool moved;
+};
+
+// Works out who in JavaScript hears about `event`, and what, calling `emit`
+// with a `JsEvent` for each of them. A handle nobody has subscribed to sends
+// every event untranslated, and so does anything for the `NativeWatcher`
+// itself, like `armed`. Translating here, on the main thread, means each
+// subject sees events in order, and JavaScript doesn't have to look at the
+// ones that don't concern any of its watchers.
+template <typename Emit>
+static void TranslateEvent(const PathWatcherEventBatch &batch,
+                           const PathWatcherEvent &event, PathWatcher &pw,
+                           Emit &&emit) {
+  uint32_t code = EventCode(event.type, event.isChild);
+  std::vector<EventSubscriber> *subscribers = pw.Subscribers(event.handle);
+  if (!subscribers || code == kArmedEvent) {
+    emit(JsEvent{code, 0, SubjectPath::Event, false});
+    return;
+  }
+
+  std::string_view path(batch.PathAt(event.newPathOffset),
+                        event.newPathLength);
+  std::string_view oldPath(batch.PathAt(event.oldPathOffset),
+                           event.oldPathLength);
+  for (auto &subscriber : *subscribers) {
+    if (!subscriber.subject) {
+      emit(JsEvent{code, 0, SubjectPath::Event, false});
+      continue;
+    }
+    SubjectEvent translated;
+    if (subscriber.subject->Translate(code, path, oldPath, translated)) {
+      emit(JsEvent{translated.code, subscriber.id, translated.path,
+                   translated.moved});
     }
+  }
+}
 
-    if (action == efsw::Action::Add) {
-      // One easy way to check if a file was truly just created: does its
-      // creation time match its modification time? If not, the file has been
-      // written to since its creation.
-      if (file.st_birthtimespec.tv_sec != file.st_mtimespec.tv_sec) {
-        return;
+// Converts a `PathWatcherEvent` into the lists of arguments our JS callback
+// expects, one for each `JsEvent` it makes (see `TranslateEvent`), adding
+// them to `out`. An untranslated event's arguments are its event name,
+// watcher handle, path, and old path. A translated one's path is the one its
+// subscriber's callbacks should see, which may be empty or `null`; its old
+// path is where its subject moved, if it did, and its subscriber comes
+// last, after a root. JS strings are created directly from the batch's path
+// buffer, except for the event name, which is always one of a few we keep
+// around. With `smallHandles`, the handle is its number there, and an event
+// for a handle JavaScript has let go of makes no arguments at all. With
+// `rootRelativePaths`, paths leave out the watched path, which comes after
+// the old path, from `strings`.
+static void AppendEventArguments(Napi::Env env,
+                                 const PathWatcherEventBatch &batch,
+                                 const PathWatcherEvent &event,
+                                 PathWatcher &pw,
+                                 std::vector<std::vector<napi_value>> &out) {
+  Napi::Value handle;
+  uint32_t index;
+  const HandleIndex *smallHandles = pw.SmallHandles();
+  if (!smallHandles) {
+    handle = WatcherHandleToBigInt(env, event.handle);
+  } else if (smallHandles->Find(event.handle, index)) {
+    handle = Napi::Number::New(env, index);
+  } else {
+    return;
+  }
+
+  bool relative = pw.RootRelativePaths();
+  uint32_t skip = relative ? event.rootLength : 0;
+  uint32_t oldSkip = event.oldPathLength > 0 ? skip : 0;
+  // Made for the first `JsEvent` that needs them, and shared by the rest.
+  Napi::Value path, oldPath, root;
+  auto makePath = [&]() {
+    if (path.IsEmpty()) {
+      path = Napi::String::New(env, batch.PathAt(event.newPathOffset + skip),
+                               event.newPathLength - skip);
+      if (relative) {
+        root = pw.strings.Root(env, event.handle,
+                               batch.PathAt(event.newPathOffset), skip);
       }
+    }
+    return path;
+  };
 
-      // Next, weed out unnecessary `create` and `change` events that represent
-      // file actions that happened before we started watching.
-      if (PredatesWatchStart(file.st_birthtimespec, startTime)) {
-#ifdef DEBUG
-        std::cout << "File was created before we started this path watcher! "
-                     "(skipping)"
-                  << std::endl;
-#endif
-        return;
+  TranslateEvent(batch, event, pw, [&](const JsEvent &js) {
+    Napi::String eventName = pw.strings.EventName(env, js.code);
+    if (js.subscriber == 0) {
+      makePath();
+      if (oldPath.IsEmpty()) {
+        oldPath =
+            Napi::String::New(env, batch.PathAt(event.oldPathOffset + oldSkip),
+                              event.oldPathLength - oldSkip);
       }
-    } else if (action == efsw::Action::Modified) {
-      if (PredatesWatchStart(file.st_mtimespec, startTime)) {
-#ifdef DEBUG
-        std::cout << "File was modified before we started this path watcher! "
-                     "(skipping)"
-                  << std::endl;
-#endif
-        return;
+      if (relative) {
+        out.push_back({eventName, handle, path, oldPath, root});
+      } else {
+        out.push_back({eventName, handle, path, oldPath});
       }
+      return;
     }
-  }
-#endif
 
-  std::vector<char> oldPath;
-  if (!oldFilename.empty()) {
-    std::string oldPathStr = dir + oldFilename;
-    oldPath.assign(oldPathStr.begin(), oldPathStr.end());
-  }
+    Napi::Value jsPath, jsRoot = env.Undefined();
+    switch (js.path) {
+    case SubjectPath::Event:
+      jsPath = makePath();
+      if (relative)
+        jsRoot = root;
+      break;
+    case SubjectPath::Empty:
+      jsPath = Napi::String::New(env, "", 0);
+      break;
+    case SubjectPath::Null:
+      jsPath = env.Null();
+      break;
+    }
+    // Only a translated `rename`, `create` or `delete` with the event's path
+    // moves its subject.
+    Napi::Value movedTo = js.moved ? makePath() : env.Undefined();
+    out.push_back({eventName, handle, jsPath, movedTo, jsRoot,
+                   Napi::Number::New(env, js.subscriber)});
+  });
+}
 
-  if (!tsfn)
-    return;
-  napi_status status = tsfn.Acquire();
-  if (status != napi_ok) {
-    // We couldn't acquire the `tsfn`; it might be in the process of being
-    // aborted because our environment is terminating.
+// Collapses redundant events within a batch so that JavaScript doesn't have to
+// filter them one at a time. Events are compared per handle and path:
+//
+//   * create, then any number of changes → create
+//   * create, then delete → nothing at all
+//   * change, then change → change
+//   * change, then delete → delete
+//   * delete, then create → change (this is what an atomic save looks like)
+//
+// Renames are never collapsed; they act as a barrier for both of the paths
+// they involve, since events on either side of a rename refer to different
+// files.
+static void CoalesceEvents(PathWatcherEventBatch &batch) {
+  PathWatcherEventList &events = batch.events;
+  if (events.size() < 2)
     return;
-  }
 
-  PathWatcherEvent *event =
-      new PathWatcherEvent(action, watchId, newPath, oldPath, realPath);
+  // Keys point into `batch.pathData`, which doesn't change while we work.
+  typedef std::pair<efsw::WatchID, std::string_view> EventKey;
+  struct EventKeyHash {
+    size_t operator()(const EventKey &key) const {
+      return std::hash<std::string_view>()(key.second) ^
+             std::hash<efsw::WatchID>()(key.first);
+    }
+  };
+  auto keyFor = [&batch](efsw::WatchID handle, uint32_t offset,
+                         uint32_t length) {
+    return EventKey(handle, std::string_view(batch.PathAt(offset), length));
+  };
 
-  // TODO: Instead of calling `BlockingCall` once per event, throttle them by
-  // some small amount of time (like 50-100ms). That will allow us to deliver
-  // them in batches more efficiently — and for the wrapper JavaScript code to
-  // do some elimination of redundant events.
-  status = tsfn.BlockingCall(event, ProcessEvent);
+  // Maps each handle/path key to the index of the most recent event we're
+  // keeping for it.
+  std::unordered_map<EventKey, size_t, EventKeyHash> latest;
+  std::vector<bool> keep(events.size(), true);
 
-  tsfn.Release();
-  if (status != napi_ok) {
-    // TODO: Not sure how this could fail, or how we should present it to the
-    // user if it does fail. This action runs on a separate thread and it's not
-    // immediately clear how we'd surface an exception from here.
-    delete event;
+  for (size_t i = 0; i < events.size(); i++) {
+    PathWatcherEvent &event = events[i];
+    if (event.type == efsw::Actions::Moved) {
+      latest.erase(
+          keyFor(event.handle, event.newPathOffset, event.newPathLength));
+      latest.erase(
+          keyFor(event.handle, event.oldPathOffset, event.oldPathLength));
+      continue;
+    }
+
+    EventKey key = keyFor(event.handle, event.newPathOffset,
+                          event.newPathLength);
+    auto it = latest.find(key);
+    if (it == latest.end()) {
+      latest.emplace(key, i);
+      continue;
+    }
+
+    PathWatcherEvent &previous = events[it->second];
+    if (previous.type == event.type) {
+      // Repeats add nothing.
+      keep[i] = false;
+    } else if (previous.type == efsw::Actions::Add &&
+               event.type == efsw::Actions::Modified) {
+      keep[i] = false;
+    } else if (previous.type == efsw::Actions::Add &&
+               event.type == efsw::Actions::Delete) {
+      keep[it->second] = false;
+      keep[i] = false;
+      latest.erase(it);
+    } else if (previous.type == efsw::Actions::Modified &&
+               event.type == efsw::Actions::Delete) {
+      keep[it->second] = false;
+      it->second = i;
+    } else if (previous.type == efsw::Actions::Delete &&
+               event.type == efsw::Actions::Add) {
+      keep[it->second] = false;
+      event.type = efsw::Actions::Modified;
+      it->second = i;
+    } else {
+      it->second = i;
+    }
+  }
+
+  // The path bytes of discarded events stay behind in `pathData`; that's
+  // cheaper than compacting it.
+  size_t target = 0;
+  for (size_t i = 0; i < events.size(); i++) {
+    if (!keep[i])
+      continue;
+    if (target != i) {
+      events[target] = events[i];
+    }
+    target++;
   }
+  events.resize(target);
 }
 
-static int next_env_id = 1;
+// Called once a batch has been dealt with, whether or not it was delivered, so
+// that its events no longer count against the queue it came from. Overflow
+// and throttled events never counted in the first place.
+static void ReleaseQueuedEvents(PathWatcherEventBatch *batch) {
+  if (batch->inFlight) {
+    --*batch->inFlight;
+    batch->inFlight.reset();
+  }
+  if (!batch->queuedCount)
+    return;
+  size_t count = 0;
+  for (auto &event : batch->events) {
+    if (event.type != OverflowAction && event.type != ThrottledAction)
+      count++;
+  }
+  *batch->queuedCount -= count;
+  batch->queuedCount.reset();
+}
 
-PathWatcher::PathWatcher(Napi::Env env, Napi::Object exports) {
-  envId = next_env_id++;
+// Notes, for `getStats` and the `dispatch` probe, that a batch has made it to
+// the main thread.
+static void RecordDelivery(PathWatcherEventBatch *batch) {
+  efPROBE(dispatch,
+          batch->events.empty() ? 0 : batch->events.front().handle,
+          batch->events.size());
+  if (!batch->stats)
+    return;
+  PathWatcherStats &stats = *batch->stats;
+  stats.queueDepth--;
+  stats.deliveryLatency.Record(std::chrono::steady_clock::now() -
+                               batch->handedOffAt);
+  for (auto &event : batch->events) {
+    if (event.type == OverflowAction) {
+      stats.overflows++;
+    } else if (event.type != ArmedAction && event.type != ThrottledAction) {
+      stats.eventsDelivered++;
+    }
+  }
+}
 
-#ifdef DEBUG
-  std::cout << "Initializing PathWatcher" << std::endl;
-#endif
+// Gives up a batch once we're finished with it, returning it to its pool if it
+// has one.
+static void ReleaseBatch(PathWatcherEventBatch *batch) {
+  ReleaseQueuedEvents(batch);
+  if (batch->pool) {
+    batch->pool->Recycle(batch);
+  } else {
+    delete batch;
+  }
+}
 
-  DefineAddon(exports,
-              {InstanceMethod("watch", &PathWatcher::Watch),
-               InstanceMethod("unwatch", &PathWatcher::Unwatch),
-               InstanceMethod("setCallback", &PathWatcher::SetCallback)});
+struct BatchReleaser {
+  void operator()(PathWatcherEventBatch *batch) const { ReleaseBatch(batch); }
+};
+typedef std::unique_ptr<PathWatcherEventBatch, BatchReleaser> BatchOwner;
 
-  env.SetInstanceData<PathWatcher>(this);
+// This is the main-thread function that receives `ThreadSafeFunction` calls
+// when batching is disabled. It invokes our callback once per event (in
+// practice, there's only ever one), converting each into JS values first.
+static void ProcessEvent(Napi::Env env, Napi::Function callback,
+                         PathWatcherEventBatch *batch) {
+  // We own the batch from here on out.
+  BatchOwner owned(batch);
+  ReleaseQueuedEvents(batch);
+  RecordDelivery(batch);
+  if (EnvIsStopping(env))
+    return;
+
+  PathWatcher &pw = *env.GetInstanceData<PathWatcher>();
+  std::vector<std::vector<napi_value>> calls;
+  for (auto &event : owned->events) {
+    // Every call for an event is worked out before any of them is made,
+    // since a callback can subscribe or unsubscribe.
+    calls.clear();
+    AppendEventArguments(env, *owned, event, pw, calls);
+    for (auto &args : calls) {
+      try {
+        callback.Call(args);
+      } catch (const Napi::Error &e) {
+        // TODO: Unsure why this would happen.
+        Napi::TypeError::New(env, "Unknown error handling filesystem event")
+            .ThrowAsJavaScriptException();
+      }
+    }
+  }
 }
 
-PathWatcher::~PathWatcher() {
-  isFinalizing = true;
-  StopAllListeners();
+// A batch as an array of events, each of which is an array of the same values
+// that `ProcessEvent` would pass as arguments.
+static Napi::Array BatchArray(Napi::Env env,
+                              const PathWatcherEventBatch &batch) {
+  Napi::Array events = Napi::Array::New(env, batch.events.size());
+  PathWatcher &pw = *env.GetInstanceData<PathWatcher>();
+  std::vector<std::vector<napi_value>> entries;
+  uint32_t index = 0;
+  for (auto &event : batch.events) {
+    entries.clear();
+    AppendEventArguments(env, batch, event, pw, entries);
+    for (auto &args : entries) {
+      Napi::Array entry = Napi::Array::New(env, args.size());
+      for (uint32_t i = 0; i < args.size(); i++) {
+        entry.Set(i, args[i]);
+      }
+      events.Set(index++, entry);
+    }
+  }
+  if (index < batch.events.size())
+    events.Set("length", Napi::Number::New(env, index));
+  return events;
 }
 
-// Watch a given path. Returns a handle.
-Napi::Value PathWatcher::Watch(const Napi::CallbackInfo &info) {
-  auto env = info.Env();
-  // Record the current timestamp as early as possible. We'll use this as a way
-  // of ignoring file-watcher events that happened before we started watching.
-  auto now = Now();
+// The batched counterpart of `ProcessEvent`. Invokes the callback once with a
+// single argument: the batch as a `BatchArray`.
+static void ProcessEventBatch(Napi::Env env, Napi::Function callback,
+                              PathWatcherEventBatch *batch) {
+  BatchOwner owned(batch);
+  ReleaseQueuedEvents(batch);
+  RecordDelivery(batch);
+  if (EnvIsStopping(env))
+    return;
 
-  // First argument must be a string.
-  if (!info[0].IsString()) {
-    Napi::TypeError::New(env, "String required").ThrowAsJavaScriptException();
-    return env.Null();
+  try {
+    callback.Call({BatchArray(env, *owned)});
+  } catch (const Napi::Error &e) {
+    Napi::TypeError::New(env, "Unknown error handling filesystem events")
+        .ThrowAsJavaScriptException();
   }
+}
 
-  // Second argument is optional and tells us whether to use a recursive
-  // watcher. Defaults to `false`.
-  bool useRecursiveWatcher = false;
-  if (info[1].IsBoolean()) {
-    auto recursiveOption = info[1].As<Napi::Boolean>();
-    useRecursiveWatcher = recursiveOption;
+// Appends the UTF-8 in `data` to `out` as UTF-16, replacing any byte that
+// isn't part of a valid sequence with U+FFFD.
+static void AppendUtf16(std::u16string &out, const char *data, size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    unsigned char lead = data[i];
+    if (lead < 0x80) {
+      out.push_back(lead);
+      i++;
+      continue;
+    }
+    size_t extra = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC2 ? 1 : 0;
+    uint32_t codePoint = lead & (0x3F >> extra);
+    bool valid = extra > 0 && lead < 0xF5 && i + extra < length;
+    for (size_t k = 1; valid && k <= extra; k++) {
+      unsigned char next = data[i + k];
+      valid = (next & 0xC0) == 0x80;
+      codePoint = (codePoint << 6) | (next & 0x3F);
+    }
+    // Reject overlong forms, surrogates, and anything past U+10FFFF.
+    if (extra == 2 && (codePoint < 0x800 || (codePoint >> 11) == 0x1B))
+      valid = false;
+    if (extra == 3 && (codePoint < 0x10000 || codePoint > 0x10FFFF))
+      valid = false;
+    if (!valid) {
+      out.push_back(0xFFFD);
+      i++;
+      continue;
+    }
+    if (codePoint >= 0x10000) {
+      codePoint -= 0x10000;
+      out.push_back(static_cast<char16_t>(0xD800 + (codePoint >> 10)));
+      out.push_back(static_cast<char16_t>(0xDC00 + (codePoint & 0x3FF)));
+    } else {
+      out.push_back(static_cast<char16_t>(codePoint));
+    }
+    i += extra + 1;
   }
+}
 
-  // The wrapper JS will resolve this to the file's real path. We expect to be
-  // dealing with real locations on disk, since that's what EFSW will report to
-  // us anyway.
-  Napi::String path = info[0].ToString();
-  std::string cppPath(path);
+// The number of `uint32_t`s in each record of a packed batch: event code,
+// handle index, path offset, path length, old path offset, old path length,
+// and subscriber.
+static const size_t kPackedRecordSize = 7;
+// The path length that stands for a path of `null`.
+static const uint32_t kPackedNullPath = 0xFFFFFFFF;
 
-  StripTrailingSlashFromPath(cppPath);
+// The packed form of a batch, used when `packedBatches` is set. Rather than
+// building several JS values for every event, this makes two:
+//
+//   * an `ArrayBuffer` that starts with two `uint32_t`s (the number of events
+//     and the number of distinct handles), followed by the handles as
+//     `int64_t`s, followed by one record of `kPackedRecordSize` `uint32_t`s
+//     per event. With `smallHandles`, there are no handles to list: each
+//     record holds its handle's number instead of an index into them;
+//   * a single string holding every path in the batch, which the records
+//     refer to by offset and length in UTF-16 code units.
+//
+// JavaScript can then slice out only the paths it actually needs. Each
+// `JsEvent` gets a record of its own (see `TranslateEvent`); those for one
+// native event share its paths. A translated record's paths are as described
+// for `AppendEventArguments`, with `kPackedNullPath` for `null`.
+// `ProcessPackedEventBatch` invokes the callback with them as arguments.
+static std::pair<Napi::ArrayBuffer, Napi::String>
+PackBatch(Napi::Env env, const PathWatcherEventBatch *owned) {
+  PathWatcher &pw = *env.GetInstanceData<PathWatcher>();
+  const HandleIndex *smallHandles = SmallHandles(env);
+  std::vector<int64_t> handles;
+  std::vector<uint32_t> records;
+  std::u16string paths;
+  records.reserve(owned->events.size() * kPackedRecordSize);
+  paths.reserve(owned->pathData.size());
 
-#ifdef DEBUG
-  std::cout << "PathWatcher::Watch path: [" << cppPath << "]" << std::endl;
-#endif
+  for (auto &event : owned->events) {
+    uint32_t handleIndex = 0;
+    if (smallHandles) {
+      // The record can hold the handle's number itself. There's no point in
+      // sending an event for a handle that doesn't have one anymore.
+      if (!smallHandles->Find(event.handle, handleIndex))
+        continue;
+    }
 
-  // It's invalid to call `watch` before having set a callback via
-  // `setCallback`.
-  if (callback.IsEmpty()) {
-    Napi::TypeError::New(env, "No callback set").ThrowAsJavaScriptException();
-    return env.Null();
-  }
+    // Filled in for the first record that needs them.
+    bool packed = false;
+    uint32_t newPathOffset = 0, newPathLength = 0;
+    uint32_t oldPathOffset = 0, oldPathLength = 0;
+    TranslateEvent(*owned, event, pw, [&](const JsEvent &js) {
+      if (!packed) {
+        packed = true;
+        if (!smallHandles) {
+          // Batches rarely involve more than a handful of handles.
+          int64_t handle = static_cast<int64_t>(event.handle);
+          while (handleIndex < handles.size() && handles[handleIndex] != handle)
+            handleIndex++;
+          if (handleIndex == handles.size())
+            handles.push_back(handle);
+        }
+        newPathOffset = static_cast<uint32_t>(paths.size());
+        AppendUtf16(paths, owned->PathAt(event.newPathOffset),
+                    event.newPathLength);
+        oldPathOffset = static_cast<uint32_t>(paths.size());
+        AppendUtf16(paths, owned->PathAt(event.oldPathOffset),
+                    event.oldPathLength);
+        newPathLength = oldPathOffset - newPathOffset;
+        oldPathLength = static_cast<uint32_t>(paths.size()) - oldPathOffset;
+      }
 
-  if (!isWatching) {
-#ifdef DEBUG
-    std::cout << "  Creating ThreadSafeFunction and FileWatcher" << std::endl;
-#endif
-    int myGeneration = ++watchGeneration;
-    tsfn = Napi::ThreadSafeFunction::New(
-        env, callback.Value(), "pathwatcher-efsw-listener", 0, 1,
-        [this, myGeneration](Napi::Env env) {
-          // This is unexpected. We should try to do some cleanup before the
-          // environment terminates.
-          //
-          // We retain a "generation" value; if it increments by the time this
-          // finalizer runs, that means the watcher has started up again and we
-          // should skip teardown.
-          if (watchGeneration == myGeneration) {
-            StopAllListeners();
-          }
-        });
+      records.push_back(js.code);
+      records.push_back(handleIndex);
+      if (js.subscriber == 0) {
+        records.push_back(newPathOffset);
+        records.push_back(newPathLength);
+        records.push_back(oldPathOffset);
+        records.push_back(oldPathLength);
+      } else {
+        records.push_back(newPathOffset);
+        records.push_back(js.path == SubjectPath::Event ? newPathLength
+                          : js.path == SubjectPath::Null ? kPackedNullPath
+                                                         : 0);
+        records.push_back(newPathOffset);
+        records.push_back(js.moved ? newPathLength : 0);
+      }
+      records.push_back(js.subscriber);
+    });
+  }
 
-    listener = new PathWatcherListener(env, tsfn);
+  size_t headerSize = 2 * sizeof(uint32_t);
+  size_t handlesSize = handles.size() * sizeof(int64_t);
+  size_t recordsSize = records.size() * sizeof(uint32_t);
+  Napi::ArrayBuffer buffer =
+      Napi::ArrayBuffer::New(env, headerSize + handlesSize + recordsSize);
+  char *data = static_cast<char *>(buffer.Data());
+  uint32_t header[2] = {
+      static_cast<uint32_t>(records.size() / kPackedRecordSize),
+      static_cast<uint32_t>(handles.size())};
+  memcpy(data, header, headerSize);
+  if (handlesSize)
+    memcpy(data + headerSize, handles.data(), handlesSize);
+  if (recordsSize)
+    memcpy(data + headerSize + handlesSize, records.data(), recordsSize);
+  return {buffer, Napi::String::New(env, paths.data(), paths.size())};
+}
 
-#ifdef __APPLE__
-    fileWatcher = new FileWatcher();
-#else
-    fileWatcher = new efsw::FileWatcher();
-    fileWatcher->followSymlinks(true);
-    fileWatcher->watch();
-#endif
+static void ProcessPackedEventBatch(Napi::Env env, Napi::Function callback,
+                                    PathWatcherEventBatch *batch) {
+  BatchOwner owned(batch);
+  ReleaseQueuedEvents(batch);
+  RecordDelivery(batch);
+  if (EnvIsStopping(env))
+    return;
 
-    isWatching = true;
+  auto packed = PackBatch(env, owned.get());
+  try {
+    callback.Call({packed.first, packed.second});
+  } catch (const Napi::Error &e) {
+    Napi::TypeError::New(env, "Unknown error handling filesystem events")
+        .ThrowAsJavaScriptException();
   }
+}
 
-  // EFSW represents watchers as unsigned `int`s; we can easily convert these
-  // to JavaScript.
-  WatcherHandle handle =
-      fileWatcher->addWatch(cppPath, listener, useRecursiveWatcher);
+// How many raw events can wait for the dispatcher thread before backends have
+// to wait for it (or, with `nonBlocking`, start dropping events).
+static const size_t kRawEventRingSize = 8192;
 
-#ifdef DEBUG
-  std::cout << " handle: [" << handle << "]" << std::endl;
-#endif
+// This is Dmitry Vyukov's bounded queue. Each slot's sequence number says
+// whose turn it is: a slot is free for the producer claiming position `p` when
+// its sequence is `p`, and ready for the consumer when it's `p + 1`.
+RawEventRing::RawEventRing(size_t capacity)
+    : slots(new Slot[capacity]), mask(capacity - 1) {
+  for (size_t i = 0; i < capacity; i++) {
+    slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
 
-  if (handle >= 0) {
-    // For each new watched path, remember both the normalized path and the
-    // time we started watching it.
-    PathTimestampPair pair = {cppPath, now};
-    listener->AddPath(pair, handle);
-  } else {
-    auto error = Napi::Error::New(env, "Failed to add watch; unknown error");
-    error.Set("code", Napi::Number::New(env, handle));
-    error.ThrowAsJavaScriptException();
-    return env.Null();
+bool RawEventRing::TryPush(efsw::Action action, efsw::WatchID handle,
+                           const std::string &dir,
+                           const std::string &filename,
+                           const std::string &oldFilename,
+                           std::chrono::steady_clock::time_point reportedAt) {
+  size_t position = enqueuePosition.load(std::memory_order_relaxed);
+  Slot *slot;
+  while (true) {
+    slot = &slots[position & mask];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    intptr_t difference =
+        static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+    if (difference == 0) {
+      if (enqueuePosition.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed))
+        break;
+    } else if (difference < 0) {
+      // The consumer hasn't gotten to this slot since we last filled it.
+      return false;
+    } else {
+      // Another producer claimed this position first.
+      position = enqueuePosition.load(std::memory_order_relaxed);
+    }
   }
 
-  // The `watch` function returns a number much like `setTimeout` or
+  slot->event.action = action;
+  slot->event.handle = handle;
+  slot->event.reportedAt = reportedAt;
+  slot->event.dir.assign(dir);
+  slot->event.filename.assign(filename);
+  slot->event.oldFilename.assign(oldFilename);
+  slot->sequence.store(position + 1, std::memory_order_release);
+  return true;
+}
+
+bool RawEventRing::TryPop(RawEvent &event) {
+  Slot &slot = slots[dequeuePosition & mask];
+  if (slot.sequence.load(std::memory_order_acquire) != dequeuePosition + 1)
+    return false;
+
+  event.action = slot.event.action;
+  event.handle = slot.event.handle;
+  event.reportedAt = slot.event.reportedAt;
+  event.dir.swap(slot.event.dir);
+  event.filename.swap(slot.event.filename);
+  event.oldFilename.swap(slot.event.oldFilename);
+  slot.sequence.store(dequeuePosition + mask + 1, std::memory_order_release);
+  dequeuePosition++;
+  return true;
+}
+
+bool RawEventRing::IsEmpty() const {
+  const Slot &slot = slots[dequeuePosition & mask];
+  return slot.sequence.load(std::memory_order_acquire) != dequeuePosition + 1;
+}
+
+#ifdef __APPLE__
+// How many threads check macOS events against the filesystem. Watchers are
+// spread across them by handle.
+static const size_t kValidationThreads = 4;
+#endif
+
+// Covered handles start here, so that they can't run into the handles the
+// backends give out, which count up from one.
+static const efsw::WatchID kFirstCoveredHandle =
+    std::numeric_limits<efsw::WatchID>::max() / 2;
+
+PathWatcherListener::PathWatcherListener(
+    Napi::Env env, Napi::ThreadSafeFunction tsfn, DeliveryOptions options,
+    std::shared_ptr<PathWatcherEventPool> pool,
+    std::shared_ptr<PathWatcherStats> stats)
+    : ring(kRawEventRingSize), pathTable(std::make_shared<WatchedPathTable>()),
+      nextCoveredHandle(kFirstCoveredHandle), tsfn(tsfn), options(options),
+      pool(pool), stats(stats),
+      queuedCount(std::make_shared<std::atomic<size_t>>(0)),
+      bulkInFlight(std::make_shared<std::atomic<size_t>>(0)) {
+  if (options.batchWindowMs > 0 || options.nonBlocking) {
+    flushThread = std::thread(&PathWatcherListener::FlushLoop, this);
+  }
+#ifdef __APPLE__
+  for (size_t i = 0; i < kValidationThreads; i++) {
+    validationShards.push_back(std::make_unique<ValidationShard>());
+    validationShards.back()->thread =
+        std::thread(&PathWatcherListener::ValidationLoop, this,
+                    validationShards.back().get());
+  }
+#endif
+  dispatchThread = std::thread(&PathWatcherListener::DispatchLoop, this);
+}
+
+// Forgets our watched paths and stops. Our watches are left for the caller
+// to remove, or to tear down along with their backend.
+void PathWatcherListener::Stop() {
+  bool wasShuttingDown = false;
+  if (!isShuttingDown.compare_exchange_strong(wasShuttingDown, true))
+    return;
+  {
+    std::lock_guard<std::mutex> lock(pathTableMutex);
+    PublishPathTable(std::make_shared<WatchedPathTable>());
+  }
+  // New responders will now bail early; wait for any that were already under
+  // way to finish.
+  while (activeHandlers > 0) {
+    std::this_thread::yield();
+  }
+  // The dispatcher feeds everything downstream of it. Whatever is still in
+  // the ring is discarded.
+  StopDispatcher();
+#ifdef __APPLE__
+  // Validation threads feed the batch, so they have to stop first.
+  StopValidation();
+#endif
+  // The digest thread is fed by the validation threads and feeds the batch.
+  StopDigests();
+  // Any events still waiting in a batch will be discarded; nobody will be
+  // around to hear about them.
+  StopFlushThread();
+  ReleasePulledBatches();
+}
+
+void PathWatcherListener::StopDispatcher() {
+  {
+    std::lock_guard<std::mutex> lock(dispatchMutex);
+    dispatcherStopping = true;
+  }
+  dispatchCondition.notify_one();
+  if (dispatchThread.joinable()) {
+    dispatchThread.join();
+  }
+}
+
+void PathWatcherListener::StopFlushThread() {
+  {
+    std::lock_guard<std::mutex> lock(batchMutex);
+    flushThreadStopping = true;
+    pendingBatch.Clear();
+    priorityBatch.Clear();
+    overflowedHandles.clear();
+    throttledHandles.clear();
+  }
+  batchCondition.notify_one();
+  if (flushThread.joinable()) {
+    flushThread.join();
+  }
+}
+
+// Hands a batch of events to the main thread. Takes ownership of `batch`.
+// When `asArray` is `false`, each event is delivered with its own callback
+// invocation, as though batching didn't exist.
+void PathWatcherListener::DeliverBatch(PathWatcherEventBatch *batch,
+                                       bool asArray) {
+  if (!tsfn) {
+    ReleaseBatch(batch);
+    return;
+  }
+  efPROBE(enqueue,
+          batch->events.empty() ? 0 : batch->events.front().handle,
+          batch->events.size());
+
+  if (options.pullDelivery) {
+    if (stats) {
+      batch->stats = stats;
+      batch->handedOffAt = std::chrono::steady_clock::now();
+      stats->queueDepth++;
+    }
+    bool shouldNotify = false;
+    {
+      std::lock_guard<std::mutex> lock(pullMutex);
+      if (batch->inFlight) {
+        pulledBatches.push_back(batch);
+      } else {
+        // Anything from outside the bulk lane goes ahead of the bulk
+        // batches.
+        auto bulk = std::find_if(
+            pulledBatches.begin(), pulledBatches.end(),
+            [](PathWatcherEventBatch *waiting) { return !!waiting->inFlight; });
+        pulledBatches.insert(bulk, batch);
+      }
+      shouldNotify = !pullNotified;
+      pullNotified = true;
+    }
+    if (shouldNotify)
+      NotifyEventsAvailable();
+    return;
+  }
+  napi_status status = tsfn.Acquire();
+  if (status != napi_ok) {
+    // We couldn't acquire the `tsfn`; it might be in the process of being
+    // aborted because our environment is terminating.
+    ReleaseBatch(batch);
+    return;
+  }
+
+  auto processor = !asArray                ? ProcessEvent
+                   : options.packedBatches ? ProcessPackedEventBatch
+                                           : ProcessEventBatch;
+
+  if (stats) {
+    batch->stats = stats;
+    batch->handedOffAt = std::chrono::steady_clock::now();
+    int64_t depth = ++stats->queueDepth;
+    int64_t highWater = stats->queueDepthHighWater;
+    while (depth > highWater &&
+           !stats->queueDepthHighWater.compare_exchange_weak(highWater, depth))
+      ;
+  }
+
+  // With an unbounded `ThreadSafeFunction` queue, neither of these will wait
+  // on the main thread; but `NonBlockingCall` is the one that makes that
+  // promise explicitly.
+  if (options.nonBlocking) {
+    status = tsfn.NonBlockingCall(batch, processor);
+  } else {
+    status = tsfn.BlockingCall(batch, processor);
+  }
+
+  tsfn.Release();
+  if (status != napi_ok) {
+    if (stats)
+      stats->queueDepth--;
+    // TODO: Not sure how this could fail, or how we should present it to the
+    // user if it does fail. This action runs on a separate thread and it's not
+    // immediately clear how we'd surface an exception from here.
+    ReleaseBatch(batch);
+  }
+}
+
+// Tells JavaScript, in pull mode, that there are batches waiting to be
+// drained.
+static void ProcessEventsAvailable(Napi::Env env, Napi::Function callback,
+                                   PathWatcherEventBatch *) {
+  if (EnvIsStopping(env))
+    return;
+  try {
+    callback.Call({});
+  } catch (const Napi::Error &e) {
+    Napi::TypeError::New(env, "Unknown error handling filesystem events")
+        .ThrowAsJavaScriptException();
+  }
+}
+
+void PathWatcherListener::NotifyEventsAvailable() {
+  if (tsfn.Acquire() != napi_ok)
+    return;
+  tsfn.NonBlockingCall(static_cast<PathWatcherEventBatch *>(nullptr),
+                       ProcessEventsAvailable);
+  tsfn.Release();
+}
+
+PathWatcherEventBatch *PathWatcherListener::Drain(size_t maxEvents) {
+  std::deque<PathWatcherEventBatch *> taken;
+  bool shouldNotify = false;
+  {
+    std::lock_guard<std::mutex> lock(pullMutex);
+    size_t count = 0;
+    while (!pulledBatches.empty()) {
+      size_t next = pulledBatches.front()->events.size();
+      if (maxEvents > 0 && !taken.empty() && count + next > maxEvents)
+        break;
+      count += next;
+      taken.push_back(pulledBatches.front());
+      pulledBatches.pop_front();
+    }
+    // Whatever's left (or comes along later) gets a notification of its own.
+    pullNotified = !pulledBatches.empty();
+    shouldNotify = pullNotified;
+  }
+  if (shouldNotify)
+    NotifyEventsAvailable();
+  if (taken.empty())
+    return nullptr;
+
+  PathWatcherEventBatch *merged = pool->Acquire();
+  for (auto *batch : taken) {
+    RecordDelivery(batch);
+    uint32_t shift = static_cast<uint32_t>(merged->pathData.size());
+    merged->pathData.append(batch->pathData);
+    for (auto event : batch->events) {
+      event.newPathOffset += shift;
+      event.oldPathOffset += shift;
+      merged->events.push_back(event);
+    }
+    ReleaseBatch(batch);
+  }
+  return merged;
+}
+
+void PathWatcherListener::ReleasePulledBatches() {
+  std::deque<PathWatcherEventBatch *> batches;
+  {
+    std::lock_guard<std::mutex> lock(pullMutex);
+    batches.swap(pulledBatches);
+    pullNotified = false;
+  }
+  for (auto *batch : batches) {
+    if (batch->stats)
+      batch->stats->queueDepth--;
+    ReleaseBatch(batch);
+  }
+}
+
+// Past this many buckets, we forget the ones that have filled back up, since
+// they'd start out full anyway. Callers must hold `batchMutex`. Handles that
+// are unwatched lose theirs right away, so this only comes into play with
+// that many busy watches.
+static const size_t kTokenBucketLimit = 1024;
+
+// Spends one of the handle's tokens, if it has one, after topping up its
+// bucket for the time that's gone by. Callers must hold `batchMutex`.
+bool PathWatcherListener::TakeToken(efsw::WatchID handle) {
+  auto it = tokenBuckets.find(handle);
+  bool own = it != tokenBuckets.end() && it->second.rate > 0;
+  double rate = own ? it->second.rate : options.handleEventsPerSecond;
+  if (rate <= 0)
+    return true;
+  size_t burstSize = own ? it->second.burst : options.handleEventBurst;
+  double burst = burstSize > 0 ? static_cast<double>(burstSize)
+                               : std::max(rate, 1.0);
+  auto now = std::chrono::steady_clock::now();
+
+  if (it == tokenBuckets.end()) {
+    if (tokenBuckets.size() >= kTokenBucketLimit) {
+      // A bucket with a rate of its own would forget it, so those stay.
+      for (auto bucket = tokenBuckets.begin(); bucket != tokenBuckets.end();) {
+        std::chrono::duration<double> idle = now - bucket->second.refilledAt;
+        if (bucket->second.rate <= 0 &&
+            bucket->second.tokens + idle.count() * rate >= burst) {
+          bucket = tokenBuckets.erase(bucket);
+        } else {
+          ++bucket;
+        }
+      }
+    }
+    it = tokenBuckets.emplace(handle, TokenBucket{burst, now}).first;
+  }
+
+  TokenBucket &bucket = it->second;
+  std::chrono::duration<double> elapsed = now - bucket.refilledAt;
+  bucket.tokens = std::min(burst, bucket.tokens + elapsed.count() * rate);
+  bucket.refilledAt = now;
+  if (bucket.tokens < 1)
+    return false;
+  bucket.tokens -= 1;
+  return true;
+}
+
+void PathWatcherListener::SetRateLimit(efsw::WatchID handle, double rate,
+                                       size_t burst) {
+  if (rate <= 0)
+    return;
+  std::lock_guard<std::mutex> lock(batchMutex);
+  double tokens = burst > 0 ? static_cast<double>(burst) : std::max(rate, 1.0);
+  TokenBucket bucket = {tokens, std::chrono::steady_clock::now(), rate, burst};
+  auto it = tokenBuckets.find(handle);
+  if (it == tokenBuckets.end()) {
+    tokenBuckets.emplace(handle, bucket);
+  } else {
+    if (it->second.rate > 0)
+      ownRateLimits--;
+    it->second = bucket;
+  }
+  ownRateLimits++;
+}
+
+void PathWatcherListener::ForgetTokenBucket(efsw::WatchID handle) {
+  std::lock_guard<std::mutex> lock(batchMutex);
+  auto it = tokenBuckets.find(handle);
+  if (it == tokenBuckets.end())
+    return;
+  if (it->second.rate > 0)
+    ownRateLimits--;
+  tokenBuckets.erase(it);
+}
+
+// Whether there's nothing at all waiting to go out with the next batch.
+// Callers must hold `batchMutex`.
+bool PathWatcherListener::BatchIsEmpty() const {
+  return pendingBatch.events.empty() && overflowedHandles.empty() &&
+         throttledHandles.empty();
+}
+
+// Adds an event to the pending batch. The first event in an empty batch
+// starts the clock on that batch's window. Events in the priority lane go to
+// a batch of their own, which doesn't wait for a window at all.
+void PathWatcherListener::EnqueueEvent(efsw::Action action,
+                                       efsw::WatchID handle,
+                                       const std::string &dir,
+                                       const std::string &filename,
+                                       const std::string &oldFilename,
+                                       const std::string &watcherPath) {
+  bool shouldNotify = false;
+  {
+    std::lock_guard<std::mutex> lock(batchMutex);
+    if (flushThreadStopping)
+      return;
+    if (!priorityHandles.empty() &&
+        IsPriorityEvent(handle, dir, filename, oldFilename)) {
+      // A handful of files that someone is looking at can't flood anything,
+      // so these are never dropped or held back.
+      priorityBatch.Add(action, handle, dir, filename, oldFilename,
+                        watcherPath);
+      ++*queuedCount;
+      shouldNotify = true;
+    } else {
+      if (BatchIsEmpty()) {
+        batchDeadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(options.batchWindowMs);
+        shouldNotify = true;
+      }
+      // An `armed` event can't be summed up by an overflow, so it's never
+      // dropped.
+      if (options.nonBlocking && action != ArmedAction &&
+          *queuedCount >= options.maxQueueSize) {
+        // JavaScript isn't keeping up. Rather than wait for it, drop this
+        // event and make a note to tell JavaScript what it missed.
+        overflowedHandles.emplace(handle, watcherPath);
+        efPROBE(drop, handle, kDropQueueFull);
+        if (stats)
+          stats->eventsDropped++;
+      } else if ((options.handleEventsPerSecond > 0 || ownRateLimits > 0) &&
+                 action != ArmedAction && action != OverflowAction &&
+                 !TakeToken(handle)) {
+        // This handle has used up its share. Count the event instead, so that
+        // the handle is summed up once at the end of the batch.
+        ThrottledEvents &throttled = throttledHandles[handle];
+        if (throttled.count++ == 0)
+          throttled.watcherPath = watcherPath;
+        if (stats)
+          stats->eventsThrottled++;
+      } else {
+        pendingBatch.Add(action, handle, dir, filename, oldFilename,
+                         watcherPath);
+        ++*queuedCount;
+        if (pendingBatch.events.size() >= options.batchMaxSize) {
+          shouldNotify = true;
+        }
+      }
+    }
+  }
+  if (shouldNotify) {
+    batchCondition.notify_one();
+  }
+}
+
+// Whether an event belongs in the priority lane. Callers must hold
+// `batchMutex`.
+bool PathWatcherListener::IsPriorityEvent(
+    efsw::WatchID handle, const std::string &dir, const std::string &filename,
+    const std::string &oldFilename) const {
+  auto it = priorityHandles.find(handle);
+  if (it == priorityHandles.end())
+    return false;
+  const std::unordered_set<std::string> &paths = it->second;
+  if (paths.empty())
+    return true;
+  return paths.count(dir + filename) > 0 ||
+         (!oldFilename.empty() && paths.count(dir + oldFilename) > 0);
+}
+
+void PathWatcherListener::SetPriority(efsw::WatchID handle,
+                                      std::unordered_set<std::string> paths) {
+  std::lock_guard<std::mutex> lock(batchMutex);
+  priorityHandles[handle] = std::move(paths);
+}
+
+void PathWatcherListener::ClearPriority(efsw::WatchID handle) {
+  std::lock_guard<std::mutex> lock(batchMutex);
+  priorityHandles.erase(handle);
+}
+
+// How many bulk batches may be on their way to JavaScript at once while the
+// priority lane is in use, and how often the flush thread checks whether
+// they've arrived.
+static const size_t kMaxBulkBatchesInFlight = 2;
+static const std::chrono::milliseconds kBulkLanePollInterval(5);
+
+// Whether a bulk batch should wait for the ones before it, so that a priority
+// batch won't have to. Callers must hold `batchMutex`.
+bool PathWatcherListener::BulkLaneIsBusy() const {
+  return !priorityHandles.empty() && !options.pullDelivery &&
+         *bulkInFlight >= kMaxBulkBatchesInFlight;
+}
+
+// Sends the priority batch along right away. Expects `lock` to hold
+// `batchMutex`, and lets go of it while delivering.
+void PathWatcherListener::FlushPriorityBatch(
+    std::unique_lock<std::mutex> &lock) {
+  PathWatcherEventBatch *batch = pool->Acquire();
+  std::swap(batch->events, priorityBatch.events);
+  std::swap(batch->pathData, priorityBatch.pathData);
+  batch->queuedCount = queuedCount;
+  lock.unlock();
+  if (options.coalesce) {
+    size_t before = batch->events.size();
+    CoalesceEvents(*batch);
+    *queuedCount -= before - batch->events.size();
+  }
+  DeliverBatch(batch, true);
+  lock.lock();
+}
+
+// Runs on its own thread whenever batching is enabled. Waits for a batch to
+// either fill up or reach the end of its window, then sends it along.
+void PathWatcherListener::FlushLoop() {
+  std::unique_lock<std::mutex> lock(batchMutex);
+  auto hasPriorityEvents = [this] { return !priorityBatch.events.empty(); };
+  while (!flushThreadStopping) {
+    if (hasPriorityEvents()) {
+      FlushPriorityBatch(lock);
+      continue;
+    }
+    if (BatchIsEmpty()) {
+      batchCondition.wait(lock, [&] {
+        return flushThreadStopping || hasPriorityEvents() || !BatchIsEmpty();
+      });
+      continue;
+    }
+
+    batchCondition.wait_until(lock, batchDeadline, [&] {
+      return flushThreadStopping || hasPriorityEvents() ||
+             pendingBatch.events.size() >= options.batchMaxSize;
+    });
+    if (flushThreadStopping)
+      break;
+    if (hasPriorityEvents())
+      continue;
+    if (BulkLaneIsBusy()) {
+      // The batch keeps growing (and coalescing) in the meantime.
+      batchCondition.wait_for(lock, kBulkLanePollInterval, [&] {
+        return flushThreadStopping || hasPriorityEvents();
+      });
+      continue;
+    }
+
+    PathWatcherEventBatch *batch = pool->Acquire();
+    std::swap(batch->events, pendingBatch.events);
+    std::swap(batch->pathData, pendingBatch.pathData);
+    batch->queuedCount = queuedCount;
+    ++*bulkInFlight;
+    batch->inFlight = bulkInFlight;
+    std::unordered_map<efsw::WatchID, std::string> overflows;
+    overflows.swap(overflowedHandles);
+    std::unordered_map<efsw::WatchID, ThrottledEvents> throttled;
+    throttled.swap(throttledHandles);
+
+    // Don't hold the lock while we coalesce or wait on the main thread; the
+    // watcher threads should be able to keep adding to the next batch.
+    lock.unlock();
+    if (options.coalesce) {
+      size_t before = batch->events.size();
+      CoalesceEvents(*batch);
+      *queuedCount -= before - batch->events.size();
+    }
+    for (auto &it : overflows) {
+      batch->AddOverflow(it.first, it.second);
+    }
+    // An overflow already says that anything may have changed.
+    for (auto &it : throttled) {
+      if (overflows.count(it.first) == 0)
+        batch->AddThrottled(it.first, it.second.watcherPath, it.second.count);
+    }
+    if (batch->events.empty()) {
+      ReleaseBatch(batch);
+    } else {
+      DeliverBatch(batch, true);
+    }
+    lock.lock();
+  }
+}
+
+std::shared_ptr<const WatchedPathTable>
+PathWatcherListener::PathTable() const {
+  return std::atomic_load(&pathTable);
+}
+
+// Callers must hold `pathTableMutex`.
+void PathWatcherListener::PublishPathTable(
+    std::shared_ptr<const WatchedPathTable> table) {
+  std::atomic_store(&pathTable, std::move(table));
+}
+
+// Correlate a watch ID to what we know about its path.
+void PathWatcherListener::AddPath(PathTimestampPair pair,
+                                  efsw::WatchID handle) {
+  AddPaths({{std::move(pair), handle}});
+}
+
+// Correlate several watch IDs to what we know about their paths at once. This
+// copies the path table only once, no matter how many pairs there are.
+void PathWatcherListener::AddPaths(
+    std::vector<std::pair<PathTimestampPair, efsw::WatchID>> pairs) {
+  if (pairs.empty())
+    return;
+  std::vector<std::pair<efsw::WatchID, std::string>> armed;
+  {
+    std::lock_guard<std::mutex> lock(pathTableMutex);
+    auto table = std::make_shared<WatchedPathTable>(*PathTable());
+    for (auto &it : pairs) {
+      if (armedEarly.erase(it.second) > 0)
+        armed.emplace_back(it.second, it.first.path);
+      table->pathsToHandles[efsw::InternedPath(it.first.path)] = it.second;
+      table->paths[it.second] = std::move(it.first);
+    }
+    PublishPathTable(std::move(table));
+  }
+  if (watchesBeingAdded > 0) {
+    hasEarlyReplay = true;
+    WakeDispatcher();
+  }
+  for (auto &it : armed) {
+    DispatchEvent(ArmedAction, it.first, it.second, "", "", it.second);
+  }
+}
+
+void PathWatcherListener::BeginAddingWatch() { watchesBeingAdded++; }
+
+void PathWatcherListener::EndAddingWatch() {
+  {
+    std::lock_guard<std::mutex> lock(pathTableMutex);
+    // Whatever is still held once nothing's being added was for a watch
+    // that failed, or one that's already gone.
+    if (--watchesBeingAdded == 0)
+      armedEarly.clear();
+  }
+  hasEarlyReplay = true;
+  WakeDispatcher();
+}
+
+// Remove metadata for a given watch ID.
+std::vector<efsw::WatchID>
+PathWatcherListener::RemovePath(efsw::WatchID handle) {
+  return RemovePaths({handle});
+}
+
+// Remove metadata for several watch IDs at once.
+std::vector<efsw::WatchID>
+PathWatcherListener::RemovePaths(const std::vector<efsw::WatchID> &handles) {
+  if (isShuttingDown)
+    return handles;
+  std::vector<efsw::WatchID> removable;
+  std::lock_guard<std::mutex> lock(pathTableMutex);
+  std::shared_ptr<const WatchedPathTable> current = PathTable();
+  std::shared_ptr<WatchedPathTable> table;
+  for (auto handle : handles) {
+    auto it = current->paths.find(handle);
+    if (it == current->paths.end()) {
+      // Not one of ours (anymore), but the backend may still know it.
+      if (current->coveringHandles.count(handle) == 0 &&
+          current->retired.count(handle) == 0)
+        removable.push_back(handle);
+      continue;
+    }
+#ifdef DEBUG
+    std::cout << "Unwatching handle: [" << handle << "] path: ["
+              << it->second.path << "]" << std::endl;
+#endif
+    if (!table) {
+      table = std::make_shared<WatchedPathTable>(*current);
+      current = table;
+    }
+    auto pathIt =
+        table->pathsToHandles.find(efsw::InternedPath::find(it->second.path));
+    if (pathIt != table->pathsToHandles.end() && pathIt->second == handle)
+      table->pathsToHandles.erase(pathIt);
+    table->paths.erase(handle);
+    ClearPathFilter(handle);
+    ClearPriority(handle);
+    ForgetTokenBucket(handle);
+    ForgetChangeLog(handle);
+    if (stats)
+      stats->ForgetHandle(handle);
+
+    auto covering = table->coveringHandles.find(handle);
+    if (covering != table->coveringHandles.end()) {
+      // A covered handle. Its covering watch may have been waiting on it.
+      efsw::WatchID coveringHandle = covering->second;
+      table->coveringHandles.erase(covering);
+      auto &siblings = table->covered[coveringHandle];
+      siblings.erase(std::remove(siblings.begin(), siblings.end(), handle),
+                     siblings.end());
+      if (siblings.empty()) {
+        table->covered.erase(coveringHandle);
+        if (table->retired.erase(coveringHandle) > 0)
+          removable.push_back(coveringHandle);
+      }
+    } else if (table->covered.count(handle) > 0) {
+      table->retired.insert(handle);
+    } else {
+      removable.push_back(handle);
+    }
+  }
+  if (table) {
+    PublishPathTable(std::move(table));
+  }
+  return removable;
+}
+
+// Finds a backend watch of ours on the same real path, made with the same
+// options, so that it sees exactly what a new watch of `pair` would.
+bool PathWatcherListener::FindSameWatch(const WatchedPathTable &table,
+                                        const PathTimestampPair &pair,
+                                        efsw::WatchID &same) {
+  for (auto &it : table.paths) {
+    const PathTimestampPair &other = it.second;
+    if (other.realPath == pair.realPath &&
+        other.recursive == pair.recursive &&
+        other.patternKey == pair.patternKey &&
+        other.optionKey == pair.optionKey && other.digest == pair.digest &&
+        other.fingerprint == pair.fingerprint &&
+        table.coveringHandles.count(it.first) == 0) {
+      same = it.first;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Finds a recursive backend watch of ours, without patterns, whose events
+// include everything a watch on `path` would see.
+bool PathWatcherListener::FindCoveringWatch(const WatchedPathTable &table,
+                                            const std::string &path,
+                                            efsw::WatchID &covering) {
+  for (auto &it : table.paths) {
+    const PathTimestampPair &pair = it.second;
+    if (!pair.recursive || pair.patterns || !pair.patternKey.empty() ||
+        !pair.optionKey.empty() ||
+        table.coveringHandles.count(it.first) > 0)
+      continue;
+    if (path.compare(0, pair.path.size(), pair.path) != 0)
+      continue;
+    if (path.size() == pair.path.size() ||
+        path[pair.path.size()] == PATH_SEPARATOR) {
+      covering = it.first;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PathWatcherListener::ShareExistingWatch(PathTimestampPair pair,
+                                             bool coverable,
+                                             efsw::WatchID &handle) {
+  std::lock_guard<std::mutex> lock(pathTableMutex);
+  std::shared_ptr<const WatchedPathTable> current = PathTable();
+  efsw::WatchID covering;
+  if (FindSameWatch(*current, pair, covering)) {
+    // The two may have reached the same directory by different names. Events
+    // come in under the backend watch's, and get ours instead on the way out.
+    // Its patterns apply to us too, when it's the one applying them.
+    const PathTimestampPair &same = current->paths.at(covering);
+    if (same.path != pair.path)
+      pair.backendPath = same.path;
+    pair.patterns = same.patterns;
+  } else if (!coverable ||
+             !FindCoveringWatch(*current, pair.path, covering)) {
+    return false;
+  }
+
+  auto table = std::make_shared<WatchedPathTable>(*current);
+  handle = nextCoveredHandle++;
+  table->pathsToHandles.emplace(efsw::InternedPath(pair.path), handle);
+  table->paths[handle] = std::move(pair);
+  table->covered[covering].push_back(handle);
+  table->coveringHandles[handle] = covering;
+  PublishPathTable(std::move(table));
+  return true;
+}
+
+// The backends watch a path only once, so a watch of `pair` can't have a
+// backend watch of its own when one of ours already watches its real path
+// tuned some other way. Sharing that one would quietly lose this one's tuning.
+bool PathWatcherListener::IsWatchedWithOtherTuning(
+    const PathTimestampPair &pair) {
+  std::lock_guard<std::mutex> lock(pathTableMutex);
+  std::shared_ptr<const WatchedPathTable> current = PathTable();
+  for (auto &it : current->paths) {
+    const PathTimestampPair &other = it.second;
+    if (other.realPath == pair.realPath &&
+        other.optionKey != pair.optionKey &&
+        current->coveringHandles.count(it.first) == 0)
+      return true;
+  }
+  return false;
+}
+
+void PathWatcherListener::SetPathFilter(
+    efsw::WatchID handle, std::unordered_set<std::string> paths) {
+  std::lock_guard<std::mutex> lock(pathFilterMutex);
+  pathFilters[handle] = std::move(paths);
+  hasPathFilters = true;
+}
+
+void PathWatcherListener::ClearPathFilter(efsw::WatchID handle) {
+  std::lock_guard<std::mutex> lock(pathFilterMutex);
+  pathFilters.erase(handle);
+  hasPathFilters = !pathFilters.empty();
+}
+
+bool PathWatcherListener::HasPath(std::string path) {
+  std::shared_ptr<const WatchedPathTable> table = PathTable();
+  auto it = table->pathsToHandles.find(efsw::InternedPath::find(path));
+  return it != table->pathsToHandles.end();
+}
+
+efsw::WatchID PathWatcherListener::GetHandleForPath(std::string path) {
+  std::shared_ptr<const WatchedPathTable> table = PathTable();
+  auto it = table->pathsToHandles.find(efsw::InternedPath::find(path));
+  return it->second;
+}
+
+bool PathWatcherListener::IsEmpty() { return PathTable()->paths.empty(); }
+
+// What a set of paths takes, strings and all.
+static void AddPathSetUsage(const std::unordered_set<std::string> &paths,
+                            efsw::MemoryUsage &usage) {
+  usage.watchTableBytes += efsw::MemoryCost::hash(paths);
+  for (auto &path : paths)
+    usage.stringBytes += efsw::MemoryCost::string(path);
+}
+
+void PathWatcherListener::MemoryUsage(efsw::MemoryUsage &usage) {
+  using efsw::MemoryCost::hash;
+  using efsw::MemoryCost::string;
+
+  // Tables are never modified once they're published, so the one we're
+  // holding on to can be read without a lock.
+  std::shared_ptr<const WatchedPathTable> table = PathTable();
+  usage.watchTableBytes +=
+      sizeof(WatchedPathTable) + hash(table->paths) +
+      hash(table->pathsToHandles) + hash(table->covered) +
+      hash(table->coveringHandles) + hash(table->retired);
+  for (auto &it : table->paths) {
+    usage.stringBytes += string(it.second.path) +
+                         string(it.second.realPath) +
+                         string(it.second.patternKey) +
+                         string(it.second.optionKey) +
+                         string(it.second.backendPath);
+  }
+  for (auto &it : table->covered)
+    usage.watchTableBytes += efsw::MemoryCost::buffer(it.second);
+  {
+    std::lock_guard<std::mutex> lock(pathTableMutex);
+    usage.watchTableBytes += hash(armedEarly);
+  }
+  {
+    std::lock_guard<std::mutex> lock(pathFilterMutex);
+    usage.watchTableBytes += hash(pathFilters);
+    for (auto &it : pathFilters)
+      AddPathSetUsage(it.second, usage);
+  }
+
+  usage.pendingEventBytes += ring.SlotBytes();
+  {
+    std::lock_guard<std::mutex> lock(batchMutex);
+    usage.pendingEventBytes += BatchBytes(pendingBatch) +
+                               BatchBytes(priorityBatch);
+    usage.watchTableBytes += hash(overflowedHandles) + hash(tokenBuckets) +
+                             hash(throttledHandles) + hash(priorityHandles);
+    for (auto &it : overflowedHandles)
+      usage.stringBytes += string(it.second);
+    for (auto &it : throttledHandles)
+      usage.stringBytes += string(it.second.watcherPath);
+    for (auto &it : priorityHandles)
+      AddPathSetUsage(it.second, usage);
+  }
+  {
+    std::lock_guard<std::mutex> lock(pullMutex);
+    usage.pendingEventBytes += efsw::MemoryCost::deque(pulledBatches);
+    for (auto batch : pulledBatches)
+      usage.pendingEventBytes += BatchBytes(*batch);
+  }
+  {
+    std::lock_guard<std::mutex> lock(changeLogMutex);
+    usage.watchTableBytes += hash(changeLogs);
+    for (auto &it : changeLogs)
+      usage.watchTableBytes += it.second.MemoryUsage();
+  }
+  {
+    std::lock_guard<std::mutex> lock(digestMutex);
+    usage.pendingEventBytes += efsw::MemoryCost::deque(digestQueue);
+    for (auto &event : digestQueue) {
+      usage.stringBytes += string(event.dir) + string(event.filename) +
+                           string(event.oldFilename);
+    }
+    usage.watchTableBytes += hash(pendingModified);
+    for (auto &it : pendingModified) {
+      usage.watchTableBytes += hash(it.second);
+      for (auto &pending : it.second)
+        usage.stringBytes += string(pending.first);
+    }
+  }
+
+#ifdef __APPLE__
+  {
+    std::lock_guard<std::mutex> lock(statCacheMutex);
+    usage.watchTableBytes += hash(statCache);
+    for (auto &it : statCache)
+      usage.stringBytes += string(it.first);
+  }
+  for (auto &shard : validationShards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    usage.pendingEventBytes += efsw::MemoryCost::deque(shard->queue);
+    for (auto &event : shard->queue) {
+      usage.stringBytes += string(event.dir) + string(event.filename) +
+                           string(event.oldFilename);
+    }
+  }
+#endif
+}
+
+#ifdef __APPLE__
+// Decides whether a `stat` result shows that a creation is one of macOS’s
+// false positives (see `handleFileAction`).
+static bool ShouldSkipCreation(const struct stat &file) {
+  // One easy way to check if a file was truly just created: does its creation
+  // time match its modification time? If not, the file has been written to
+  // since its creation.
+  return file.st_birthtimespec.tv_sec != file.st_mtimespec.tv_sec;
+}
+
+// Past this many entries we stop caching until the window rolls over, rather
+// than let a huge burst grow the cache without bound.
+static const size_t kStatCacheLimit = 1024;
+
+bool PathWatcherListener::LookupStat(const std::string &path,
+                                     struct stat &result) {
+  std::lock_guard<std::mutex> lock(statCacheMutex);
+  auto it = statCache.find(path);
+  if (it == statCache.end())
+    return false;
+  if (it->second.expires <= std::chrono::steady_clock::now()) {
+    statCache.erase(it);
+    return false;
+  }
+  result = it->second.info;
+  return true;
+}
+
+void PathWatcherListener::RememberStat(const std::string &path,
+                                       const struct stat &result) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> lock(statCacheMutex);
+  if (statCache.size() >= kStatCacheLimit) {
+    for (auto it = statCache.begin(); it != statCache.end();) {
+      if (it->second.expires <= now) {
+        it = statCache.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (statCache.size() >= kStatCacheLimit)
+      return;
+  }
+  // Unbatched delivery has no window of its own, so borrow a short one.
+  int windowMs = std::max(options.batchWindowMs, 10);
+  statCache[path] = {result, now + std::chrono::milliseconds(windowMs)};
+}
+
+void PathWatcherListener::ForgetStat(const std::string &path) {
+  std::lock_guard<std::mutex> lock(statCacheMutex);
+  statCache.erase(path);
+}
+#endif
+
+// Counts a `handleFileAction` call as active for as long as it's in scope.
+class ActiveHandlerScope {
+public:
+  explicit ActiveHandlerScope(std::atomic<int> &count) : count(count) {
+    ++count;
+  }
+  ~ActiveHandlerScope() { --count; }
+
+private:
+  std::atomic<int> &count;
+};
+
+void PathWatcherListener::handleFileAction(efsw::WatchID watchId,
+                                           const std::string &dir,
+                                           const std::string &filename,
+                                           efsw::Action action,
+                                           std::string oldFilename) {
+  efPROBE(action_entry, watchId, action);
+  Receive(watchId, dir, filename, action, oldFilename);
+  efPROBE(action_exit, watchId, action);
+}
+
+// The inotify backend hands us everything it read from the kernel in one go.
+void PathWatcherListener::handleFileActions(const efsw::FileAction *actions,
+                                            size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    const efsw::FileAction &it = actions[i];
+    efPROBE(action_entry, it.watchid, it.action);
+    Receive(it.watchid, *it.dir, *it.filename, it.action, *it.oldFilename);
+    efPROBE(action_exit, it.watchid, it.action);
+  }
+}
+
+void PathWatcherListener::Receive(efsw::WatchID watchId,
+                                  const std::string &dir,
+                                  const std::string &filename,
+                                  efsw::Action action,
+                                  const std::string &oldFilename) {
+#ifdef DEBUG
+  std::cout << "PathWatcherListener::handleFileAction dir: " << dir
+            << " filename: " << filename << " oldFilename: " << filename
+            << " action: " << EventType(action, true) << std::endl;
+#endif
+  // Don't try to proceed if we've already started the shutdown process…
+  if (isShuttingDown)
+    return;
+
+  // …but if we haven't, make sure that shutdown doesn’t happen until we’re
+  // done.
+  ActiveHandlerScope scope(activeHandlers);
+  if (isShuttingDown)
+    return;
+
+  // Everything else happens on the dispatcher thread, so that the backend can
+  // get straight back to reading from the OS.
+  PushRawEvent(action, watchId, dir, filename, oldFilename);
+}
+
+// Called by the backend once a watch started with `armInBackground` is
+// watching its whole tree. This goes through the dispatcher like any other
+// event, so that it can't overtake the events that came before it.
+void PathWatcherListener::handleWatchArmed(efsw::WatchID watchId) {
+  if (isShuttingDown)
+    return;
+  ActiveHandlerScope scope(activeHandlers);
+  if (isShuttingDown)
+    return;
+
+  PushRawEvent(ArmedAction, watchId, "", "", "");
+}
+
+// Hands an event to the dispatcher thread, waking it up if it's asleep.
+void PathWatcherListener::PushRawEvent(efsw::Action action,
+                                       efsw::WatchID handle,
+                                       const std::string &dir,
+                                       const std::string &filename,
+                                       const std::string &oldFilename) {
+  std::chrono::steady_clock::time_point reportedAt;
+  if (stats)
+    reportedAt = std::chrono::steady_clock::now();
+
+  while (!ring.TryPush(action, handle, dir, filename, oldFilename,
+                       reportedAt)) {
+    // An `armed` event can't be summed up by an overflow, so it's never
+    // dropped.
+    if (options.nonBlocking && action != ArmedAction) {
+      // The dispatcher is behind and we've promised not to wait on it. Drop
+      // the event and make a note to tell JavaScript what it missed.
+      std::lock_guard<std::mutex> lock(ringOverflowMutex);
+      ringOverflows.insert(handle);
+      hasRingOverflows = true;
+      efPROBE(drop, handle, kDropQueueFull);
+      if (stats)
+        stats->eventsDropped++;
+      break;
+    }
+    if (isShuttingDown)
+      return;
+    std::this_thread::yield();
+  }
+
+  WakeDispatcher();
+}
+
+// Wakes the dispatcher thread if it's asleep, once there's something new for
+// it to look at.
+void PathWatcherListener::WakeDispatcher() {
+  // Pairs with the fence in `DispatchLoop`: either we see that the dispatcher
+  // has gone idle, or it sees what we did before it goes to sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (dispatcherIdle.load(std::memory_order_relaxed)) {
+    {
+      std::lock_guard<std::mutex> lock(dispatchMutex);
+      dispatcherIdle = false;
+    }
+    dispatchCondition.notify_one();
+  }
+}
+
+// Runs on its own thread for as long as the listener is alive. Takes raw
+// events off the ring in the order they were pushed and sends them on their
+// way.
+void PathWatcherListener::DispatchLoop() {
+  RawEvent event;
+  while (!dispatcherStopping) {
+    if (ring.TryPop(event)) {
+      HandleRawEvent(event);
+      continue;
+    }
+    if (DrainRingOverflows())
+      continue;
+    if (hasEarlyReplay.exchange(false)) {
+      ReplayEarlyEvents();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(dispatchMutex);
+    dispatcherIdle = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!ring.IsEmpty() || hasRingOverflows || hasEarlyReplay) {
+      dispatcherIdle = false;
+      continue;
+    }
+    dispatchCondition.wait(
+        lock, [this] { return dispatcherStopping || !dispatcherIdle; });
+    dispatcherIdle = false;
+  }
+}
+
+// Reports the handles that had events dropped on their way into the ring.
+// Returns whether there were any.
+bool PathWatcherListener::DrainRingOverflows() {
+  if (!hasRingOverflows)
+    return false;
+  std::unordered_set<efsw::WatchID> handles;
+  {
+    std::lock_guard<std::mutex> lock(ringOverflowMutex);
+    handles.swap(ringOverflows);
+    hasRingOverflows = false;
+  }
+  RawEvent event;
+  event.action = OverflowAction;
+  event.reportedAt = std::chrono::steady_clock::time_point();
+  for (auto handle : handles) {
+    event.handle = handle;
+    HandleRawEvent(event);
+  }
+  return !handles.empty();
+}
+
+// Does what the backend would otherwise have had to do itself: finds the
+// watcher an event belongs to and sends the event along.
+void PathWatcherListener::HandleRawEvent(const RawEvent &event) {
+  if (isShuttingDown)
+    return;
+
+  if (event.action == ArmedAction) {
+    HandleArmed(event.handle);
+    return;
+  }
+
+  // Held events go first, so that a handle's events stay in order.
+  if (!earlyEvents.empty())
+    ReplayEarlyEvents();
+
+  // We hold on to the table itself so that we can refer to its entries
+  // without copying them.
+  std::shared_ptr<const WatchedPathTable> table = PathTable();
+  if (RouteRawEvent(event, *table))
+    return;
+  // Couldn't find the watcher. Unless it's one we're still adding, assume
+  // it's been removed.
+  if (watchesBeingAdded > 0)
+    HoldEarlyEvent(event);
+}
+
+// Finds the watcher an event belongs to in `table` and sends the event along.
+// Returns `false` if there isn't one.
+bool PathWatcherListener::RouteRawEvent(const RawEvent &event,
+                                        const WatchedPathTable &table) {
+  auto it = table.paths.find(event.handle);
+  auto covered = table.covered.find(event.handle);
+  if (it == table.paths.end() && covered == table.covered.end())
+    return false;
+
+  // Overflows from the ring itself weren't reported by anyone, so they have no
+  // time to measure from.
+  if (stats && event.reportedAt.time_since_epoch().count() != 0) {
+    stats->dispatchLatency.Record(std::chrono::steady_clock::now() -
+                                  event.reportedAt);
+    stats->eventsReceived++;
+    stats->CountHandleEvent(event.handle);
+  }
+
+  if (covered != table.covered.end())
+    RouteCoveredEvent(event, table, covered->second);
+  // A retired handle only lives on for the sake of the handles it covers.
+  if (it != table.paths.end())
+    HandleWatchEvent(event, it->second);
+  return true;
+}
+
+// The most events we hold for watches that are still being added. Past it, a
+// handle just gets an overflow once it's added.
+static const size_t kMaxEarlyEvents = 4096;
+
+void PathWatcherListener::HoldEarlyEvent(const RawEvent &event) {
+  if (earlyEvents.size() >= kMaxEarlyEvents) {
+    earlyOverflows.insert(event.handle);
+    efPROBE(drop, event.handle, kDropQueueFull);
+    if (stats)
+      stats->eventsDropped++;
+    return;
+  }
+  earlyEvents.push_back(event);
+}
+
+// Sends on the held events whose watches have been added since, and drops the
+// rest if nothing is being added anymore.
+void PathWatcherListener::ReplayEarlyEvents() {
+  if (earlyEvents.empty() && earlyOverflows.empty())
+    return;
+  std::shared_ptr<const WatchedPathTable> table = PathTable();
+  bool adding = watchesBeingAdded > 0;
+  std::vector<RawEvent> held;
+  held.swap(earlyEvents);
+  for (auto &event : held) {
+    if (!RouteRawEvent(event, *table) && adding)
+      earlyEvents.push_back(std::move(event));
+  }
+
+  RawEvent overflow;
+  overflow.action = OverflowAction;
+  overflow.reportedAt = std::chrono::steady_clock::time_point();
+  for (auto it = earlyOverflows.begin(); it != earlyOverflows.end();) {
+    overflow.handle = *it;
+    if (RouteRawEvent(overflow, *table) || !adding) {
+      it = earlyOverflows.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+// Sends an event along to the watcher of `pair`, which `event.handle` names.
+void PathWatcherListener::HandleWatchEvent(const RawEvent &event,
+                                           const PathTimestampPair &pair) {
+  if (event.action == OverflowAction) {
+    // There's nothing on disk to validate; the watcher just lost track.
+    DispatchOverflow(event.handle, pair.path);
+    return;
+  }
+
+  if (!PassesPathFilter(event) || !PassesPatterns(event, pair)) {
+    efPROBE(drop, event.handle, kDropFiltered);
+    if (stats)
+      stats->eventsFiltered++;
+    return;
+  }
+
+#ifdef __APPLE__
+  // On macOS, events have to be checked against the filesystem before we can
+  // trust them (see `IsFalsePositive`). A `stat` can be slow on a network
+  // volume or a sleepy external disk, so we don't do it here, where it would
+  // hold up every other event the watcher has to tell us about. Instead we
+  // hand the event to a validation thread. Each watcher handle always goes to
+  // the same thread, so its events stay in order, but a slow disk under one
+  // watched root can't hold up events from the others.
+  QueueValidation(event.action, event.handle, event.dir, event.filename,
+                  event.oldFilename);
+#else
+  ForwardEvent(event.action, event.handle, event.dir, event.filename,
+               event.oldFilename, pair);
+#endif
+}
+
+// Hands an event that's passed every other check to the digest stage, if its
+// watch wants its files compared, or straight on to JavaScript otherwise.
+void PathWatcherListener::ForwardEvent(efsw::Action action,
+                                       efsw::WatchID handle,
+                                       const std::string &dir,
+                                       const std::string &filename,
+                                       const std::string &oldFilename,
+                                       const PathTimestampPair &pair) {
+  if (pair.digest || pair.fingerprint) {
+    QueueDigest(action, handle, dir, filename, oldFilename);
+  } else {
+    DispatchEvent(action, handle, dir, filename, oldFilename, pair.path);
+  }
+}
+
+// Once this many digests are on hand, we forget them all and start over. Each
+// is only there to spare the next event for its file, after all.
+static const size_t kMaxDigests = 10000;
+
+// How long a `Modified` event waits, along with whatever comes in meanwhile,
+// before we look at its file. A save often truncates the file before it writes
+// it, and each step is an event of its own; looked at straight away, the first
+// would find the file empty and look like a change.
+static const std::chrono::milliseconds kDigestSettle(50);
+
+void PathWatcherListener::QueueDigest(efsw::Action action,
+                                      efsw::WatchID handle,
+                                      const std::string &dir,
+                                      const std::string &filename,
+                                      const std::string &oldFilename) {
+  {
+    std::lock_guard<std::mutex> lock(digestMutex);
+    if (digestStopping)
+      return;
+    if (!digestThread.joinable())
+      digestThread = std::thread(&PathWatcherListener::DigestLoop, this);
+    digestQueue.push_back({action, handle, dir, filename, oldFilename,
+                           std::chrono::steady_clock::now()});
+    if (action == efsw::Action::Modified)
+      pendingModified[handle][dir + filename]++;
+  }
+  digestCondition.notify_one();
+}
+
+void PathWatcherListener::DigestLoop() {
+  std::unique_lock<std::mutex> lock(digestMutex);
+  std::deque<PendingDigest> batch;
+  while (true) {
+    digestCondition.wait(
+        lock, [&] { return digestStopping || !digestQueue.empty(); });
+    if (digestStopping)
+      return;
+    // Everything queued by the time the oldest event has settled goes as one
+    // batch, so a burst waits out the settle time once rather than once per
+    // event. Only `Modified` events need it at all.
+    if (!pendingModified.empty() &&
+        digestCondition.wait_until(lock,
+                                   digestQueue.front().queued + kDigestSettle,
+                                   [&] { return digestStopping; }))
+      return;
+    batch.swap(digestQueue);
+    for (auto &event : batch) {
+      if (IsSuperseded(event))
+        continue;
+      lock.unlock();
+
+      std::shared_ptr<const WatchedPathTable> table = PathTable();
+      auto it = table->paths.find(event.handle);
+      if (it == table->paths.end()) {
+        // The watch is gone, and so is any use for what we knew about it.
+        auto known = digests.find(event.handle);
+        if (known != digests.end()) {
+          digestCount -= known->second.size();
+          digests.erase(known);
+        }
+      } else if (!isShuttingDown) {
+        if (!IsUnchanged(event, it->second)) {
+          DispatchEvent(event.action, event.handle, event.dir, event.filename,
+                        event.oldFilename, it->second.path);
+        } else {
+          efPROBE(drop, event.handle, kDropUnchanged);
+          if (stats)
+            stats->eventsFiltered++;
+        }
+      }
+
+      lock.lock();
+      if (digestStopping)
+        return;
+    }
+    batch.clear();
+  }
+}
+
+// Whether a `Modified` event has a later one for the same file queued after
+// it, in this batch or the next. If so, only that one needs looking at:
+// whatever this one saw is already out of date. Either way, the event is no
+// longer pending. Called with `digestMutex` held.
+bool PathWatcherListener::IsSuperseded(const PendingDigest &event) {
+  if (event.action != efsw::Action::Modified)
+    return false;
+  auto watch = pendingModified.find(event.handle);
+  if (watch == pendingModified.end())
+    return false;
+  auto it = watch->second.find(event.dir + event.filename);
+  if (it == watch->second.end())
+    return false;
+  if (--it->second > 0)
+    return true;
+  watch->second.erase(it);
+  if (watch->second.empty())
+    pendingModified.erase(watch);
+  return false;
+}
+
+// Whether this is a `Modified` event for a file that's just as it was the
+// last time we looked. With `pair.fingerprint`, that means its size,
+// modification time and inode; with `pair.digest`, its contents, which a
+// matching fingerprint saves us from reading. Anything else that happens to a
+// file makes us forget it, since we can't know what we had is still right.
+bool PathWatcherListener::IsUnchanged(const PendingDigest &event,
+                                      const PathTimestampPair &pair) {
+  auto &known = digests[event.handle];
+  std::string path = event.dir + event.filename;
+  if (event.action != efsw::Action::Modified) {
+    digestCount -= known.erase(path);
+    if (event.action == efsw::Action::Moved)
+      digestCount -= known.erase(event.dir + event.oldFilename);
+    return false;
+  }
+
+  KnownFile now;
+  if (!ReadFingerprint(path, now.fingerprint)) {
+    // It's gone or it isn't a file. Either way, let the event through and
+    // let whoever's listening figure it out.
+    digestCount -= known.erase(path);
+    return false;
+  }
+  // What we had may have been taken too soon after a write to vouch for the
+  // file. Another write in the same tick would have been reported, though,
+  // and we'd have looked again when we got to it. So once this event came in
+  // well after that tick, giving the backend as long again to report it, it
+  // can't be that write's.
+  auto age = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - event.queued);
+  int64_t queuedNs = now.fingerprint.takenNs - age.count();
+  auto it = known.find(path);
+  bool sameFingerprint =
+      it != known.end() && it->second.fingerprint == now.fingerprint &&
+      (it->second.fingerprint.IsSettled() ||
+       now.fingerprint.IsSettledAt(queuedNs - 2000000000LL));
+
+  bool unchanged;
+  if (!pair.digest) {
+    unchanged = sameFingerprint;
+  } else if (sameFingerprint && it->second.hashed) {
+    unchanged = true;
+    now.hash = it->second.hash;
+    now.hashed = true;
+  } else {
+    XxHash64 hasher;
+    if (HashFile(path, hasher) != 0) {
+      digestCount -= known.erase(path);
+      return false;
+    }
+    now.hash = hasher.Digest();
+    now.hashed = true;
+    unchanged = it != known.end() && it->second.hashed &&
+                it->second.hash == now.hash;
+  }
+
+  if (it != known.end()) {
+    it->second = now;
+    return unchanged;
+  }
+  if (digestCount >= kMaxDigests) {
+    digests.clear();
+    digestCount = 0;
+  }
+  // `clear` may have taken `known` with it.
+  digests[event.handle][path] = now;
+  digestCount++;
+  return unchanged;
+}
+
+// Stops the digest thread. Events it hasn't gotten to yet are discarded.
+void PathWatcherListener::StopDigests() {
+  {
+    std::lock_guard<std::mutex> lock(digestMutex);
+    digestStopping = true;
+    digestQueue.clear();
+    pendingModified.clear();
+  }
+  digestCondition.notify_one();
+  if (digestThread.joinable()) {
+    digestThread.join();
+  }
+}
+
+// Is `path` something a watch on `pair` would have reported? A recursive watch
+// sees everything below its path and a plain one only its own entries. Both
+// hear about the watched directory itself going away.
+static bool IsWithinWatch(const std::string &path,
+                          const std::string &watchPath, bool recursive) {
+  size_t length = watchPath.size();
+  if (path.compare(0, length, watchPath) != 0)
+    return false;
+  if (path.size() == length)
+    return true;
+  if (path[length] != PATH_SEPARATOR)
+    return false;
+  return recursive ||
+         path.find(PATH_SEPARATOR, length + 1) == std::string::npos;
+}
+
+// Whether either of an event's paths is one that a watch on `watchPath` would
+// have reported.
+static bool IsEventWithinWatch(const std::string &dir,
+                               const std::string &filename,
+                               const std::string &oldFilename,
+                               const std::string &watchPath, bool recursive) {
+  std::string path = dir + filename;
+  StripTrailingSlashFromPath(path);
+  if (IsWithinWatch(path, watchPath, recursive))
+    return true;
+  if (oldFilename.empty())
+    return false;
+  path = dir + oldFilename;
+  StripTrailingSlashFromPath(path);
+  return IsWithinWatch(path, watchPath, recursive);
+}
+
+// Hands a covering watch's event to each handle it covers that would have
+// heard about it from a watch of its own.
+void PathWatcherListener::RouteCoveredEvent(
+    const RawEvent &event, const WatchedPathTable &table,
+    const std::vector<efsw::WatchID> &handles) {
+  for (auto handle : handles) {
+    auto it = table.paths.find(handle);
+    if (it == table.paths.end())
+      continue;
+    const PathTimestampPair &pair = it->second;
+    const std::string &watchPath =
+        pair.backendPath.empty() ? pair.path : pair.backendPath;
+    if (event.action != OverflowAction &&
+        !IsEventWithinWatch(event.dir, event.filename, event.oldFilename,
+                            watchPath, pair.recursive))
+      continue;
+    RawEvent routed = event;
+    routed.handle = handle;
+    // Swap the backend watch's name for the directory for ours, the way a
+    // covering watch's subscriptions are scoped.
+    if (!pair.backendPath.empty() &&
+        routed.dir.compare(0, watchPath.size(), watchPath) == 0)
+      routed.dir.replace(0, watchPath.size(), pair.path);
+    HandleWatchEvent(routed, pair);
+  }
+}
+
+// Whether JavaScript wants to hear about this event. With a filter in place,
+// it does when either of the event's paths is one it asked for.
+bool PathWatcherListener::PassesPathFilter(const RawEvent &event) {
+  if (!hasPathFilters)
+    return true;
+  std::lock_guard<std::mutex> lock(pathFilterMutex);
+  auto it = pathFilters.find(event.handle);
+  if (it == pathFilters.end())
+    return true;
+
+  std::string &path = pathFilterScratch;
+  path.assign(event.dir).append(event.filename);
+  if (it->second.count(path))
+    return true;
+  if (event.oldFilename.empty())
+    return false;
+
+  path.assign(event.dir).append(event.oldFilename);
+  if (!it->second.count(path))
+    return false;
+  // A file we're filtering for was renamed. JavaScript follows a file to its
+  // new name, so we do too; otherwise we'd drop the file's events until
+  // JavaScript got around to updating the filter.
+  it->second.insert(event.dir + event.filename);
+  return true;
+}
+
+// Whether the watch's `exclude` and `include` patterns let this event through.
+// Only macOS gets this far with patterns; elsewhere EFSW has already applied
+// them. Like EFSW, we keep a rename when either of its names passes.
+bool PathWatcherListener::PassesPatterns(const RawEvent &event,
+                                         const PathTimestampPair &pair) {
+  if (!pair.patterns)
+    return true;
+  if (pair.patterns->accepts(pair.path, event.dir, event.filename))
+    return true;
+  return !event.oldFilename.empty() &&
+         pair.patterns->accepts(pair.path, event.dir, event.oldFilename);
+}
+
+// Sends the event for a watch that's finished arming. That can happen before
+// `Watch` has had a chance to record the handle, in which case `AddPaths`
+// sends the event instead.
+void PathWatcherListener::HandleArmed(efsw::WatchID handle) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(pathTableMutex);
+    std::shared_ptr<const WatchedPathTable> table = PathTable();
+    auto it = table->paths.find(handle);
+    if (it == table->paths.end()) {
+      // Only a watch that's still being added can be ours without being in
+      // the table; any other handle has been removed.
+      if (watchesBeingAdded > 0)
+        armedEarly.insert(handle);
+      return;
+    }
+    path = it->second.path;
+  }
+  DispatchEvent(ArmedAction, handle, path, "", "", path);
+}
+
+// Sends an event that has passed any filtering on its way to JavaScript.
+void PathWatcherListener::DispatchEvent(efsw::Action action,
+                                        efsw::WatchID handle,
+                                        const std::string &dir,
+                                        const std::string &filename,
+                                        const std::string &oldFilename,
+                                        const std::string &watcherPath) {
+  if (options.changeLogSize > 0 && action != ArmedAction)
+    RecordChange(handle, dir, filename, oldFilename);
+
+  if (options.batchWindowMs > 0 || options.nonBlocking) {
+    EnqueueEvent(action, handle, dir, filename, oldFilename, watcherPath);
+    return;
+  }
+
+  PathWatcherEventBatch *batch = pool->Acquire();
+  batch->Add(action, handle, dir, filename, oldFilename, watcherPath);
+  DeliverBatch(batch, false);
+}
+
+// Tells JavaScript that the backend dropped events for this handle. When we're
+// batching, this joins any overflows of our own, so that the handle is
+// reported once per batch no matter who noticed.
+void PathWatcherListener::DispatchOverflow(efsw::WatchID handle,
+                                           const std::string &watcherPath) {
+  if (options.changeLogSize > 0)
+    ResetChangeLog(handle);
+
+  if (options.batchWindowMs > 0 || options.nonBlocking) {
+    bool shouldNotify = false;
+    {
+      std::lock_guard<std::mutex> lock(batchMutex);
+      if (flushThreadStopping)
+        return;
+      if (BatchIsEmpty()) {
+        batchDeadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(options.batchWindowMs);
+        shouldNotify = true;
+      }
+      overflowedHandles.emplace(handle, watcherPath);
+    }
+    if (shouldNotify) {
+      batchCondition.notify_one();
+    }
+    return;
+  }
+
+  PathWatcherEventBatch *batch = pool->Acquire();
+  batch->AddOverflow(handle, watcherPath);
+  DeliverBatch(batch, false);
+}
+
+// Notes the paths an event touched in its handle's change log. A rename
+// counts as a change to both of its paths.
+void PathWatcherListener::RecordChange(efsw::WatchID handle,
+                                       const std::string &dir,
+                                       const std::string &filename,
+                                       const std::string &oldFilename) {
+  std::lock_guard<std::mutex> lock(changeLogMutex);
+  auto it = changeLogs.find(handle);
+  if (it == changeLogs.end()) {
+    it = changeLogs.emplace(handle, ChangeLog(options.changeLogSize,
+                                              ++changeSequence))
+             .first;
+  }
+  if (!oldFilename.empty())
+    it->second.Record(dir + oldFilename, ++changeSequence);
+  it->second.Record(dir + filename, ++changeSequence);
+}
+
+// Whoever polls this handle's log next has to start over, since the backend
+// lost track of what changed.
+void PathWatcherListener::ResetChangeLog(efsw::WatchID handle) {
+  std::lock_guard<std::mutex> lock(changeLogMutex);
+  auto it = changeLogs.find(handle);
+  if (it != changeLogs.end())
+    it->second.Reset(++changeSequence);
+}
+
+void PathWatcherListener::ForgetChangeLog(efsw::WatchID handle) {
+  std::lock_guard<std::mutex> lock(changeLogMutex);
+  changeLogs.erase(handle);
+}
+
+bool PathWatcherListener::GetChangesSince(efsw::WatchID handle,
+                                          uint64_t cursor, size_t maxPaths,
+                                          ChangeSet &result) {
+  if (options.changeLogSize == 0)
+    return false;
+  std::lock_guard<std::mutex> lock(changeLogMutex);
+  auto it = changeLogs.find(handle);
+  if (it == changeLogs.end()) {
+    it = changeLogs.emplace(handle, ChangeLog(options.changeLogSize,
+                                              ++changeSequence))
+             .first;
+  }
+  result = it->second.Since(cursor, changeSequence, maxPaths);
+  return true;
+}
+
+#ifdef __APPLE__
+// macOS seems to think that lots of file creations happen that aren't
+// actually creations; for instance, multiple successive writes to the same
+// file will sometimes nonsensically produce a `child-create` event preceding
+// each `child-change` event.
+//
+// Luckily, we can easily check whether or not a file has actually been
+// created on macOS: we can compare creation time to modification time. This
+// weeds out most of the false positives.
+//
+// Changes need no such check. Both of our backends only report what happened
+// after a watch started (FSEvents compares event IDs; kqueue can't see
+// earlier changes at all), so a change is always one we asked about.
+//
+// Bursts of events tend to involve the same few files, so we remember what
+// `stat` told us for the rest of the delivery window. A cached result is
+// only trusted to reject a creation: modification times only move forward,
+// so a fresh `stat` would say the same thing now. Anything else gets a fresh
+// `stat`. Deletions and renames can put a different file at the same path,
+// so they evict whatever we had.
+bool PathWatcherListener::IsFalsePositive(efsw::Action action,
+                                          const std::string &dir,
+                                          const std::string &filename,
+                                          const std::string &oldFilename) {
+  if (action == efsw::Action::Modified)
+    return false;
+
+  std::string newPathStr = dir + filename;
+  if (action == efsw::Action::Delete) {
+    // The file is _expected_ not to exist anymore, so there's nothing to
+    // check.
+    ForgetStat(newPathStr);
+    return false;
+  }
+
+  if (action == efsw::Action::Moved) {
+    ForgetStat(newPathStr);
+    ForgetStat(dir + oldFilename);
+  }
+
+  struct stat file;
+  bool isCreation = action == efsw::Action::Add;
+  if (isCreation && LookupStat(newPathStr, file) && ShouldSkipCreation(file))
+    return true;
+
+  if (stat(newPathStr.c_str(), &file) != 0) {
+    // It's a strange outcome for a file not to exist when we've been told
+    // about anything other than its deletion; it means we should ignore this
+    // event.
+    ForgetStat(newPathStr);
+    return true;
+  }
+  RememberStat(newPathStr, file);
+  return isCreation && ShouldSkipCreation(file);
+}
+
+void PathWatcherListener::QueueValidation(efsw::Action action,
+                                          efsw::WatchID handle,
+                                          const std::string &dir,
+                                          const std::string &filename,
+                                          const std::string &oldFilename) {
+  ValidationShard &shard =
+      *validationShards[static_cast<size_t>(handle) % validationShards.size()];
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.queue.push_back({action, handle, dir, filename, oldFilename});
+  }
+  shard.condition.notify_one();
+}
+
+void PathWatcherListener::ValidationLoop(ValidationShard *shard) {
+  std::unique_lock<std::mutex> lock(shard->mutex);
+  while (true) {
+    shard->condition.wait(
+        lock, [&] { return shard->stopping || !shard->queue.empty(); });
+    if (shard->stopping)
+      return;
+    PendingValidation event = std::move(shard->queue.front());
+    shard->queue.pop_front();
+    lock.unlock();
+
+    // The watcher may have gone away while this event was waiting. If it
+    // hasn't, we need its path anyway.
+    std::shared_ptr<const WatchedPathTable> table = PathTable();
+    auto it = table->paths.find(event.handle);
+    if (!isShuttingDown && it != table->paths.end()) {
+      if (!IsFalsePositive(event.action, event.dir, event.filename,
+                           event.oldFilename)) {
+        ForwardEvent(event.action, event.handle, event.dir, event.filename,
+                     event.oldFilename, it->second);
+      } else {
+        efPROBE(drop, event.handle, kDropFalsePositive);
+        if (stats)
+          stats->eventsFiltered++;
+      }
+    }
+
+    lock.lock();
+  }
+}
+
+// Stops the validation threads. Events they haven't gotten to yet are
+// discarded.
+void PathWatcherListener::StopValidation() {
+  for (auto &shard : validationShards) {
+    {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      shard->stopping = true;
+      shard->queue.clear();
+    }
+    shard->condition.notify_one();
+  }
+  for (auto &shard : validationShards) {
+    if (shard->thread.joinable()) {
+      shard->thread.join();
+    }
+  }
+}
+#endif
+
+static int next_env_id = 1;
+
+PathWatcher::PathWatcher(Napi::Env env, Napi::Object exports)
+    : eventPool(std::make_shared<PathWatcherEventPool>()) {
+  envId = next_env_id++;
+
+#ifdef DEBUG
+  std::cout << "Initializing PathWatcher" << std::endl;
+#endif
+
+  DefineAddon(exports,
+              {InstanceMethod("watch", &PathWatcher::Watch),
+               InstanceMethod("unwatch", &PathWatcher::Unwatch),
+               InstanceMethod("watchMany", &PathWatcher::WatchMany),
+               InstanceMethod("unwatchMany", &PathWatcher::UnwatchMany),
+               InstanceMethod("watchAsync", &PathWatcher::WatchAsync),
+               InstanceMethod("unwatchAsync", &PathWatcher::UnwatchAsync),
+               InstanceMethod("setCallback", &PathWatcher::SetCallback),
+               InstanceMethod("getEventPoolStats",
+                              &PathWatcher::GetEventPoolStats),
+               InstanceMethod("getLastEventId", &PathWatcher::GetLastEventId),
+               InstanceMethod("getFdStats", &PathWatcher::GetFdStats),
+               InstanceMethod("getStats", &PathWatcher::GetStats),
+               InstanceMethod("getMemoryUsage", &PathWatcher::GetMemoryUsage),
+               InstanceMethod("setPathFilter", &PathWatcher::SetPathFilter),
+               InstanceMethod("getChangesSince",
+                              &PathWatcher::GetChangesSince),
+               InstanceMethod("drain", &PathWatcher::Drain),
+               InstanceMethod("setPriority", &PathWatcher::SetPriority),
+               InstanceMethod("subscribe", &PathWatcher::Subscribe),
+               InstanceMethod("unsubscribe", &PathWatcher::Unsubscribe),
+               InstanceMethod("listDirectory", &PathWatcher::ListDirectory),
+               InstanceMethod("listDirectoryAsync",
+                              &PathWatcher::ListDirectoryAsync),
+               InstanceMethod("digestFileAsync",
+                              &PathWatcher::DigestFileAsync),
+               InstanceMethod("loadTreeIndexAsync",
+                              &PathWatcher::LoadTreeIndexAsync),
+               InstanceMethod("setTraceEnabled",
+                              &PathWatcher::SetTraceEnabled),
+               InstanceMethod("getTrace", &PathWatcher::GetTrace)});
+
+  env.SetInstanceData<PathWatcher>(this);
+}
+
+PathWatcher::~PathWatcher() {
+  isFinalizing = true;
+  StopAllListeners();
+}
+
+// Start up our `ThreadSafeFunction`, listener, and file watcher if they
+// aren't already running.
+void PathWatcher::EnsureWatching(Napi::Env env) {
+  if (isWatching)
+    return;
+#ifdef DEBUG
+  std::cout << "  Creating ThreadSafeFunction and FileWatcher" << std::endl;
+#endif
+  int myGeneration = ++watchGeneration;
+  tsfn = Napi::ThreadSafeFunction::New(
+      env, callback.Value(), "pathwatcher-efsw-listener", 0, 1,
+      [this, myGeneration](Napi::Env env) {
+        // This is unexpected. We should try to do some cleanup before the
+        // environment terminates.
+        //
+        // We retain a "generation" value; if it increments by the time this
+        // finalizer runs, that means the watcher has started up again and we
+        // should skip teardown.
+        if (watchGeneration == myGeneration) {
+          StopAllListeners();
+        }
+      });
+
+  if (deliveryOptions.collectStats && !stats) {
+    stats = std::make_shared<PathWatcherStats>();
+    lastStatsAt = stats->startedAt;
+  }
+  listener = new PathWatcherListener(
+      env, tsfn, deliveryOptions, eventPool,
+      deliveryOptions.collectStats ? stats : nullptr);
+
+  if (backendOptions.sharedBackend) {
+    sharedBackend = SharedBackend::Acquire(backendOptions);
+    fileWatcher = sharedBackend->Watcher();
+    isWatching = true;
+    return;
+  }
+
+#ifdef __APPLE__
+  fileWatcher = new FileWatcher();
+  ApplyBackendOptions();
+#else
+  efsw::Backend backend = efsw::Backends::Default;
+  if (backendOptions.linuxFanotify) {
+    backend = efsw::Backends::Fanotify;
+  } else if (backendOptions.linuxIoUring) {
+    backend = efsw::Backends::InotifyIoUring;
+  } else if (backendOptions.winUsnJournal) {
+    backend = efsw::Backends::WinUsnJournal;
+  }
+  fileWatcher = new efsw::FileWatcher(backend);
+  fileWatcher->followSymlinks(true);
+  ApplyBackendOptions();
+  fileWatcher->watch();
+#endif
+
+  isWatching = true;
+}
+
+// Builds the error we report when a path can't be watched. EFSW tells us why
+// via a negative handle, which we pass along as the error's `code`.
+static Napi::Error WatchError(Napi::Env env, WatcherHandle handle) {
+  const char *message = "Failed to add watch; unknown error";
+  if (handle == efsw::Errors::FileRepeated) {
+    message = "Failed to add watch; the path is already watched with "
+              "different options";
+  }
+  auto error = Napi::Error::New(env, message);
+  error.Set("code", Napi::Number::New(env, handle));
+  return error;
+}
+
+// Resolves symlinks in `path`, the way `fs.realpathSync` would. Gives the path
+// back as is if it can't be resolved, or on Windows, where our callers have
+// already done all the resolving that matters.
+static std::string RealPath(const std::string &path) {
+#ifdef _WIN32
+  return path;
+#else
+  char *resolved = realpath(path.c_str(), nullptr);
+  if (!resolved)
+    return path;
+  std::string result(resolved);
+  free(resolved);
+  return result;
+#endif
+}
+
+// Helpers for reading individual options out of an options object. Each one
+// leaves `out` alone unless the option is present and has the right type.
+static void ReadOption(Napi::Object options, const char *name, bool &out) {
+  Napi::Value value = options.Get(name);
+  if (value.IsBoolean())
+    out = value.As<Napi::Boolean>().Value();
+}
+
+static void ReadOption(Napi::Object options, const char *name, int &out,
+                       int minimum) {
+  Napi::Value value = options.Get(name);
+  if (value.IsNumber())
+    out = std::max(minimum, value.As<Napi::Number>().Int32Value());
+}
+
+static void ReadOption(Napi::Object options, const char *name, size_t &out,
+                       size_t minimum) {
+  Napi::Value value = options.Get(name);
+  if (!value.IsNumber())
+    return;
+  int64_t number = value.As<Napi::Number>().Int64Value();
+  out = std::max(minimum, static_cast<size_t>(std::max<int64_t>(number, 0)));
+}
+
+static void ReadOption(Napi::Object options, const char *name, double &out,
+                       double minimum) {
+  Napi::Value value = options.Get(name);
+  if (value.IsNumber())
+    out = std::max(minimum, value.As<Napi::Number>().DoubleValue());
+}
+
+static void ReadOption(Napi::Object options, const char *name,
+                       std::string &out) {
+  Napi::Value value = options.Get(name);
+  if (value.IsString())
+    out = value.As<Napi::String>().Utf8Value();
+}
+
+// Every pattern of a watch, in one string that's the same for any two watches
+// with the same patterns in the same order.
+static std::string PatternKey(
+    const std::vector<efsw::WatcherOption> &patterns) {
+  std::string key;
+  for (const auto &pattern : patterns) {
+    key += pattern.mOption == efsw::Options::Exclude ? '-' : '+';
+    key += pattern.mPattern;
+    key += '\0';
+  }
+  return key;
+}
+
+// Turns the `{ exclude, include }` patterns JavaScript gave us into the
+// options EFSW expects. Anything that isn't a string is skipped.
+static std::vector<efsw::WatcherOption> ReadPatterns(Napi::Value value) {
+  std::vector<efsw::WatcherOption> patterns;
+  if (!value.IsObject())
+    return patterns;
+
+  auto object = value.As<Napi::Object>();
+  const std::pair<const char *, efsw::Option> lists[] = {
+      {"exclude", efsw::Options::Exclude}, {"include", efsw::Options::Include}};
+  for (const auto &list : lists) {
+    Napi::Value array = object.Get(list.first);
+    if (!array.IsArray())
+      continue;
+    auto items = array.As<Napi::Array>();
+    for (uint32_t i = 0; i < items.Length(); i++) {
+      Napi::Value item = items.Get(i);
+      if (item.IsString())
+        patterns.emplace_back(list.second, item.As<Napi::String>().Utf8Value());
+    }
+  }
+  return patterns;
+}
+
+// Reads the rest of the object `ReadPatterns` reads: settings that tune one
+// watch, for the backends that support them, which the others ignore.
+// `resyncOnOverflow` and `writeCompleteOnly` override the `setCallback`
+// options of the same names. Whatever was given goes in `request.optionKey`,
+// since a backend watch tuned one way can't stand in for one tuned another.
+static void ReadWatchOptions(Napi::Value value, WatchRequest &request) {
+  if (!value.IsObject())
+    return;
+
+  auto object = value.As<Napi::Object>();
+  const std::pair<const char *, bool *> flags[] = {
+      {"resyncOnOverflow", &request.resyncOnOverflow},
+      {"writeCompleteOnly", &request.writeCompleteOnly},
+      {"incrementalScan", &request.incrementalScan}};
+  for (const auto &flag : flags) {
+    if (!object.Get(flag.first).IsBoolean())
+      continue;
+    ReadOption(object, flag.first, *flag.second);
+    request.optionKey += std::string("\1") + flag.first + '=' +
+                         (*flag.second ? '1' : '0');
+  }
+
+  const std::pair<const char *, int *> numbers[] = {
+      {"pollIntervalMs", &request.pollIntervalMs},
+      {"maxPollIntervalMs", &request.maxPollIntervalMs},
+      {"scanBudget", &request.scanBudget},
+      {"scanThreads", &request.scanThreads},
+      {"winBufferSize", &request.winBufferSize}};
+  for (const auto &number : numbers) {
+    if (!object.Get(number.first).IsNumber())
+      continue;
+    ReadOption(object, number.first, *number.second, 0);
+    request.optionKey += std::string("\1") + number.first + '=' +
+                         std::to_string(*number.second);
+  }
+
+  // These tune our handle rather than the backend's watch, so they're left
+  // out of the key.
+  ReadOption(object, "handleEventsPerSecond", request.handleEventsPerSecond,
+             0.0);
+  ReadOption(object, "handleEventBurst", request.handleEventBurst,
+             static_cast<size_t>(0));
+}
+
+#ifdef __APPLE__
+// Turns the name of a backend into the watcher's idea of it. Names we don't
+// know, the empty one included, mean the default.
+static MacBackend ParseMacBackend(const std::string &name) {
+  if (name == "fsevents")
+    return MacBackend::FSEvents;
+  if (name == "kqueue")
+    return MacBackend::Kqueue;
+  if (name == "hybrid")
+    return MacBackend::Hybrid;
+  return MacBackend::Default;
+}
+
+// The backend for watches that don't ask for one.
+static MacBackend DefaultMacBackend(const BackendOptions &options) {
+  MacBackend backend = ParseMacBackend(options.macBackend);
+  if (backend != MacBackend::Default)
+    return backend;
+#ifdef USE_KQUEUE
+  return MacBackend::Kqueue;
+#else
+  return MacBackend::FSEvents;
+#endif
+}
+#endif
+
+// Asks `fileWatcher` to watch what `request` describes, on behalf of
+// `listener`.
+static WatcherHandle AddWatchTo(FileWatcher *fileWatcher,
+                                efsw::FileWatchListener *listener,
+                                const WatchRequest &request) {
+  const std::string &cppPath = request.pair.path;
+  bool useRecursiveWatcher = request.pair.recursive;
+  // EFSW represents watchers as unsigned `int`s; we can easily convert these
+  // to JavaScript.
+#ifdef __APPLE__
+  return fileWatcher->addWatch(
+      cppPath, listener, useRecursiveWatcher, request.sinceEventId,
+      ParseMacBackend(request.backend), request.resyncOnOverflow);
+#else
+  std::vector<efsw::WatcherOption> watchOptions(request.patterns);
+  // Only a generic watch, which is what we get when no native backend would
+  // start, polls.
+  if (request.incrementalScan) {
+    watchOptions.emplace_back(efsw::Options::GenericIncrementalScan, 1);
+  }
+  if (request.pollIntervalMs > 0) {
+    watchOptions.emplace_back(efsw::Options::GenericMinPollInterval,
+                              request.pollIntervalMs);
+  }
+  if (request.maxPollIntervalMs > 0) {
+    watchOptions.emplace_back(efsw::Options::GenericMaxPollInterval,
+                              request.maxPollIntervalMs);
+  }
+  if (request.scanBudget > 0) {
+    watchOptions.emplace_back(efsw::Options::GenericScanBudget,
+                              request.scanBudget);
+  }
+  if (request.scanThreads > 1) {
+    watchOptions.emplace_back(efsw::Options::GenericScanThreads,
+                              request.scanThreads);
+  }
+#ifdef _WIN32
+  if (request.winBufferSize > 0) {
+    watchOptions.emplace_back(efsw::Options::WinBufferSize,
+                              request.winBufferSize);
+  }
+#endif
+#ifdef __linux__
+  if (request.armInBackground && request.armDepth > 0) {
+    watchOptions.emplace_back(efsw::Options::LinuxLazyRecursiveDepth,
+                              request.armDepth);
+  } else if (request.armInBackground) {
+    watchOptions.emplace_back(efsw::Options::LinuxAsyncRecursive, 1);
+  }
+  if (request.resyncOnOverflow) {
+    watchOptions.emplace_back(efsw::Options::ResyncOnOverflow, 1);
+  }
+  if (request.writeCompleteOnly) {
+    watchOptions.emplace_back(efsw::Options::LinuxWriteCompleteOnly, 1);
+  }
+  if (!request.watchFile.empty()) {
+    std::vector<efsw::WatcherOption> fileOptions(watchOptions);
+    fileOptions.emplace_back(efsw::Options::LinuxWatchFile, 1);
+    WatcherHandle handle = fileWatcher->addWatch(
+        cppPath + PATH_SEPARATOR + request.watchFile, listener, false,
+        fileOptions, 0);
+    if (handle >= 0)
+      return handle;
+    // Only inotify watches files, and only while the watch budget lasts. A
+    // watch on the directory reports the same events for the file, and more
+    // besides.
+  }
+#endif
+  return fileWatcher->addWatch(cppPath, listener, useRecursiveWatcher,
+                               watchOptions, request.sinceEventId);
+#endif
+}
+
+static void RemoveWatchesFrom(FileWatcher *fileWatcher,
+                              const std::vector<efsw::WatchID> &handles) {
+#ifdef __APPLE__
+  fileWatcher->removeWatches(handles);
+#else
+  for (auto handle : handles) {
+    fileWatcher->removeWatch(handle);
+  }
+#endif
+}
+
+static std::mutex sharedBackendMutex;
+static std::weak_ptr<SharedBackend> sharedBackendInstance;
+
+std::shared_ptr<SharedBackend>
+SharedBackend::Acquire(const BackendOptions &options) {
+  std::lock_guard<std::mutex> lock(sharedBackendMutex);
+  std::shared_ptr<SharedBackend> backend = sharedBackendInstance.lock();
+  if (!backend) {
+    backend.reset(new SharedBackend(options));
+    sharedBackendInstance = backend;
+  }
+  return backend;
+}
+
+SharedBackend::SharedBackend(const BackendOptions &options) {
+#ifdef __APPLE__
+  fileWatcher = new FileWatcher(DefaultMacBackend(options));
+  fileWatcher->setStreamOptions(options.fsEventsLatencyMs / 1000.0,
+                                options.fsEventsNoDefer);
+  fileWatcher->setFdBudget(options.kqueueFdBudget);
+#else
+  efsw::Backend backend = efsw::Backends::Default;
+  if (options.linuxFanotify) {
+    backend = efsw::Backends::Fanotify;
+  } else if (options.linuxIoUring) {
+    backend = efsw::Backends::InotifyIoUring;
+  } else if (options.winUsnJournal) {
+    backend = efsw::Backends::WinUsnJournal;
+  }
+  fileWatcher = new efsw::FileWatcher(backend);
+  fileWatcher->followSymlinks(true);
+  fileWatcher->backgroundScanBudget(
+      static_cast<unsigned int>(options.backgroundScanOpsPerSecond));
+  fileWatcher->kernelWatchBudget(options.linuxWatchBudget);
+  fileWatcher->watch();
+#endif
+}
+
+// Only runs once the last environment has let go of us, by which point every
+// listener has removed its watches.
+SharedBackend::~SharedBackend() { delete fileWatcher; }
+
+// Finds a backend watch that can serve `request`, and the subscription that
+// would carry its events. Callers must hold `subscriberMutex`.
+bool SharedBackend::FindSharedWatch(const WatchRequest &request,
+                                    efsw::WatchID &backend,
+                                    Subscription &subscription) {
+  // A replay has to have a stream of its own, and a watch that asked for a
+  // backend has to get that one.
+  if (request.sinceEventId != 0 || !request.backend.empty())
+    return false;
+  const PathTimestampPair &pair = request.pair;
+  for (auto &it : watches) {
+    const BackendWatch &watch = it.second;
+    if (watch.realPath == pair.realPath &&
+        watch.patternKey == pair.patternKey &&
+        watch.optionKey == pair.optionKey &&
+        watch.recursive == pair.recursive) {
+      backend = it.first;
+      return true;
+    }
+  }
+  // A watch tuned on its own can't be covered by one that isn't.
+  if (!request.optionKey.empty())
+    return false;
+  for (auto &it : watches) {
+    const BackendWatch &watch = it.second;
+    // Anything else means filtering the watch's events, which we can only do
+    // for what it reports in the first place.
+    if (!watch.recursive || !watch.patternKey.empty() ||
+        !watch.optionKey.empty() ||
+        !IsWithinWatch(pair.realPath, watch.realPath, true))
+      continue;
+    backend = it.first;
+    subscription.scoped = true;
+    // The backend reports paths below the one it was given.
+    subscription.path =
+        watch.path + pair.realPath.substr(watch.realPath.size());
+    subscription.recursive = pair.recursive;
+    subscription.patterns = efsw::PathFilter::create(request.patterns);
+    return true;
+  }
+  return false;
+}
+
+// Whether the backend already watches `pair`'s real path for a watch tuned
+// differently, which it can't watch a second time. Callers must hold
+// `subscriberMutex`.
+bool SharedBackend::IsWatchedWithOtherTuning(const PathTimestampPair &pair) {
+  for (auto &it : watches) {
+    if (it.second.realPath == pair.realPath &&
+        it.second.optionKey != pair.optionKey)
+      return true;
+  }
+  return false;
+}
+
+WatcherHandle SharedBackend::AddWatch(PathWatcherListener *listener,
+                                      const WatchRequest &request) {
+  std::lock_guard<std::mutex> lock(watchMutex);
+  Subscription subscription = {nextHandle, listener, false, "", false,
+                               nullptr,    request.armInBackground};
+  bool notifyArmed = false;
+  std::vector<efsw::WatchID> nested;
+  {
+    std::lock_guard<std::mutex> subscriberLock(subscriberMutex);
+    efsw::WatchID backend;
+    if (FindSharedWatch(request, backend, subscription)) {
+      BackendWatch &watch = watches.at(backend);
+      watch.subscriptions.push_back(subscription);
+      subscriptions[subscription.handle] = backend;
+      nextHandle++;
+#ifdef __linux__
+      // Elsewhere, `RecordWatch` does this for us.
+      notifyArmed = request.armInBackground && watch.armed;
+#endif
+    } else if (IsWatchedWithOtherTuning(request.pair)) {
+      return efsw::Errors::FileRepeated;
+    } else if (request.pair.recursive && request.patterns.empty() &&
+               request.optionKey.empty() && request.sinceEventId == 0) {
+      // The backend won't arm the parts of a new tree that already have
+      // watches of their own, so those have to go first. Only the ones
+      // without patterns or tuning, though, since the new watch has neither.
+      // The others keep their backend watches, and with them their own view,
+      // even where the backend then leaves their part of the new tree to them.
+      for (auto &it : watches) {
+        const BackendWatch &watch = it.second;
+        if (watch.patternKey.empty() && watch.optionKey.empty() &&
+            IsWithinWatch(watch.realPath, request.pair.realPath, true))
+          nested.push_back(it.first);
+      }
+    }
+  }
+  if (subscription.handle != nextHandle) {
+    if (notifyArmed)
+      listener->handleWatchArmed(subscription.handle);
+    return subscription.handle;
+  }
+
+  if (!nested.empty())
+    RemoveWatchesFrom(fileWatcher, nested);
+  {
+    std::lock_guard<std::mutex> subscriberLock(subscriberMutex);
+    addingWatch = true;
+  }
+  WatcherHandle backendHandle = AddWatchTo(fileWatcher, this, request);
+
+  std::vector<Subscription> moved;
+  {
+    std::lock_guard<std::mutex> subscriberLock(subscriberMutex);
+    addingWatch = false;
+    // `watchMutex` keeps this the only watch being added, so whatever else
+    // armed early belongs to none of ours.
+    std::unordered_set<efsw::WatchID> armed;
+    armed.swap(armedEarly);
+    if (backendHandle >= 0) {
+      BackendWatch watch = {request.pair.path,       request.pair.realPath,
+                            request.pair.recursive,  request.patterns,
+                            request.pair.patternKey, request.pair.optionKey,
+                            true,                    {subscription}};
+#ifdef __linux__
+      // Elsewhere, `addWatch` doesn't return until the whole tree is watched.
+      if (request.armInBackground) {
+        watch.armed = armed.count(backendHandle) > 0;
+        notifyArmed = watch.armed;
+      }
+#endif
+      subscriptions[subscription.handle] = backendHandle;
+      nextHandle++;
+
+      // The new watch sees everything the nested ones did.
+      for (auto handle : nested) {
+        BackendWatch &old = watches.at(handle);
+        std::shared_ptr<efsw::PathFilter> oldPatterns =
+            efsw::PathFilter::create(old.patterns);
+        for (auto &it : old.subscriptions) {
+          if (!it.scoped) {
+            it.scoped = true;
+            it.path = request.pair.path +
+                      old.realPath.substr(request.pair.realPath.size());
+            it.recursive = old.recursive;
+            if (!it.patterns)
+              it.patterns = oldPatterns;
+          } else {
+            it.path = request.pair.path +
+                      it.path.substr(old.path.size());
+          }
+          subscriptions[it.handle] = backendHandle;
+          watch.subscriptions.push_back(it);
+          moved.push_back(it);
+        }
+        watches.erase(handle);
+      }
+      watches[backendHandle] = std::move(watch);
+    }
+  }
+
+  if (backendHandle < 0 && !nested.empty()) {
+    // Put back what we took away. They get new backend handles, but nobody
+    // outside of here knows those.
+    std::vector<BackendWatch> removed;
+    {
+      std::lock_guard<std::mutex> subscriberLock(subscriberMutex);
+      for (auto handle : nested) {
+        removed.push_back(std::move(watches.at(handle)));
+        watches.erase(handle);
+      }
+    }
+    for (auto &old : removed) {
+      WatchRequest again;
+      again.pair.path = old.path;
+      again.pair.recursive = old.recursive;
+      again.patterns = old.patterns;
+      WatcherHandle restored = AddWatchTo(fileWatcher, this, again);
+      std::lock_guard<std::mutex> subscriberLock(subscriberMutex);
+      for (auto &it : old.subscriptions) {
+        if (restored < 0) {
+          subscriptions.erase(it.handle);
+        } else {
+          subscriptions[it.handle] = restored;
+        }
+        moved.push_back(it);
+      }
+      if (restored >= 0)
+        watches[restored] = std::move(old);
+    }
+  }
+
+  // Whatever happened between removing the nested watches and arming the
+  // new one went unseen, so whoever was relying on them should rescan.
+  for (auto &it : moved) {
+    it.listener->Receive(it.handle, it.path, "", OverflowAction, "");
+  }
+
+  if (backendHandle < 0)
+    return backendHandle;
+  if (notifyArmed)
+    listener->handleWatchArmed(subscription.handle);
+  return subscription.handle;
+}
+
+void SharedBackend::RemoveWatches(const std::vector<efsw::WatchID> &handles) {
+  std::lock_guard<std::mutex> lock(watchMutex);
+  std::vector<efsw::WatchID> unused;
+  {
+    std::lock_guard<std::mutex> subscriberLock(subscriberMutex);
+    for (auto handle : handles) {
+      auto it = subscriptions.find(handle);
+      if (it == subscriptions.end())
+        continue;
+      efsw::WatchID backendHandle = it->second;
+      subscriptions.erase(it);
+
+      auto &list = watches.at(backendHandle).subscriptions;
+      list.erase(std::remove_if(list.begin(), list.end(),
+                                [handle](const Subscription &subscription) {
+                                  return subscription.handle == handle;
+                                }),
+                 list.end());
+      if (list.empty()) {
+        watches.erase(backendHandle);
+        unused.push_back(backendHandle);
+      }
+    }
+  }
+  if (!unused.empty())
+    RemoveWatchesFrom(fileWatcher, unused);
+}
+
+void SharedBackend::RemoveListener(PathWatcherListener *listener) {
+  std::vector<efsw::WatchID> handles;
+  {
+    std::lock_guard<std::mutex> lock(subscriberMutex);
+    for (auto &it : watches) {
+      for (auto &subscription : it.second.subscriptions) {
+        if (subscription.listener == listener)
+          handles.push_back(subscription.handle);
+      }
+    }
+  }
+  RemoveWatches(handles);
+}
+
+void SharedBackend::MemoryUsage(efsw::MemoryUsage &usage) {
+  std::lock_guard<std::mutex> lock(subscriberMutex);
+  usage.watchTableBytes += efsw::MemoryCost::hash(watches) +
+                           efsw::MemoryCost::hash(subscriptions) +
+                           efsw::MemoryCost::hash(armedEarly);
+  for (auto &it : watches) {
+    const BackendWatch &watch = it.second;
+    usage.watchTableBytes += efsw::MemoryCost::buffer(watch.patterns) +
+                             efsw::MemoryCost::buffer(watch.subscriptions);
+    usage.stringBytes += efsw::MemoryCost::string(watch.path) +
+                         efsw::MemoryCost::string(watch.realPath) +
+                         efsw::MemoryCost::string(watch.patternKey) +
+                         efsw::MemoryCost::string(watch.optionKey);
+    for (auto &subscription : watch.subscriptions)
+      usage.stringBytes += efsw::MemoryCost::string(subscription.path);
+  }
+}
+
+bool SharedBackend::Accepts(const BackendWatch &watch,
+                            const Subscription &subscription,
+                            const std::string &dir,
+                            const std::string &filename,
+                            const std::string &oldFilename) {
+  if (subscription.scoped &&
+      !IsEventWithinWatch(dir, filename, oldFilename, subscription.path,
+                          subscription.recursive))
+    return false;
+  if (!subscription.patterns)
+    return true;
+  const std::string &root =
+      subscription.scoped ? subscription.path : watch.path;
+  if (subscription.patterns->accepts(root, dir, filename))
+    return true;
+  return !oldFilename.empty() &&
+         subscription.patterns->accepts(root, dir, oldFilename);
+}
+
+void SharedBackend::handleFileAction(efsw::WatchID watchId,
+                                     const std::string &dir,
+                                     const std::string &filename,
+                                     efsw::Action action,
+                                     std::string oldFilename) {
+  efPROBE(action_entry, watchId, action);
+  {
+    std::lock_guard<std::mutex> lock(subscriberMutex);
+    Deliver(watchId, dir, filename, action, oldFilename);
+  }
+  efPROBE(action_exit, watchId, action);
+}
+
+void SharedBackend::handleFileActions(const efsw::FileAction *actions,
+                                      size_t count) {
+  std::lock_guard<std::mutex> lock(subscriberMutex);
+  for (size_t i = 0; i < count; i++) {
+    const efsw::FileAction &it = actions[i];
+    efPROBE(action_entry, it.watchid, it.action);
+    Deliver(it.watchid, *it.dir, *it.filename, it.action, *it.oldFilename);
+    efPROBE(action_exit, it.watchid, it.action);
+  }
+}
+
+void SharedBackend::Deliver(efsw::WatchID watchId, const std::string &dir,
+                            const std::string &filename, efsw::Action action,
+                            const std::string &oldFilename) {
+  auto it = watches.find(watchId);
+  if (it == watches.end())
+    return;
+  for (auto &subscription : it->second.subscriptions) {
+    if (action != OverflowAction &&
+        !Accepts(it->second, subscription, dir, filename, oldFilename)) {
+      efPROBE(drop, subscription.handle, kDropFiltered);
+      continue;
+    }
+    subscription.listener->Receive(subscription.handle, dir, filename, action,
+                                   oldFilename);
+  }
+}
+
+void SharedBackend::handleWatchArmed(efsw::WatchID watchId) {
+  std::lock_guard<std::mutex> lock(subscriberMutex);
+  auto it = watches.find(watchId);
+  if (it == watches.end()) {
+    // Only the watch `AddWatch` is adding can be ours without being listed.
+    if (addingWatch)
+      armedEarly.insert(watchId);
+    return;
+  }
+  it->second.armed = true;
+  for (auto &subscription : it->second.subscriptions) {
+    if (subscription.armInBackground)
+      subscription.listener->handleWatchArmed(subscription.handle);
+  }
+}
+
+// Reads the arguments to `watch` and `watchAsync`. Throws and returns `false`
+// if they don't make sense.
+// Sets the path `request` watches, along with what tells its watch apart from
+// the others: where the path really leads and how the watch filters events.
+static void SetWatchPath(WatchRequest &request, const std::string &path) {
+  request.pair.path = path;
+  request.pair.realPath = RealPath(path);
+  request.pair.patternKey = PatternKey(request.patterns);
+  request.pair.optionKey = request.optionKey;
+  // A watch on one file only sees that file, so it's shared like a watch
+  // whose patterns only let that file through would be.
+  if (!request.watchFile.empty()) {
+    request.pair.patternKey += '=' + request.watchFile;
+  }
+}
+
+// Reads every argument of `watch` after the path, which `watchMany` takes
+// too.
+void PathWatcher::ReadWatchArguments(const Napi::CallbackInfo &info,
+                                     WatchRequest &request) {
+  // Second argument is optional and tells us whether to use a recursive
+  // watcher. Defaults to `false`.
+  if (info[1].IsBoolean()) {
+    request.pair.recursive = info[1].As<Napi::Boolean>();
+  }
+
+  // Fourth argument is optional and only matters for recursive watchers: when
+  // `true`, we return as soon as the top directory is watched and arm the rest
+  // of the tree in the background. An `armed` event follows once it's done.
+  if (info[3].IsBoolean()) {
+    request.armInBackground = info[3].As<Napi::Boolean>();
+  }
+
+  // Fifth argument is optional: `{ exclude, include }`, two arrays of glob
+  // patterns relative to the watched path (see `efsw::PathFilter` for the
+  // syntax). Events for paths they rule out never make it to JavaScript, and
+  // the backends that watch directory by directory don't watch excluded ones
+  // at all. The same object can tune this watch (see `ReadWatchOptions`).
+  request.patterns = ReadPatterns(info[4]);
+  request.resyncOnOverflow = backendOptions.resyncOnOverflow;
+  request.writeCompleteOnly = backendOptions.linuxWriteCompleteOnly;
+  ReadWatchOptions(info[4], request);
+
+  // Sixth argument is optional: when `true`, a `Modified` event only gets
+  // through if the file's digest changed, so that saving the same contents
+  // again (or just touching the file) goes unreported.
+  if (info[5].IsBoolean()) {
+    request.pair.digest = info[5].As<Napi::Boolean>();
+  }
+
+  // Seventh argument is optional: when `true`, a `Modified` event only gets
+  // through if the file's size, modification time or inode changed. Cheaper
+  // than a digest, since nothing gets read, but touching a file counts.
+  if (info[6].IsBoolean()) {
+    request.pair.fingerprint = info[6].As<Napi::Boolean>();
+  }
+
+  // Eighth argument is optional and goes with `armInBackground`: how many
+  // levels of subdirectories to watch before we return, leaving only the
+  // deeper ones for the background. Only Linux arms in levels; elsewhere it's
+  // ignored.
+  if (info[7].IsNumber()) {
+    request.armDepth = std::max(0, info[7].As<Napi::Number>().Int32Value());
+  }
+
+#ifdef __APPLE__
+  // Ninth argument is optional: the backend this watch should use, by name
+  // (see `macBackend`).
+  if (info[8].IsString()) {
+    request.backend = info[8].As<Napi::String>().Utf8Value();
+  }
+#endif
+
+#ifdef __linux__
+  // Tenth argument is optional: the name of a file in the watched directory
+  // to watch by itself (see `efsw::Options::LinuxWatchFile`), so that the
+  // rest of the directory's goings-on never wake us. Events still come as if
+  // from a watch on the directory.
+  if (info[9].IsString()) {
+    request.watchFile = info[9].As<Napi::String>().Utf8Value();
+  }
+#endif
+
+#if defined(__APPLE__) || defined(_WIN32)
+  // Third argument is optional: an event ID (as returned by `getLastEventId`)
+  // from which to replay this path's changes. Only meaningful on the FSEvents
+  // and NTFS journal backends; kqueue and `ReadDirectoryChangesW` ignore it.
+  if (info[2].IsBigInt()) {
+    bool lossless;
+    request.sinceEventId = info[2].As<Napi::BigInt>().Uint64Value(&lossless);
+  }
+#endif
+}
+
+bool PathWatcher::ReadWatchRequest(const Napi::CallbackInfo &info,
+                                   WatchRequest &request) {
+  auto env = info.Env();
+
+  // First argument must be a string.
+  if (!info[0].IsString()) {
+    Napi::TypeError::New(env, "String required").ThrowAsJavaScriptException();
+    return false;
+  }
+  ReadWatchArguments(info, request);
+
+  // The wrapper JS will resolve this to the file's real path. We expect to be
+  // dealing with real locations on disk, since that's what EFSW will report to
+  // us anyway.
+  Napi::String path = info[0].ToString();
+  std::string cppPath(path);
+
+  StripTrailingSlashFromPath(cppPath);
+
+#ifdef DEBUG
+  std::cout << "PathWatcher::Watch path: [" << cppPath << "]" << std::endl;
+#endif
+
+  // It's invalid to call `watch` before having set a callback via
+  // `setCallback`.
+  if (callback.IsEmpty()) {
+    Napi::TypeError::New(env, "No callback set").ThrowAsJavaScriptException();
+    return false;
+  }
+
+  SetWatchPath(request, cppPath);
+  return true;
+}
+
+// If one of our watches already sees everything this one would, whether it's
+// the same watch made again or a recursive one above this path, we don't ask
+// the backend for another. That saves inotify watches on Linux and an FSEvents
+// stream restart on macOS. Replays, background arming and watches that ask for
+// a particular backend need a backend watch of their own, though, and a
+// covering watch can't have patterns that this one doesn't.
+bool PathWatcher::ShareWatch(const WatchRequest &request,
+                             efsw::WatchID &handle) {
+  if (request.armInBackground || request.sinceEventId != 0 ||
+      !request.backend.empty())
+    return false;
+  if (!listener->ShareExistingWatch(
+          request.pair,
+          request.patterns.empty() && request.optionKey.empty(), handle))
+    return false;
+#ifdef DEBUG
+  std::cout << " shared handle: [" << handle << "]" << std::endl;
+#endif
+  listener->SetRateLimit(handle, request.handleEventsPerSecond,
+                         request.handleEventBurst);
+  return true;
+}
+
+WatcherHandle PathWatcher::AddBackendWatch(const WatchRequest &request) {
+  // The shared backend knows every environment's watches, so it checks this
+  // itself.
+  if (!sharedBackend && listener->IsWatchedWithOtherTuning(request.pair))
+    return efsw::Errors::FileRepeated;
+  WatcherHandle handle = sharedBackend
+                             ? sharedBackend->AddWatch(listener, request)
+                             : AddWatchTo(fileWatcher, listener, request);
+#ifdef DEBUG
+  std::cout << " handle: [" << handle << "]" << std::endl;
+#endif
+  return handle;
+}
+
+// Adds backend watches for the requests at `indices`, which differ only in
+// their paths, the way `watchMany` makes them.
+std::vector<WatcherHandle>
+PathWatcher::AddBackendWatches(const std::vector<WatchRequest> &requests,
+                               const std::vector<size_t> &indices) {
+  std::vector<WatcherHandle> handles;
+  if (indices.empty())
+    return handles;
+#ifdef __APPLE__
+  // The FSEvents stream is rebuilt once for all of them. They take the same
+  // options `AddWatchTo` gives one watch, and go through the same check as
+  // `AddBackendWatch`.
+  if (!sharedBackend) {
+    handles.assign(indices.size(), efsw::Errors::FileRepeated);
+    std::vector<size_t> batched;
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < indices.size(); i++) {
+      const WatchRequest &request = requests[indices[i]];
+      if (listener->IsWatchedWithOtherTuning(request.pair))
+        continue;
+      batched.push_back(i);
+      paths.push_back(request.pair.path);
+    }
+    if (paths.empty())
+      return handles;
+    const WatchRequest &first = requests[indices[0]];
+    std::vector<WatcherHandle> added = fileWatcher->addWatches(
+        paths, listener, first.pair.recursive, first.sinceEventId,
+        ParseMacBackend(first.backend), first.resyncOnOverflow);
+    for (size_t i = 0; i < added.size(); i++)
+      handles[batched[i]] = added[i];
+    return handles;
+  }
+#endif
+  handles.reserve(indices.size());
+  for (size_t index : indices)
+    handles.push_back(AddBackendWatch(requests[index]));
+  return handles;
+}
+
+void PathWatcher::RemoveBackendWatches(
+    const std::vector<efsw::WatchID> &handles) {
+  if (sharedBackend) {
+    sharedBackend->RemoveWatches(handles);
+  } else {
+    RemoveWatchesFrom(fileWatcher, handles);
+  }
+}
+
+// Remembers a watch the backend has just given us `handle` for.
+void PathWatcher::RecordWatch(WatchRequest &request, WatcherHandle handle) {
+  RecordWatches({{&request, handle}});
+}
+
+// Like `RecordWatch`, for several watches at once.
+void PathWatcher::RecordWatches(
+    const std::vector<std::pair<WatchRequest *, WatcherHandle>> &watches) {
+  std::vector<std::pair<PathTimestampPair, efsw::WatchID>> pairs;
+  pairs.reserve(watches.size());
+  for (auto &it : watches) {
+    WatchRequest &request = *it.first;
+#ifdef __APPLE__
+    // Our macOS watchers don't know about patterns, so we apply them
+    // ourselves as events come in.
+    request.pair.patterns = efsw::PathFilter::create(request.patterns);
+#endif
+    listener->SetRateLimit(it.second, request.handleEventsPerSecond,
+                           request.handleEventBurst);
+    pairs.push_back({request.pair, it.second});
+  }
+  listener->AddPaths(std::move(pairs));
+#ifndef __linux__
+  // Other backends arm the whole tree before `addWatch` returns, so there's
+  // nothing to wait for.
+  for (auto &it : watches) {
+    if (it.first->armInBackground)
+      listener->handleWatchArmed(it.second);
+  }
+#endif
+}
+
+// Watch a given path. Returns a handle.
+Napi::Value PathWatcher::Watch(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  WatchRequest request;
+  if (!ReadWatchRequest(info, request))
+    return env.Null();
+
+  EnsureWatching(env);
+
+  efsw::WatchID handle;
+  if (!ShareWatch(request, handle)) {
+    WaitForUnwatches(lastUnwatch);
+    listener->BeginAddingWatch();
+    handle = AddBackendWatch(request);
+    if (handle < 0) {
+      listener->EndAddingWatch();
+      WatchError(env, handle).ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    RecordWatch(request, handle);
+    listener->EndAddingWatch();
+  }
+
+  // The `watch` function returns a number much like `setTimeout` or
   // `setInterval` would; this is the handle that the wrapper JavaScript can
   // use to unwatch the path later.
   //
   // But EFSW defines a WatchID as a `long`, which means it's 64-bits and
   // therefore possibly larger than the JS `Number` type can handle. We'll use
-  // `BigInt`s instead because we live in the future.
-  return WatcherHandleToBigInt(env, handle);
+  // `BigInt`s instead because we live in the future, unless `smallHandles`
+  // says to number them ourselves.
+  return HandleToJs(env, handle);
+}
+
+// Unwatch the given handle.
+Napi::Value PathWatcher::Unwatch(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+
+  if (!isWatching) {
+    // We're not listening right now, so this is redundant at best and invalid
+    // at worst. Return early so we don't try to use resources that have
+    // already been finalized.
+    return env.Undefined();
+  }
+
+  if (!IsHandle(info[0])) {
+    Napi::TypeError::New(env, "Argument must be a handle")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (!listener)
+    return env.Undefined();
+
+  efsw::WatchID handle = HandleFromJs(info[0]);
+
+  // EFSW doesn’t mind if we give it a handle that it doesn’t recognize; it’ll
+  // just silently do nothing.
+  //
+  // This is useful because removing watcher can innocuously error anyway on
+  // certain platforms. For instance, Linux will automatically stop watching a
+  // directory when it gets deleted, and will then complain when you try to
+  // stop the watcher that was already stopped. This shows up in debug logging
+  // but is otherwise safe to ignore.
+  RemoveBackendWatches(listener->RemovePath(handle));
+  ReleaseHandles({handle});
+  FinishUnwatching(env);
+
+  return env.Undefined();
+}
+
+// Watch several paths at once. Takes an array of paths, followed by the same
+// optional arguments as `watch`, which apply to all of them alike.
+//
+// Returns an array with one entry per path, in the same order: either a
+// handle or, if that path couldn't be watched, an `Error` whose `code` says
+// why. We don't throw in that case, since the other paths may have been
+// watched successfully.
+//
+// This is cheaper than calling `watch` repeatedly: on macOS, the FSEvents
+// stream is rebuilt once for the whole set rather than once per path.
+Napi::Value PathWatcher::WatchMany(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+
+  if (!info[0].IsArray()) {
+    Napi::TypeError::New(env, "Array of paths required")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  WatchRequest common;
+  ReadWatchArguments(info, common);
+
+  Napi::Array pathArray = info[0].As<Napi::Array>();
+  std::vector<std::string> cppPaths;
+  cppPaths.reserve(pathArray.Length());
+  for (uint32_t i = 0; i < pathArray.Length(); i++) {
+    Napi::Value value = pathArray.Get(i);
+    if (!value.IsString()) {
+      Napi::TypeError::New(env, "Array of paths required")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    std::string cppPath = value.As<Napi::String>();
+    StripTrailingSlashFromPath(cppPath);
+    cppPaths.push_back(std::move(cppPath));
+  }
+
+  if (callback.IsEmpty()) {
+    Napi::TypeError::New(env, "No callback set").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  Napi::Array result = Napi::Array::New(env, cppPaths.size());
+  if (cppPaths.empty())
+    return result;
+
+  EnsureWatching(env);
+
+  // Like `watch`, we only ask the backend for the paths that none of our
+  // watches already sees, counting the ones in this set. Sorting puts each
+  // path after any of its ancestors, and those that are the same as, or below,
+  // one of the set's own paths wait until that's been watched.
+  std::vector<size_t> order(cppPaths.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return cppPaths[a] < cppPaths[b]; });
+
+  std::vector<WatchRequest> requests(cppPaths.size(), common);
+  std::unordered_set<std::string> roots;
+  std::unordered_set<std::string> realPaths;
+  std::vector<size_t> direct;
+  std::vector<size_t> deferred;
+  for (size_t index : order) {
+    WatchRequest &request = requests[index];
+    SetWatchPath(request, cppPaths[index]);
+    const PathTimestampPair &pair = request.pair;
+
+    bool shareLater = realPaths.count(pair.realPath) > 0;
+    for (size_t end = pair.path.size();
+         end != std::string::npos && !shareLater;
+         end = end == 0 ? std::string::npos
+                        : pair.path.rfind(PATH_SEPARATOR, end - 1)) {
+      shareLater = roots.count(pair.path.substr(0, end)) > 0;
+    }
+    efsw::WatchID handle;
+    if (shareLater) {
+      deferred.push_back(index);
+    } else if (ShareWatch(request, handle)) {
+      result.Set(static_cast<uint32_t>(index), HandleToJs(env, handle));
+    } else {
+      direct.push_back(index);
+      realPaths.insert(pair.realPath);
+      if (pair.recursive)
+        roots.insert(pair.path);
+    }
+  }
+
+  WaitForUnwatches(lastUnwatch);
+  listener->BeginAddingWatch();
+  std::vector<WatcherHandle> handles = AddBackendWatches(requests, direct);
+
+  std::vector<std::pair<WatchRequest *, WatcherHandle>> added;
+  added.reserve(handles.size());
+  for (size_t i = 0; i < handles.size(); i++) {
+    uint32_t index = static_cast<uint32_t>(direct[i]);
+    WatcherHandle handle = handles[i];
+    if (handle >= 0) {
+      added.push_back({&requests[index], handle});
+      result.Set(index, HandleToJs(env, handle));
+    } else {
+      result.Set(index, WatchError(env, handle).Value());
+    }
+  }
+  RecordWatches(added);
+
+  // Now that their roots are in, the rest can share them, if they can share
+  // at all.
+  for (size_t i : deferred) {
+    uint32_t index = static_cast<uint32_t>(i);
+    efsw::WatchID handle;
+    if (!ShareWatch(requests[index], handle)) {
+      // The path that would have covered this one couldn't be watched, or
+      // can't cover it. That doesn't mean this one can't be watched.
+      handle = AddBackendWatch(requests[index]);
+      if (handle >= 0)
+        RecordWatch(requests[index], handle);
+    }
+    if (handle >= 0) {
+      result.Set(index, HandleToJs(env, handle));
+    } else {
+      result.Set(index, WatchError(env, handle).Value());
+    }
+  }
+  listener->EndAddingWatch();
+
+  // If nothing could be watched, we may not need to be running at all.
+  FinishUnwatching(env);
+
+  return result;
+}
+
+// Unwatch several handles at once. Takes an array of handles.
+Napi::Value PathWatcher::UnwatchMany(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+
+  if (!isWatching)
+    return env.Undefined();
+
+  if (!info[0].IsArray()) {
+    Napi::TypeError::New(env, "Array of handles required")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (!listener)
+    return env.Undefined();
+
+  Napi::Array handleArray = info[0].As<Napi::Array>();
+  std::vector<efsw::WatchID> handles;
+  handles.reserve(handleArray.Length());
+  for (uint32_t i = 0; i < handleArray.Length(); i++) {
+    Napi::Value value = handleArray.Get(i);
+    if (!IsHandle(value)) {
+      Napi::TypeError::New(env, "Array of handles required")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    handles.push_back(HandleFromJs(value));
+  }
+
+  RemoveBackendWatches(listener->RemovePaths(handles));
+  ReleaseHandles(handles);
+  FinishUnwatching(env);
+
+  return env.Undefined();
+}
+
+// Adds a backend watch on a worker thread, for `watchAsync`.
+class WatchWorker : public Napi::AsyncWorker {
+public:
+  WatchWorker(Napi::Env env, PathWatcher *watcher, WatchRequest request)
+      : Napi::AsyncWorker(env, "pathwatcher-watch"), watcher(watcher),
+        request(std::move(request)),
+        deferred(Napi::Promise::Deferred::New(env)),
+        generation(watcher->watchGeneration),
+        unwatchesBefore(watcher->lastUnwatch) {}
+
+  Napi::Promise Promise() { return deferred.Promise(); }
+
+  void Execute() override {
+    watcher->WaitForUnwatches(unwatchesBefore);
+    handle = watcher->AddBackendWatch(request);
+    watcher->EndBackendWork();
+  }
+
+  void OnOK() override {
+    auto env = Env();
+    watcher->pendingBackendWork--;
+    if (generation != watcher->watchGeneration || !watcher->isWatching) {
+      // Everything was torn down while we were waiting on the backend, and
+      // this watch went with it.
+      deferred.Reject(Napi::Error::New(env, "Watcher was stopped").Value());
+      return;
+    }
+    if (handle < 0) {
+      watcher->listener->EndAddingWatch();
+      deferred.Reject(WatchError(env, handle).Value());
+      watcher->FinishUnwatching(env);
+      return;
+    }
+    watcher->RecordWatch(request, handle);
+    watcher->listener->EndAddingWatch();
+    deferred.Resolve(watcher->HandleToJs(env, handle));
+  }
+
+private:
+  PathWatcher *watcher;
+  WatchRequest request;
+  Napi::Promise::Deferred deferred;
+  int generation;
+  uint64_t unwatchesBefore;
+  WatcherHandle handle = 0;
+};
+
+// Removes backend watches on a worker thread, for `unwatchAsync`.
+class UnwatchWorker : public Napi::AsyncWorker {
+public:
+  UnwatchWorker(Napi::Env env, PathWatcher *watcher,
+                std::vector<efsw::WatchID> handles, uint64_t number)
+      : Napi::AsyncWorker(env, "pathwatcher-unwatch"), watcher(watcher),
+        handles(std::move(handles)),
+        deferred(Napi::Promise::Deferred::New(env)),
+        generation(watcher->watchGeneration), number(number) {}
+
+  Napi::Promise Promise() { return deferred.Promise(); }
+
+  void Execute() override {
+    watcher->RemoveBackendWatches(handles);
+    watcher->EndBackendWork(number);
+  }
+
+  void OnOK() override {
+    auto env = Env();
+    watcher->pendingBackendWork--;
+    if (generation == watcher->watchGeneration)
+      watcher->FinishUnwatching(env);
+    deferred.Resolve(env.Undefined());
+  }
+
+private:
+  PathWatcher *watcher;
+  std::vector<efsw::WatchID> handles;
+  Napi::Promise::Deferred deferred;
+  int generation;
+  uint64_t number;
+};
+
+// Called by a worker once it's done with `fileWatcher`. An unwatch worker
+// passes the number it was queued with.
+void PathWatcher::EndBackendWork(uint64_t unwatch) {
+  std::lock_guard<std::mutex> lock(backendWorkMutex);
+  backendWorkInFlight--;
+  if (unwatch != 0)
+    unwatchesInFlight.erase(unwatch);
+  backendWorkDone.notify_all();
+}
+
+// Waits until every `unwatchAsync` worker numbered `upTo` or lower has
+// removed its watches. Later ones don't matter: the worker pool runs work in
+// the order it was queued, so waiting on them could leave it with no thread
+// to run them on.
+void PathWatcher::WaitForUnwatches(uint64_t upTo) {
+  std::unique_lock<std::mutex> lock(backendWorkMutex);
+  backendWorkDone.wait(lock, [&] {
+    return unwatchesInFlight.empty() || *unwatchesInFlight.begin() > upTo;
+  });
+}
+
+// Waits until no worker is using `fileWatcher`, so that we can delete it.
+void PathWatcher::WaitForBackendWork() {
+  std::unique_lock<std::mutex> lock(backendWorkMutex);
+  backendWorkDone.wait(lock, [this] { return backendWorkInFlight == 0; });
+}
+
+// Like `watch`, but resolves with the handle instead of returning it, and asks
+// the backend for the watch on a worker thread. A recursive watch on a big
+// tree, or an FSEvents stream restart, can take long enough that we'd rather
+// not do it on the main thread. Arguments are the same as for `watch`; bad
+// ones still throw right away.
+Napi::Value PathWatcher::WatchAsync(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  WatchRequest request;
+  if (!ReadWatchRequest(info, request))
+    return env.Null();
+
+  EnsureWatching(env);
+
+  // Sharing an existing watch never touches the backend, so there's nothing
+  // to wait for.
+  efsw::WatchID handle;
+  if (ShareWatch(request, handle)) {
+    auto deferred = Napi::Promise::Deferred::New(env);
+    deferred.Resolve(HandleToJs(env, handle));
+    return deferred.Promise();
+  }
+
+  // The watch can report before `WatchWorker::OnOK` gets to add its path.
+  listener->BeginAddingWatch();
+  auto worker = new WatchWorker(env, this, std::move(request));
+  pendingBackendWork++;
+  {
+    std::lock_guard<std::mutex> lock(backendWorkMutex);
+    backendWorkInFlight++;
+  }
+  worker->Queue();
+  return worker->Promise();
+}
+
+// Like `unwatch`, but removes the backend watch on a worker thread and
+// resolves once it's gone. Events for the handle stop right away.
+Napi::Value PathWatcher::UnwatchAsync(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  auto resolved = [&env]() {
+    auto deferred = Napi::Promise::Deferred::New(env);
+    deferred.Resolve(env.Undefined());
+    return deferred.Promise();
+  };
+
+  if (!IsHandle(info[0])) {
+    Napi::TypeError::New(env, "Argument must be a handle")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (!isWatching || !listener)
+    return resolved();
+
+  efsw::WatchID handle = HandleFromJs(info[0]);
+  std::vector<efsw::WatchID> removable = listener->RemovePath(handle);
+  ReleaseHandles({handle});
+  if (removable.empty()) {
+    FinishUnwatching(env);
+    return resolved();
+  }
+
+  auto worker =
+      new UnwatchWorker(env, this, std::move(removable), ++lastUnwatch);
+  pendingBackendWork++;
+  {
+    std::lock_guard<std::mutex> lock(backendWorkMutex);
+    backendWorkInFlight++;
+    unwatchesInFlight.insert(lastUnwatch);
+  }
+  worker->Queue();
+  return worker->Promise();
+}
+
+// Shuts everything down if there's nothing left to watch.
+void PathWatcher::FinishUnwatching(Napi::Env env) {
+  // A worker may still be adding or removing a watch; whichever finishes last
+  // will check again.
+  if (pendingBackendWork > 0)
+    return;
+  if (isWatching && listener->IsEmpty()) {
+    Cleanup(env);
+    isWatching = false;
+  }
+}
+
+void PathWatcher::StopAllListeners() {
+  // This function is called internally in situations where we detect that the
+  // environment is terminating. At that point, it's not safe to try to release
+  // any `ThreadSafeFunction`s; but we can do the rest of the cleanup work
+  // here.
+  if (!isWatching)
+    return;
+  if (!listener)
+    return;
+  WaitForBackendWork();
+  if (sharedBackend) {
+    // Other environments may still be using the backend itself.
+    sharedBackend->RemoveListener(listener);
+    listener->Stop();
+    sharedBackend.reset();
+  } else {
+    // Nobody else is using the backend, so there's no point in removing our
+    // watches one at a time; with thousands of them, that's slow enough to
+    // notice when a window closes or a worker terminates. Deleting the
+    // backend closes its inotify or kqueue descriptor or FSEvents stream in
+    // one step, which drops every watch at once, and wakes its thread right
+    // away. Anything it reports in the meantime is ignored, since we've
+    // stopped.
+    listener->Stop();
+    delete fileWatcher;
+  }
+  fileWatcher = nullptr;
+  isWatching = false;
+  handleIndex.Clear();
+  strings.Clear();
+  subscribers.clear();
+  if (stats) {
+    // None of these handles will be seen again.
+    std::lock_guard<std::mutex> lock(stats->handleEventsMutex);
+    stats->handleEvents.clear();
+  }
+  lastHandleEvents.clear();
+}
+
+const HandleIndex *PathWatcher::SmallHandles() const {
+  return listener && isWatching && listener->Options().smallHandles
+             ? &handleIndex
+             : nullptr;
+}
+
+// Gives JavaScript the handle of a watch it just made: a `BigInt`, or with
+// `smallHandles`, a newly assigned number.
+Napi::Value PathWatcher::HandleToJs(Napi::Env env, efsw::WatchID handle) {
+  if (!SmallHandles())
+    return WatcherHandleToBigInt(env, handle);
+  return Napi::Number::New(env, handleIndex.Assign(handle));
+}
+
+// The handle that JavaScript means by `value`, which has to be a `BigInt` or
+// a number (see `IsHandle`). A number we didn't hand out means handle `0`,
+// which nothing has.
+efsw::WatchID PathWatcher::HandleFromJs(Napi::Value value) const {
+  if (value.IsNumber())
+    return handleIndex.Resolve(value.As<Napi::Number>().Uint32Value());
+  return BigIntToWatcherHandle(value.As<Napi::BigInt>());
+}
+
+bool PathWatcher::RootRelativePaths() const {
+  return listener && isWatching && listener->Options().rootRelativePaths;
+}
+
+std::vector<EventSubscriber> *PathWatcher::Subscribers(efsw::WatchID handle) {
+  auto it = subscribers.find(handle);
+  return it == subscribers.end() ? nullptr : &it->second;
+}
+
+// Forgets what we kept for handles JavaScript has unwatched: their numbers,
+// their watched paths' strings, and their subscribers.
+void PathWatcher::ReleaseHandles(const std::vector<efsw::WatchID> &handles) {
+  for (auto handle : handles) {
+    handleIndex.Release(handle);
+    strings.Forget(handle);
+    subscribers.erase(handle);
+  }
+}
+
+Napi::String JsStringCache::EventName(Napi::Env env, uint32_t code) {
+  if (eventNames.empty())
+    eventNames.resize(sizeof(kEventNames) / sizeof(kEventNames[0]));
+  Napi::Reference<Napi::String> &name = eventNames[code];
+  if (name.IsEmpty())
+    name = Napi::Persistent(Napi::String::New(env, kEventNames[code]));
+  return name.Value();
+}
+
+Napi::String JsStringCache::Root(Napi::Env env, efsw::WatchID handle,
+                                 const char *data, size_t length) {
+  if (length == 0)
+    return Napi::String::New(env, "", 0);
+  CachedRoot &root = roots[handle];
+  // A handle's watched path doesn't change, but the backend may hand its
+  // handle to another watch once JavaScript is done with the first.
+  if (root.value.IsEmpty() || root.text.size() != length ||
+      memcmp(root.text.data(), data, length) != 0) {
+    root.text.assign(data, length);
+    root.value = Napi::Persistent(Napi::String::New(env, data, length));
+  }
+  return root.value.Value();
+}
+
+void JsStringCache::Forget(efsw::WatchID handle) { roots.erase(handle); }
+
+// Forgets every watched path. The event names stay.
+void JsStringCache::Clear() { roots.clear(); }
+
+// Set the JavaScript callback that will be invoked whenever a file changes.
+//
+// The user-facing API allows for an arbitrary number of different callbacks;
+// this is an internal API for the wrapping JavaScript to use. That internal
+// callback can multiplex to however many other callbacks need to be invoked.
+//
+// An optional second argument configures batching:
+//
+//   * `batchWindowMs`: how long to collect events before delivering them as a
+//     batch. Defaults to `0`, which means each event is delivered on its own.
+//   * `batchMaxSize`: the most events a single batch may hold before being
+//     delivered early.
+//   * `coalesce`: whether to collapse redundant events within a batch (for
+//     instance, a create followed by several changes). Defaults to `true`.
+//   * `nonBlocking`: when `true`, never make the OS-facing threads wait on
+//     JavaScript. Implies batching (with a window of `0` if none is given).
+//   * `maxQueueSize`: in non-blocking mode, how many undelivered events may
+//     pile up before we start dropping them and sending `overflow` events.
+//   * `eventPoolSize`: how many idle event batches to keep around for reuse.
+//     Use `getEventPoolStats` to see how many are needed in practice.
+//   * `collectStats`: whether to keep the counters and timings reported by
+//     `getStats`. Defaults to `false`.
+//   * `packedBatches`: whether to deliver batches in the packed binary form
+//     described above `ProcessPackedEventBatch`. Defaults to `false`.
+//   * `handleEventsPerSecond`: when batching, how many events a second each
+//     handle may deliver before the rest are summed up in one `throttled`
+//     event per batch. Defaults to `0`, no limit.
+//   * `handleEventBurst`: how many events a handle may deliver at once before
+//     its rate limit applies. Defaults to `0`, one second's worth.
+//   * `changeLogSize`: how many changed paths each handle keeps for
+//     `getChangesSince`. Defaults to `0`, which keeps no log.
+//   * `pullDelivery`: whether to hold batches until JavaScript calls `drain`,
+//     invoking the callback with no arguments when there's something to
+//     drain. Defaults to `false`.
+//   * `smallHandles`: whether to hand out handles as small, reused numbers
+//     rather than as `BigInt`s. Defaults to `false`.
+//   * `rootRelativePaths`: whether events that aren't packed should come with
+//     paths relative to the watched path, which follows them as one more
+//     argument. Defaults to `false`.
+//
+// …and the OS-level watcher:
+//
+//   * `fsEventsLatencyMs`: (FSEvents only) how long `fseventsd` may hold on
+//     to events in order to coalesce them. Defaults to `0`.
+//   * `fsEventsNoDefer`: (FSEvents only) whether to deliver the first event
+//     after a quiet period immediately. Defaults to `true`.
+//   * `kqueueFdBudget`: (kqueue only) how many fds watches may hold before
+//     the least recently active ones are demoted to polling. Defaults to `0`,
+//     which means half the process's fd limit.
+//   * `macBackend`: (macOS only) `fsevents`, `kqueue` or `hybrid`, the
+//     backend for watches that don't ask for one. `hybrid` watches
+//     directories with FSEvents and files with kqueue. Defaults to the
+//     build's choice.
+//   * `linuxFanotify`: (Linux only) whether to watch with fanotify, which
+//     marks each file system once instead of every directory in a tree.
+//     Needs `CAP_SYS_ADMIN`; falls back to inotify without it. Defaults to
+//     `false`.
+//   * `linuxIoUring`: (Linux inotify only) whether to read events through
+//     io_uring rather than epoll and `read`. Defaults to `false`.
+//   * `winUsnJournal`: (Windows only) whether to read each NTFS volume's
+//     change journal rather than watch every directory on its own. Needs
+//     read access to the volume; falls back to `ReadDirectoryChangesW`
+//     without it. Defaults to `false`.
+//   * `backgroundScanOpsPerSecond`: (efsw only) how many directories a second
+//     polling and background arming may read. Defaults to `0`, no limit.
+//   * `linuxWatchBudget`: (Linux inotify only) how many inotify watches we may
+//     hold. Directories past it are polled, and the busiest of them get
+//     watches back as room frees up. Defaults to `0`, which leaves a tenth of
+//     `max_user_watches` to other processes.
+//   * `resyncOnOverflow`: (Linux inotify and macOS FSEvents) whether to
+//     answer an overflow by listing the affected watches again and reporting
+//     what changed, rather than with an `overflow` event. Defaults to
+//     `false`.
+//   * `linuxWriteCompleteOnly`: (Linux inotify only) whether a file only
+//     counts as modified once its writer closes it. Defaults to `false`.
+//
+// When batching is on, the callback receives a single array of
+// `[event, handle, path, oldPath]` entries instead of those four arguments
+// (or, with `packedBatches`, an `ArrayBuffer` and a string of paths).
+// Delivery options, `linuxFanotify`, `linuxIoUring` and `winUsnJournal` take
+// effect the next time the native watcher starts up; the other backend
+// options take effect immediately.
+void PathWatcher::SetCallback(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  if (!info[0].IsFunction()) {
+    Napi::TypeError::New(env, "Function required").ThrowAsJavaScriptException();
+    return;
+  }
+
+  if (info[1].IsObject()) {
+    Napi::Object options = info[1].As<Napi::Object>();
+    ReadOption(options, "batchWindowMs", deliveryOptions.batchWindowMs, 0);
+    ReadOption(options, "batchMaxSize", deliveryOptions.batchMaxSize, 1);
+    ReadOption(options, "coalesce", deliveryOptions.coalesce);
+    ReadOption(options, "nonBlocking", deliveryOptions.nonBlocking);
+    ReadOption(options, "maxQueueSize", deliveryOptions.maxQueueSize, 1);
+    ReadOption(options, "collectStats", deliveryOptions.collectStats);
+    ReadOption(options, "packedBatches", deliveryOptions.packedBatches);
+    ReadOption(options, "pullDelivery", deliveryOptions.pullDelivery);
+    ReadOption(options, "smallHandles", deliveryOptions.smallHandles);
+    ReadOption(options, "rootRelativePaths",
+               deliveryOptions.rootRelativePaths);
+    ReadOption(options, "handleEventsPerSecond",
+               deliveryOptions.handleEventsPerSecond, 0.0);
+    ReadOption(options, "handleEventBurst", deliveryOptions.handleEventBurst,
+               0);
+    ReadOption(options, "changeLogSize", deliveryOptions.changeLogSize, 0);
+
+    if (options.Get("eventPoolSize").IsNumber()) {
+      size_t poolSize = 0;
+      ReadOption(options, "eventPoolSize", poolSize, 0);
+      eventPool->SetCapacity(poolSize);
+    }
+
+    ReadOption(options, "fsEventsLatencyMs", backendOptions.fsEventsLatencyMs,
+               0.0);
+    ReadOption(options, "fsEventsNoDefer", backendOptions.fsEventsNoDefer);
+    ReadOption(options, "kqueueFdBudget", backendOptions.kqueueFdBudget, 0);
+    ReadOption(options, "macBackend", backendOptions.macBackend);
+    ReadOption(options, "linuxFanotify", backendOptions.linuxFanotify);
+    ReadOption(options, "linuxIoUring", backendOptions.linuxIoUring);
+    ReadOption(options, "winUsnJournal", backendOptions.winUsnJournal);
+    ReadOption(options, "backgroundScanOpsPerSecond",
+               backendOptions.backgroundScanOpsPerSecond, 0);
+    ReadOption(options, "linuxWatchBudget", backendOptions.linuxWatchBudget,
+               0);
+    ReadOption(options, "resyncOnOverflow", backendOptions.resyncOnOverflow);
+    ReadOption(options, "linuxWriteCompleteOnly",
+               backendOptions.linuxWriteCompleteOnly);
+    ReadOption(options, "sharedBackend", backendOptions.sharedBackend);
+    ApplyBackendOptions();
+  }
+
+  Napi::Function fn = info[0].As<Napi::Function>();
+  callback.Reset();
+  callback = Napi::Persistent(fn);
 }
 
-// Unwatch the given handle.
-Napi::Value PathWatcher::Unwatch(const Napi::CallbackInfo &info) {
+// Hands our backend options to the file watcher, if there is one.
+void PathWatcher::ApplyBackendOptions() {
+  // A shared backend keeps the options it started with.
+  if (!fileWatcher || sharedBackend)
+    return;
+#ifdef __APPLE__
+  fileWatcher->setStreamOptions(backendOptions.fsEventsLatencyMs / 1000.0,
+                                backendOptions.fsEventsNoDefer);
+  fileWatcher->setFdBudget(backendOptions.kqueueFdBudget);
+  fileWatcher->setDefaultBackend(DefaultMacBackend(backendOptions));
+#else
+  fileWatcher->backgroundScanBudget(
+      static_cast<unsigned int>(backendOptions.backgroundScanOpsPerSecond));
+  fileWatcher->kernelWatchBudget(backendOptions.linuxWatchBudget);
+#endif
+}
+
+// Reports how the event batch pool has been used so far, for the purposes of
+// sizing it via the `eventPoolSize` option.
+Napi::Value PathWatcher::GetEventPoolStats(const Napi::CallbackInfo &info) {
   auto env = info.Env();
+  PathWatcherEventPoolStats stats = eventPool->Stats();
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("allocated", Napi::Number::New(env, stats.allocated));
+  result.Set("inUse", Napi::Number::New(env, stats.inUse));
+  result.Set("inUseHighWater", Napi::Number::New(env, stats.inUseHighWater));
+  result.Set("eventsHighWater",
+             Napi::Number::New(env, stats.eventsHighWater));
+  result.Set("pathBytesHighWater",
+             Napi::Number::New(env, stats.pathBytesHighWater));
+  return result;
+}
 
-  if (!isWatching) {
-    // We're not listening right now, so this is redundant at best and invalid
-    // at worst. Return early so we don't try to use resources that have
-    // already been finalized.
+// Adds up what the backend and the listener are holding on to, so that it's
+// possible to tell how much of a process's memory is ours. Byte counts are
+// estimates; see `efsw::MemoryUsage`. A shared backend is counted whole, the
+// watches other environments have on it included.
+Napi::Value PathWatcher::GetMemoryUsage(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  efsw::MemoryUsage backend;
+  if (fileWatcher)
+    backend = fileWatcher->memoryUsage();
+  if (sharedBackend)
+    sharedBackend->MemoryUsage(backend);
+  efsw::MemoryUsage own;
+  if (listener)
+    listener->MemoryUsage(own);
+  own.watchTableBytes += handleIndex.MemoryUsage();
+
+  size_t backendBytes = backend.watchTableBytes + backend.pendingEventBytes +
+                        backend.stringBytes;
+  size_t listenerBytes =
+      own.watchTableBytes + own.pendingEventBytes + own.stringBytes;
+  size_t eventPoolBytes = eventPool->IdleBytes();
+  size_t internedPathBytes = efsw::InternedPath::tableBytes();
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("watchTableBytes",
+             Napi::Number::New(env, backend.watchTableBytes +
+                                        own.watchTableBytes));
+  result.Set("pendingEventBytes",
+             Napi::Number::New(env, backend.pendingEventBytes +
+                                        own.pendingEventBytes));
+  result.Set("stringBytes",
+             Napi::Number::New(env, backend.stringBytes + own.stringBytes +
+                                        internedPathBytes));
+  result.Set("backendBytes", Napi::Number::New(env, backendBytes));
+  result.Set("listenerBytes", Napi::Number::New(env, listenerBytes));
+  result.Set("eventPoolBytes", Napi::Number::New(env, eventPoolBytes));
+  result.Set("internedPathBytes", Napi::Number::New(env, internedPathBytes));
+  result.Set("totalBytes",
+             Napi::Number::New(env, backendBytes + listenerBytes +
+                                        eventPoolBytes + internedPathBytes));
+  result.Set("kernelWatches", Napi::Number::New(env, backend.kernelWatches));
+  result.Set("fileDescriptors",
+             Napi::Number::New(env, backend.fileDescriptors));
+  result.Set("polledDirectories",
+             Napi::Number::New(env, backend.polledDirectories));
+  return result;
+}
+
+// Returns an ID that can later be passed to `watch` to resume from this point;
+// see `FSEventsFileWatcher::getLastEventId`. FSEvents can do this for any path,
+// and on Windows the NTFS journal can for paths on its volume (the optional
+// argument); elsewhere we return `null`.
+Napi::Value PathWatcher::GetLastEventId(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+#ifdef __APPLE__
+  uint64_t id = fileWatcher ? fileWatcher->getLastEventId()
+                            : FSEventsGetCurrentEventId();
+  return Napi::BigInt::New(env, id);
+#elif defined(_WIN32)
+  // Journal positions are per volume, so we need to know which one. Without a
+  // running watcher there's no journal to ask.
+  if (!info[0].IsString() || !fileWatcher) return env.Null();
+  uint64_t id =
+      fileWatcher->lastEventId(info[0].As<Napi::String>().Utf8Value());
+  if (id == 0) return env.Null();
+  return Napi::BigInt::New(env, id);
+#else
+  return env.Null();
+#endif
+}
+
+// Reports how the kqueue backend is spending its fd budget, or `null` off
+// macOS.
+Napi::Value PathWatcher::GetFdStats(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+#ifdef __APPLE__
+  KqueueFdStats stats = {backendOptions.kqueueFdBudget, 0, 0, 0, 0};
+  if (fileWatcher)
+    stats = fileWatcher->getFdStats();
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("budget", Napi::Number::New(env, stats.budget));
+  result.Set("kqueueWatches", Napi::Number::New(env, stats.kqueueWatches));
+  result.Set("polledWatches", Napi::Number::New(env, stats.polledWatches));
+  result.Set("evictions", Napi::Number::New(env, stats.evictions));
+  result.Set("promotions", Napi::Number::New(env, stats.promotions));
+  return result;
+#else
+  return env.Null();
+#endif
+}
+
+// Tells the native side which paths JavaScript cares about for a given
+// handle: `setPathFilter(handle, paths)`. Events that involve none of `paths`
+// are dropped before they're ever queued for the main thread. Pass `null` to
+// go back to delivering everything.
+Napi::Value PathWatcher::SetPathFilter(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+
+  if (!IsHandle(info[0])) {
+    Napi::TypeError::New(env, "Argument must be a handle")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (!isWatching || !listener)
+    return env.Undefined();
+
+  efsw::WatchID handle = HandleFromJs(info[0]);
+
+  if (!info[1].IsArray()) {
+    listener->ClearPathFilter(handle);
     return env.Undefined();
   }
 
-  if (!info[0].IsBigInt()) {
-    Napi::TypeError::New(env, "Argument must be a BigInt")
+  Napi::Array array = info[1].As<Napi::Array>();
+  std::unordered_set<std::string> paths;
+  for (uint32_t i = 0; i < array.Length(); i++) {
+    Napi::Value value = array.Get(i);
+    if (!value.IsString()) {
+      Napi::TypeError::New(env, "Paths must be strings")
+          .ThrowAsJavaScriptException();
+      return env.Null();
+    }
+    paths.insert(value.As<Napi::String>().Utf8Value());
+  }
+  listener->SetPathFilter(handle, std::move(paths));
+
+  return env.Undefined();
+}
+
+// Puts a handle's events in the priority lane: `setPriority(handle, value)`.
+// `value` is `true` for all of its events, an array of paths for only the
+// events that involve one of them, or `false` to go back to the bulk lane.
+// Only matters when batching.
+Napi::Value PathWatcher::SetPriority(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+
+  if (!IsHandle(info[0])) {
+    Napi::TypeError::New(env, "Argument must be a handle")
         .ThrowAsJavaScriptException();
     return env.Null();
   }
 
-  if (!listener)
+  if (!isWatching || !listener)
     return env.Undefined();
 
-  efsw::WatchID handle = BigIntToWatcherHandle(info[0].As<Napi::BigInt>());
+  efsw::WatchID handle = HandleFromJs(info[0]);
 
-  // EFSW doesn’t mind if we give it a handle that it doesn’t recognize; it’ll
-  // just silently do nothing.
-  //
-  // This is useful because removing watcher can innocuously error anyway on
-  // certain platforms. For instance, Linux will automatically stop watching a
-  // directory when it gets deleted, and will then complain when you try to
-  // stop the watcher that was already stopped. This shows up in debug logging
-  // but is otherwise safe to ignore.
-  fileWatcher->removeWatch(handle);
-  listener->RemovePath(handle);
+  if (info[1].IsArray()) {
+    Napi::Array array = info[1].As<Napi::Array>();
+    std::unordered_set<std::string> paths;
+    for (uint32_t i = 0; i < array.Length(); i++) {
+      Napi::Value value = array.Get(i);
+      if (!value.IsString()) {
+        Napi::TypeError::New(env, "Paths must be strings")
+            .ThrowAsJavaScriptException();
+        return env.Null();
+      }
+      paths.insert(value.As<Napi::String>().Utf8Value());
+    }
+    // An empty set would mean every path.
+    if (paths.empty()) {
+      listener->ClearPriority(handle);
+    } else {
+      listener->SetPriority(handle, std::move(paths));
+    }
+  } else if (info[1].IsBoolean() && info[1].As<Napi::Boolean>()) {
+    listener->SetPriority(handle, {});
+  } else {
+    listener->ClearPriority(handle);
+  }
 
-  if (listener->IsEmpty()) {
-    Cleanup(env);
-    isWatching = false;
+  return env.Undefined();
+}
+
+// Subscribes a `PathWatcher` to a handle's events: `subscribe(handle, id,
+// watchedPath, targetPath, watchingParent, isDirectory)`. From then on, its
+// events come translated for it (see `EventSubject`), with `id` as their
+// subscriber. `subscribe(handle, 0)` asks for the handle's events as the
+// backend reported them, which a handle nobody has subscribed to sends
+// anyway. Subscribing again with the same ID replaces the subject.
+Napi::Value PathWatcher::Subscribe(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+
+  if (!IsHandle(info[0]) || !info[1].IsNumber()) {
+    Napi::TypeError::New(env, "Handle and subscriber ID required")
+        .ThrowAsJavaScriptException();
+    return env.Null();
   }
+  uint32_t id = info[1].As<Napi::Number>().Uint32Value();
+  if (id != 0 && (!info[2].IsString() || !info[3].IsString())) {
+    Napi::TypeError::New(env, "Watched and target paths must be strings")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  if (!isWatching || !listener)
+    return env.Undefined();
 
+  efsw::WatchID handle = HandleFromJs(info[0]);
+  std::vector<EventSubscriber> &list = subscribers[handle];
+  auto it = std::find_if(
+      list.begin(), list.end(),
+      [id](const EventSubscriber &entry) { return entry.id == id; });
+  if (it == list.end())
+    it = list.insert(list.end(), EventSubscriber{id, std::nullopt});
+  if (id != 0) {
+    bool watchingParent =
+        info[4].IsBoolean() && info[4].As<Napi::Boolean>().Value();
+    bool isDirectory =
+        info[5].IsBoolean() && info[5].As<Napi::Boolean>().Value();
+    it->subject.emplace(info[2].As<Napi::String>().Utf8Value(),
+                        info[3].As<Napi::String>().Utf8Value(),
+                        watchingParent, isDirectory);
+  }
   return env.Undefined();
 }
 
-void PathWatcher::StopAllListeners() {
-  // This function is called internally in situations where we detect that the
-  // environment is terminating. At that point, it's not safe to try to release
-  // any `ThreadSafeFunction`s; but we can do the rest of the cleanup work
-  // here.
-  if (!isWatching)
-    return;
-  if (!listener)
-    return;
-  listener->Stop(fileWatcher);
+// Undoes `subscribe(handle, id)`: `unsubscribe(handle, id)`.
+Napi::Value PathWatcher::Unsubscribe(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
 
-  delete fileWatcher;
-  isWatching = false;
+  if (!IsHandle(info[0]) || !info[1].IsNumber()) {
+    Napi::TypeError::New(env, "Handle and subscriber ID required")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+
+  auto found = subscribers.find(HandleFromJs(info[0]));
+  if (found == subscribers.end())
+    return env.Undefined();
+  uint32_t id = info[1].As<Napi::Number>().Uint32Value();
+  std::vector<EventSubscriber> &list = found->second;
+  list.erase(std::remove_if(
+                 list.begin(), list.end(),
+                 [id](const EventSubscriber &entry) { return entry.id == id; }),
+             list.end());
+  if (list.empty())
+    subscribers.erase(found);
+  return env.Undefined();
 }
 
-// Set the JavaScript callback that will be invoked whenever a file changes.
-//
-// The user-facing API allows for an arbitrary number of different callbacks;
-// this is an internal API for the wrapping JavaScript to use. That internal
-// callback can multiplex to however many other callbacks need to be invoked.
-void PathWatcher::SetCallback(const Napi::CallbackInfo &info) {
+// Answers from a handle's change log: `getChangesSince(handle, cursor,
+// maxPaths)`. `cursor` is a `BigInt` from an earlier answer, or `0n` to start.
+// Gives back `{ paths, cursor, freshInstance }` (see `ChangeSet`), or `null`
+// when the `changeLogSize` option is off.
+Napi::Value PathWatcher::GetChangesSince(const Napi::CallbackInfo &info) {
   auto env = info.Env();
-  if (!info[0].IsFunction()) {
-    Napi::TypeError::New(env, "Function required").ThrowAsJavaScriptException();
+
+  if (!IsHandle(info[0]) || !info[1].IsBigInt()) {
+    Napi::TypeError::New(env, "Handle and BigInt cursor required")
+        .ThrowAsJavaScriptException();
+    return env.Null();
   }
 
-  Napi::Function fn = info[0].As<Napi::Function>();
-  callback.Reset();
-  callback = Napi::Persistent(fn);
+  if (!isWatching || !listener)
+    return env.Null();
+
+  efsw::WatchID handle = HandleFromJs(info[0]);
+  bool lossless;
+  uint64_t cursor = info[1].As<Napi::BigInt>().Uint64Value(&lossless);
+  size_t maxPaths = 0;
+  if (info[2].IsNumber()) {
+    double value = info[2].As<Napi::Number>().DoubleValue();
+    if (value > 0)
+      maxPaths = static_cast<size_t>(value);
+  }
+
+  ChangeSet changes;
+  if (!listener->GetChangesSince(handle, cursor, maxPaths, changes))
+    return env.Null();
+
+  Napi::Array paths = Napi::Array::New(env, changes.paths.size());
+  for (size_t i = 0; i < changes.paths.size(); i++) {
+    paths.Set(static_cast<uint32_t>(i),
+              Napi::String::New(env, changes.paths[i]));
+  }
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("paths", paths);
+  result.Set("cursor", Napi::BigInt::New(env, changes.cursor));
+  result.Set("freshInstance", Napi::Boolean::New(env, changes.freshInstance));
+  return result;
+}
+
+// Takes the events waiting for JavaScript when the `pullDelivery` option is
+// on: `drain(maxEvents)`. Gives back the same thing the callback would have
+// been invoked with (with `packedBatches`, an `ArrayBuffer` and a string of
+// paths, as an array of two), or `null` if nothing was waiting. `maxEvents`
+// caps how many events come back, a whole batch at a time, except that the
+// oldest batch always does; `0` or none takes everything.
+Napi::Value PathWatcher::Drain(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  size_t maxEvents = 0;
+  if (info[0].IsNumber()) {
+    double value = info[0].As<Napi::Number>().DoubleValue();
+    if (value > 0 && value < 4294967296.0)
+      maxEvents = static_cast<size_t>(value);
+  }
+
+  if (!isWatching || !listener || !listener->Options().pullDelivery)
+    return env.Null();
+  BatchOwner batch(listener->Drain(maxEvents));
+  if (!batch)
+    return env.Null();
+
+  // The listener's options are the ones it started with, which `setCallback`
+  // may have changed since.
+  if (!listener->Options().packedBatches)
+    return BatchArray(env, *batch);
+  auto packed = PackBatch(env, batch.get());
+  Napi::Array result = Napi::Array::New(env, 2);
+  result.Set(0u, packed.first);
+  result.Set(1u, packed.second);
+  return result;
+}
+
+// What `listDirectory` found in a directory: each entry's name and the
+// `kEntry*` bits that describe it.
+struct DirectoryListing {
+  std::vector<std::string> names;
+  std::vector<uint8_t> types;
+};
+
+static const uint8_t kEntryFile = 1;
+static const uint8_t kEntryDirectory = 2;
+// Set along with whichever of the above the link's target is, if either.
+static const uint8_t kEntrySymlink = 4;
+
+#ifdef _WIN32
+static std::string FromWide(const wchar_t *path) {
+  int length =
+      WideCharToMultiByte(CP_UTF8, 0, path, -1, nullptr, 0, nullptr, nullptr);
+  if (length <= 1)
+    return std::string();
+  std::string result(length - 1, '\0');
+  WideCharToMultiByte(CP_UTF8, 0, path, -1, &result[0], length, nullptr,
+                      nullptr);
+  return result;
+}
+
+// Reads a whole directory with as few trips to the kernel as Windows allows.
+// The listing already has every entry's attributes, so only links need
+// another look. Returns a Win32 error code.
+static int ListDirectory(const std::string &path, DirectoryListing &listing) {
+  std::wstring dir = ToWide(path);
+  if (!dir.empty() && dir.back() != L'\\' && dir.back() != L'/')
+    dir += L'\\';
+  WIN32_FIND_DATAW data;
+  HANDLE find =
+      FindFirstFileExW((dir + L"*").c_str(), FindExInfoBasic, &data,
+                       FindExSearchNameMatch, nullptr,
+                       FIND_FIRST_EX_LARGE_FETCH);
+  if (find == INVALID_HANDLE_VALUE)
+    return GetLastError();
+
+  do {
+    if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0)
+      continue;
+    DWORD attributes = data.dwFileAttributes;
+    uint8_t type = 0;
+    // Node treats junctions as links too.
+    if ((attributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+        (data.dwReserved0 == IO_REPARSE_TAG_SYMLINK ||
+         data.dwReserved0 == IO_REPARSE_TAG_MOUNT_POINT)) {
+      type = kEntrySymlink;
+      HANDLE target = CreateFileW(
+          (dir + data.cFileName).c_str(), 0,
+          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+          OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+      BY_HANDLE_FILE_INFORMATION info;
+      if (target == INVALID_HANDLE_VALUE) {
+        attributes = INVALID_FILE_ATTRIBUTES;
+      } else {
+        attributes = GetFileInformationByHandle(target, &info)
+                         ? info.dwFileAttributes
+                         : INVALID_FILE_ATTRIBUTES;
+        CloseHandle(target);
+      }
+    }
+    if (attributes != INVALID_FILE_ATTRIBUTES) {
+      type |= (attributes & FILE_ATTRIBUTE_DIRECTORY) ? kEntryDirectory
+                                                       : kEntryFile;
+    }
+    listing.names.push_back(FromWide(data.cFileName));
+    listing.types.push_back(type);
+  } while (FindNextFileW(find, &data));
+
+  DWORD error = GetLastError();
+  FindClose(find);
+  return error == ERROR_NO_MORE_FILES ? 0 : error;
+}
+#else
+// Sorts a `stat` result into the `kEntry*` bits.
+static uint8_t EntryType(const struct stat &info) {
+  if (S_ISDIR(info.st_mode))
+    return kEntryDirectory;
+  if (S_ISREG(info.st_mode))
+    return kEntryFile;
+  return 0;
+}
+
+// Reads a whole directory in one go. `d_type` usually tells us what each
+// entry is, so only links (and entries on filesystems that don't fill it in)
+// cost a `stat`, and that's relative to the open directory so the kernel
+// doesn't walk the whole path again. Returns an `errno`.
+static int ListDirectory(const std::string &path, DirectoryListing &listing) {
+  int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    int error = errno;
+    close(fd);
+    return error;
+  }
+
+  int error = 0;
+  for (;;) {
+    errno = 0;
+    struct dirent *entry = readdir(dir);
+    if (!entry) {
+      error = errno;
+      break;
+    }
+    const char *name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+
+    struct stat info;
+    uint8_t type = 0;
+    bool symlink = entry->d_type == DT_LNK;
+    if (entry->d_type == DT_DIR) {
+      type = kEntryDirectory;
+    } else if (entry->d_type == DT_REG) {
+      type = kEntryFile;
+    } else if (entry->d_type == DT_UNKNOWN &&
+               fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+      symlink = S_ISLNK(info.st_mode);
+      type = EntryType(info);
+    }
+    if (symlink) {
+      type = kEntrySymlink;
+      if (fstatat(fd, name, &info, 0) == 0)
+        type |= EntryType(info);
+    }
+    listing.names.emplace_back(name);
+    listing.types.push_back(type);
+  }
+
+  closedir(dir);
+  return error;
+}
+#endif
+
+// Turns an error from `ListDirectory` or `DigestFile` into the kind of error
+// `fs` would have given us for `syscall`.
+static Napi::Error FileSystemError(Napi::Env env, const char *syscall,
+                                   const std::string &path, int error) {
+  int code = uv_translate_sys_error(error);
+  std::string message = std::string(uv_err_name(code)) + ": " +
+                        uv_strerror(code) + ", " + syscall + " '" + path + "'";
+  auto result = Napi::Error::New(env, message);
+  result.Set("errno", Napi::Number::New(env, code));
+  result.Set("code", Napi::String::New(env, uv_err_name(code)));
+  result.Set("syscall", Napi::String::New(env, syscall));
+  result.Set("path", Napi::String::New(env, path));
+  return result;
+}
+
+// Packs a listing as `{ names, types }`: an array of names and a
+// `Uint8Array` of `kEntry*` bits to go with them.
+static Napi::Object ListingObject(Napi::Env env, DirectoryListing &listing) {
+  size_t count = listing.names.size();
+  Napi::Array names = Napi::Array::New(env, count);
+  for (size_t i = 0; i < count; i++) {
+    names.Set(static_cast<uint32_t>(i),
+              Napi::String::New(env, listing.names[i]));
+  }
+  Napi::Uint8Array types = Napi::Uint8Array::New(env, count);
+  if (count > 0)
+    memcpy(types.Data(), listing.types.data(), count);
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("names", names);
+  result.Set("types", types);
+  return result;
+}
+
+static bool ReadFilePath(const Napi::CallbackInfo &info,
+                         std::string &path) {
+  if (!info[0].IsString()) {
+    Napi::TypeError::New(info.Env(), "String required")
+        .ThrowAsJavaScriptException();
+    return false;
+  }
+  path = info[0].As<Napi::String>().Utf8Value();
+  return true;
+}
+
+// Lists a directory on a worker thread, for `listDirectoryAsync`.
+class ListDirectoryWorker : public Napi::AsyncWorker {
+public:
+  ListDirectoryWorker(Napi::Env env, std::string path)
+      : Napi::AsyncWorker(env, "pathwatcher-list"), path(std::move(path)),
+        deferred(Napi::Promise::Deferred::New(env)) {}
+
+  Napi::Promise Promise() { return deferred.Promise(); }
+
+  void Execute() override { error = ListDirectory(path, listing); }
+
+  void OnOK() override {
+    auto env = Env();
+    if (error) {
+      deferred.Reject(FileSystemError(env, "scandir", path, error).Value());
+      return;
+    }
+    deferred.Resolve(ListingObject(env, listing));
+  }
+
+private:
+  std::string path;
+  Napi::Promise::Deferred deferred;
+  DirectoryListing listing;
+  int error = 0;
+};
+
+// Lists a directory and tells us what each entry is, following links, all in
+// one call: `listDirectory(path)`. Gives back `{ names, types }`; see
+// `ListingObject`.
+Napi::Value PathWatcher::ListDirectory(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  std::string path;
+  if (!ReadFilePath(info, path))
+    return env.Null();
+
+  DirectoryListing listing;
+  if (int error = ::ListDirectory(path, listing)) {
+    FileSystemError(env, "scandir", path, error).ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  return ListingObject(env, listing);
+}
+
+// Like `listDirectory`, but does the reading on a worker thread and returns
+// a promise.
+Napi::Value PathWatcher::ListDirectoryAsync(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  std::string path;
+  if (!ReadFilePath(info, path))
+    return env.Null();
+
+  auto worker = new ListDirectoryWorker(env, std::move(path));
+  worker->Queue();
+  return worker->Promise();
+}
+
+// Hashes a file on a worker thread, for `digestFileAsync`.
+class DigestFileWorker : public Napi::AsyncWorker {
+public:
+  DigestFileWorker(Napi::Env env, std::string path)
+      : Napi::AsyncWorker(env, "pathwatcher-digest"), path(std::move(path)),
+        deferred(Napi::Promise::Deferred::New(env)) {}
+
+  Napi::Promise Promise() { return deferred.Promise(); }
+
+  void Execute() override { error = ::DigestFile(path, digest); }
+
+  void OnOK() override {
+    auto env = Env();
+    if (error) {
+      deferred.Reject(FileSystemError(env, "open", path, error).Value());
+      return;
+    }
+    deferred.Resolve(Napi::String::New(env, digest));
+  }
+
+private:
+  std::string path;
+  Napi::Promise::Deferred deferred;
+  std::string digest;
+  int error = 0;
+};
+
+// Gives back a promise of the SHA-1 digest of a file's contents, as hex:
+// `digestFileAsync(path)`. The file is read on a worker thread, a chunk at a
+// time, so it never has to fit in memory.
+Napi::Value PathWatcher::DigestFileAsync(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  std::string path;
+  if (!ReadFilePath(info, path))
+    return env.Null();
+
+  auto worker = new DigestFileWorker(env, std::move(path));
+  worker->Queue();
+  return worker->Promise();
+}
+
+// Refreshes a tree index on a worker thread, for `loadTreeIndexAsync`.
+class TreeIndexWorker : public Napi::AsyncWorker {
+public:
+  TreeIndexWorker(Napi::Env env, std::string root, std::string indexPath,
+                  uint64_t eventId)
+      : Napi::AsyncWorker(env, "pathwatcher-tree-index"),
+        root(std::move(root)), indexPath(std::move(indexPath)),
+        eventId(eventId), deferred(Napi::Promise::Deferred::New(env)) {}
+
+  Napi::Promise Promise() { return deferred.Promise(); }
+
+  void Execute() override {
+    error = RefreshTreeIndex(root, indexPath, eventId, tree);
+  }
+
+  void OnOK() override {
+    auto env = Env();
+    if (error) {
+      deferred.Reject(FileSystemError(env, "scandir", root, error).Value());
+      return;
+    }
+
+    size_t count = tree.entries.size();
+    Napi::Array paths = Napi::Array::New(env, count);
+    Napi::Uint8Array types = Napi::Uint8Array::New(env, count);
+    Napi::Float64Array sizes = Napi::Float64Array::New(env, count);
+    Napi::Float64Array mtimes = Napi::Float64Array::New(env, count);
+    for (size_t i = 0; i < count; i++) {
+      const TreeEntry &entry = tree.entries[i];
+      paths.Set(static_cast<uint32_t>(i), Napi::String::New(env, entry.path));
+      types[i] = entry.type;
+      sizes[i] = static_cast<double>(entry.size);
+      mtimes[i] = static_cast<double>(entry.modifiedNs) / 1e6;
+    }
+
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("paths", paths);
+    result.Set("types", types);
+    result.Set("sizes", sizes);
+    result.Set("mtimes", mtimes);
+    if (tree.eventId) {
+      result.Set("eventId", Napi::BigInt::New(env, tree.eventId));
+    } else {
+      result.Set("eventId", env.Null());
+    }
+    result.Set("directoriesChecked",
+               Napi::Number::New(env, tree.directoriesChecked));
+    result.Set("directoriesRead",
+               Napi::Number::New(env, tree.directoriesRead));
+    deferred.Resolve(result);
+  }
+
+private:
+  std::string root;
+  std::string indexPath;
+  uint64_t eventId;
+  Napi::Promise::Deferred deferred;
+  TreeIndexResult tree;
+  int error = 0;
+};
+
+// Lists everything below a directory with help from an index file saved the
+// last time: `loadTreeIndexAsync(root, indexPath[, eventId])`. `eventId` (a
+// `BigInt`) is saved in the new index, and the one saved in the old index
+// comes back with the results. See `RefreshTreeIndex`.
+Napi::Value PathWatcher::LoadTreeIndexAsync(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  std::string root;
+  if (!ReadFilePath(info, root))
+    return env.Null();
+  if (!info[1].IsString()) {
+    Napi::TypeError::New(env, "Index path must be a string")
+        .ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  std::string indexPath = info[1].As<Napi::String>().Utf8Value();
+  uint64_t eventId = 0;
+  if (info[2].IsBigInt()) {
+    bool lossless;
+    eventId = info[2].As<Napi::BigInt>().Uint64Value(&lossless);
+  }
+
+  auto worker =
+      new TreeIndexWorker(env, std::move(root), std::move(indexPath), eventId);
+  worker->Queue();
+  return worker->Promise();
+}
+
+// Turns the backends' trace ring on or off: `setTraceEnabled(enabled)`. The
+// ring is shared by the whole process, so this affects every environment.
+Napi::Value PathWatcher::SetTraceEnabled(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  if (!info[0].IsBoolean()) {
+    Napi::TypeError::New(env, "Boolean required").ThrowAsJavaScriptException();
+    return env.Null();
+  }
+  efsw::Trace::setEnabled(info[0].As<Napi::Boolean>());
+  return env.Undefined();
+}
+
+// Gives back what's in the trace ring, oldest first, as an array of strings.
+// Pass `true` to empty it afterward: `getTrace(clear)`.
+Napi::Value PathWatcher::GetTrace(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  std::vector<std::string> messages = efsw::Trace::snapshot();
+  if (info[0].IsBoolean() && info[0].As<Napi::Boolean>())
+    efsw::Trace::clear();
+
+  Napi::Array result = Napi::Array::New(env, messages.size());
+  for (size_t i = 0; i < messages.size(); i++) {
+    result.Set(static_cast<uint32_t>(i), Napi::String::New(env, messages[i]));
+  }
+  return result;
+}
+
+static Napi::Object HistogramObject(Napi::Env env,
+                                    const LatencyHistogram &histogram) {
+  LatencyHistogram::Summary summary = histogram.Summarize();
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("count", Napi::Number::New(env, summary.count));
+  result.Set("meanUs", Napi::Number::New(env, summary.meanUs));
+  result.Set("p50Us", Napi::Number::New(env, summary.p50Us));
+  result.Set("p90Us", Napi::Number::New(env, summary.p90Us));
+  result.Set("p99Us", Napi::Number::New(env, summary.p99Us));
+  result.Set("maxUs", Napi::Number::New(env, summary.maxUs));
+  return result;
+}
+
+// Reports the counters and timings kept when `collectStats` is on, or `null`
+// if it never has been. Per-handle rates cover the time since the last call.
+Napi::Value PathWatcher::GetStats(const Napi::CallbackInfo &info) {
+  auto env = info.Env();
+  if (!stats)
+    return env.Null();
+
+  auto now = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(now - lastStatsAt).count();
+  std::unordered_map<efsw::WatchID, uint64_t> handleEvents;
+  {
+    std::lock_guard<std::mutex> lock(stats->handleEventsMutex);
+    handleEvents = stats->handleEvents;
+  }
+
+  Napi::Object result = Napi::Object::New(env);
+  result.Set("dispatchLatency",
+             HistogramObject(env, stats->dispatchLatency));
+  result.Set("deliveryLatency",
+             HistogramObject(env, stats->deliveryLatency));
+  result.Set("eventsReceived",
+             Napi::Number::New(env, stats->eventsReceived.load()));
+  result.Set("eventsDelivered",
+             Napi::Number::New(env, stats->eventsDelivered.load()));
+  result.Set("eventsFiltered",
+             Napi::Number::New(env, stats->eventsFiltered.load()));
+  result.Set("eventsDropped",
+             Napi::Number::New(env, stats->eventsDropped.load()));
+  result.Set("eventsThrottled",
+             Napi::Number::New(env, stats->eventsThrottled.load()));
+  result.Set("overflows", Napi::Number::New(env, stats->overflows.load()));
+  result.Set("queueDepth", Napi::Number::New(
+                               env, std::max<int64_t>(0, stats->queueDepth)));
+  result.Set("queueDepthHighWater",
+             Napi::Number::New(env, stats->queueDepthHighWater.load()));
+
+  Napi::Array handles = Napi::Array::New(env);
+  const HandleIndex *smallHandles = SmallHandles();
+  uint32_t index = 0;
+  for (auto &it : handleEvents) {
+    // A number is only ours to report while JavaScript still has its handle.
+    uint32_t number = 0;
+    if (smallHandles && !smallHandles->Find(it.first, number))
+      continue;
+    uint64_t previous = 0;
+    auto last = lastHandleEvents.find(it.first);
+    if (last != lastHandleEvents.end())
+      previous = last->second;
+    Napi::Object entry = Napi::Object::New(env);
+    entry.Set("handle", smallHandles
+                            ? Napi::Value(Napi::Number::New(env, number))
+                            : WatcherHandleToBigInt(env, it.first));
+    entry.Set("events", Napi::Number::New(env, it.second));
+    entry.Set("eventsPerSecond",
+              Napi::Number::New(env, seconds > 0
+                                         ? (it.second - previous) / seconds
+                                         : 0));
+    handles.Set(index++, entry);
+  }
+  result.Set("handles", handles);
+
+  lastHandleEvents.swap(handleEvents);
+  lastStatsAt = now;
+  return result;
 }
 
 void PathWatcher::Cleanup(Napi::Env env) {
@@ -563,6 +5289,11 @@ void PathWatcher::Cleanup(Napi::Env env) {
     // we should release `tsfn`; when we add a new watcher thereafter, we can
     // create a new `tsfn`.
     tsfn.Abort();
+    // Batches still waiting in its queue are dropped along with it, and will
+    // never reach `RecordDelivery`; take them out of the queue depth here,
+    // since the stats outlive this `tsfn`.
+    if (stats)
+      stats->queueDepth = 0;
   }
 }
 
@@ -1,26 +1,34 @@
 #pragma once
 
+#include "../vendor/efsw/include/efsw/InternedPath.hpp"
+#include "../vendor/efsw/include/efsw/PathFilter.hpp"
 #include "../vendor/efsw/include/efsw/efsw.hpp"
+#include "change-log.h"
+#include "event-subject.h"
+#include "handle-index.h"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <napi.h>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #ifdef __APPLE__
-#ifdef USE_KQUEUE
-#include "./platform/KqueueFileWatcher.hpp"
-typedef KqueueFileWatcher FileWatcher;
-#else
-#include "./platform/FSEventsFileWatcher.hpp"
-typedef FSEventsFileWatcher FileWatcher;
-#endif // USE_KQUEUE
+// Each watch goes to FSEvents or kqueue; `USE_KQUEUE` only changes which one
+// watches go to when nobody says.
+#include "./platform/MacFileWatcher.hpp"
+typedef MacFileWatcher FileWatcher;
+#include <sys/stat.h>
 #endif // __APPLE__
 
-#ifndef _WIN32
-#include <sys/time.h>
-#endif
-
 #ifdef _WIN32
 #define PATH_SEPARATOR '\\'
 #else
@@ -33,96 +41,907 @@ typedef efsw::FileWatcher FileWatcher;
 
 typedef efsw::WatchID WatcherHandle;
 
-#ifdef _WIN32
+// What we know about a watched path. `patterns` holds the watch's `exclude`
+// and `include` patterns on macOS, where we apply them ourselves; EFSW's
+// backends apply them everywhere else. `realPath` (the path with symlinks
+// resolved) and `patternKey` (every pattern in one string) tell us when two
+// watches would see exactly the same events. `optionKey` is the watch's own
+// tuning, as in `WatchRequest`.
 struct PathTimestampPair {
   std::string path;
-  int timestamp;
+  std::shared_ptr<efsw::PathFilter> patterns;
+  bool recursive = false;
+  std::string realPath;
+  std::string patternKey;
+  std::string optionKey;
+  // For a handle that shares another's backend watch, the path that watch
+  // reports this one's events under, when it isn't `path`: the same
+  // directory by another name, like a symlink to it. Empty otherwise.
+  std::string backendPath;
+  // Whether `Modified` events have to change the file's digest to count.
+  bool digest = false;
+  // Whether they have to change its size, modification time or inode.
+  bool fingerprint = false;
 };
-#else
-struct PathTimestampPair {
-  std::string path;
-  timeval timestamp;
+
+// What we can learn about a file without reading it. When none of it has
+// changed, neither have the file's contents, as long as the modification
+// time was already in the past when we looked (see `IsSettled`).
+struct FileFingerprint {
+  uint64_t size;
+  int64_t modifiedNs;
+  uint64_t inode;
+  // When we looked, on the same clock as `modifiedNs`.
+  int64_t takenNs;
+
+  bool operator==(const FileFingerprint &other) const {
+    return size == other.size && modifiedNs == other.modifiedNs &&
+           inode == other.inode;
+  }
+
+  // A file can be written again within the same tick of the filesystem's
+  // clock, keeping its size and modification time, so a fingerprint only
+  // vouches for the contents once that tick is well behind it. Some
+  // filesystems only keep modification times to the second or two.
+  bool IsSettled() const { return IsSettledAt(takenNs); }
+  bool IsSettledAt(int64_t ns) const {
+    return ns - modifiedNs >= 2000000000LL;
+  }
 };
-#endif
 
+// A single filesystem event. To keep these small and cheap to create, paths
+// aren't stored here; they live in the `pathData` buffer of whichever
+// `PathWatcherEventBatch` owns the event and are referred to by offset and
+// length.
 struct PathWatcherEvent {
   efsw::Action type;
   efsw::WatchID handle;
-  std::vector<char> new_path;
-  std::vector<char> old_path;
-
-  std::string watcher_path;
-
-  // Default constructor
-  PathWatcherEvent() = default;
-
-  // Constructor
-  PathWatcherEvent(efsw::Action t, efsw::WatchID h, const std::vector<char> &np,
-                   const std::vector<char> &op = std::vector<char>(),
-                   const std::string &wp = "")
-      : type(t), handle(h), new_path(np), old_path(op), watcher_path(wp) {}
-
-  // Copy constructor
-  PathWatcherEvent(const PathWatcherEvent &other)
-      : type(other.type), handle(other.handle), new_path(other.new_path),
-        old_path(other.old_path), watcher_path(other.watcher_path) {}
-
-  // Copy assignment operator
-  PathWatcherEvent &operator=(const PathWatcherEvent &other) {
-    if (this != &other) {
-      type = other.type;
-      handle = other.handle;
-      new_path = other.new_path;
-      old_path = other.old_path;
-      watcher_path = other.watcher_path;
-    }
-    return *this;
-  }
+  // Whether this event happened to something inside the watched directory,
+  // as opposed to the watched directory itself.
+  bool isChild;
+  // How much of the path is the watched path and the separator after it, or
+  // `0` if the path isn't inside the watched path.
+  uint32_t rootLength;
+  uint32_t newPathOffset;
+  uint32_t newPathLength;
+  uint32_t oldPathOffset;
+  uint32_t oldPathLength;
+};
 
-  // Move constructor
-  PathWatcherEvent(PathWatcherEvent &&other) noexcept
-      : type(other.type), handle(other.handle),
-        new_path(std::move(other.new_path)),
-        old_path(std::move(other.old_path)),
-        watcher_path(std::move(other.watcher_path)) {}
-
-  // Move assignment operator
-  PathWatcherEvent &operator=(PathWatcherEvent &&other) noexcept {
-    if (this != &other) {
-      type = other.type;
-      handle = other.handle;
-      new_path = std::move(other.new_path);
-      old_path = std::move(other.old_path);
-      watcher_path = std::move(other.watcher_path);
-    }
-    return *this;
-  }
+// Tells JavaScript that events for a given handle were dropped and that it
+// should assume anything in that watched path may have changed. Backends send
+// it when the OS drops events (e.g., inotify's `IN_Q_OVERFLOW`); we send it
+// ourselves when JavaScript falls too far behind.
+const efsw::Action OverflowAction = efsw::Actions::Overflow;
+
+// Not a real efsw action. We use it to tell JavaScript that a watch started
+// with `armInBackground` is now watching everything it's going to.
+const efsw::Action ArmedAction = static_cast<efsw::Action>(0);
+
+// Not a real efsw action either. Stands in for the events a handle had held
+// back by its rate limit during one batch window; its old path holds how many
+// there were.
+const efsw::Action ThrottledAction = static_cast<efsw::Action>(7);
+
+// Options that govern how events are handed off to JavaScript. These are
+// set via the (optional) second argument to `setCallback` and apply to every
+// watcher that shares the callback.
+struct DeliveryOptions {
+  // When nonzero, events are collected for up to this many milliseconds and
+  // then delivered to the callback as a single array. When zero, each event
+  // is delivered with its own callback invocation.
+  int batchWindowMs = 0;
+  // A batch is flushed early when it reaches this many events, no matter how
+  // much of its window remains.
+  size_t batchMaxSize = 1000;
+  // Whether redundant events within a batch should be collapsed before
+  // they're delivered. Only meaningful when batching is enabled.
+  bool coalesce = true;
+  // When `true`, the threads that read from the OS never wait on the
+  // JavaScript thread. Events pile up in a native queue instead; if that
+  // queue reaches `maxQueueSize`, further events are dropped and a single
+  // overflow event is sent for each affected handle.
+  bool nonBlocking = false;
+  size_t maxQueueSize = 10000;
+  // When nonzero, each handle may deliver this many events a second (and up
+  // to `handleEventBurst` at once). Anything past that is held back and
+  // summed up in a single `throttled` event at the end of the batch, so that
+  // one noisy watch can't crowd out the rest. Only applies when batching.
+  double handleEventsPerSecond = 0;
+  // How many events a handle may deliver in a burst before its rate limit
+  // kicks in. `0` means one second's worth.
+  size_t handleEventBurst = 0;
+  // When nonzero, each handle keeps a log of up to this many changed paths,
+  // for `getChangesSince` to answer from. Changes are logged before they're
+  // queued for JavaScript, so the log stays whole even when `nonBlocking` or
+  // `handleEventsPerSecond` keeps events from being delivered.
+  size_t changeLogSize = 0;
+  // Whether to keep the counters and timings that `getStats` reports. When
+  // `false`, none of them cost anything beyond a null check.
+  bool collectStats = false;
+  // Whether batches should be delivered as a packed `ArrayBuffer` of records
+  // and a single string of paths, rather than as an array of arrays. Saves
+  // creating several JS values per event that JavaScript may never look at.
+  bool packedBatches = false;
+  // When `true`, batches wait for JavaScript to `drain` them instead of being
+  // pushed to the callback. The callback is invoked with no arguments when
+  // there's something to drain, and then not again until the next `drain`.
+  bool pullDelivery = false;
+  // When `true`, JavaScript gets handles as small numbers from a
+  // `HandleIndex` instead of as `BigInt`s.
+  bool smallHandles = false;
+  // When `true`, events that aren't packed give JavaScript their watched path
+  // as a separate argument, and their paths relative to it. The watched path
+  // is the same string every time, so only the rest is new.
+  bool rootRelativePaths = false;
+};
+
+// Options that tune the OS-level watcher itself. Like `DeliveryOptions`, these
+// are set via `setCallback`; not every backend honors every option.
+struct BackendOptions {
+  // (FSEvents) How long, in milliseconds, `fseventsd` may wait to coalesce
+  // events before delivering them to us.
+  double fsEventsLatencyMs = 0;
+  // (FSEvents) When `true`, the first event after a quiet period is
+  // delivered right away rather than waiting out the latency window.
+  bool fsEventsNoDefer = true;
+  // (kqueue) How many fds watches may use before the least recently active
+  // ones are demoted to polling. `0` picks a default from the fd limit.
+  size_t kqueueFdBudget = 0;
+  // (macOS) Which backend watches use when they don't ask for one:
+  // `fsevents`, `kqueue` or `hybrid`, which watches directories with FSEvents
+  // and single files with kqueue. Empty means the build's default. Applies to
+  // watches added from then on.
+  std::string macBackend;
+  // (Linux) When `true`, watch whole file systems with fanotify instead of
+  // watching each directory with inotify. Needs `CAP_SYS_ADMIN`; without it
+  // we quietly stay on inotify. Takes effect the next time the watcher starts.
+  bool linuxFanotify = false;
+  // (inotify) When `true`, read inotify events through io_uring, which takes
+  // one system call per batch instead of three. Quietly ignored where io_uring
+  // isn't available. Takes effect the next time the watcher starts.
+  bool linuxIoUring = false;
+  // (Windows) When `true`, read each NTFS volume's change journal instead of
+  // watching each directory with `ReadDirectoryChangesW`. Needs read access
+  // to the volume, usually an administrator; without it, or off NTFS, we
+  // quietly stay on `ReadDirectoryChangesW`. Takes effect the next time the
+  // watcher starts.
+  bool winUsnJournal = false;
+  // (efsw) How many directories a second background scanning (polling, and
+  // arming recursive watches in the background) may read. `0` means no limit.
+  size_t backgroundScanOpsPerSecond = 0;
+  // (inotify) How many inotify watches we may hold before the quietest
+  // directories below recursive watches are polled instead. `0` picks a
+  // default from `max_user_watches`.
+  size_t linuxWatchBudget = 0;
+  // (inotify) When `true`, keep a snapshot of every watched directory so that
+  // an overflow can be answered with the changes it hid rather than with an
+  // `overflow` event. Applies to watches added from then on.
+  bool resyncOnOverflow = false;
+  // (inotify) When `true`, a file only counts as modified once whoever wrote
+  // it closes it, rather than on every write. Applies to watches added from
+  // then on.
+  bool linuxWriteCompleteOnly = false;
+  // When `true`, share one backend (one inotify instance, one FSEvents stream)
+  // with every other environment in the process that sets this too, instead
+  // of starting our own. The first environment to start it picks the
+  // backend's options. Takes effect the next time the watcher starts.
+  bool sharedBackend = false;
+};
+
+typedef std::vector<PathWatcherEvent> PathWatcherEventList;
+
+class PathWatcherEventPool;
+struct PathWatcherStats;
+
+// A group of events along with the single buffer that holds all of their
+// paths. Appending an event costs, at most, a reallocation of `pathData` or
+// `events`; once a buffer has grown to fit a typical batch, it costs nothing.
+struct PathWatcherEventBatch {
+  PathWatcherEventList events;
+  std::string pathData;
+  // Shared with the listener that produced this batch. Tracks how many
+  // events are waiting to be processed, whether in the listener's buffer or
+  // in the `ThreadSafeFunction`'s queue.
+  std::shared_ptr<std::atomic<size_t>> queuedCount;
+  // Shared with the listener too, for batches from its bulk lane. Counts the
+  // ones handed to the `ThreadSafeFunction` that haven't reached JavaScript.
+  std::shared_ptr<std::atomic<size_t>> inFlight;
+  // The pool this batch should go back to once it's been delivered.
+  std::shared_ptr<PathWatcherEventPool> pool;
+  // Set when stats are being collected, along with the time the batch was
+  // handed to the `ThreadSafeFunction`.
+  std::shared_ptr<PathWatcherStats> stats;
+  std::chrono::steady_clock::time_point handedOffAt;
+
+  // Records an event whose path is `dir + filename` (and whose old path, if
+  // any, is `dir + oldFilename`).
+  void Add(efsw::Action type, efsw::WatchID handle, const std::string &dir,
+           const std::string &filename, const std::string &oldFilename,
+           const std::string &watcherPath);
+  // Records an overflow event for the given handle.
+  void AddOverflow(efsw::WatchID handle, const std::string &watcherPath);
+  // Records that `count` events for the given handle were held back by its
+  // rate limit.
+  void AddThrottled(efsw::WatchID handle, const std::string &watcherPath,
+                    size_t count);
+  void Clear();
+
+  const char *PathAt(uint32_t offset) const { return pathData.data() + offset; }
 };
 
-class PathWatcherListener : public efsw::FileWatchListener {
+struct PathWatcherEventPoolStats {
+  // How many batches have ever been allocated from the heap.
+  size_t allocated = 0;
+  // How many batches are currently out of the pool.
+  size_t inUse = 0;
+  // The most batches that have ever been out of the pool at once.
+  size_t inUseHighWater = 0;
+  // The most events and path bytes that any one batch has had to hold.
+  size_t eventsHighWater = 0;
+  size_t pathBytesHighWater = 0;
+};
+
+// Durations sorted into power-of-two buckets of microseconds: bucket `n` holds
+// everything under `2^n` µs that didn't fit in the one before it. Any thread
+// may record into it without a lock.
+class LatencyHistogram {
+public:
+  static const size_t kBuckets = 32;
+
+  struct Summary {
+    uint64_t count = 0;
+    double meanUs = 0;
+    // Percentiles are the upper bound of the bucket they fall in.
+    uint64_t p50Us = 0;
+    uint64_t p90Us = 0;
+    uint64_t p99Us = 0;
+    uint64_t maxUs = 0;
+  };
+
+  void Record(std::chrono::steady_clock::duration duration);
+  Summary Summarize() const;
+
+private:
+  std::atomic<uint64_t> buckets[kBuckets] = {};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> totalUs{0};
+  std::atomic<uint64_t> maxUs{0};
+};
+
+// What `getStats` reports. Created when `collectStats` is turned on and kept
+// from then on, so that numbers accumulate across watching sessions.
+struct PathWatcherStats {
+  std::chrono::steady_clock::time_point startedAt =
+      std::chrono::steady_clock::now();
+  // From a backend reporting an event to the dispatcher thread picking it up.
+  LatencyHistogram dispatchLatency;
+  // From a batch being handed to the `ThreadSafeFunction` to JavaScript
+  // receiving it.
+  LatencyHistogram deliveryLatency;
+  // Events that reached the dispatcher for a handle we know about.
+  std::atomic<uint64_t> eventsReceived{0};
+  // Events (not counting overflows) that made it to JavaScript.
+  std::atomic<uint64_t> eventsDelivered{0};
+  // Events the macOS `stat` check decided were false positives, or that a
+  // path filter said nobody wanted.
+  std::atomic<uint64_t> eventsFiltered{0};
+  // Events thrown away because JavaScript or the dispatcher fell behind.
+  std::atomic<uint64_t> eventsDropped{0};
+  // Events held back by a handle's rate limit and summed up instead.
+  std::atomic<uint64_t> eventsThrottled{0};
+  // Overflow events that made it to JavaScript, whoever sent them.
+  std::atomic<uint64_t> overflows{0};
+  // Batches waiting in the `ThreadSafeFunction`'s queue.
+  std::atomic<int64_t> queueDepth{0};
+  std::atomic<int64_t> queueDepthHighWater{0};
+
+  // Events received per handle. Only the dispatcher thread adds to this; a
+  // handle's entry goes away when it's unwatched.
+  std::mutex handleEventsMutex;
+  std::unordered_map<efsw::WatchID, uint64_t> handleEvents;
+
+  void CountHandleEvent(efsw::WatchID handle);
+  void ForgetHandle(efsw::WatchID handle);
+};
+
+// Keeps a free list of event batches so that, once event delivery reaches a
+// steady state, it doesn't need to touch the heap at all. Batches are taken
+// out on whichever thread is recording events and returned on the main
+// thread after JavaScript has seen them.
+class PathWatcherEventPool
+    : public std::enable_shared_from_this<PathWatcherEventPool> {
 public:
-  PathWatcherListener(Napi::Env env, Napi::ThreadSafeFunction tsfn);
+  explicit PathWatcherEventPool(size_t capacity = 16);
+  ~PathWatcherEventPool();
+
+  PathWatcherEventBatch *Acquire();
+  void Recycle(PathWatcherEventBatch *batch);
+  // The most idle batches we'll hold on to. Any more than that are freed.
+  void SetCapacity(size_t capacity);
+  PathWatcherEventPoolStats Stats();
+  // Roughly how many bytes the idle batches' buffers hold.
+  size_t IdleBytes();
+
+private:
+  std::mutex mutex;
+  std::vector<PathWatcherEventBatch *> freeBatches;
+  size_t capacity;
+  PathWatcherEventPoolStats stats;
+};
+
+// An event just as a backend reported it, before we've done anything with it.
+struct RawEvent {
+  efsw::Action action;
+  efsw::WatchID handle;
+  // When the backend reported it. Only set when stats are being collected.
+  std::chrono::steady_clock::time_point reportedAt;
+  std::string dir;
+  std::string filename;
+  std::string oldFilename;
+};
+
+// A bounded queue of raw events. Any number of backend threads push onto it
+// and a single dispatcher thread pops off of it, and neither side ever takes a
+// lock. Each slot's strings keep their capacity from one event to the next, so
+// a steady stream of events doesn't touch the heap.
+class RawEventRing {
+public:
+  // `capacity` must be a power of two.
+  explicit RawEventRing(size_t capacity);
+
+  // Returns `false`, without waiting, if the ring is full.
+  bool TryPush(efsw::Action action, efsw::WatchID handle,
+               const std::string &dir, const std::string &filename,
+               const std::string &oldFilename,
+               std::chrono::steady_clock::time_point reportedAt);
+
+  // These may only be called from the dispatcher thread. `TryPop` swaps the
+  // event's strings into `event`, so whatever `event` held gets reused.
+  bool TryPop(RawEvent &event);
+  bool IsEmpty() const;
+  // What the slots take, leaving out what their strings hold, which only the
+  // threads using a slot may look at.
+  size_t SlotBytes() const { return (mask + 1) * sizeof(Slot); }
+
+private:
+  struct Slot {
+    std::atomic<size_t> sequence;
+    RawEvent event;
+  };
+
+  std::unique_ptr<Slot[]> slots;
+  size_t mask;
+  // Kept on its own cache line, since every producer writes to it.
+  alignas(64) std::atomic<size_t> enqueuePosition{0};
+  alignas(64) size_t dequeuePosition = 0;
+};
+
+// The paths a listener knows about. A table is never modified once it's been
+// published; writers build a new one and swap it in, so readers on the event
+// threads never need to take a lock.
+//
+// Not every handle has a watch of its own in the backend. When a path is
+// already inside a recursive watch, or is watched already in just the same
+// way, we hand out a covered handle instead and route the covering watch's
+// events to it. `covered` lists the covered handles of each covering one, and
+// `coveringHandles` goes the other way. A covering handle that JavaScript
+// unwatches while it still covers others is `retired`: its own events stop,
+// but its backend watch stays until the last handle it covers goes away. In
+// effect, each backend watch is reference-counted.
+//
+// `pathsToHandles` is keyed on interned paths, so that the copy a writer
+// makes shares every path with the table it replaces rather than copying
+// them all again.
+struct WatchedPathTable {
+  std::unordered_map<efsw::WatchID, PathTimestampPair> paths;
+  std::unordered_map<efsw::InternedPath, efsw::WatchID> pathsToHandles;
+  std::unordered_map<efsw::WatchID, std::vector<efsw::WatchID>> covered;
+  std::unordered_map<efsw::WatchID, efsw::WatchID> coveringHandles;
+  std::unordered_set<efsw::WatchID> retired;
+};
+
+// Final, so that the shared backend's calls into it needn't be virtual.
+class PathWatcherListener final : public efsw::FileWatchListener {
+public:
+  PathWatcherListener(Napi::Env env, Napi::ThreadSafeFunction tsfn,
+                      DeliveryOptions options,
+                      std::shared_ptr<PathWatcherEventPool> pool,
+                      std::shared_ptr<PathWatcherStats> stats);
 
   void handleFileAction(efsw::WatchID watchId, const std::string &dir,
                         const std::string &filename, efsw::Action action,
                         std::string oldFilename) override;
+  void handleFileActions(const efsw::FileAction *actions,
+                         size_t count) override;
+  void handleWatchArmed(efsw::WatchID watchId) override;
+  // What both of the above come down to, and what the shared backend calls
+  // for each of its subscribers. Takes `oldFilename` by reference, so that
+  // nobody has to copy it.
+  void Receive(efsw::WatchID watchId, const std::string &dir,
+               const std::string &filename, efsw::Action action,
+               const std::string &oldFilename);
 
   void AddPath(PathTimestampPair pair, efsw::WatchID handle);
-  void RemovePath(efsw::WatchID handle);
+  void AddPaths(std::vector<std::pair<PathTimestampPair, efsw::WatchID>> pairs);
+  // Bracket asking the backend for a watch and adding its path. In between,
+  // events for handles we don't know yet are held rather than dropped, since
+  // the new watch can report before `AddPath` hears of it.
+  void BeginAddingWatch();
+  void EndAddingWatch();
+  // Watches `pair.path` by way of a backend watch we already have, if there's
+  // one that sees the same events or, when `coverable` is set, a recursive
+  // one above it. Returns whether it did, leaving the new handle in `handle`.
+  bool ShareExistingWatch(PathTimestampPair pair, bool coverable,
+                          efsw::WatchID &handle);
+  // Whether one of our backend watches is on `pair.realPath` but tuned
+  // differently, in which case the backend won't watch it for `pair`.
+  bool IsWatchedWithOtherTuning(const PathTimestampPair &pair);
+  // These return the handles whose backend watches can now be removed, which
+  // leaves out covering handles that are still needed and covered handles,
+  // which never had backend watches to begin with.
+  std::vector<efsw::WatchID> RemovePath(efsw::WatchID handle);
+  std::vector<efsw::WatchID>
+  RemovePaths(const std::vector<efsw::WatchID> &handles);
+  // Limits the events delivered for `handle` to those involving one of
+  // `paths`. `ClearPathFilter` goes back to delivering every event.
+  void SetPathFilter(efsw::WatchID handle,
+                     std::unordered_set<std::string> paths);
+  // Gives `handle` a rate limit of its own, which takes the place of
+  // `handleEventsPerSecond` and `handleEventBurst` for it. Does nothing when
+  // `rate` is zero.
+  void SetRateLimit(efsw::WatchID handle, double rate, size_t burst);
+  void ClearPathFilter(efsw::WatchID handle);
+  // Sends `handle`'s events through the priority lane, or only its events
+  // that involve one of `paths` when there are any. `ClearPriority` puts the
+  // handle back in the bulk lane.
+  void SetPriority(efsw::WatchID handle,
+                   std::unordered_set<std::string> paths);
+  void ClearPriority(efsw::WatchID handle);
+  // Finds out what changed under `handle` after `cursor`, starting the
+  // handle's log if it hasn't got one yet. Returns `false` when change logs
+  // are off.
+  bool GetChangesSince(efsw::WatchID handle, uint64_t cursor, size_t maxPaths,
+                       ChangeSet &result);
+  // With `options.pullDelivery`, takes the batches waiting for JavaScript,
+  // merged into one, oldest first. Stops short of a batch that would take the
+  // total past `maxEvents` (unless it's the first), or takes them all when
+  // that's zero. Returns null if there weren't any. Runs on the main thread.
+  PathWatcherEventBatch *Drain(size_t maxEvents);
+  const DeliveryOptions &Options() const { return options; }
   bool HasPath(std::string path);
   efsw::WatchID GetHandleForPath(std::string path);
   bool IsEmpty();
+  // Adds up what the listener holds: its path tables, filters and change
+  // logs, and the events it hasn't handed to JavaScript yet. Leaves out what
+  // only its own threads may look at, like the digest thread's fingerprints.
+  void MemoryUsage(efsw::MemoryUsage &usage);
   void Stop();
-  void Stop(FileWatcher *fileWatcher);
 
 private:
+  void PushRawEvent(efsw::Action action, efsw::WatchID handle,
+                    const std::string &dir, const std::string &filename,
+                    const std::string &oldFilename);
+  void DispatchLoop();
+  bool DrainRingOverflows();
+  void WakeDispatcher();
+  void HandleRawEvent(const RawEvent &event);
+  bool RouteRawEvent(const RawEvent &event, const WatchedPathTable &table);
+  void HoldEarlyEvent(const RawEvent &event);
+  void ReplayEarlyEvents();
+  void HandleWatchEvent(const RawEvent &event, const PathTimestampPair &pair);
+  void RouteCoveredEvent(const RawEvent &event, const WatchedPathTable &table,
+                         const std::vector<efsw::WatchID> &handles);
+  // These two expect `pathTableMutex` to be held.
+  bool FindSameWatch(const WatchedPathTable &table,
+                     const PathTimestampPair &pair, efsw::WatchID &same);
+  bool FindCoveringWatch(const WatchedPathTable &table,
+                         const std::string &path, efsw::WatchID &covering);
+  void HandleArmed(efsw::WatchID handle);
+  bool PassesPathFilter(const RawEvent &event);
+  bool PassesPatterns(const RawEvent &event, const PathTimestampPair &pair);
+  void StopDispatcher();
+
+  void EnqueueEvent(efsw::Action action, efsw::WatchID handle,
+                    const std::string &dir, const std::string &filename,
+                    const std::string &oldFilename,
+                    const std::string &watcherPath);
+  bool TakeToken(efsw::WatchID handle);
+  void ForgetTokenBucket(efsw::WatchID handle);
+  bool IsPriorityEvent(efsw::WatchID handle, const std::string &dir,
+                       const std::string &filename,
+                       const std::string &oldFilename) const;
+  bool BatchIsEmpty() const;
+  bool BulkLaneIsBusy() const;
+  void FlushPriorityBatch(std::unique_lock<std::mutex> &lock);
+  void DeliverBatch(PathWatcherEventBatch *batch, bool asArray);
+  void NotifyEventsAvailable();
+  void ReleasePulledBatches();
+  void FlushLoop();
+  void StopFlushThread();
+
+  std::shared_ptr<const WatchedPathTable> PathTable() const;
+  void PublishPathTable(std::shared_ptr<const WatchedPathTable> table);
+
+  void DispatchEvent(efsw::Action action, efsw::WatchID handle,
+                     const std::string &dir, const std::string &filename,
+                     const std::string &oldFilename,
+                     const std::string &watcherPath);
+  void DispatchOverflow(efsw::WatchID handle, const std::string &watcherPath);
+  void RecordChange(efsw::WatchID handle, const std::string &dir,
+                    const std::string &filename,
+                    const std::string &oldFilename);
+  void ResetChangeLog(efsw::WatchID handle);
+  void ForgetChangeLog(efsw::WatchID handle);
+  void ForwardEvent(efsw::Action action, efsw::WatchID handle,
+                    const std::string &dir, const std::string &filename,
+                    const std::string &oldFilename,
+                    const PathTimestampPair &pair);
+
+  struct PendingDigest {
+    efsw::Action action;
+    efsw::WatchID handle;
+    std::string dir;
+    std::string filename;
+    std::string oldFilename;
+    std::chrono::steady_clock::time_point queued;
+  };
+  void QueueDigest(efsw::Action action, efsw::WatchID handle,
+                   const std::string &dir, const std::string &filename,
+                   const std::string &oldFilename);
+  void DigestLoop();
+  bool IsSuperseded(const PendingDigest &event);
+  bool IsUnchanged(const PendingDigest &event, const PathTimestampPair &pair);
+  void StopDigests();
+
+#ifdef __APPLE__
+  struct PendingValidation {
+    efsw::Action action;
+    efsw::WatchID handle;
+    std::string dir;
+    std::string filename;
+    std::string oldFilename;
+  };
+
+  // One validation thread and the events waiting for it.
+  struct ValidationShard {
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<PendingValidation> queue;
+    bool stopping = false;
+    std::thread thread;
+  };
+
+  bool IsFalsePositive(efsw::Action action, const std::string &dir,
+                       const std::string &filename,
+                       const std::string &oldFilename);
+  void QueueValidation(efsw::Action action, efsw::WatchID handle,
+                       const std::string &dir, const std::string &filename,
+                       const std::string &oldFilename);
+  void ValidationLoop(ValidationShard *shard);
+  void StopValidation();
+  bool LookupStat(const std::string &path, struct stat &result);
+  void RememberStat(const std::string &path, const struct stat &result);
+  void ForgetStat(const std::string &path);
+#endif
+
   std::atomic<bool> isShuttingDown{false};
-  std::mutex shutdownMutex;
-  std::mutex pathsMutex;
-  std::mutex pathsToHandlesMutex;
+  // How many `handleFileAction` calls are under way. `Stop` waits for this to
+  // reach zero.
+  std::atomic<int> activeHandlers{0};
+
+  // The dispatcher stage. Backend threads only push their events onto `ring`;
+  // the dispatcher thread looks them up, filters them, and hands them off to
+  // JavaScript, so that a backend never waits on any of that.
+  RawEventRing ring;
+  std::thread dispatchThread;
+  std::mutex dispatchMutex;
+  std::condition_variable dispatchCondition;
+  // Set while the dispatcher is asleep, or about to be, so that producers
+  // know to wake it up.
+  std::atomic<bool> dispatcherIdle{false};
+  std::atomic<bool> dispatcherStopping{false};
+  // Handles that had events dropped because the ring was full and
+  // `options.nonBlocking` was set.
+  std::mutex ringOverflowMutex;
+  std::unordered_set<efsw::WatchID> ringOverflows;
+  std::atomic<bool> hasRingOverflows{false};
+  // How many watches are between `BeginAddingWatch` and `EndAddingWatch`.
+  std::atomic<int> watchesBeingAdded{0};
+  // Set when `earlyEvents` should be looked at again, because a path was
+  // added or a watch finished being added.
+  std::atomic<bool> hasEarlyReplay{false};
+  // Events for handles that weren't in `pathTable` yet while watches were
+  // being added, oldest first, and the handles that had more than we keep.
+  // Only touched by the dispatcher thread.
+  std::vector<RawEvent> earlyEvents;
+  std::unordered_set<efsw::WatchID> earlyOverflows;
+  // The paths JavaScript wants to hear about, for each handle that has asked
+  // for a filter. Handles without an entry get every event.
+  std::mutex pathFilterMutex;
+  std::unordered_map<efsw::WatchID, std::unordered_set<std::string>>
+      pathFilters;
+  std::atomic<bool> hasPathFilters{false};
+  // Only touched by the dispatcher thread.
+  std::string pathFilterScratch;
+
+  // Serializes writers of `pathTable`. Readers don't need it.
+  std::mutex pathTableMutex;
+  std::shared_ptr<const WatchedPathTable> pathTable;
+  // Handles that finished arming before `Watch` got around to adding them to
+  // `pathTable`. Guarded by `pathTableMutex`.
+  std::unordered_set<efsw::WatchID> armedEarly;
+  // The next handle `AddCoveredPath` gives out. These count up from well
+  // above anything a backend hands out. Guarded by `pathTableMutex`.
+  efsw::WatchID nextCoveredHandle;
   Napi::ThreadSafeFunction tsfn;
-  std::unordered_map<efsw::WatchID, PathTimestampPair> paths;
-  std::unordered_map<std::string, efsw::WatchID> pathsToHandles;
+  DeliveryOptions options;
+  std::shared_ptr<PathWatcherEventPool> pool;
+  // Null unless `options.collectStats` is set.
+  std::shared_ptr<PathWatcherStats> stats;
+
+  // Batching state. Only used when `options.batchWindowMs` is nonzero or
+  // `options.nonBlocking` is set; the flush thread sleeps until a batch's
+  // window closes (or it fills up), then hands the whole batch to the main
+  // thread at once.
+  std::mutex batchMutex;
+  std::condition_variable batchCondition;
+  PathWatcherEventBatch pendingBatch;
+  std::chrono::steady_clock::time_point batchDeadline;
+  std::shared_ptr<std::atomic<size_t>> queuedCount;
+  // Handles (and their watched paths) that have had events dropped since the
+  // last batch went out.
+  std::unordered_map<efsw::WatchID, std::string> overflowedHandles;
+  // Each handle's rate limit, when `options.handleEventsPerSecond` is set or
+  // the handle has one of its own, and the events it has held back since the
+  // last batch went out. `rate` and `burst` are the handle's own, if nonzero.
+  struct TokenBucket {
+    double tokens;
+    std::chrono::steady_clock::time_point refilledAt;
+    double rate = 0;
+    size_t burst = 0;
+  };
+  struct ThrottledEvents {
+    std::string watcherPath;
+    size_t count = 0;
+  };
+  std::unordered_map<efsw::WatchID, TokenBucket> tokenBuckets;
+  // How many of those have a rate of their own.
+  size_t ownRateLimits = 0;
+  std::unordered_map<efsw::WatchID, ThrottledEvents> throttledHandles;
+  // The priority lane. Events for these handles (or, for handles with a set
+  // of paths, for those paths) skip the batch window and the rate limit, and
+  // go out as soon as the flush thread sees them. While any handle is here,
+  // bulk batches wait for the ones before them to reach JavaScript, so that
+  // the `ThreadSafeFunction`'s queue stays short enough to get ahead of.
+  std::unordered_map<efsw::WatchID, std::unordered_set<std::string>>
+      priorityHandles;
+  PathWatcherEventBatch priorityBatch;
+  std::shared_ptr<std::atomic<size_t>> bulkInFlight;
+  bool flushThreadStopping = false;
+  std::thread flushThread;
+
+  // Batches waiting to be drained, when `options.pullDelivery` is set, and
+  // whether JavaScript has been told about them since it last drained.
+  std::mutex pullMutex;
+  std::deque<PathWatcherEventBatch *> pulledBatches;
+  bool pullNotified = false;
+
+  // Each handle's change log, when `options.changeLogSize` is set. Every log
+  // takes its sequence numbers from `changeSequence`.
+  std::mutex changeLogMutex;
+  uint64_t changeSequence = 0;
+  std::unordered_map<efsw::WatchID, ChangeLog> changeLogs;
+
+  // The digest stage, for watches that only want to hear about files that
+  // really changed. A `stat` can be slow and hashing a big file takes a
+  // while, so it gets a thread of its own, started the first time it's
+  // needed. Every event for such a watch goes through here, so that none of
+  // them overtakes its `Modified` events.
+  std::mutex digestMutex;
+  std::condition_variable digestCondition;
+  std::deque<PendingDigest> digestQueue;
+  // How many `Modified` events are queued for each file, by handle and path,
+  // so that `IsSuperseded` needn't look through the queue.
+  std::unordered_map<efsw::WatchID, std::unordered_map<std::string, size_t>>
+      pendingModified;
+  bool digestStopping = false;
+  std::thread digestThread;
+  // What we last saw of each file, by handle. Only touched by the digest
+  // thread.
+  struct KnownFile {
+    FileFingerprint fingerprint;
+    bool hashed = false;
+    uint64_t hash = 0;
+  };
+  std::unordered_map<efsw::WatchID,
+                     std::unordered_map<std::string, KnownFile>>
+      digests;
+  size_t digestCount = 0;
+
+#ifdef __APPLE__
+  // Recent `stat` results for the false-positive filter in
+  // `handleFileAction`, so that a burst of events on one file doesn't stat it
+  // over and over. Entries live for one delivery window.
+  struct CachedStat {
+    struct stat info;
+    std::chrono::steady_clock::time_point expires;
+  };
+  std::mutex statCacheMutex;
+  std::unordered_map<std::string, CachedStat> statCache;
+
+  std::vector<std::unique_ptr<ValidationShard>> validationShards;
+#endif
+};
+
+// Everything a call to `watch` or `watchAsync` asked for.
+struct WatchRequest {
+  PathTimestampPair pair;
+  bool armInBackground = false;
+  // With `armInBackground`, how many levels below the watched directory to
+  // arm before returning. Zero arms nothing but the directory itself. Only
+  // used on Linux.
+  int armDepth = 0;
+  // Whether the backend should resync the watch itself after an overflow.
+  // Only the inotify backend can.
+  bool resyncOnOverflow = false;
+  // Whether only finished writes count as modifications. Only the inotify
+  // backend can tell.
+  bool writeCompleteOnly = false;
+  // On Linux, the name of the one file in `pair.path` this watch is for, when
+  // it asked to have that file watched by itself. Empty watches the
+  // directory.
+  std::string watchFile;
+  // Tuning for backends that take it, from `watch`'s fifth argument. Zero
+  // leaves the backend's default: one second between scans for a generic
+  // watch, without backing off, every directory scanned on each pass by one
+  // thread, and a 63 KiB buffer on Windows.
+  bool incrementalScan = false;
+  int pollIntervalMs = 0;
+  int maxPollIntervalMs = 0;
+  int scanBudget = 0;
+  int scanThreads = 0;
+  int winBufferSize = 0;
+  // A rate limit for this watch alone, as in `DeliveryOptions`. It applies to
+  // our handle rather than the backend's watch, so it doesn't keep the watch
+  // from being shared and stays out of `optionKey`.
+  double handleEventsPerSecond = 0;
+  size_t handleEventBurst = 0;
+  // The tuning this watch asked for itself, which keeps it from sharing a
+  // backend watch that wasn't tuned the same way.
+  std::string optionKey;
+  // Only used on the FSEvents backend.
+  uint64_t sinceEventId = 0;
+  // On macOS, the backend this watch asked for, as in
+  // `BackendOptions::macBackend`. Empty means the default.
+  std::string backend;
+  std::vector<efsw::WatcherOption> patterns;
+};
+
+// A backend that several environments (the main thread and any number of
+// workers) can share, so that the kernel doesn't have to watch a directory
+// once for each of them. Each environment still has a listener of its own;
+// this one hears from the backend and hands each event to every listener that
+// asked for it.
+//
+// A listener's handle is a subscription to one of the backend's watches, so
+// handles never repeat across listeners even when their watches are shared,
+// and we're free to move a subscription from one backend watch to another. A
+// request shares a backend watch on the same real path when their patterns
+// match, and it shares a recursive one above it, like `ShareExistingWatch`
+// does within a listener. When a recursive watch comes along above watches we
+// already have, it takes over the subscriptions of those without patterns or
+// tuning.
+class SharedBackend : public efsw::FileWatchListener {
+public:
+  // Returns the process's shared backend, starting it with `options` if no
+  // environment is using it yet.
+  static std::shared_ptr<SharedBackend> Acquire(const BackendOptions &options);
+  ~SharedBackend();
+
+  FileWatcher *Watcher() { return fileWatcher; }
+  WatcherHandle AddWatch(PathWatcherListener *listener,
+                         const WatchRequest &request);
+  void RemoveWatches(const std::vector<efsw::WatchID> &handles);
+  // Drops every subscription `listener` has. Once this returns, the listener
+  // won't hear from us again.
+  void RemoveListener(PathWatcherListener *listener);
+  // Adds up what the subscription tables hold.
+  void MemoryUsage(efsw::MemoryUsage &usage);
+
+  void handleFileAction(efsw::WatchID watchId, const std::string &dir,
+                        const std::string &filename, efsw::Action action,
+                        std::string oldFilename) override;
+  void handleFileActions(const efsw::FileAction *actions,
+                         size_t count) override;
+  void handleWatchArmed(efsw::WatchID watchId) override;
+
+private:
+  explicit SharedBackend(const BackendOptions &options);
+
+  // Passes an event on to the subscriptions that want it. Expects
+  // `subscriberMutex` to be held.
+  void Deliver(efsw::WatchID watchId, const std::string &dir,
+               const std::string &filename, efsw::Action action,
+               const std::string &oldFilename);
+
+  struct Subscription {
+    efsw::WatchID handle;
+    PathWatcherListener *listener;
+    // When the subscription only wants part of what the backend watch sees,
+    // the path and depth of that part.
+    bool scoped;
+    std::string path;
+    bool recursive;
+    // Patterns the backend watch doesn't apply for us, relative to `path`.
+    std::shared_ptr<efsw::PathFilter> patterns;
+    // Whether it asked to hear when the watch is armed.
+    bool armInBackground;
+  };
+
+  struct BackendWatch {
+    std::string path;
+    std::string realPath;
+    bool recursive;
+    std::vector<efsw::WatcherOption> patterns;
+    std::string patternKey;
+    std::string optionKey;
+    bool armed;
+    std::vector<Subscription> subscriptions;
+  };
+
+  bool FindSharedWatch(const WatchRequest &request, efsw::WatchID &backend,
+                       Subscription &subscription);
+  bool IsWatchedWithOtherTuning(const PathTimestampPair &pair);
+  bool Accepts(const BackendWatch &watch, const Subscription &subscription,
+               const std::string &dir, const std::string &filename,
+               const std::string &oldFilename);
+
+  FileWatcher *fileWatcher;
+  // Serializes adding and removing watches. Never held by the backend's
+  // threads, so it's safe to hold while we call into the backend.
+  std::mutex watchMutex;
+  // Guards everything below, which the backend's threads read as events come
+  // in. Never held while we call into the backend.
+  std::mutex subscriberMutex;
+  std::unordered_map<efsw::WatchID, BackendWatch> watches;
+  // Subscription handle to backend handle.
+  std::unordered_map<efsw::WatchID, efsw::WatchID> subscriptions;
+  // Backend watches that finished arming before `AddWatch` recorded them,
+  // which it only keeps while `addingWatch` is set.
+  std::unordered_set<efsw::WatchID> armedEarly;
+  bool addingWatch = false;
+  efsw::WatchID nextHandle = 1;
+};
+
+// Strings that JavaScript sees over and over, kept alive between events so
+// that we don't make them again each time: the event names and, for each
+// handle, the path it watches. Only touched on the main thread.
+class JsStringCache {
+public:
+  Napi::String EventName(Napi::Env env, uint32_t code);
+  // The string for `length` bytes at `data`, which are `handle`'s watched path
+  // and the separator after it.
+  Napi::String Root(Napi::Env env, efsw::WatchID handle, const char *data,
+                    size_t length);
+  void Forget(efsw::WatchID handle);
+  void Clear();
+
+private:
+  struct CachedRoot {
+    std::string text;
+    Napi::Reference<Napi::String> value;
+  };
+  std::vector<Napi::Reference<Napi::String>> eventNames;
+  std::unordered_map<efsw::WatchID, CachedRoot> roots;
+};
+
+// Someone in JavaScript who hears a handle's events: a `PathWatcher`, by
+// its ID, with the subject that translates them for it; or, with ID `0` and
+// no subject, whoever wants them as the backend reported them.
+struct EventSubscriber {
+  uint32_t id;
+  std::optional<EventSubject> subject;
 };
 
 class PathWatcher : public Napi::Addon<PathWatcher> {
@@ -130,21 +949,112 @@ public:
   PathWatcher(Napi::Env env, Napi::Object exports);
   ~PathWatcher();
   bool isStopping = false;
+  // The numbers JavaScript knows our handles by, when `smallHandles` is on;
+  // otherwise `nullptr`.
+  const HandleIndex *SmallHandles() const;
+  bool RootRelativePaths() const;
+  // Whoever subscribed to `handle`'s events, or `nullptr` if nobody has, in
+  // which case everyone hears them untranslated.
+  std::vector<EventSubscriber> *Subscribers(efsw::WatchID handle);
+  JsStringCache strings;
 
 private:
   Napi::Value Watch(const Napi::CallbackInfo &info);
   Napi::Value Unwatch(const Napi::CallbackInfo &info);
+  Napi::Value WatchMany(const Napi::CallbackInfo &info);
+  Napi::Value UnwatchMany(const Napi::CallbackInfo &info);
+  Napi::Value WatchAsync(const Napi::CallbackInfo &info);
+  Napi::Value UnwatchAsync(const Napi::CallbackInfo &info);
+  void ReadWatchArguments(const Napi::CallbackInfo &info,
+                          WatchRequest &request);
+  bool ReadWatchRequest(const Napi::CallbackInfo &info, WatchRequest &request);
+  bool ShareWatch(const WatchRequest &request, efsw::WatchID &handle);
+  // The part of watching and unwatching that talks to the backend, and so
+  // the part that can take a while. These two are safe to call from a worker
+  // thread.
+  WatcherHandle AddBackendWatch(const WatchRequest &request);
+  std::vector<WatcherHandle>
+  AddBackendWatches(const std::vector<WatchRequest> &requests,
+                    const std::vector<size_t> &indices);
+  void RemoveBackendWatches(const std::vector<efsw::WatchID> &handles);
+  void RecordWatch(WatchRequest &request, WatcherHandle handle);
+  void RecordWatches(
+      const std::vector<std::pair<WatchRequest *, WatcherHandle>> &watches);
+  void EndBackendWork(uint64_t unwatch = 0);
+  void WaitForBackendWork();
+  void WaitForUnwatches(uint64_t upTo);
+  void EnsureWatching(Napi::Env env);
+  void ApplyBackendOptions();
+  void FinishUnwatching(Napi::Env env);
   void SetCallback(const Napi::CallbackInfo &info);
+  Napi::Value GetEventPoolStats(const Napi::CallbackInfo &info);
+  Napi::Value GetLastEventId(const Napi::CallbackInfo &info);
+  Napi::Value GetFdStats(const Napi::CallbackInfo &info);
+  Napi::Value GetStats(const Napi::CallbackInfo &info);
+  Napi::Value GetMemoryUsage(const Napi::CallbackInfo &info);
+  Napi::Value SetPathFilter(const Napi::CallbackInfo &info);
+  Napi::Value SetPriority(const Napi::CallbackInfo &info);
+  Napi::Value Subscribe(const Napi::CallbackInfo &info);
+  Napi::Value Unsubscribe(const Napi::CallbackInfo &info);
+  Napi::Value GetChangesSince(const Napi::CallbackInfo &info);
+  Napi::Value Drain(const Napi::CallbackInfo &info);
+  Napi::Value ListDirectory(const Napi::CallbackInfo &info);
+  Napi::Value ListDirectoryAsync(const Napi::CallbackInfo &info);
+  Napi::Value DigestFileAsync(const Napi::CallbackInfo &info);
+  Napi::Value LoadTreeIndexAsync(const Napi::CallbackInfo &info);
+  Napi::Value SetTraceEnabled(const Napi::CallbackInfo &info);
+  Napi::Value GetTrace(const Napi::CallbackInfo &info);
   void Cleanup(Napi::Env env);
   void StopAllListeners();
+  Napi::Value HandleToJs(Napi::Env env, efsw::WatchID handle);
+  efsw::WatchID HandleFromJs(Napi::Value value) const;
+  void ReleaseHandles(const std::vector<efsw::WatchID> &handles);
 
   int envId;
   bool isFinalizing = false;
   bool isWatching = false;
   int watchGeneration = 0;
+  DeliveryOptions deliveryOptions;
+  BackendOptions backendOptions;
+  // Outlives any one listener, so that its batches (and its stats) carry
+  // over from one watching session to the next.
+  std::shared_ptr<PathWatcherEventPool> eventPool;
+  // Created the first time a listener starts with `collectStats` set.
+  std::shared_ptr<PathWatcherStats> stats;
+  // Per-handle event counts as of the last `getStats` call, which its
+  // events-per-second figures are measured against.
+  std::unordered_map<efsw::WatchID, uint64_t> lastHandleEvents;
+  std::chrono::steady_clock::time_point lastStatsAt;
   Napi::FunctionReference callback;
   Napi::ThreadSafeFunction tsfn;
   PathWatcherListener *listener;
+  // Only touched on the main thread. Emptied whenever the listener stops.
+  HandleIndex handleIndex;
+  // Each handle's subscribers, in the order they subscribed. Only touched on
+  // the main thread. Emptied whenever the listener stops.
+  std::unordered_map<efsw::WatchID, std::vector<EventSubscriber>> subscribers;
 
   FileWatcher *fileWatcher = nullptr;
+  // Set while we're using the process's shared backend, whose watcher
+  // `fileWatcher` then points to.
+  std::shared_ptr<SharedBackend> sharedBackend;
+
+  // `watchAsync` and `unwatchAsync` calls whose promises haven't settled yet.
+  // We don't shut the backend down while there are any. Only touched on the
+  // main thread.
+  size_t pendingBackendWork = 0;
+  // How many of those still have a worker thread using `fileWatcher`.
+  std::mutex backendWorkMutex;
+  std::condition_variable backendWorkDone;
+  size_t backendWorkInFlight = 0;
+  // The `unwatchAsync` workers among them that haven't removed their watches
+  // yet, numbered in the order they were queued. Until one has, the backend
+  // still has the old watch, and a new one on the same path would be refused
+  // or taken away again, so adds wait for the unwatches queued before them.
+  std::set<uint64_t> unwatchesInFlight;
+  // The number the last of those got. Only touched on the main thread.
+  uint64_t lastUnwatch = 0;
+
+  friend class WatchWorker;
+  friend class UnwatchWorker;
 };
@@ -0,0 +1,200 @@
+#include "digest.h"
+#include <algorithm>
+#include <cstring>
+
+static inline uint32_t RotateLeft(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+Sha1::Sha1() {
+  state[0] = 0x67452301;
+  state[1] = 0xefcdab89;
+  state[2] = 0x98badcfe;
+  state[3] = 0x10325476;
+  state[4] = 0xc3d2e1f0;
+}
+
+void Sha1::Transform(const uint8_t *block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) |
+           (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t temp = RotateLeft(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = RotateLeft(b, 30);
+    b = a;
+    a = temp;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void Sha1::Update(const uint8_t *data, size_t length) {
+  totalLength += length;
+  if (buffered > 0) {
+    size_t take = std::min(length, sizeof(buffer) - buffered);
+    memcpy(buffer + buffered, data, take);
+    buffered += take;
+    data += take;
+    length -= take;
+    if (buffered < sizeof(buffer))
+      return;
+    Transform(buffer);
+    buffered = 0;
+  }
+  // Whole blocks are hashed straight out of the caller's buffer.
+  while (length >= sizeof(buffer)) {
+    Transform(data);
+    data += sizeof(buffer);
+    length -= sizeof(buffer);
+  }
+  memcpy(buffer, data, length);
+  buffered = length;
+}
+
+std::string Sha1::HexDigest() {
+  uint64_t bits = totalLength * 8;
+  uint8_t padding[72] = {0x80};
+  size_t padLength = (buffered < 56 ? 56 : 120) - buffered;
+  for (int i = 0; i < 8; i++) {
+    padding[padLength + i] = uint8_t(bits >> (56 - i * 8));
+  }
+  Update(padding, padLength + 8);
+
+  static const char kHex[] = "0123456789abcdef";
+  std::string result(40, '0');
+  for (int i = 0; i < 20; i++) {
+    uint8_t byte = uint8_t(state[i / 4] >> (24 - (i % 4) * 8));
+    result[i * 2] = kHex[byte >> 4];
+    result[i * 2 + 1] = kHex[byte & 0xf];
+  }
+  return result;
+}
+
+static const uint64_t kPrime1 = 0x9e3779b185ebca87ULL;
+static const uint64_t kPrime2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t kPrime3 = 0x165667b19e3779f9ULL;
+static const uint64_t kPrime4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t kPrime5 = 0x27d4eb2f165667c5ULL;
+
+static inline uint64_t RotateLeft64(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// Reads little-endian, whatever the machine is.
+static inline uint64_t Read64(const uint8_t *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+static inline uint32_t Read32(const uint8_t *p) {
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+         (uint32_t(p[3]) << 24);
+}
+
+static inline uint64_t Round(uint64_t lane, uint64_t input) {
+  lane += input * kPrime2;
+  return RotateLeft64(lane, 31) * kPrime1;
+}
+
+static inline uint64_t MergeRound(uint64_t hash, uint64_t lane) {
+  hash ^= Round(0, lane);
+  return hash * kPrime1 + kPrime4;
+}
+
+XxHash64::XxHash64(uint64_t seed) : seed(seed) {
+  lanes[0] = seed + kPrime1 + kPrime2;
+  lanes[1] = seed + kPrime2;
+  lanes[2] = seed;
+  lanes[3] = seed - kPrime1;
+}
+
+void XxHash64::Update(const uint8_t *data, size_t length) {
+  totalLength += length;
+  if (buffered > 0) {
+    size_t take = std::min(length, sizeof(buffer) - buffered);
+    memcpy(buffer + buffered, data, take);
+    buffered += take;
+    data += take;
+    length -= take;
+    if (buffered < sizeof(buffer))
+      return;
+    for (int i = 0; i < 4; i++)
+      lanes[i] = Round(lanes[i], Read64(buffer + i * 8));
+    buffered = 0;
+  }
+  while (length >= sizeof(buffer)) {
+    for (int i = 0; i < 4; i++)
+      lanes[i] = Round(lanes[i], Read64(data + i * 8));
+    data += sizeof(buffer);
+    length -= sizeof(buffer);
+  }
+  memcpy(buffer, data, length);
+  buffered = length;
+}
+
+uint64_t XxHash64::Digest() const {
+  uint64_t hash;
+  if (totalLength >= sizeof(buffer)) {
+    hash = RotateLeft64(lanes[0], 1) + RotateLeft64(lanes[1], 7) +
+           RotateLeft64(lanes[2], 12) + RotateLeft64(lanes[3], 18);
+    for (int i = 0; i < 4; i++)
+      hash = MergeRound(hash, lanes[i]);
+  } else {
+    hash = seed + kPrime5;
+  }
+  hash += totalLength;
+
+  const uint8_t *p = buffer;
+  size_t left = buffered;
+  for (; left >= 8; p += 8, left -= 8) {
+    hash ^= Round(0, Read64(p));
+    hash = RotateLeft64(hash, 27) * kPrime1 + kPrime4;
+  }
+  if (left >= 4) {
+    hash ^= uint64_t(Read32(p)) * kPrime1;
+    hash = RotateLeft64(hash, 23) * kPrime2 + kPrime3;
+    p += 4;
+    left -= 4;
+  }
+  for (; left > 0; p++, left--) {
+    hash ^= *p * kPrime5;
+    hash = RotateLeft64(hash, 11) * kPrime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= kPrime2;
+  hash ^= hash >> 29;
+  hash *= kPrime3;
+  hash ^= hash >> 32;
+  return hash;
+}
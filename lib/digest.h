@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A SHA-1 digest that's fed a piece at a time, so that hashing a big file
+// never means holding all of it in memory. Gives the same answer as Node's
+// `crypto.createHash('sha1')`.
+class Sha1 {
+public:
+  Sha1();
+
+  void Update(const uint8_t *data, size_t length);
+  // Finishes the digest and returns it as 40 lowercase hex digits. Don't call
+  // `Update` again afterward.
+  std::string HexDigest();
+
+private:
+  void Transform(const uint8_t *block);
+
+  uint32_t state[5];
+  uint64_t totalLength = 0;
+  uint8_t buffer[64];
+  size_t buffered = 0;
+};
+
+// XXH64, a fast non-cryptographic hash, fed a piece at a time like `Sha1`.
+// Good for telling whether a file changed, when nobody outside this process
+// will ever see the result.
+class XxHash64 {
+public:
+  explicit XxHash64(uint64_t seed = 0);
+
+  void Update(const uint8_t *data, size_t length);
+  uint64_t Digest() const;
+
+private:
+  uint64_t lanes[4];
+  uint64_t seed;
+  uint64_t totalLength = 0;
+  uint8_t buffer[32];
+  size_t buffered = 0;
+};
@@ -0,0 +1,164 @@
+#include "event-subject.h"
+#include <utility>
+
+#ifdef _WIN32
+static bool IsSeparator(char c) { return c == '\\' || c == '/'; }
+static const char kSeparator = '\\';
+#else
+static bool IsSeparator(char c) { return c == '/'; }
+static const char kSeparator = '/';
+#endif
+
+// What Node's `path.dirname` gives for an absolute path without a trailing
+// separator.
+static std::string_view Dirname(std::string_view path) {
+  size_t end = path.size();
+  while (end > 0 && !IsSeparator(path[end - 1]))
+    end--;
+  if (end == 0)
+    return ".";
+  // Keep the separator if it's the root, like `/` or `C:\`.
+  size_t rootLength = 1;
+#ifdef _WIN32
+  if (path.size() >= 3 && path[1] == ':' && IsSeparator(path[2]))
+    rootLength = 3;
+#endif
+  while (end > rootLength && IsSeparator(path[end - 1]))
+    end--;
+  return path.substr(0, end);
+}
+
+EventSubject::EventSubject(std::string watchedPath, std::string targetPath,
+                           bool watchingParent, bool isDirectory)
+    : watchedPath(std::move(watchedPath)), targetPath(std::move(targetPath)),
+      watchingParent(watchingParent), isDirectory(isDirectory) {}
+
+// Whether `path` is the watched directory or anything under it.
+bool EventSubject::IsWatched(std::string_view path) const {
+  if (path.size() < watchedPath.size() ||
+      path.compare(0, watchedPath.size(), watchedPath) != 0)
+    return false;
+  if (path.size() == watchedPath.size())
+    return true;
+  if (!watchedPath.empty() && IsSeparator(watchedPath.back()))
+    return true;
+  return path[watchedPath.size()] == kSeparator;
+}
+
+// Follows the subject to where a rename took it. The backends pair up both
+// halves of a rename by identity, so it's still the same file or directory.
+void EventSubject::MoveTo(std::string_view path) {
+  targetPath.assign(path);
+  watchedPath.assign(watchingParent ? Dirname(path) : path);
+}
+
+bool EventSubject::Translate(uint32_t code, std::string_view path,
+                             std::string_view oldPath, SubjectEvent &out) {
+  // Does the event name the exact path we care about, before or after?
+  bool isTarget = path == targetPath;
+  bool wasTarget = oldPath == targetPath;
+  // Is it somewhere within the directory we watch?
+  bool newWatched = IsWatched(path);
+  bool oldWatched = IsWatched(oldPath);
+  if (!newWatched && !oldWatched)
+    return false;
+
+  out.code = code;
+  out.path = SubjectPath::Event;
+  out.moved = false;
+  switch (code) {
+  case kOverflowEvent:
+  case kThrottledEvent:
+    // Events were dropped or held back, so we don't know exactly what
+    // changed. The best we can say is that something did.
+    out.code = kChangeEvent;
+    out.path = SubjectPath::Empty;
+    break;
+  case kRenameEvent:
+    if (!isTarget && !wasTarget)
+      return false;
+    break;
+  case kChangeEvent:
+    if (!isTarget)
+      return false;
+    if (!watchingParent)
+      out.path = SubjectPath::Empty;
+    break;
+  case kDeleteEvent:
+    // Watching a directory doesn't tell you when it's deleted.
+    if (!isTarget || isDirectory)
+      return false;
+    break;
+  case kCreateEvent:
+    if (!isTarget)
+      return false;
+    break;
+  case kChildCreateEvent:
+    if (isTarget) {
+      out.code = kCreateEvent;
+    } else if (!watchingParent) {
+      out.code = kChangeEvent;
+      out.path = SubjectPath::Empty;
+    } else {
+      // A sibling of the file we're watching.
+      return false;
+    }
+    break;
+  case kChildDeleteEvent:
+    if (!watchingParent) {
+      out.code = kChangeEvent;
+      out.path = SubjectPath::Empty;
+    } else if (isTarget) {
+      out.code = kDeleteEvent;
+    } else {
+      return false;
+    }
+    break;
+  case kChildRenameEvent:
+    if (!isTarget && !wasTarget) {
+      // A watched file only cares about renames that involve it. A watched
+      // directory hears about renames of its own children, but not of
+      // anything further down.
+      if (watchingParent)
+        return false;
+      if (Dirname(path) != watchedPath && Dirname(oldPath) != watchedPath)
+        return false;
+      out.code = kChangeEvent;
+      out.path = SubjectPath::Empty;
+      break;
+    }
+    if (newWatched && !isTarget) {
+      // Our subject moved somewhere we can still see, so we keep following
+      // it there.
+      MoveTo(path);
+      out.moved = true;
+    }
+    if ((oldWatched && newWatched) ||
+        (!watchingParent && Dirname(path) == Dirname(oldPath))) {
+      out.code = kRenameEvent;
+    } else if (oldWatched) {
+      // It moved somewhere we aren't watching, which is as good as gone.
+      out.code = kDeleteEvent;
+    } else {
+      // It came from somewhere we weren't watching.
+      out.code = kCreateEvent;
+    }
+    break;
+  case kChildChangeEvent:
+    if (watchingParent ? !isTarget : isTarget)
+      return false;
+    out.code = kChangeEvent;
+    out.path = SubjectPath::Empty;
+    break;
+  }
+
+  if (isTarget) {
+    // The subject already existed when we started watching it, so a
+    // `create` for it is spurious, and a `delete` carries no path.
+    if (out.code == kCreateEvent)
+      return false;
+    if (out.code == kDeleteEvent)
+      out.path = SubjectPath::Null;
+  }
+  return true;
+}
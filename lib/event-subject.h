@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// The codes events go by on their way to JavaScript. Must be kept in the same
+// order as `kEventNames` in `core.cc`.
+enum : uint32_t {
+  kUnknownEvent = 0,
+  kCreateEvent,
+  kChildCreateEvent,
+  kDeleteEvent,
+  kChildDeleteEvent,
+  kChangeEvent,
+  kChildChangeEvent,
+  kRenameEvent,
+  kChildRenameEvent,
+  kOverflowEvent,
+  kArmedEvent,
+  kThrottledEvent
+};
+
+// Which path an event handed to a subscriber carries.
+enum class SubjectPath {
+  // The path the native event is about.
+  Event,
+  // An empty string: something in the watched directory changed.
+  Empty,
+  // `null`: the subject itself is gone.
+  Null
+};
+
+// What one subscriber hears about one native event.
+struct SubjectEvent {
+  uint32_t code;
+  SubjectPath path;
+  // Set when the event took the subject somewhere else: a rename of it to
+  // the event's path, which is where the subject is now.
+  bool moved;
+};
+
+// One `PathWatcher`'s view of the events on the native watch it's attached
+// to: the file or directory it cares about, and the directory it watches for
+// it (the same path, unless it watches a file by way of its parent). Turns
+// raw native events into the ones that `PathWatcher` should pass on to its
+// callbacks, following its subject when it's renamed.
+class EventSubject {
+public:
+  EventSubject(std::string watchedPath, std::string targetPath,
+               bool watchingParent, bool isDirectory);
+
+  // Fills in what the subscriber should hear about an event with code `code`
+  // on `path` (and `oldPath`, for a rename, or empty). Returns `false` if it
+  // shouldn't hear anything.
+  bool Translate(uint32_t code, std::string_view path,
+                 std::string_view oldPath, SubjectEvent &out);
+
+  const std::string &TargetPath() const { return targetPath; }
+
+private:
+  bool IsWatched(std::string_view path) const;
+  void MoveTo(std::string_view path);
+
+  std::string watchedPath;
+  std::string targetPath;
+  bool watchingParent;
+  bool isDirectory;
+};
@@ -0,0 +1,54 @@
+#include "handle-index.h"
+#include "include/efsw/MemoryCost.hpp"
+
+uint32_t HandleIndex::Assign(efsw::WatchID handle) {
+  auto it = indices.find(handle);
+  if (it != indices.end())
+    return it->second;
+
+  uint32_t index;
+  if (!freeSlots.empty()) {
+    index = freeSlots.back();
+    freeSlots.pop_back();
+  } else {
+    if (handles.empty())
+      handles.push_back(0);
+    index = static_cast<uint32_t>(handles.size());
+    handles.push_back(0);
+  }
+  handles[index] = handle;
+  indices.emplace(handle, index);
+  return index;
+}
+
+bool HandleIndex::Find(efsw::WatchID handle, uint32_t &index) const {
+  auto it = indices.find(handle);
+  if (it == indices.end())
+    return false;
+  index = it->second;
+  return true;
+}
+
+efsw::WatchID HandleIndex::Resolve(uint32_t index) const {
+  return index < handles.size() ? handles[index] : 0;
+}
+
+void HandleIndex::Release(efsw::WatchID handle) {
+  auto it = indices.find(handle);
+  if (it == indices.end())
+    return;
+  handles[it->second] = 0;
+  freeSlots.push_back(it->second);
+  indices.erase(it);
+}
+
+void HandleIndex::Clear() {
+  handles.clear();
+  freeSlots.clear();
+  indices.clear();
+}
+
+size_t HandleIndex::MemoryUsage() const {
+  return efsw::MemoryCost::buffer(handles) +
+         efsw::MemoryCost::buffer(freeSlots) + efsw::MemoryCost::hash(indices);
+}
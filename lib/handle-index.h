@@ -0,0 +1,32 @@
+#pragma once
+
+#include "include/efsw/efsw.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Hands out small, dense numbers for watch handles, for the `smallHandles`
+// option. They fit in a JS small integer, so JavaScript can pass them around
+// and index arrays with them without a `BigInt` being allocated for every
+// event. Numbers start at 1 and are reused once their handle is released.
+// Not thread-safe.
+class HandleIndex {
+public:
+  // The number for `handle`, newly assigned if it didn't have one.
+  uint32_t Assign(efsw::WatchID handle);
+  // Finds the number for `handle`. Returns `false` if it hasn't got one.
+  bool Find(efsw::WatchID handle, uint32_t &index) const;
+  // The handle for `index`, or `0` if it's not in use.
+  efsw::WatchID Resolve(uint32_t index) const;
+  void Release(efsw::WatchID handle);
+  void Clear();
+  // Roughly how many bytes the tables hold.
+  size_t MemoryUsage() const;
+
+private:
+  // Indexed by number; `0` marks a free slot, including slot 0 itself.
+  std::vector<efsw::WatchID> handles;
+  std::vector<uint32_t> freeSlots;
+  std::unordered_map<efsw::WatchID, uint32_t> indices;
+};
@@ -1,7 +1,11 @@
 #include "../core.h"
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include "FSEventsFileWatcher.hpp"
+#include "../../vendor/efsw/include/efsw/Probes.hpp"
+#include <string_view>
 
 #ifdef DEBUG
 #include <iostream>
@@ -21,6 +25,12 @@ int shorthandFSEventsModified = kFSEventStreamEventFlagItemFinderInfoMod |
   kFSEventStreamEventFlagItemModified |
   kFSEventStreamEventFlagItemInodeMetaMod;
 
+// Flags that mean FSEvents can't (or won't) tell us exactly what changed, and
+// that we'll have to look for ourselves.
+int rescanFSEventsFlags = kFSEventStreamEventFlagMustScanSubDirs |
+  kFSEventStreamEventFlagUserDropped |
+  kFSEventStreamEventFlagKernelDropped;
+
 // Ensure a given path has a trailing separator for comparison purposes.
 static std::string NormalizePath(std::string path) {
   if (path.back() == PATH_SEPARATOR) return path;
@@ -31,48 +41,69 @@ static bool PathsAreEqual(std::string pathA, std::string pathB) {
   return NormalizePath(pathA) == NormalizePath(pathB);
 }
 
+// Scratch space for converting `CFString`s back to UTF-8. Reused so that the
+// slow paths below don't allocate a buffer for every event. Each thread gets
+// its own, since FSEvents callbacks and our callers may be on different
+// threads.
+static std::vector<char>& ConversionBuffer(size_t size) {
+  static thread_local std::vector<char> buffer;
+  if (buffer.size() < size) buffer.resize(size);
+  return buffer;
+}
+
+// Whether a string is pure ASCII. ASCII text has no decomposed characters,
+// so it's already in NFC; that's most paths, and we can skip CoreFoundation
+// for them entirely.
+static bool IsAscii(const std::string& str) {
+  for (unsigned char c : str) {
+    if (c >= 0x80) return false;
+  }
+  return true;
+}
+
+// Copies a `CFString` into a `std::string` as UTF-8.
+static std::string CopyCFStringAsUTF8(CFStringRef cfString) {
+  const char* cStr = CFStringGetCStringPtr(cfString, kCFStringEncodingUTF8);
+  if (cStr) return std::string(cStr);
+
+  CFIndex length = CFStringGetLength(cfString);
+  CFIndex maxSize = CFStringGetMaximumSizeForEncoding(
+    length,
+    kCFStringEncodingUTF8
+  );
+  if (maxSize == kCFNotFound) return std::string();
+
+  // +1 for null terminator.
+  std::vector<char>& buffer = ConversionBuffer(maxSize + 1);
+  if (!CFStringGetCString(
+    cfString,
+    buffer.data(),
+    buffer.size(),
+    kCFStringEncodingUTF8
+  )) {
+    return std::string();
+  }
+  return std::string(buffer.data());
+}
+
 std::string PrecomposeFileName(const std::string& name) {
-	CFStringRef cfStringRef = CFStringCreateWithCString(
+  if (IsAscii(name)) return name;
+
+  CFStringRef cfStringRef = CFStringCreateWithCString(
     kCFAllocatorDefault,
     name.c_str(),
     kCFStringEncodingUTF8
   );
+  if (!cfStringRef) return name;
 
-	CFMutableStringRef cfMutable = CFStringCreateMutableCopy(NULL, 0, cfStringRef);
-
-	CFStringNormalize(cfMutable, kCFStringNormalizationFormC);
-
-	const char* c_str = CFStringGetCStringPtr(cfMutable, kCFStringEncodingUTF8);
-
-	if (c_str != NULL) {
-		std::string result(c_str);
-		CFRelease(cfStringRef);
-		CFRelease(cfMutable);
-		return result;
-	}
-
-	CFIndex length = CFStringGetLength(cfMutable);
-	CFIndex maxSize = CFStringGetMaximumSizeForEncoding(length, kCFStringEncodingUTF8);
-	if (maxSize == kCFNotFound) {
-		CFRelease(cfStringRef);
-		CFRelease(cfMutable);
-		return std::string();
-	}
+  CFMutableStringRef cfMutable = CFStringCreateMutableCopy(NULL, 0, cfStringRef);
+  CFRelease(cfStringRef);
+  if (!cfMutable) return name;
 
-	std::string result(maxSize + 1, '\0');
-	if (CFStringGetCString(
-    cfMutable,
-    &result[0],
-    result.size(),
-    kCFStringEncodingUTF8
-  )) {
-		result.resize(std::strlen(result.c_str()));
-		CFRelease(cfStringRef);
-		CFRelease(cfMutable);
-	} else {
-		result.clear();
-	}
-	return result;
+  CFStringNormalize(cfMutable, kCFStringNormalizationFormC);
+  std::string result = CopyCFStringAsUTF8(cfMutable);
+  CFRelease(cfMutable);
+  return result;
 }
 
 // Returns whether `path` currently exists on disk. Does not distiguish between
@@ -139,134 +170,488 @@ std::string FileNameFromPath(std::string filepath) {
 	return filepath;
 }
 
-// Borrowed from `efsw`. Don’t ask me to explain it.
-static std::string convertCFStringToStdString( CFStringRef cfString ) {
-  // Try to get the C string pointer directly.
-	const char* cStr = CFStringGetCStringPtr(cfString, kCFStringEncodingUTF8);
-
-	if (cStr) {
-    // If the pointer is valid, directly return a `std::string` from it.
-		return std::string(cStr);
-	} else {
-    // If not, manually convert it.
-		CFIndex length = CFStringGetLength(cfString);
-		CFIndex maxSize = CFStringGetMaximumSizeForEncoding(
-      length,
-      kCFStringEncodingUTF8
-    ) + 1; // +1 for null terminator
-
-		char* buffer = new char[maxSize];
-
-		if (CFStringGetCString(
-      cfString,
-      buffer,
-      maxSize,
-      kCFStringEncodingUTF8
-    )) {
-			std::string result(buffer);
-			delete[] buffer;
-			return result;
-		} else {
-			delete[] buffer;
-			return "";
-		}
-	}
+// Like `PathWithoutFileName(filepath, false)`, but returns a view into
+// `filepath` instead of allocating a new string. Used for index lookups,
+// which happen on every event.
+static std::string_view ParentPathView(std::string_view filepath) {
+  while (filepath.size() > 1 && filepath.back() == PATH_SEPARATOR) {
+    filepath.remove_suffix(1);
+  }
+  size_t pos = filepath.find_last_of(PATH_SEPARATOR);
+  if (pos != std::string_view::npos) return filepath.substr(0, pos);
+  return filepath;
+}
+
+static bool SameTime(const struct timespec& a, const struct timespec& b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// The most shards we'll make. Past that, directories in a tree that doesn't
+// have a shard yet go to one for their whole volume.
+static const size_t kMaxShards = 16;
+
+// How many leading components of a directory's path decide its shard, which
+// is about where a project's root tends to be: `/Users/me/project`, say.
+static const int kShardDepth = 3;
+
+// Given a directory we're about to watch, returns a key naming the shard it
+// goes in: its volume, and the first `kShardDepth` components of its path, or
+// only its volume when `volumeOnly` is set.
+static std::string ShardKeyForPath(const std::string& dir, bool volumeOnly) {
+  struct stat st;
+  std::string key = std::to_string(
+    stat(dir.c_str(), &st) == 0 ? (uint64_t) st.st_dev : 0
+  ) + ':';
+  if (volumeOnly) return key;
+
+  size_t end = 0;
+  for (int i = 0; i < kShardDepth && end != std::string::npos; i++) {
+    end = dir.find(PATH_SEPARATOR, end + 1);
+  }
+  return key + dir.substr(0, end);
 }
 
-// Empty constructor.
+static void DoNothing(void*) {}
+
+FSEventsFileWatcher::FSEventsFileWatcher() {
+  rebuildQueue = dispatch_queue_create(NULL, NULL);
+}
 
 FSEventsFileWatcher::~FSEventsFileWatcher() {
   pendingDestruction = true;
-  // Defer cleanup until we can finish processing file events.
-  std::unique_lock<std::mutex> lock(processingMutex);
-  while (isProcessing) {
-    processingComplete.wait(lock);
+
+  // Make sure no deferred rebuild can fire from here on out. Cancellation
+  // stops future firings; the empty synchronous call waits out any firing
+  // that's already under way.
+  for (auto& it : shards) {
+    dispatch_source_cancel(it.second->rebuildTimer);
   }
+  dispatch_sync_f(rebuildQueue, nullptr, &DoNothing);
 
+  {
+    std::lock_guard<std::mutex> streamLock(streamMutex);
+    for (auto& it : shards) {
+      stopCurrentStream(*it.second);
+    }
+  }
+
+  // No stream will call back again, but some may still be handling events
+  // they already had. Each shard's queue lets us wait those out.
+  for (auto& it : shards) {
+    dispatch_sync_f(it.second->queue, nullptr, &DoNothing);
+    dispatch_release(it.second->rebuildTimer);
+    dispatch_release(it.second->queue);
+  }
+  dispatch_release(rebuildQueue);
   isValid = false;
-  if (currentEventStream) {
-    FSEventStreamStop(currentEventStream);
-    FSEventStreamInvalidate(currentEventStream);
-    FSEventStreamRelease(currentEventStream);
+}
+
+// Given a path, returns the directory we should watch on its behalf.
+//
+// FSEvents watches directories, not individual files. If the caller passes a
+// file path (which the JS layer now does when watching a specific file on
+// macOS), silently promote it to the parent directory. The stream will then
+// deliver per-file events for the whole directory, and the existing
+// event-matching logic — which already keys on the parent directory — will
+// route events for the right file to the right handle.
+static std::string WatchDirectoryForPath(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+    return PathWithoutFileName(path, false);
+  }
+  return path;
+}
+
+// FSEventStreamStart() doesn't expose a reason for failure. Inspect a path
+// post-hoc to return the most specific error code we can.
+static efsw::WatchID DiagnoseWatchFailure(const std::string& watchDir) {
+  struct stat st;
+  if (stat(watchDir.c_str(), &st) != 0) {
+    if (errno == EACCES || errno == EPERM) {
+      return efsw::Errors::FileNotReadable;
+    }
+    return efsw::Errors::FileNotFound;
+  }
+
+  struct statfs sfsb;
+  if (statfs(watchDir.c_str(), &sfsb) == 0) {
+    if (!(sfsb.f_flags & MNT_LOCAL)) {
+      return efsw::Errors::FileRemote;
+    }
+  }
+
+  return efsw::Errors::WatcherFailed;
+}
+
+// Private: record a directory in our maps under a new handle. Doesn't touch
+// the stream. Events with IDs at or below `startId` are dropped for this
+// handle. Only a `resync` watch keeps `snapshot`.
+efsw::WatchID FSEventsFileWatcher::addHandle(
+  const std::string& watchDir,
+  efsw::FileWatchListener* listener,
+  DirSnapshot snapshot,
+  bool resync,
+  FSEventStreamEventId startId,
+  Shard* shard
+) {
+  std::lock_guard<std::mutex> lock(mapMutex);
+  efsw::WatchID handle = nextHandleID++;
+  handlesToPaths[handle] = efsw::InternedPath(watchDir);
+  handlesToStartIds[handle] = startId;
+  pathIndex.insert(watchDir, handle);
+  handlesToListeners[handle] = listener;
+  if (resync) {
+    handlesToSnapshots[handle] = std::move(snapshot);
+    snapshotCount = handlesToSnapshots.size();
+  }
+  handlesToShards[handle] = shard;
+  shard->handles.insert(handle);
+  return handle;
+}
+
+// Private: returns the shard that a directory we're about to watch belongs
+// in, making it if need be.
+FSEventsFileWatcher::Shard* FSEventsFileWatcher::shardForPath(
+  const std::string& watchDir
+) {
+  std::string key = ShardKeyForPath(watchDir, false);
+  std::lock_guard<std::mutex> lock(streamMutex);
+  auto it = shards.find(key);
+  if (it == shards.end() && shards.size() >= kMaxShards) {
+    key = ShardKeyForPath(watchDir, true);
+    it = shards.find(key);
   }
+  if (it != shards.end()) return it->second.get();
+
+  Shard* shard = new Shard();
+  shard->watcher = this;
+  shard->queue = dispatch_queue_create(NULL, NULL);
+  shard->rebuildTimer = dispatch_source_create(
+    DISPATCH_SOURCE_TYPE_TIMER, 0, 0, rebuildQueue
+  );
+  dispatch_set_context(shard->rebuildTimer, shard);
+  dispatch_source_set_event_handler_f(
+    shard->rebuildTimer,
+    &FSEventsFileWatcher::rebuildTimerFired
+  );
+  // Disarmed until we need it.
+  dispatch_source_set_timer(shard->rebuildTimer, DISPATCH_TIME_FOREVER, 0, 0);
+  dispatch_resume(shard->rebuildTimer);
+  shards[key].reset(shard);
+  return shard;
 }
 
 efsw::WatchID FSEventsFileWatcher::addWatch(
   const std::string& directory,
   efsw::FileWatchListener* listener,
   // The `_useRecursion` flag is ignored; it's present for API compatibility.
-  bool _useRecursion
+  bool _useRecursion,
+  FSEventStreamEventId sinceWhen,
+  bool resync
 ) {
-  // FSEvents watches directories, not individual files. If the caller passes a
-  // file path (which the JS layer now does when watching a specific file on
-  // macOS), silently promote it to the parent directory. The stream will then
-  // deliver per-file events for the whole directory, and the existing
-  // event-matching logic — which already keys on the parent directory — will
-  // route events for the right file to the right handle.
-  struct stat st;
-  std::string watchDir = directory;
-  if (stat(directory.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
-    watchDir = PathWithoutFileName(directory, false);
+  return addWatches(
+    { directory }, listener, _useRecursion, sinceWhen, resync
+  )[0];
+}
+
+std::vector<efsw::WatchID> FSEventsFileWatcher::addWatches(
+  const std::vector<std::string>& directories,
+  efsw::FileWatchListener* listener,
+  bool _useRecursion,
+  FSEventStreamEventId sinceWhen,
+  bool resync
+) {
+  std::vector<efsw::WatchID> handles;
+  std::vector<efsw::WatchID> added;
+  std::vector<std::string> addedDirs;
+  // What each shard has to add, so that it rebuilds its stream once.
+  std::unordered_map<Shard*, std::vector<efsw::WatchID>> addedByShard;
+  handles.reserve(directories.size());
+  // FSEvents numbers events in the order they happen, so anything at or
+  // below the current ID happened before we started watching. Checking that
+  // here is cheaper than a `stat` per event, and it doesn't care what the
+  // clock says. Replays ask for those older events on purpose.
+  FSEventStreamEventId startId = sinceWhen == 0 ?
+    FSEventsGetCurrentEventId() : 0;
+  for (const auto& directory : directories) {
+    std::string watchDir = WatchDirectoryForPath(directory);
+    // Since the stream might not be rebuilt until later, we can't wait for
+    // it to fail before deciding whether a path is watchable. A path that
+    // doesn't exist (or can't be read) is the most likely reason for failure,
+    // so we check for that up front.
+    if (!PathExists(watchDir)) {
+      handles.push_back(DiagnoseWatchFailure(watchDir));
+      continue;
+    }
+    // List the directory now, while nobody's waiting on its events, so that
+    // a later rescan has something to compare against.
+    DirSnapshot snapshot;
+    if (resync) readDirSnapshot(watchDir, snapshot);
+    Shard* shard = shardForPath(watchDir);
+    efsw::WatchID handle = addHandle(
+      watchDir,
+      listener,
+      std::move(snapshot),
+      resync,
+      startId,
+      shard
+    );
+    handles.push_back(handle);
+    addedByShard[shard].push_back(handle);
+  }
+  if (addedByShard.empty()) return handles;
+
+  // The paths of the shards whose new streams failed to start.
+  std::unordered_map<efsw::WatchID, std::string> failed;
+  for (auto& it : addedByShard) {
+    if (
+      requestStreamRebuild(*it.first, it.second, sinceWhen) !=
+      RebuildResult::Failed
+    ) continue;
+    for (auto handle : it.second) {
+      std::lock_guard<std::mutex> lock(mapMutex);
+      failed[handle] = handlesToPaths[handle].str();
+    }
   }
+  if (failed.empty()) return handles;
+
+  // At least one of a shard's new paths can't be watched. All of its
+  // previously-watched paths were already working in its prior stream, so
+  // the new paths are the most likely culprits — but FSEvents won't tell us
+  // which one. Back them all out; if there's more than one, add them again
+  // one at a time so that each gets its own diagnosis.
+  for (auto& it : failed) {
+    removeHandle(it.first);
+  }
+  for (auto& handle : handles) {
+    auto it = failed.find(handle);
+    if (it == failed.end()) continue;
+    handle = failed.size() == 1 ?
+      DiagnoseWatchFailure(it->second) :
+      addWatch(it->second, listener, _useRecursion, 0, resync);
+  }
+  return handles;
+}
 
-  efsw::WatchID handle = nextHandleID++;
+void FSEventsFileWatcher::removeWatch(
+  efsw::WatchID handle
+) {
+  removeWatches({ handle });
+}
+
+void FSEventsFileWatcher::removeWatches(
+  const std::vector<efsw::WatchID>& handles
+) {
+  if (handles.empty()) return;
+  // Only the shards the handles were in need new streams.
+  std::set<Shard*> affected;
+  for (auto handle : handles) {
+    if (Shard* shard = removeHandle(handle)) affected.insert(shard);
+  }
+
+  for (Shard* shard : affected) {
+    bool empty;
+    {
+      std::lock_guard<std::mutex> lock(mapMutex);
+      empty = shard->handles.empty();
+    }
+    if (empty) {
+      std::lock_guard<std::mutex> lock(streamMutex);
+      // Nothing left to watch, so any rebuild we were planning is moot.
+      shard->rebuildScheduled = false;
+      shard->pendingReplayHandles.clear();
+      stopCurrentStream(*shard);
+      continue;
+    }
+
+    // We don't capture the return value here because it doesn’t affect our
+    // response. If a new stream fails to start for whatever reason, the old
+    // stream will still work. And because we've removed the handles from the
+    // relevant maps, we will silently ignore any filesystem events that
+    // happen at the given paths.
+    requestStreamRebuild(*shard, {});
+  }
+}
+
+void FSEventsFileWatcher::setStreamOptions(double latency, bool noDefer) {
+  std::vector<Shard*> running;
   {
-    std::lock_guard<std::mutex> lock(mapMutex);
-    handlesToPaths[handle] = watchDir;
-    pathsToHandles[watchDir] = handle;
-    handlesToListeners[handle] = listener;
+    std::lock_guard<std::mutex> lock(streamMutex);
+    if (latency == streamLatency && noDefer == streamNoDefer) return;
+    streamLatency = latency;
+    streamNoDefer = noDefer;
+    for (auto& it : shards) {
+      if (it.second->currentEventStream) running.push_back(it.second.get());
+    }
+  }
+  for (Shard* shard : running) {
+    requestStreamRebuild(*shard, {});
+  }
+}
+
+// Private: ask for a shard's stream to be rebuilt to reflect its current set
+// of watched paths. `addedHandles` are handles whose paths are new since the
+// last rebuild.
+FSEventsFileWatcher::RebuildResult FSEventsFileWatcher::requestStreamRebuild(
+  Shard& shard,
+  const std::vector<efsw::WatchID>& addedHandles,
+  FSEventStreamEventId resumeFrom
+) {
+  std::lock_guard<std::mutex> lock(streamMutex);
+  auto now = std::chrono::steady_clock::now();
+
+  // Resuming needs a replaying stream, and only a deferred rebuild knows how
+  // to keep a replay from repeating events to the paths that already had
+  // them.
+  if (resumeFrom == 0 && !shard.rebuildScheduled && (
+    !shard.currentEventStream || now - shard.lastRebuild >= rebuildDelay
+  )) {
+    // We've been quiet for a while, so there's no reason to wait.
+    shard.lastRebuild = now;
+    return startNewStream(shard) ?
+      RebuildResult::Started : RebuildResult::Failed;
   }
 
-  bool didStart = startNewStream();
+  if (!shard.rebuildScheduled) {
+    shard.rebuildScheduled = true;
+    shard.pendingSinceId = FSEventsGetCurrentEventId();
+    dispatch_source_set_timer(
+      shard.rebuildTimer,
+      dispatch_time(
+        DISPATCH_TIME_NOW,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          rebuildDelay
+        ).count()
+      ),
+      DISPATCH_TIME_FOREVER,
+      0
+    );
+  }
+  if (resumeFrom != 0 && resumeFrom < shard.pendingSinceId) {
+    shard.pendingSinceId = resumeFrom;
+  }
+  shard.pendingReplayHandles.insert(addedHandles.begin(), addedHandles.end());
+  return RebuildResult::Deferred;
+}
 
-  if (!didStart) {
-    removeHandle(handle);
-
-    // FSEventStreamStart() doesn't expose a reason for failure. Inspect the
-    // newly-added path post-hoc to return the most specific error code we can.
-    // (All previously-watched paths were already working in the prior stream,
-    // so the new path is the most likely culprit.)
-    if (stat(watchDir.c_str(), &st) != 0) {
-      if (errno == EACCES || errno == EPERM) {
-        return efsw::Errors::FileNotReadable;
+void FSEventsFileWatcher::rebuildTimerFired(void* context) {
+  Shard* shard = static_cast<Shard*>(context);
+  shard->watcher->rebuildDeferredStream(*shard);
+}
+
+// Private: carry out a rebuild that was deferred by `requestStreamRebuild`.
+// Runs on `rebuildQueue`.
+void FSEventsFileWatcher::rebuildDeferredStream(Shard& shard) {
+  if (!isValid || pendingDestruction) return;
+  std::lock_guard<std::mutex> lock(streamMutex);
+  if (!shard.rebuildScheduled) return;
+  shard.rebuildScheduled = false;
+  shard.lastRebuild = std::chrono::steady_clock::now();
+
+  uint64_t replayCutoff;
+  {
+    std::lock_guard<std::mutex> mapLock(mapMutex);
+    shard.replayHandles = std::move(shard.pendingReplayHandles);
+    shard.pendingReplayHandles.clear();
+    if (shard.replayHandles.empty()) {
+      shard.replayCutoff = 0;
+    } else {
+      // Everything up to the last event this shard delivered is old news to
+      // the paths it was already watching. If it hasn't delivered anything,
+      // anything up to now is.
+      shard.replayCutoff = shard.lastEventId.load();
+      if (shard.replayCutoff == 0) {
+        shard.replayCutoff = FSEventsGetCurrentEventId();
       }
-      return efsw::Errors::FileNotFound;
     }
+    replayCutoff = shard.replayCutoff;
+  }
+
+  // If there's nothing new, there's nothing to replay.
+  bool didStart = startNewStream(
+    shard,
+    replayCutoff == 0 ? kFSEventStreamEventIdSinceNow : shard.pendingSinceId
+  );
+
+  // If this fails, the old stream keeps running, so existing paths are still
+  // covered. There's nobody waiting on this call to tell about the new paths;
+  // they'll be picked up on the next successful rebuild.
+  if (!didStart) {
+    std::lock_guard<std::mutex> mapLock(mapMutex);
+    shard.replayHandles.clear();
+    shard.replayCutoff = 0;
+  }
+}
+
+FSEventStreamEventId FSEventsFileWatcher::getLastEventId() {
+  uint64_t id = lastEventId.load();
+  return id == 0 ? FSEventsGetCurrentEventId() : id;
+}
 
-    struct statfs sfsb;
-    if (statfs(watchDir.c_str(), &sfsb) == 0) {
-      if (!(sfsb.f_flags & MNT_LOCAL)) {
-        return efsw::Errors::FileRemote;
+efsw::MemoryUsage FSEventsFileWatcher::memoryUsage() {
+  efsw::MemoryUsage usage;
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    usage.watchTableBytes += efsw::MemoryCost::hash(handlesToPaths) +
+      efsw::MemoryCost::hash(handlesToListeners) +
+      efsw::MemoryCost::hash(handlesToSnapshots) +
+      efsw::MemoryCost::hash(handlesToStartIds) +
+      efsw::MemoryCost::hash(handlesToShards) + pathIndex.memoryUsage();
+    for (auto& entry : handlesToSnapshots) {
+      usage.watchTableBytes += efsw::MemoryCost::hash(entry.second);
+      for (auto& file : entry.second) {
+        usage.stringBytes += efsw::MemoryCost::string(file.first);
       }
     }
-
-    return efsw::Errors::WatcherFailed;
+    usage.pendingEventBytes += efsw::MemoryCost::tree(pendingRescans);
   }
+  {
+    std::lock_guard<std::mutex> lock(streamMutex);
+    usage.watchTableBytes += efsw::MemoryCost::hash(shards);
+    for (auto& it : shards) {
+      const Shard& shard = *it.second;
+      usage.watchTableBytes += sizeof(Shard) +
+        efsw::MemoryCost::hash(shard.handles) +
+        efsw::MemoryCost::hash(shard.pendingReplayHandles) +
+        efsw::MemoryCost::hash(shard.replayHandles);
+      usage.stringBytes += efsw::MemoryCost::string(it.first);
+      usage.kernelWatches += (shard.currentEventStream != nullptr) +
+        (shard.nextEventStream != nullptr);
+    }
+  }
+  return usage;
+}
 
-  return handle;
+// Private: whether an event is a replayed copy of one that the shard's
+// previous stream already delivered. Callers must hold `mapMutex`.
+bool FSEventsFileWatcher::isDuplicateReplay(
+  const Shard& shard,
+  efsw::WatchID handle,
+  uint64_t eventId
+) {
+  if (eventId > shard.replayCutoff) return false;
+  return shard.replayHandles.find(handle) == shard.replayHandles.end();
 }
 
-void FSEventsFileWatcher::removeWatch(
-  efsw::WatchID handle
+// Private: whether an event happened before its watcher was added. Callers
+// must hold `mapMutex`.
+bool FSEventsFileWatcher::predatesWatch(
+  efsw::WatchID handle,
+  uint64_t eventId
 ) {
-  auto remainingCount = removeHandle(handle);
+  auto it = handlesToStartIds.find(handle);
+  return it != handlesToStartIds.end() && eventId <= it->second;
+}
 
-  if (remainingCount == 0) {
-    if (currentEventStream) {
-      FSEventStreamStop(currentEventStream);
-      FSEventStreamInvalidate(currentEventStream);
-      FSEventStreamRelease(currentEventStream);
-    }
-    currentEventStream = nullptr;
-    return;
+// Private: stop and release a shard's current stream. Callers must hold
+// `streamMutex`.
+void FSEventsFileWatcher::stopCurrentStream(Shard& shard) {
+  if (shard.currentEventStream) {
+    FSEventStreamStop(shard.currentEventStream);
+    FSEventStreamInvalidate(shard.currentEventStream);
+    FSEventStreamRelease(shard.currentEventStream);
   }
-
-  // We don't capture the return value here because it doesn’t affect our
-  // response. If a new stream fails to start for whatever reason, the old
-  // stream will still work. And because we've removed the handle from the
-  // relevant maps, we will silently ignore any filesystem events that happen
-  // at the given path.
-  startNewStream();
+  shard.currentEventStream = nullptr;
 }
 
 void FSEventsFileWatcher::FSEventCallback(
@@ -277,13 +662,31 @@ void FSEventsFileWatcher::FSEventCallback(
   const FSEventStreamEventFlags eventFlags[],
   const FSEventStreamEventId eventIds[]
 ) {
-  FSEventsFileWatcher* instance = static_cast<FSEventsFileWatcher*>(userData);
-  if (!instance->isValid) return;
+  Shard* shard = static_cast<Shard*>(userData);
+  FSEventsFileWatcher* instance = shard->watcher;
+  if (!instance->isValid || instance->pendingDestruction) return;
+  efPROBE(read, reinterpret_cast<uintptr_t>(streamRef), numEvents);
 
   std::vector<FSEvent> events;
   events.reserve(numEvents);
 
   for (size_t i = 0; i < numEvents; i++) {
+    uint64_t eventId = (uint64_t) eventIds[i];
+    for (std::atomic<uint64_t>* last :
+         {&instance->lastEventId, &shard->lastEventId}) {
+      uint64_t lastId = last->load();
+      while (eventId > lastId && !last->compare_exchange_weak(lastId, eventId));
+    }
+
+    if (eventFlags[i] & kFSEventStreamEventFlagHistoryDone) {
+      // A replaying stream has caught up to the present, so there's nothing
+      // left to deduplicate.
+      std::lock_guard<std::mutex> lock(instance->mapMutex);
+      shard->replayHandles.clear();
+      shard->replayCutoff = 0;
+      continue;
+    }
+
     CFDictionaryRef pathInfoDict = static_cast<CFDictionaryRef>(
       CFArrayGetValueAtIndex((CFArrayRef) eventPaths, i)
     );
@@ -294,12 +697,14 @@ void FSEventsFileWatcher::FSEventCallback(
       CFDictionaryGetValue(pathInfoDict, kFSEventStreamEventExtendedFileIDKey)
     );
 
-    if (cfInode) {
+    // Events that ask us to rescan don't carry a file ID, but we still need
+    // them.
+    if (cfInode || (eventFlags[i] & rescanFSEventsFlags)) {
       unsigned long inode = 0;
-      CFNumberGetValue(cfInode, kCFNumberLongType, &inode);
+      if (cfInode) CFNumberGetValue(cfInode, kCFNumberLongType, &inode);
       events.push_back(
         FSEvent(
-          convertCFStringToStdString(path),
+          CopyCFStringAsUTF8(path),
           (long) eventFlags[i],
           (uint64_t) eventIds[i],
           inode
@@ -309,8 +714,8 @@ void FSEventsFileWatcher::FSEventCallback(
   }
 
   if (!instance->isValid) return;
-  instance->handleActions(events);
-  instance->process();
+  instance->handleActions(*shard, events);
+  instance->process(*shard);
 }
 
 void FSEventsFileWatcher::sendFileAction(
@@ -334,21 +739,24 @@ void FSEventsFileWatcher::sendFileAction(
   );
 }
 
-struct FileEventMatch {
-  efsw::WatchID handle;
-  std::string path;
-};
-
-void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
+void FSEventsFileWatcher::handleActions(
+  Shard& shard,
+  std::vector<FSEvent>& events
+) {
   size_t esize = events.size();
 
   for (size_t i = 0; i < esize; i++) {
     FSEvent& event = events[i];
-    std::vector<FileEventMatch> matches;
+
+    // A coalesced or dropped event says nothing reliable about any single
+    // file, so rather than guess, we compare the affected directories against
+    // what we last saw of them once this batch is handled.
+    if (event.flags & rescanFSEventsFlags) {
+      queueRescans(event.path);
+      continue;
+    }
 
     if (event.flags & (
-      kFSEventStreamEventFlagUserDropped |
-      kFSEventStreamEventFlagKernelDropped |
       kFSEventStreamEventFlagEventIdsWrapped |
       kFSEventStreamEventFlagHistoryDone |
       kFSEventStreamEventFlagMount |
@@ -358,6 +766,7 @@ void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
 
     efsw::WatchID handle;
     std::string path;
+    bool snapshotted;
 
     {
       // How do we match up this path change to the watcher that cares about
@@ -369,10 +778,9 @@ void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
       // possibility of recursive watchers, one file change can correspond to
       // arbitrarily many watchers.
       //
-      // For that reason, we can do a simple map lookup. First we try the
-      // path’s parent directory; if that’s not successful, we try the full
-      // path. One of these is (for practical purposes) guaranteed to find a
-      // watcher.
+      // For that reason, we can do a simple index lookup on the path’s
+      // parent directory. The index walks path components against a view of
+      // `event.path`, so this doesn't allocate.
       //
       // NOTE: `efsw` currently does not detect a directory’s deletion when
       // that directory is the one being watched. For consistency, we'll try to
@@ -384,14 +792,23 @@ void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
       // creations — is to listen on the directory’s parent, which neatly
       // mirrors the situation with files.
       //
+      // Shards can nest: a path deep enough to get a shard of its own can
+      // still sit inside a shallower shard's root, and then both streams
+      // report what happens in it. The index is shared by every shard, so
+      // we only take matches that belong to the stream we're handling;
+      // the other shard's stream reports the rest.
+      //
       std::lock_guard<std::mutex> lock(mapMutex);
-      auto itpth = pathsToHandles.find(PathWithoutFileName(event.path, false));
-      if (itpth != pathsToHandles.end()) {
+      handle = pathIndex.find(ParentPathView(event.path));
+      if (handle != 0 && !shard.handles.count(handle)) continue;
+      if (handle != 0) {
         // We have an entry for this paths’s owner directory. We prefer this
         // whether the entry itself is a file or a directory (to replicate
         // `efsw`’s bug).
-        path = itpth->first;
-        handle = itpth->second;
+        if (isDuplicateReplay(shard, handle, event.id)) continue;
+        if (predatesWatch(handle, event.id)) continue;
+        path = handlesToPaths[handle].str();
+        snapshotted = handlesToSnapshots.count(handle) != 0;
       } else {
         // Couldn't match this up to a watcher. A bit unusual, but not
         // catastrophic.
@@ -399,6 +816,8 @@ void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
       }
     }
 
+    if (snapshotted) updateSnapshot(event.path);
+
     std::string dirPath(PathWithoutFileName(event.path));
     std::string filePath(FileNameFromPath(event.path));
 
@@ -408,7 +827,7 @@ void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
       kFSEventStreamEventFlagItemRenamed
     )) {
       if (!PathsAreEqual(dirPath, path)) {
-        dirsChanged.insert(dirPath);
+        shard.dirsChanged.insert(dirPath);
       }
     }
 
@@ -432,6 +851,7 @@ void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
         // If so, compare this event and the next one to figure out which one
         // refers to a current file on disk.
         FSEvent& nEvent = events[i + 1];
+        updateSnapshot(nEvent.path);
         std::string newDir(PathWithoutFileName(nEvent.path));
         std::string newFilepath(FileNameFromPath(nEvent.path));
 
@@ -481,7 +901,7 @@ void FSEventsFileWatcher::handleActions(std::vector<FSEvent>& events) {
           kFSEventStreamEventFlagItemRenamed
         )) {
           if (!PathsAreEqual(newDir, path)) {
-            dirsChanged.insert(newDir);
+            shard.dirsChanged.insert(newDir);
           }
         }
 
@@ -534,60 +954,201 @@ void FSEventsFileWatcher::handleAddModDel(
   }
 }
 
-// Private: clean up a handle from both unordered maps.
-size_t FSEventsFileWatcher::removeHandle(efsw::WatchID handle) {
+// Private: clean up a handle from our maps. Returns the shard it was in, if
+// there was one.
+FSEventsFileWatcher::Shard* FSEventsFileWatcher::removeHandle(
+  efsw::WatchID handle
+) {
   // If we're destroyed (or about to destroy ourselves), don't try to do
   // anything to these maps; the mutex lock will fail.
-  if (!isValid || pendingDestruction) return 0;
+  if (!isValid || pendingDestruction) return nullptr;
   std::lock_guard<std::mutex> lock(mapMutex);
-  std::string path;
+  Shard* shard = nullptr;
+  auto its = handlesToShards.find(handle);
+  if (its != handlesToShards.end()) {
+    shard = its->second;
+    shard->handles.erase(handle);
+    handlesToShards.erase(its);
+  }
   auto itp = handlesToPaths.find(handle);
   if (itp != handlesToPaths.end()) {
-    path = itp->second;
+    pathIndex.erase(itp->second.str(), handle);
     handlesToPaths.erase(itp);
   }
-  auto itpth = pathsToHandles.find(path);
-  if (itpth != pathsToHandles.end()) {
-    pathsToHandles.erase(itpth);
-  }
   auto itl = handlesToListeners.find(handle);
   if (itl != handlesToListeners.end()) {
     handlesToListeners.erase(itl);
   }
-  return handlesToPaths.size();
+  handlesToSnapshots.erase(handle);
+  snapshotCount = handlesToSnapshots.size();
+  handlesToStartIds.erase(handle);
+  pendingRescans.erase(handle);
+  return shard;
 }
 
-void FSEventsFileWatcher::process() {
-  // We are very careful in this function to ensure that `FSEventsFileWatcher`
-  // doesn’t finalize while this is happening.
-  if (!isValid || pendingDestruction) return;
+// Private: lists a directory's entries (other than `.` and `..`) along with
+// their inodes and modification times. Doesn't follow symlinks.
+bool FSEventsFileWatcher::readDirSnapshot(
+  const std::string& path,
+  DirSnapshot& snapshot
+) {
+  snapshot.clear();
+  DIR* dir = opendir(path.c_str());
+  if (!dir) return false;
+  int dirFd = dirfd(dir);
+  while (struct dirent* entry = readdir(dir)) {
+    const char* name = entry->d_name;
+    if (name[0] == '.' && (
+      name[1] == '\0' || (name[1] == '.' && name[2] == '\0')
+    )) continue;
+    struct stat st;
+    // Already gone again.
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+    snapshot[name] = { st.st_ino, st.st_mtimespec, S_ISDIR(st.st_mode) };
+  }
+  closedir(dir);
+  return true;
+}
+
+// Private: brings the cached listing of a path's watched parent up to date
+// with whatever is at that path now. Ordinary events go through here so that
+// a later rescan only reports what they didn't.
+void FSEventsFileWatcher::updateSnapshot(const std::string& path) {
+  if (snapshotCount == 0) return;
+  struct stat st;
+  bool exists = lstat(path.c_str(), &st) == 0;
+  std::string name = FileNameFromPath(path);
+
+  std::lock_guard<std::mutex> lock(mapMutex);
+  efsw::WatchID handle = pathIndex.find(ParentPathView(path));
+  if (handle == 0) return;
+  auto it = handlesToSnapshots.find(handle);
+  if (it == handlesToSnapshots.end()) return;
+  if (exists) {
+    it->second[name] = { st.st_ino, st.st_mtimespec, S_ISDIR(st.st_mode) };
+  } else {
+    it->second.erase(name);
+  }
+}
+
+// Private: marks for rescanning every watched directory that an event for
+// `path` might have hidden changes in. That's the directory at `path` and
+// everything we watch below it (which is what `MustScanSubDirs` means), plus
+// its parent, since the directory itself may have come or gone.
+void FSEventsFileWatcher::queueRescans(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mapMutex);
+  for (const auto& pair : handlesToPaths) {
+    if (path.empty() || PathStartsWith(pair.second.str(), path)) {
+      pendingRescans.insert(pair.first);
+    }
+  }
+  efsw::WatchID parent = pathIndex.find(ParentPathView(path));
+  if (parent != 0) pendingRescans.insert(parent);
+}
+
+// Private: compares a watched directory's current listing to the one we
+// cached and reports the differences as child events. A watch without a
+// listing just hears that it lost track.
+//
+// An entry that disappeared under one name and appeared under another with
+// the same inode was renamed. A file whose inode or modification time changed
+// was modified; a directory's modification time only says that something
+// inside it changed, which its own watcher (if any) reports.
+void FSEventsFileWatcher::rescanDirectory(efsw::WatchID handle) {
+  std::string dir;
+  bool snapshotted;
   {
-    std::unique_lock<std::mutex> lock(processingMutex);
-    if (isProcessing) return;
-    isProcessing = true;
+    std::lock_guard<std::mutex> lock(mapMutex);
+    auto it = handlesToPaths.find(handle);
+    if (it == handlesToPaths.end()) return;
+    dir = it->second.str();
+    snapshotted = handlesToSnapshots.count(handle) != 0;
+  }
+  if (!snapshotted) {
+    sendFileAction(handle, dir, "", efsw::Actions::Overflow);
+    return;
   }
 
-  ProcessingGuard guard(*this);
+  // If the directory itself is gone, everything in it is too.
+  DirSnapshot current;
+  readDirSnapshot(dir, current);
 
-  std::set<std::string> dirsCopy;
+  DirSnapshot previous;
   {
-    dirsCopy = dirsChanged;
-    dirsChanged.clear();
+    std::lock_guard<std::mutex> lock(mapMutex);
+    auto it = handlesToSnapshots.find(handle);
+    if (it == handlesToSnapshots.end()) return;
+    previous.swap(it->second);
+    it->second = current;
   }
 
+  std::string childDir = NormalizePath(dir);
+
+  // Entries that are gone, by inode, so that we can spot renames.
+  std::unordered_map<ino_t, std::string> removed;
+  for (const auto& pair : previous) {
+    if (current.find(pair.first) == current.end()) {
+      removed[pair.second.inode] = pair.first;
+    }
+  }
+
+  for (const auto& pair : current) {
+    if (pendingDestruction) return;
+    auto old = previous.find(pair.first);
+    if (old == previous.end()) {
+      auto renamed = removed.find(pair.second.inode);
+      if (renamed != removed.end()) {
+        sendFileAction(
+          handle, childDir, pair.first, efsw::Actions::Moved, renamed->second
+        );
+        removed.erase(renamed);
+      } else {
+        sendFileAction(handle, childDir, pair.first, efsw::Actions::Add);
+      }
+    } else if (old->second.inode != pair.second.inode || (
+      !pair.second.isDirectory &&
+      !SameTime(old->second.mtime, pair.second.mtime)
+    )) {
+      sendFileAction(handle, childDir, pair.first, efsw::Actions::Modified);
+    }
+  }
+
+  for (const auto& pair : removed) {
+    if (pendingDestruction) return;
+    sendFileAction(handle, childDir, pair.second, efsw::Actions::Delete);
+  }
+}
+
+// Runs on a shard's queue, which `FSEventsFileWatcher`'s destructor waits on,
+// so we can't be destroyed while this is happening. Rescans may have been
+// asked for by any shard's events; whichever shard gets here first does them.
+void FSEventsFileWatcher::process(Shard& shard) {
+  if (!isValid || pendingDestruction) return;
+
+  std::set<efsw::WatchID> rescans;
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    rescans.swap(pendingRescans);
+  }
+
+  for (auto handle : rescans) {
+    if (pendingDestruction) return;
+    rescanDirectory(handle);
+  }
+
+  std::set<std::string> dirsCopy;
+  dirsCopy.swap(shard.dirsChanged);
+
   // Process the copied directories.
   for (const auto& dir : dirsCopy) {
     if (pendingDestruction) return;
 
     efsw::WatchID handle;
-    std::string path;
 
     {
       std::lock_guard<std::mutex> lock(mapMutex);
-      auto itpth = pathsToHandles.find(PathWithoutFileName(dir, false));
-      if (itpth == pathsToHandles.end()) continue;
-      path = itpth->first;
-      handle = itpth->second;
+      handle = pathIndex.find(ParentPathView(dir));
+      if (handle == 0 || !shard.handles.count(handle)) continue;
     }
 
     // TODO: It is questionable whether these file events are useful or
@@ -604,18 +1165,21 @@ void FSEventsFileWatcher::process() {
   }
 }
 
-// Start a new FSEvent stream and promote it to the “active” stream after it
-// starts.
-bool FSEventsFileWatcher::startNewStream() {
-  // Build a list of all current watched paths. We'll eventually pass this to
+// Start a new FSEvent stream for a shard and promote it to the shard's
+// “active” stream after it starts. Callers must hold `streamMutex`.
+bool FSEventsFileWatcher::startNewStream(
+  Shard& shard,
+  FSEventStreamEventId sinceWhen
+) {
+  // Build a list of the shard's watched paths. We'll eventually pass this to
   // `FSEventStreamCreate`.
   std::vector<CFStringRef> cfStrings;
   {
     std::lock_guard<std::mutex> lock(mapMutex);
-    for (const auto& pair : handlesToPaths) {
+    for (auto handle : shard.handles) {
       CFStringRef cfStr = CFStringCreateWithCString(
         kCFAllocatorDefault,
-        pair.second.c_str(),
+        handlesToPaths[handle].str().c_str(),
         kCFStringEncodingUTF8
       );
       if (cfStr) {
@@ -623,6 +1187,11 @@ bool FSEventsFileWatcher::startNewStream() {
       }
     }
   }
+  if (cfStrings.empty()) {
+    // Everything it had was removed while a rebuild was on its way.
+    stopCurrentStream(shard);
+    return true;
+  }
 
   CFArrayRef paths = CFArrayCreate(
     NULL,
@@ -634,35 +1203,34 @@ bool FSEventsFileWatcher::startNewStream() {
   uint32_t streamFlags = kFSEventStreamCreateFlagNone;
 
   streamFlags = kFSEventStreamCreateFlagFileEvents |
-    kFSEventStreamCreateFlagNoDefer |
     kFSEventStreamCreateFlagUseExtendedData |
     kFSEventStreamCreateFlagUseCFTypes;
+  if (streamNoDefer) {
+    streamFlags |= kFSEventStreamCreateFlagNoDefer;
+  }
 
   FSEventStreamContext ctx;
   ctx.version = 0;
-  ctx.info = this;
+  ctx.info = &shard;
   ctx.retain = NULL;
   ctx.release = NULL;
   ctx.copyDescription = NULL;
 
-  dispatch_queue_t queue = dispatch_queue_create(NULL, NULL);
-
-  nextEventStream = FSEventStreamCreate(
+  shard.nextEventStream = FSEventStreamCreate(
     kCFAllocatorDefault,
     &FSEventsFileWatcher::FSEventCallback,
     &ctx,
     paths,
-    kFSEventStreamEventIdSinceNow,
-    0.,
+    sinceWhen,
+    streamLatency,
     streamFlags
   );
 
-  FSEventStreamSetDispatchQueue(nextEventStream, queue);
-  // The stream now holds its own retain on the queue; release ours so the
-  // queue is freed when the stream is eventually torn down.
-  dispatch_release(queue);
+  // The old stream delivers to the same queue until it stops, so the shard's
+  // events are never handled two at a time.
+  FSEventStreamSetDispatchQueue(shard.nextEventStream, shard.queue);
 
-  bool didStart = FSEventStreamStart(nextEventStream);
+  bool didStart = FSEventStreamStart(shard.nextEventStream);
 
   // Release all the strings we just created.
   for (CFStringRef str : cfStrings) {
@@ -673,20 +1241,16 @@ bool FSEventsFileWatcher::startNewStream() {
   // If it started successfully, we can swap it into place as the new main
   // stream.
   if (didStart) {
-    if (currentEventStream) {
-      FSEventStreamStop(currentEventStream);
-      FSEventStreamInvalidate(currentEventStream);
-      FSEventStreamRelease(currentEventStream);
-    }
-    currentEventStream = nextEventStream;
-    nextEventStream = nullptr;
+    stopCurrentStream(shard);
+    shard.currentEventStream = shard.nextEventStream;
+    shard.nextEventStream = nullptr;
   } else {
     // The stream was created but never started. The Stop→Invalidate→Release
     // sequence is only valid for started streams; for an un-started one, just
     // unschedule it from the dispatch queue (passing NULL) and release it.
-    FSEventStreamSetDispatchQueue(nextEventStream, NULL);
-    FSEventStreamRelease(nextEventStream);
-    nextEventStream = nullptr;
+    FSEventStreamSetDispatchQueue(shard.nextEventStream, NULL);
+    FSEventStreamRelease(shard.nextEventStream);
+    shard.nextEventStream = nullptr;
   }
 
   return didStart;
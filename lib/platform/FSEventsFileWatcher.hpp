@@ -1,13 +1,22 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <set>
 #include <vector>
 #include <mutex>
+#include <sys/stat.h>
+#include <dispatch/dispatch.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreServices/CoreServices.h>
+#include "../../vendor/efsw/include/efsw/InternedPath.hpp"
 #include "../../vendor/efsw/include/efsw/efsw.hpp"
+#include "../../vendor/efsw/include/efsw/MemoryCost.hpp"
+#include "PathTrie.hpp"
 
 class FSEvent {
 public:
@@ -26,18 +35,108 @@ public:
 
 class FSEventsFileWatcher {
 public:
-  FSEventsFileWatcher() {};
+  FSEventsFileWatcher();
   ~FSEventsFileWatcher();
+  // When `sinceWhen` is nonzero, the new watcher also receives every event
+  // for its path since that event ID (as returned by `getLastEventId`, perhaps
+  // in a previous session).
+  //
+  // When FSEvents drops or coalesces events, a watch added with `resync`
+  // lists its directory again and reports the differences as ordinary
+  // events. That means listing it up front and a `stat` per event to keep
+  // the listing current, so other watches get an `Overflow` instead.
   efsw::WatchID addWatch(
     const std::string& directory,
     efsw::FileWatchListener* watcher,
-    bool _useRecursion = false
+    bool _useRecursion = false,
+    FSEventStreamEventId sinceWhen = 0,
+    bool resync = false
   );
   void removeWatch(
     efsw::WatchID watchID
   );
 
-  void handleActions(std::vector<FSEvent>& events);
+  // Bulk versions of the above. These rebuild the stream once for the whole
+  // set of paths rather than once per path.
+  std::vector<efsw::WatchID> addWatches(
+    const std::vector<std::string>& directories,
+    efsw::FileWatchListener* watcher,
+    bool _useRecursion = false,
+    FSEventStreamEventId sinceWhen = 0,
+    bool resync = false
+  );
+  void removeWatches(
+    const std::vector<efsw::WatchID>& watchIDs
+  );
+
+  // The ID of the newest event we've seen, or the system's current event ID
+  // if we haven't seen any. Save this and pass it to `addWatch` later to pick
+  // up where this watcher left off.
+  FSEventStreamEventId getLastEventId();
+
+  // Sets the latency (in seconds) and defer mode of the streams, rebuilding
+  // any that are already running. A latency of `0` with `noDefer` is the most
+  // responsive; higher latencies let `fseventsd` coalesce bursts of events
+  // at the cost of waking us less promptly.
+  void setStreamOptions(double latency, bool noDefer);
+
+  // Adds up what our maps and snapshots hold. The only things the system
+  // keeps for us are the streams, which don't cost file descriptors; the
+  // directories changed since the last `process` aren't counted, since only
+  // a shard's own queue may look at them.
+  efsw::MemoryUsage memoryUsage();
+
+  bool isValid = true;
+
+private:
+  // The watched directories are split between several streams, so that
+  // adding or removing one only rebuilds the stream it belongs to, and a busy
+  // tree's events don't hold up everybody else's. A shard has the
+  // directories on one volume that share the first few components of their
+  // paths (see `ShardKeyForPath`), and a serial queue of its own that every
+  // stream it has over time delivers to, so its events are handled in order
+  // while other shards' are handled alongside them.
+  struct Shard {
+    FSEventsFileWatcher* watcher;
+    dispatch_queue_t queue = nullptr;
+    // Fires on `rebuildQueue` for a deferred rebuild.
+    dispatch_source_t rebuildTimer = nullptr;
+
+    // Guarded by `mapMutex`.
+    std::unordered_set<efsw::WatchID> handles;
+
+    // Guarded by `streamMutex`, as are the stream fields below.
+    //
+    // The running stream, and one we create when the shard's list of paths
+    // changes; it becomes `currentEventStream` once it starts.
+    FSEventStreamRef currentEventStream = nullptr;
+    FSEventStreamRef nextEventStream = nullptr;
+
+    // Stream rebuilds are debounced. The first rebuild after a quiet period
+    // happens right away; any more requested within `rebuildDelay` of it are
+    // folded into a single rebuild at the end of that window.
+    std::chrono::steady_clock::time_point lastRebuild;
+    bool rebuildScheduled = false;
+
+    // A deferred rebuild asks FSEvents to replay everything since the first
+    // change it was deferring, so that paths added in the meantime don't
+    // miss anything. Paths that were already being watched will see some of
+    // those events twice, so we drop replayed events (those with IDs at or
+    // below `replayCutoff`) unless they belong to one of `replayHandles`.
+    // The last two are guarded by `mapMutex`, since events look at them.
+    FSEventStreamEventId pendingSinceId = 0;
+    std::unordered_set<efsw::WatchID> pendingReplayHandles;
+    std::unordered_set<efsw::WatchID> replayHandles;
+    uint64_t replayCutoff = 0;
+
+    // The newest event this shard's streams have delivered.
+    std::atomic<uint64_t> lastEventId{0};
+
+    // Only touched on `queue`.
+    std::set<std::string> dirsChanged;
+  };
+
+  void handleActions(Shard& shard, std::vector<FSEvent>& events);
   void sendFileAction(
     efsw::WatchID watchid,
     const std::string& dir,
@@ -63,43 +162,96 @@ public:
 		std::string& filePath
   );
 
-  void process();
+  void process(Shard& shard);
 
-  bool isValid = true;
+  // What became of a request to rebuild the stream.
+  enum class RebuildResult {
+    // The stream was rebuilt right away and started successfully.
+    Started,
+    // The stream was rebuilt right away and failed to start.
+    Failed,
+    // The stream will be rebuilt shortly, along with any other changes that
+    // arrive in the meantime.
+    Deferred
+  };
 
-private:
-  // RAII guard to ensure we un-mark our “processing” flag if we're destroyed
-  // during processing.
-  class ProcessingGuard {
-    FSEventsFileWatcher& watcher;
-  public:
-    ProcessingGuard(FSEventsFileWatcher& w) : watcher(w) {}
-    ~ProcessingGuard() {
-      std::unique_lock<std::mutex> lock(watcher.processingMutex);
-      watcher.isProcessing = false;
-      watcher.processingComplete.notify_all();
-    }
+  // What we remember about each entry of a watched directory, so that a
+  // rescan can tell exactly what changed since we last looked.
+  struct DirEntryInfo {
+    ino_t inode;
+    struct timespec mtime;
+    bool isDirectory;
   };
+  typedef std::unordered_map<std::string, DirEntryInfo> DirSnapshot;
 
-  size_t removeHandle(efsw::WatchID handle);
-  bool startNewStream();
+  static bool readDirSnapshot(const std::string& path, DirSnapshot& snapshot);
+  void updateSnapshot(const std::string& path);
+  void queueRescans(const std::string& path);
+  void rescanDirectory(efsw::WatchID handle);
+
+  Shard* removeHandle(efsw::WatchID handle);
+  efsw::WatchID addHandle(
+    const std::string& watchDir,
+    efsw::FileWatchListener* listener,
+    DirSnapshot snapshot,
+    bool resync,
+    FSEventStreamEventId startId,
+    Shard* shard
+  );
+  Shard* shardForPath(const std::string& watchDir);
+  RebuildResult requestStreamRebuild(
+    Shard& shard,
+    const std::vector<efsw::WatchID>& addedHandles,
+    FSEventStreamEventId resumeFrom = 0
+  );
+  static void rebuildTimerFired(void* context);
+  void rebuildDeferredStream(Shard& shard);
+  void stopCurrentStream(Shard& shard);
+  bool startNewStream(
+    Shard& shard,
+    FSEventStreamEventId sinceWhen = kFSEventStreamEventIdSinceNow
+  );
+  bool isDuplicateReplay(
+    const Shard& shard,
+    efsw::WatchID handle,
+    uint64_t eventId
+  );
+  bool predatesWatch(efsw::WatchID handle, uint64_t eventId);
 
   long nextHandleID = 1;
-  std::atomic<bool> isProcessing{false};
   std::atomic<bool> pendingDestruction{false};
-  std::mutex processingMutex;
   std::mutex mapMutex;
-  std::condition_variable processingComplete;
 
-  // The running event stream that subscribes to all the paths we care about.
-  FSEventStreamRef currentEventStream = nullptr;
-  // An event stream that we create when our list of paths changes; it will
-  // become the `currentEventStream` after it starts.
-  FSEventStreamRef nextEventStream = nullptr;
+  // Watched directories that FSEvents has told us to rescan, either because
+  // it coalesced changes below them (`MustScanSubDirs`) or because it dropped
+  // events. Guarded by `mapMutex`.
+  std::set<efsw::WatchID> pendingRescans;
+
+  // `streamMutex` guards these, the list of shards, and every shard's
+  // streams, since rebuilds can happen on `rebuildQueue`. Shards aren't
+  // freed until we are, so a pointer to one stays good.
+  std::mutex streamMutex;
+  double streamLatency = 0.;
+  bool streamNoDefer = true;
+  std::unordered_map<std::string, std::unique_ptr<Shard>> shards;
+  dispatch_queue_t rebuildQueue = nullptr;
+  std::chrono::milliseconds rebuildDelay{10};
 
-  std::set<std::string> dirsChanged;
+  // The newest event any stream has delivered.
+  std::atomic<uint64_t> lastEventId{0};
 
-  std::unordered_map<efsw::WatchID, std::string> handlesToPaths;
-  std::unordered_map<std::string, efsw::WatchID> pathsToHandles;
+  std::unordered_map<efsw::WatchID, efsw::InternedPath> handlesToPaths;
+  PathTrie pathIndex;
   std::unordered_map<efsw::WatchID, efsw::FileWatchListener*> handlesToListeners;
+  // The shard each watch's directory is in. Guarded by `mapMutex`.
+  std::unordered_map<efsw::WatchID, Shard*> handlesToShards;
+  // The last listing we saw of each directory watched with `resync`, kept
+  // current as ordinary events come in. Guarded by `mapMutex`.
+  std::unordered_map<efsw::WatchID, DirSnapshot> handlesToSnapshots;
+  // How many entries that has, so that events can skip the `stat` and the
+  // lock when no watch resyncs.
+  std::atomic<size_t> snapshotCount{0};
+  // The latest event ID as of each watch's creation; see `predatesWatch`.
+  // Guarded by `mapMutex`.
+  std::unordered_map<efsw::WatchID, uint64_t> handlesToStartIds;
 };
@@ -1,5 +1,8 @@
 #include "KqueueFileWatcher.hpp"
+#include "../../vendor/efsw/include/efsw/Probes.hpp"
 
+#include <algorithm>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
@@ -36,6 +39,17 @@ static std::pair<std::string, std::string> SplitPath(const std::string &path) {
   return {p.substr(0, pos + 1), p.substr(pos + 1)};
 }
 
+static bool SameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// macOS spells `st_mtim` differently.
+#ifdef __APPLE__
+#define KQ_MTIME(st) ((st).st_mtimespec)
+#else
+#define KQ_MTIME(st) ((st).st_mtim)
+#endif
+
 // Raise the process soft fd limit to the hard limit. On macOS the hard limit
 // for unprivileged processes is KERN_MAXFILESPERPROC (10240 by default), which
 // is sufficient headroom for any realistic editor workload. This is a
@@ -49,8 +63,19 @@ static void RaiseFdLimit() {
   }
 }
 
-KqueueFileWatcher::KqueueFileWatcher() {
+// Unless told otherwise, let watches use up to half of the fds we're allowed,
+// leaving the rest for everything else the process does.
+static size_t DefaultFdBudget() {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+    return 4096;
+  return std::max<size_t>(static_cast<size_t>(rl.rlim_cur) / 2, 64);
+}
+
+KqueueFileWatcher::KqueueFileWatcher(efsw::WatchID firstHandle)
+    : nextHandleID(firstHandle) {
   RaiseFdLimit();
+  fdBudget = DefaultFdBudget();
 
   kqueueFd = kqueue();
   if (kqueueFd == -1) {
@@ -85,6 +110,10 @@ KqueueFileWatcher::~KqueueFileWatcher() {
     eventThread.join();
   }
 
+  // Closing the queue first drops every registration in one go, so closing
+  // each watched descriptor afterward has nothing left to detach.
+  close(kqueueFd);
+
   {
     std::lock_guard<std::mutex> lock(mapMutex);
     for (auto &pair : handlesToFds) {
@@ -96,7 +125,19 @@ KqueueFileWatcher::~KqueueFileWatcher() {
 
   close(wakeupPipe[0]);
   close(wakeupPipe[1]);
-  close(kqueueFd);
+}
+
+// Translates an `open` or `stat` failure into the error efsw would report.
+static efsw::WatchID ErrorForErrno(int err) {
+  switch (err) {
+  case ENOENT:
+    return efsw::Errors::FileNotFound;
+  case EACCES:
+  case EPERM:
+    return efsw::Errors::FileNotReadable;
+  default:
+    return efsw::Errors::WatcherFailed;
+  }
 }
 
 efsw::WatchID KqueueFileWatcher::addWatch(const std::string &path,
@@ -107,43 +148,71 @@ efsw::WatchID KqueueFileWatcher::addWatch(const std::string &path,
     return efsw::Errors::WatcherFailed;
   }
 
-  int fd = open(path.c_str(), O_EVTONLY);
-  if (fd < 0) {
-    switch (errno) {
-    case ENOENT:
-      return efsw::Errors::FileNotFound;
-    case EACCES:
-    case EPERM:
-      return efsw::Errors::FileNotReadable;
-    default:
-      return efsw::Errors::WatcherFailed;
+  // If we're at our fd budget, make room by demoting the coldest watch. If
+  // there's nothing to demote (or the process is out of fds regardless), this
+  // watch starts out polled.
+  bool haveRoom;
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    haveRoom = handlesToFds.size() < fdBudget || evictLeastActive();
+  }
+  wakeIfPending();
+
+  int fd = -1;
+  if (haveRoom) {
+    fd = open(path.c_str(), O_EVTONLY);
+    if (fd < 0 && errno != EMFILE && errno != ENFILE) {
+      return ErrorForErrno(errno);
     }
   }
 
+  struct stat st;
+  if ((fd >= 0 ? fstat(fd, &st) : stat(path.c_str(), &st)) != 0) {
+    int err = errno;
+    if (fd >= 0)
+      close(fd);
+    return ErrorForErrno(err);
+  }
+
+  // For a directory, take a listing now so that we have something to diff
+  // against when it changes.
+  bool isDirectory = S_ISDIR(st.st_mode);
+  DirSnapshot snapshot;
+  if (isDirectory && !readDirSnapshot(path, snapshot)) {
+    if (fd >= 0)
+      close(fd);
+    return efsw::Errors::FileNotReadable;
+  }
+
   efsw::WatchID handle;
   {
     std::lock_guard<std::mutex> lock(mapMutex);
     handle = nextHandleID++;
-    handlesToFds[handle] = fd;
-    fdsToHandles[fd] = handle;
-    handlesToPaths[handle] = path;
+    handlesToPaths[handle] = efsw::InternedPath(path);
     handlesToListeners[handle] = listener;
+    handlesToInodes[handle] = st.st_ino;
+    if (isDirectory) {
+      handlesToSnapshots[handle] = std::move(snapshot);
+    }
+    if (fd >= 0) {
+      handlesToFds[handle] = fd;
+      fdsToHandles[fd] = handle;
+      markActive(handle);
+    } else {
+      startPolling(handle);
+    }
   }
+  wakeIfPending();
 
-  // Store the handle in udata so the event loop can identify the watch even if
-  // the fd has been reused (the handle will no longer be in handlesToPaths, so
-  // the event will be safely ignored).
-  struct kevent ev;
-  int fflags = NOTE_WRITE | NOTE_DELETE | NOTE_RENAME | NOTE_ATTRIB;
-  EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR, fflags, 0,
-         reinterpret_cast<void *>(static_cast<intptr_t>(handle)));
-
-  if (kevent(kqueueFd, &ev, 1, nullptr, 0, nullptr) == -1) {
+  if (fd >= 0 && !registerFd(handle, fd)) {
     std::lock_guard<std::mutex> lock(mapMutex);
     handlesToFds.erase(handle);
     fdsToHandles.erase(fd);
     handlesToPaths.erase(handle);
     handlesToListeners.erase(handle);
+    handlesToSnapshots.erase(handle);
+    handlesToInodes.erase(handle);
+    forgetActivity(handle);
     close(fd);
     return efsw::Errors::WatcherFailed;
   }
@@ -151,6 +220,18 @@ efsw::WatchID KqueueFileWatcher::addWatch(const std::string &path,
   return handle;
 }
 
+// Adds an fd's `EVFILT_VNODE` filter to the kqueue.
+bool KqueueFileWatcher::registerFd(efsw::WatchID handle, int fd) {
+  // Store the handle in udata so the event loop can identify the watch even if
+  // the fd has been reused (the handle will no longer be in handlesToPaths, so
+  // the event will be safely ignored).
+  struct kevent ev;
+  int fflags = NOTE_WRITE | NOTE_DELETE | NOTE_RENAME | NOTE_ATTRIB;
+  EV_SET(&ev, fd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR, fflags, 0,
+         reinterpret_cast<void *>(static_cast<intptr_t>(handle)));
+  return kevent(kqueueFd, &ev, 1, nullptr, 0, nullptr) != -1;
+}
+
 void KqueueFileWatcher::removeWatch(efsw::WatchID handle) {
   int fd = -1;
   {
@@ -165,6 +246,10 @@ void KqueueFileWatcher::removeWatch(efsw::WatchID handle) {
     // (e.g. after NOTE_RENAME/NOTE_DELETE) but left the handle in place.
     handlesToPaths.erase(handle);
     handlesToListeners.erase(handle);
+    handlesToSnapshots.erase(handle);
+    handlesToInodes.erase(handle);
+    polledWatches.erase(handle);
+    forgetActivity(handle);
   }
   // Closing the fd automatically removes its EVFILT_VNODE filter from the
   // kqueue.
@@ -172,20 +257,32 @@ void KqueueFileWatcher::removeWatch(efsw::WatchID handle) {
     close(fd);
 }
 
-void KqueueFileWatcher::sendFileAction(efsw::WatchID handle,
+std::vector<efsw::WatchID>
+KqueueFileWatcher::addWatches(const std::vector<std::string> &paths,
+                              efsw::FileWatchListener *listener,
+                              bool useRecursion) {
+  std::vector<efsw::WatchID> handles;
+  handles.reserve(paths.size());
+  for (const auto &path : paths) {
+    handles.push_back(addWatch(path, listener, useRecursion));
+  }
+  return handles;
+}
+
+void KqueueFileWatcher::removeWatches(
+    const std::vector<efsw::WatchID> &handles) {
+  for (auto handle : handles) {
+    removeWatch(handle);
+  }
+}
+
+void KqueueFileWatcher::sendFileAction(const VnodeEvent &event,
                                        const std::string &dir,
                                        const std::string &filename,
                                        efsw::Action action,
                                        const std::string &oldFilename) {
-  efsw::FileWatchListener *listener = nullptr;
-  {
-    std::lock_guard<std::mutex> lock(mapMutex);
-    auto it = handlesToListeners.find(handle);
-    if (it == handlesToListeners.end())
-      return;
-    listener = it->second;
-  }
-  listener->handleFileAction(handle, dir, filename, action, oldFilename);
+  event.listener->handleFileAction(event.handle, dir, filename, action,
+                                   oldFilename);
 }
 
 void KqueueFileWatcher::closeFd(efsw::WatchID handle, int fd) {
@@ -193,31 +290,44 @@ void KqueueFileWatcher::closeFd(efsw::WatchID handle, int fd) {
     std::lock_guard<std::mutex> lock(mapMutex);
     handlesToFds.erase(handle);
     fdsToHandles.erase(fd);
+    forgetActivity(handle);
   }
   close(fd);
 }
 
-bool KqueueFileWatcher::reopenFd(efsw::WatchID handle,
-                                 const std::string &path) {
+bool KqueueFileWatcher::adoptReplacement(efsw::WatchID handle,
+                                         const std::string &path,
+                                         bool keepSameInode) {
+  // Opening first and asking the fd about itself saves a separate `stat`.
   int newFd = open(path.c_str(), O_EVTONLY);
   if (newFd < 0)
     return false;
+  struct stat st;
+  if (fstat(newFd, &st) != 0) {
+    close(newFd);
+    return false;
+  }
 
   {
     std::lock_guard<std::mutex> lock(mapMutex);
+    auto inode = handlesToInodes.find(handle);
+    if (!keepSameInode && inode != handlesToInodes.end() &&
+        inode->second == st.st_ino) {
+      // Same file as before; nothing was replaced.
+      close(newFd);
+      return false;
+    }
     handlesToFds[handle] = newFd;
     fdsToHandles[newFd] = handle;
+    handlesToInodes[handle] = st.st_ino;
+    markActive(handle);
   }
 
-  struct kevent ev;
-  int fflags = NOTE_WRITE | NOTE_DELETE | NOTE_RENAME | NOTE_ATTRIB;
-  EV_SET(&ev, newFd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR, fflags, 0,
-         reinterpret_cast<void *>(static_cast<intptr_t>(handle)));
-
-  if (kevent(kqueueFd, &ev, 1, nullptr, 0, nullptr) == -1) {
+  if (!registerFd(handle, newFd)) {
     std::lock_guard<std::mutex> lock(mapMutex);
     handlesToFds.erase(handle);
     fdsToHandles.erase(newFd);
+    forgetActivity(handle);
     close(newFd);
     return false;
   }
@@ -225,96 +335,503 @@ bool KqueueFileWatcher::reopenFd(efsw::WatchID handle,
   return true;
 }
 
+// How many events we harvest from the kqueue per `kevent` call. A save-all in
+// an editor can touch hundreds of files at once; this lets us pick them up
+// in a few syscalls rather than one per file.
+static const int kEventBatchSize = 256;
+
 void KqueueFileWatcher::eventLoop() {
+  struct kevent events[kEventBatchSize];
+  std::vector<VnodeEvent> batch;
+  batch.reserve(kEventBatchSize);
+
   while (!stopping) {
-    struct kevent event;
+    // While any watches are being polled, wake up in time to poll them.
+    struct timespec timeout;
+    struct timespec *timeoutPtr = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mapMutex);
+      if (!polledWatches.empty()) {
+        auto wait = std::max(nextPoll - std::chrono::steady_clock::now(),
+                             std::chrono::steady_clock::duration::zero());
+        auto ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count();
+        timeout.tv_sec = static_cast<time_t>(ns / 1000000000);
+        timeout.tv_nsec = static_cast<long>(ns % 1000000000);
+        timeoutPtr = &timeout;
+      }
+    }
+
     int r;
     do {
-      r = kevent(kqueueFd, nullptr, 0, &event, 1, nullptr);
+      r = kevent(kqueueFd, nullptr, 0, events, kEventBatchSize, timeoutPtr);
     } while (r == -1 && errno == EINTR);
 
-    if (r <= 0 || stopping)
+    if (r < 0 || stopping)
       break;
+    efPROBE(read, kqueueFd, r);
 
-    // Wakeup pipe: destructor is signalling us to exit.
-    if (static_cast<int>(event.ident) == wakeupPipe[0])
-      break;
+    // Resolve the whole harvest under one lock.
+    bool wakeup = false;
+    batch.clear();
+    {
+      std::lock_guard<std::mutex> lock(mapMutex);
+      for (int i = 0; i < r; i++) {
+        const struct kevent &event = events[i];
+
+        // Wakeup pipe: either the destructor is signalling us to exit, or
+        // polling has started and we need to stop blocking indefinitely.
+        if (static_cast<int>(event.ident) == wakeupPipe[0]) {
+          wakeup = true;
+          continue;
+        }
 
-    int fd = static_cast<int>(event.ident);
+        // Recover the handle from the udata we stored at registration time.
+        // This avoids a map lookup on the fd, which could be stale if the fd
+        // was closed and its number reused by the OS.
+        efsw::WatchID handle =
+            static_cast<efsw::WatchID>(reinterpret_cast<intptr_t>(event.udata));
+
+        // Confirm the handle is still registered. If removeWatch() was called
+        // between the event being queued and us processing it, skip.
+        auto it = handlesToPaths.find(handle);
+        if (it == handlesToPaths.end())
+          continue;
+        auto itl = handlesToListeners.find(handle);
+        if (itl == handlesToListeners.end())
+          continue;
+        if (handlesToFds.find(handle) != handlesToFds.end())
+          markActive(handle);
+
+        bool isDirectory =
+            handlesToSnapshots.find(handle) != handlesToSnapshots.end();
+        batch.push_back({handle, static_cast<int>(event.ident),
+                         static_cast<uint32_t>(event.fflags), it->second.str(),
+                         itl->second, isDirectory});
+      }
+    }
+    if (wakeup) {
+      if (stopping)
+        break;
+      char drain[64];
+      read(wakeupPipe[0], drain, sizeof(drain));
+    }
 
-    // Recover the handle from the udata we stored at registration time.
-    // This avoids a map lookup on the fd, which could be stale if the fd
-    // was closed and its number reused by the OS.
-    efsw::WatchID handle =
-        static_cast<efsw::WatchID>(reinterpret_cast<intptr_t>(event.udata));
+    for (const VnodeEvent &event : batch) {
+      if (stopping)
+        return;
+      handleEvent(event);
+    }
 
-    // Confirm the handle is still registered. If removeWatch() was called
-    // between the event being queued and us processing it, skip.
-    std::string watchedPath;
+    bool pollDue;
     {
       std::lock_guard<std::mutex> lock(mapMutex);
-      auto it = handlesToPaths.find(handle);
-      if (it == handlesToPaths.end())
-        continue;
-      watchedPath = it->second;
+      pollDue = !polledWatches.empty() &&
+                std::chrono::steady_clock::now() >= nextPoll;
+    }
+    if (pollDue) {
+      pollWatches();
+      std::lock_guard<std::mutex> lock(mapMutex);
+      nextPoll = std::chrono::steady_clock::now() + pollInterval;
     }
+  }
+}
 
-    std::pair<std::string, std::string> parts = SplitPath(watchedPath);
-    const std::string &dir = parts.first;
-    const std::string &filename = parts.second;
-
-    if (event.fflags & NOTE_RENAME) {
-      // The inode we were watching has been renamed. F_GETPATH returns its
-      // current (new) path. We must call it before closing the fd.
-      char newPathBuf[MAXPATHLEN] = {0};
-      bool gotPath = (fcntl(fd, F_GETPATH, newPathBuf) == 0);
-      std::string newPath(newPathBuf);
-
-      closeFd(handle, fd);
-
-      if (gotPath && !newPath.empty() && newPath != watchedPath) {
-        // The file moved to a genuinely different path. Report a move, using
-        // the old basename as context. The handle is now effectively without
-        // an active fd; the caller should removeWatch() and addWatch() again
-        // at the new path if it wants to keep following it.
-        std::pair<std::string, std::string> newParts = SplitPath(newPath);
-        if (parts.first != newParts.first) {
-          // Treat moves outside of the directory as deletions.
-          sendFileAction(handle, dir, filename, efsw::Actions::Delete);
-        } else {
-          sendFileAction(handle, newParts.first, newParts.second,
-                         efsw::Actions::Moved, filename);
-        }
+bool KqueueFileWatcher::ownsFd(efsw::WatchID handle, int fd) {
+  std::lock_guard<std::mutex> lock(mapMutex);
+  auto it = handlesToFds.find(handle);
+  return it != handlesToFds.end() && it->second == fd;
+}
+
+void KqueueFileWatcher::handleEvent(const VnodeEvent &event) {
+  int fd = event.fd;
+  const std::string &watchedPath = event.watchedPath;
+  std::pair<std::string, std::string> parts = SplitPath(watchedPath);
+  const std::string &dir = parts.first;
+  const std::string &filename = parts.second;
+
+  // Everything but a plain write touches the fd. Since this event was
+  // harvested, a removeWatch() may have closed that fd and the OS may have
+  // handed its number to someone else, so make sure it's still ours first.
+  if ((event.fflags & (NOTE_RENAME | NOTE_DELETE | NOTE_ATTRIB)) &&
+      !ownsFd(event.handle, fd))
+    return;
+
+  if (event.fflags & NOTE_RENAME) {
+    // The inode we were watching has been renamed. F_GETPATH returns its
+    // current (new) path. We must call it before closing the fd.
+    char newPathBuf[MAXPATHLEN] = {0};
+    bool gotPath = (fcntl(fd, F_GETPATH, newPathBuf) == 0);
+    std::string newPath(newPathBuf);
+
+    closeFd(event.handle, fd);
+
+    if (adoptReplacement(event.handle, watchedPath)) {
+      // Some editors save by renaming the original out of the way (to a
+      // backup, say) and writing a new file in its place. If a new file is
+      // already there, this was a change to the file we're watching, not a
+      // move; keep watching the path.
+      sendFileAction(event, dir, filename, efsw::Actions::Modified);
+    } else if (gotPath && !newPath.empty() && newPath != watchedPath) {
+      // The file moved to a genuinely different path. Report a move, using
+      // the old basename as context. The handle is now effectively without
+      // an active fd; the caller should removeWatch() and addWatch() again
+      // at the new path if it wants to keep following it.
+      std::pair<std::string, std::string> newParts = SplitPath(newPath);
+      if (parts.first != newParts.first) {
+        // Treat moves outside of the directory as deletions.
+        sendFileAction(event, dir, filename, efsw::Actions::Delete);
       } else {
-        // F_GETPATH failed or returned the same path — treat as a deletion.
-        sendFileAction(handle, dir, filename, efsw::Actions::Delete);
+        sendFileAction(event, newParts.first, newParts.second,
+                       efsw::Actions::Moved, filename);
       }
+    } else {
+      // F_GETPATH failed or returned the same path — treat as a deletion.
+      sendFileAction(event, dir, filename, efsw::Actions::Delete);
+    }
 
-    } else if (event.fflags & NOTE_DELETE) {
-      // The inode was deleted. This also fires when an atomic save replaces
-      // the file: rename(tmp, target) unlinks target's inode, then places
-      // tmp's inode at target's path. Because rename(2) is atomic, by the
-      // time kevent delivers NOTE_DELETE the new file is already in place.
-      closeFd(handle, fd);
-
-      struct stat st;
-      if (stat(watchedPath.c_str(), &st) == 0 &&
-          reopenFd(handle, watchedPath)) {
-        // A new file appeared at the same path: atomic save.
-        sendFileAction(handle, dir, filename, efsw::Actions::Modified);
+  } else if (event.fflags & NOTE_DELETE) {
+    // The inode was deleted. This also fires when an atomic save replaces
+    // the file: rename(tmp, target) unlinks target's inode, then places
+    // tmp's inode at target's path. Because rename(2) is atomic, by the
+    // time kevent delivers NOTE_DELETE the new file is already in place.
+    closeFd(event.handle, fd);
+
+    // NOTE_DELETE also fires when only one of the inode's links goes away.
+    // If the same inode is still at our path, it's still the file we were
+    // watching; reopen it and report a change, as for a replacement.
+    if (adoptReplacement(event.handle, watchedPath, true)) {
+      // A file is still at the path: an atomic save, or a surviving link.
+      sendFileAction(event, dir, filename, efsw::Actions::Modified);
+      // If it's a directory, its contents may be different, too.
+      if (event.isDirectory)
+        diffDirectory(event);
+    } else {
+      // The path is genuinely gone.
+      sendFileAction(event, dir, filename, efsw::Actions::Delete);
+    }
+
+  } else if (event.isDirectory) {
+    // A directory's own fd only hears about its entries being added, removed
+    // or renamed; work out which from its listing.
+    if (event.fflags & NOTE_WRITE)
+      diffDirectory(event);
+  } else if (event.fflags & NOTE_WRITE) {
+    sendFileAction(event, dir, filename, efsw::Actions::Modified);
+  } else if (event.fflags & NOTE_ATTRIB) {
+    // macOS sometimes skips NOTE_WRITE when a file is truncated to empty,
+    // firing NOTE_ATTRIB instead. Detect this by seeking to the end.
+    if (lseek(fd, 0, SEEK_END) == 0) {
+      sendFileAction(event, dir, filename, efsw::Actions::Modified);
+    }
+  }
+}
+
+// Lists a directory's entries (other than `.` and `..`) along with their
+// inodes and modification times. Doesn't follow symlinks.
+bool KqueueFileWatcher::readDirSnapshot(const std::string &path,
+                                        DirSnapshot &snapshot) {
+  DIR *dir = opendir(path.c_str());
+  if (!dir)
+    return false;
+  int dirFd = dirfd(dir);
+  snapshot.clear();
+  while (struct dirent *entry = readdir(dir)) {
+    const char *name = entry->d_name;
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+      continue;
+    struct stat st;
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+      continue; // Already gone again.
+    snapshot[name] = {st.st_ino, KQ_MTIME(st)};
+  }
+  closedir(dir);
+  return true;
+}
+
+// Compares a watched directory's current listing to the one we cached and
+// reports the differences as child events. Returns whether there were any.
+//
+// An entry that disappeared under one name and appeared under another with
+// the same inode was renamed. An entry whose inode changed was replaced (as
+// in an atomic save), which we report as a change, just as we do for a
+// watched file. So is an entry whose modification time changed.
+bool KqueueFileWatcher::diffDirectory(const VnodeEvent &event) {
+  DirSnapshot current;
+  if (!readDirSnapshot(event.watchedPath, current))
+    return false;
+
+  DirSnapshot previous;
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    auto it = handlesToSnapshots.find(event.handle);
+    if (it == handlesToSnapshots.end())
+      return false;
+    previous.swap(it->second);
+    it->second = current;
+  }
+
+  std::string childDir = event.watchedPath;
+  if (childDir.empty() || childDir.back() != '/')
+    childDir += '/';
+
+  bool changed = false;
+
+  // Entries that are gone, by inode, so that we can spot renames.
+  std::unordered_map<ino_t, std::string> removed;
+  for (const auto &pair : previous) {
+    if (current.find(pair.first) == current.end())
+      removed[pair.second.inode] = pair.first;
+  }
+
+  for (const auto &pair : current) {
+    auto old = previous.find(pair.first);
+    if (old == previous.end()) {
+      auto renamed = removed.find(pair.second.inode);
+      if (renamed != removed.end()) {
+        sendFileAction(event, childDir, pair.first, efsw::Actions::Moved,
+                       renamed->second);
+        removed.erase(renamed);
       } else {
-        // The path is genuinely gone.
-        sendFileAction(handle, dir, filename, efsw::Actions::Delete);
+        sendFileAction(event, childDir, pair.first, efsw::Actions::Add);
       }
+      changed = true;
+    } else if (old->second.inode != pair.second.inode ||
+               !SameTime(old->second.mtime, pair.second.mtime)) {
+      sendFileAction(event, childDir, pair.first, efsw::Actions::Modified);
+      changed = true;
+    }
+  }
+  changed = changed || !removed.empty();
 
-    } else if (event.fflags & NOTE_WRITE) {
-      sendFileAction(handle, dir, filename, efsw::Actions::Modified);
-    } else if (event.fflags & NOTE_ATTRIB) {
-      // macOS sometimes skips NOTE_WRITE when a file is truncated to empty,
-      // firing NOTE_ATTRIB instead. Detect this by seeking to the end.
-      if (lseek(fd, 0, SEEK_END) == 0) {
-        sendFileAction(handle, dir, filename, efsw::Actions::Modified);
+  for (const auto &pair : removed) {
+    sendFileAction(event, childDir, pair.second, efsw::Actions::Delete);
+  }
+  return changed;
+}
+
+// Wakes the event loop so that it notices a change in what it should be
+// waiting for.
+void KqueueFileWatcher::wake() {
+  char byte = 0;
+  write(wakeupPipe[1], &byte, 1);
+}
+
+void KqueueFileWatcher::wakeIfPending() {
+  if (wakePending.exchange(false))
+    wake();
+}
+
+void KqueueFileWatcher::markActive(efsw::WatchID handle) {
+  auto it = activityPositions.find(handle);
+  if (it != activityPositions.end()) {
+    activity.splice(activity.end(), activity, it->second);
+  } else {
+    activityPositions[handle] = activity.insert(activity.end(), handle);
+  }
+}
+
+void KqueueFileWatcher::forgetActivity(efsw::WatchID handle) {
+  auto it = activityPositions.find(handle);
+  if (it == activityPositions.end())
+    return;
+  activity.erase(it->second);
+  activityPositions.erase(it);
+}
+
+// Takes the fd away from the least recently active kqueue watch and polls it
+// instead. Returns `false` if there was nothing to take.
+bool KqueueFileWatcher::evictLeastActive() {
+  if (activity.empty())
+    return false;
+  efsw::WatchID victim = activity.front();
+  forgetActivity(victim);
+  auto it = handlesToFds.find(victim);
+  if (it != handlesToFds.end()) {
+    fdsToHandles.erase(it->second);
+    close(it->second);
+    handlesToFds.erase(it);
+  }
+  startPolling(victim);
+  evictions++;
+  return true;
+}
+
+void KqueueFileWatcher::startPolling(efsw::WatchID handle) {
+  auto path = handlesToPaths.find(handle);
+  if (path == handlesToPaths.end())
+    return;
+
+  PolledWatch state = {};
+  state.isDirectory =
+      handlesToSnapshots.find(handle) != handlesToSnapshots.end();
+  struct stat st;
+  if (stat(path->second.str().c_str(), &st) == 0) {
+    state.inode = st.st_ino;
+    state.mtime = KQ_MTIME(st);
+    state.size = st.st_size;
+  }
+
+  bool wasPolling = !polledWatches.empty();
+  polledWatches[handle] = state;
+  if (!wasPolling) {
+    nextPoll = std::chrono::steady_clock::now() + pollInterval;
+    wakePending = true;
+  }
+}
+
+// Checks each polled watch for changes, reporting them the way kqueue would
+// have. Runs on the event loop thread.
+void KqueueFileWatcher::pollWatches() {
+  std::vector<std::pair<VnodeEvent, PolledWatch>> due;
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    due.reserve(polledWatches.size());
+    for (const auto &pair : polledWatches) {
+      auto path = handlesToPaths.find(pair.first);
+      auto listener = handlesToListeners.find(pair.first);
+      if (path == handlesToPaths.end() ||
+          listener == handlesToListeners.end())
+        continue;
+      due.push_back({{pair.first, -1, 0, path->second.str(), listener->second,
+                      pair.second.isDirectory},
+                     pair.second});
+    }
+  }
+
+  for (const auto &item : due) {
+    if (stopping)
+      return;
+    const VnodeEvent &event = item.first;
+    const PolledWatch &before = item.second;
+    std::pair<std::string, std::string> parts = SplitPath(event.watchedPath);
+
+    struct stat st;
+    if (stat(event.watchedPath.c_str(), &st) != 0) {
+      // Gone. As with a kqueue watch whose file is deleted, the handle stays
+      // around until someone removes it, but there's nothing left to watch.
+      {
+        std::lock_guard<std::mutex> lock(mapMutex);
+        polledWatches.erase(event.handle);
+      }
+      sendFileAction(event, parts.first, parts.second, efsw::Actions::Delete);
+      continue;
+    }
+
+    bool changed;
+    if (event.isDirectory) {
+      changed = diffDirectory(event);
+    } else {
+      changed = st.st_ino != before.inode || st.st_size != before.size ||
+                !SameTime(KQ_MTIME(st), before.mtime);
+      if (changed) {
+        {
+          std::lock_guard<std::mutex> lock(mapMutex);
+          auto it = polledWatches.find(event.handle);
+          if (it != polledWatches.end()) {
+            it->second.inode = st.st_ino;
+            it->second.mtime = KQ_MTIME(st);
+            it->second.size = st.st_size;
+            handlesToInodes[event.handle] = st.st_ino;
+          }
+        }
+        sendFileAction(event, parts.first, parts.second,
+                       efsw::Actions::Modified);
       }
     }
+
+    // This watch is busy again, so it deserves a real fd.
+    if (changed)
+      promote(event.handle);
+  }
+}
+
+// Moves a polled watch back to kqueue, demoting the coldest kqueue watch if
+// we're at our budget.
+void KqueueFileWatcher::promote(efsw::WatchID handle) {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    auto it = handlesToPaths.find(handle);
+    if (it == handlesToPaths.end() ||
+        polledWatches.find(handle) == polledWatches.end())
+      return;
+    if (handlesToFds.size() >= fdBudget && !evictLeastActive())
+      return;
+    path = it->second.str();
+  }
+  wakeIfPending();
+
+  int fd = open(path.c_str(), O_EVTONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  bool haveStat = fstat(fd, &st) == 0;
+
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    if (polledWatches.erase(handle) == 0) {
+      // Removed while we weren't looking.
+      close(fd);
+      return;
+    }
+    if (haveStat)
+      handlesToInodes[handle] = st.st_ino;
+    handlesToFds[handle] = fd;
+    fdsToHandles[fd] = handle;
+    markActive(handle);
+    promotions++;
+  }
+
+  if (!registerFd(handle, fd)) {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    handlesToFds.erase(handle);
+    fdsToHandles.erase(fd);
+    forgetActivity(handle);
+    close(fd);
+    startPolling(handle);
+  }
+  wakeIfPending();
+}
+
+void KqueueFileWatcher::setFdBudget(size_t budget) {
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    fdBudget = budget > 0 ? budget : DefaultFdBudget();
+    while (handlesToFds.size() > fdBudget && evictLeastActive()) {
+    }
+  }
+  wakeIfPending();
+}
+
+KqueueFdStats KqueueFileWatcher::getFdStats() {
+  std::lock_guard<std::mutex> lock(mapMutex);
+  return {fdBudget, handlesToFds.size(), polledWatches.size(), evictions,
+          promotions};
+}
+
+efsw::MemoryUsage KqueueFileWatcher::memoryUsage() {
+  std::lock_guard<std::mutex> lock(mapMutex);
+  efsw::MemoryUsage usage;
+  usage.watchTableBytes += efsw::MemoryCost::hash(handlesToFds) +
+    efsw::MemoryCost::hash(fdsToHandles) +
+    efsw::MemoryCost::hash(handlesToPaths) +
+    efsw::MemoryCost::hash(handlesToListeners) +
+    efsw::MemoryCost::hash(handlesToSnapshots) +
+    efsw::MemoryCost::hash(handlesToInodes) +
+    efsw::MemoryCost::list(activity) +
+    efsw::MemoryCost::hash(activityPositions) +
+    efsw::MemoryCost::hash(polledWatches);
+  for (auto& entry : handlesToSnapshots) {
+    usage.watchTableBytes += efsw::MemoryCost::hash(entry.second);
+    for (auto& file : entry.second) {
+      usage.stringBytes += efsw::MemoryCost::string(file.first);
+    }
   }
+  usage.kernelWatches += handlesToFds.size();
+  usage.polledDirectories += polledWatches.size();
+  usage.fileDescriptors += handlesToFds.size() + (kqueueFd != -1) +
+    (wakeupPipe[0] != -1) + (wakeupPipe[1] != -1);
+  return usage;
 }
@@ -1,26 +1,54 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <list>
 #include <mutex>
 #include <thread>
 #include <string>
 #include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+#include <time.h>
+#include "../../vendor/efsw/include/efsw/InternedPath.hpp"
 #include "../../vendor/efsw/include/efsw/efsw.hpp"
+#include "../../vendor/efsw/include/efsw/MemoryCost.hpp"
 
-// An API-compatible replacement for FSEventsFileWatcher that uses kqueue
-// instead of FSEvents. Intended for experimentation; swap in via core.h.
+// How a watcher is keeping to its fd budget, as `getFdStats` reports it.
+struct KqueueFdStats {
+  size_t budget;
+  // Watches backed by a kqueue fd.
+  size_t kqueueWatches;
+  // Watches that have been demoted to polling.
+  size_t polledWatches;
+  size_t evictions;
+  size_t promotions;
+};
+
+// An API-compatible alternative to FSEventsFileWatcher that uses kqueue
+// instead of FSEvents. `MacFileWatcher` picks between the two for each watch.
 //
 // Key differences from FSEventsFileWatcher:
 // - No daemon dependency (no fseventsd); pure kernel interface.
-// - Consumes one file descriptor per watched path (using O_EVTONLY).
+// - Consumes one file descriptor per watched path (using O_EVTONLY). A
+//   watched directory costs one fd no matter how many children it has: when
+//   kqueue says it changed, we diff a cached listing of its entries to work
+//   out which children were created, deleted, renamed or replaced.
 // - Raises the process soft fd limit to the hard limit on construction.
+// - Keeps to an fd budget. When a new watch would exceed it, the least
+//   recently active watch gives up its fd and is polled every couple of
+//   seconds instead. A polled watch that sees a change is promoted back to
+//   kqueue (evicting another cold watch if need be).
 // - Watches inode identity, not path identity: when a file is renamed, the
 //   fd follows the inode. Atomic saves (which replace the inode) are detected
-//   via stat() after NOTE_DELETE and reported as Modified rather than Delete.
+//   by finding a different inode at the watched path after NOTE_DELETE or
+//   NOTE_RENAME, and are reported as Modified rather than Delete or Moved.
 // - No recursive watching; the _useRecursion flag is ignored.
 class KqueueFileWatcher {
 public:
-  KqueueFileWatcher();
+  // Handles count up from `firstHandle`, so that they can be told apart from
+  // another watcher's.
+  explicit KqueueFileWatcher(efsw::WatchID firstHandle = 1);
   ~KqueueFileWatcher();
 
   efsw::WatchID addWatch(
@@ -31,13 +59,77 @@ public:
 
   void removeWatch(efsw::WatchID handle);
 
+  // Bulk versions of the above. Since each kqueue watch is independent, these
+  // are simple loops; they exist so that callers can treat every backend the
+  // same way.
+  std::vector<efsw::WatchID> addWatches(
+    const std::vector<std::string>& paths,
+    efsw::FileWatchListener* listener,
+    bool _useRecursion = false
+  );
+
+  void removeWatches(const std::vector<efsw::WatchID>& handles);
+
+  // Sets how many fds our watches may use. `0` picks a default based on the
+  // process's fd limit. Lowering the budget demotes watches right away.
+  void setFdBudget(size_t budget);
+  KqueueFdStats getFdStats();
+
+  // Adds up what our maps and directory listings hold. Every kqueue-backed
+  // watch is a kernel watch and a file descriptor.
+  efsw::MemoryUsage memoryUsage();
+
   bool isValid = true;
 
 private:
+  // A harvested kqueue event, resolved against our maps.
+  struct VnodeEvent {
+    efsw::WatchID handle;
+    int fd;
+    uint32_t fflags;
+    std::string watchedPath;
+    efsw::FileWatchListener* listener;
+    bool isDirectory;
+  };
+
+  // What we remember about each entry of a watched directory.
+  struct DirEntryInfo {
+    ino_t inode;
+    struct timespec mtime;
+  };
+  typedef std::unordered_map<std::string, DirEntryInfo> DirSnapshot;
+
+  static bool readDirSnapshot(const std::string& path, DirSnapshot& snapshot);
+
+  // The last known state of a polled watch.
+  struct PolledWatch {
+    bool isDirectory;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+  };
+
   void eventLoop();
+  void handleEvent(const VnodeEvent& event);
+  bool diffDirectory(const VnodeEvent& event);
+  bool ownsFd(efsw::WatchID handle, int fd);
+  bool registerFd(efsw::WatchID handle, int fd);
+  void wake();
+  // Wakes the event loop if `startPolling` asked for it. Called once
+  // `mapMutex` is released, so the write never happens under it.
+  void wakeIfPending();
+
+  // Fd budget management. Except for `pollWatches` and `promote`, these
+  // expect the caller to hold `mapMutex`.
+  void markActive(efsw::WatchID handle);
+  void forgetActivity(efsw::WatchID handle);
+  bool evictLeastActive();
+  void startPolling(efsw::WatchID handle);
+  void pollWatches();
+  void promote(efsw::WatchID handle);
 
   void sendFileAction(
-    efsw::WatchID handle,
+    const VnodeEvent& event,
     const std::string& dir,
     const std::string& filename,
     efsw::Action action,
@@ -48,19 +140,42 @@ private:
   // handlesToPaths / handlesToListeners so that removeWatch() still works.
   void closeFd(efsw::WatchID handle, int fd);
 
-  // Opens a new fd for the given path and registers it with kqueue under an
-  // existing handle. Used after an atomic save replaces the watched inode.
-  bool reopenFd(efsw::WatchID handle, const std::string& path);
+  // If the file at `path` is a different inode from the one `handle` was
+  // following, opens it and registers it with kqueue under that handle. Used
+  // to follow a file across an atomic save, which swaps a new inode in at the
+  // same path. With `keepSameInode`, the original inode still being at the
+  // path counts too, and gets a fresh fd; that's what's left behind when one
+  // of a file's hard links is removed.
+  bool adoptReplacement(efsw::WatchID handle, const std::string& path,
+                        bool keepSameInode = false);
 
   long nextHandleID = 1;
   int kqueueFd = -1;
   int wakeupPipe[2] = {-1, -1};
   std::atomic<bool> stopping{false};
+  // Set by `startPolling` when the event loop has to start waking up to
+  // poll.
+  std::atomic<bool> wakePending{false};
   std::mutex mapMutex;
   std::thread eventThread;
 
   std::unordered_map<efsw::WatchID, int>                      handlesToFds;
   std::unordered_map<int, efsw::WatchID>                      fdsToHandles;
-  std::unordered_map<efsw::WatchID, std::string>              handlesToPaths;
+  std::unordered_map<efsw::WatchID, efsw::InternedPath>      handlesToPaths;
   std::unordered_map<efsw::WatchID, efsw::FileWatchListener*> handlesToListeners;
+  // Only watched directories have an entry here.
+  std::unordered_map<efsw::WatchID, DirSnapshot>              handlesToSnapshots;
+  // The inode each handle is following.
+  std::unordered_map<efsw::WatchID, ino_t>                    handlesToInodes;
+
+  size_t fdBudget = 0;
+  size_t evictions = 0;
+  size_t promotions = 0;
+  // kqueue-backed handles, least recently active first.
+  std::list<efsw::WatchID> activity;
+  std::unordered_map<efsw::WatchID, std::list<efsw::WatchID>::iterator>
+    activityPositions;
+  std::unordered_map<efsw::WatchID, PolledWatch> polledWatches;
+  std::chrono::milliseconds pollInterval{2000};
+  std::chrono::steady_clock::time_point nextPoll;
 };
@@ -0,0 +1,166 @@
+#include "MacFileWatcher.hpp"
+
+#include <sys/stat.h>
+
+MacFileWatcher::MacFileWatcher(MacBackend defaultBackend)
+    : defaultBackend(defaultBackend) {}
+
+MacBackend MacFileWatcher::Resolve(
+  const std::string& path,
+  bool recursive,
+  MacBackend backend
+) {
+  if (backend == MacBackend::Default) {
+    std::lock_guard<std::mutex> lock(mutex);
+    backend = defaultBackend;
+  }
+  if (backend != MacBackend::Hybrid) return backend;
+  if (recursive) return MacBackend::FSEvents;
+
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+    return MacBackend::FSEvents;
+  }
+  return MacBackend::Kqueue;
+}
+
+FSEventsFileWatcher* MacFileWatcher::FSEvents(bool start) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!fsEvents && start) {
+    fsEvents.reset(new FSEventsFileWatcher());
+    fsEvents->setStreamOptions(streamLatency, streamNoDefer);
+  }
+  return fsEvents.get();
+}
+
+KqueueFileWatcher* MacFileWatcher::Kqueue(bool start) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!kqueue && start) {
+    kqueue.reset(new KqueueFileWatcher(KqueueHandleBase));
+    kqueue->setFdBudget(fdBudget);
+  }
+  return kqueue.get();
+}
+
+efsw::WatchID MacFileWatcher::addWatch(
+  const std::string& path,
+  efsw::FileWatchListener* listener,
+  bool _useRecursion,
+  FSEventStreamEventId sinceWhen,
+  MacBackend backend,
+  bool resync
+) {
+  if (Resolve(path, _useRecursion, backend) == MacBackend::Kqueue) {
+    return Kqueue()->addWatch(path, listener, _useRecursion);
+  }
+  return FSEvents()->addWatch(
+    path, listener, _useRecursion, sinceWhen, resync
+  );
+}
+
+void MacFileWatcher::removeWatch(efsw::WatchID handle) {
+  removeWatches({handle});
+}
+
+std::vector<efsw::WatchID> MacFileWatcher::addWatches(
+  const std::vector<std::string>& paths,
+  efsw::FileWatchListener* listener,
+  bool _useRecursion,
+  FSEventStreamEventId sinceWhen,
+  MacBackend backend,
+  bool resync
+) {
+  std::vector<efsw::WatchID> handles(paths.size());
+  std::vector<std::string> streamPaths;
+  std::vector<size_t> streamPositions;
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (Resolve(paths[i], _useRecursion, backend) == MacBackend::Kqueue) {
+      handles[i] = Kqueue()->addWatch(paths[i], listener, _useRecursion);
+    } else {
+      streamPaths.push_back(paths[i]);
+      streamPositions.push_back(i);
+    }
+  }
+  if (streamPaths.empty()) return handles;
+
+  std::vector<efsw::WatchID> streamHandles = FSEvents()->addWatches(
+    streamPaths, listener, _useRecursion, sinceWhen, resync
+  );
+  for (size_t i = 0; i < streamHandles.size(); i++) {
+    handles[streamPositions[i]] = streamHandles[i];
+  }
+  return handles;
+}
+
+void MacFileWatcher::removeWatches(
+  const std::vector<efsw::WatchID>& handles
+) {
+  std::vector<efsw::WatchID> streamHandles;
+  std::vector<efsw::WatchID> kqueueHandles;
+  for (auto handle : handles) {
+    if (handle >= KqueueHandleBase) {
+      kqueueHandles.push_back(handle);
+    } else {
+      streamHandles.push_back(handle);
+    }
+  }
+  // A watcher that never started has nothing to remove.
+  KqueueFileWatcher* kq = Kqueue(false);
+  if (kq && !kqueueHandles.empty()) kq->removeWatches(kqueueHandles);
+  FSEventsFileWatcher* fse = FSEvents(false);
+  if (fse && !streamHandles.empty()) fse->removeWatches(streamHandles);
+}
+
+void MacFileWatcher::setDefaultBackend(MacBackend backend) {
+  std::lock_guard<std::mutex> lock(mutex);
+  defaultBackend =
+    backend == MacBackend::Default ? MacBackend::FSEvents : backend;
+}
+
+FSEventStreamEventId MacFileWatcher::getLastEventId() {
+  FSEventsFileWatcher* fse = FSEvents(false);
+  return fse ? fse->getLastEventId() : FSEventsGetCurrentEventId();
+}
+
+void MacFileWatcher::setStreamOptions(double latency, bool noDefer) {
+  FSEventsFileWatcher* fse;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    streamLatency = latency;
+    streamNoDefer = noDefer;
+    fse = fsEvents.get();
+  }
+  if (fse) fse->setStreamOptions(latency, noDefer);
+}
+
+void MacFileWatcher::setFdBudget(size_t budget) {
+  KqueueFileWatcher* kq;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    fdBudget = budget;
+    kq = kqueue.get();
+  }
+  if (kq) kq->setFdBudget(budget);
+}
+
+KqueueFdStats MacFileWatcher::getFdStats() {
+  KqueueFileWatcher* kq = Kqueue(false);
+  if (kq) return kq->getFdStats();
+  std::lock_guard<std::mutex> lock(mutex);
+  return {fdBudget, 0, 0, 0, 0};
+}
+
+efsw::MemoryUsage MacFileWatcher::memoryUsage() {
+  efsw::MemoryUsage usage;
+  if (FSEventsFileWatcher* fse = FSEvents(false)) usage = fse->memoryUsage();
+  if (KqueueFileWatcher* kq = Kqueue(false)) {
+    efsw::MemoryUsage more = kq->memoryUsage();
+    usage.watchTableBytes += more.watchTableBytes;
+    usage.pendingEventBytes += more.pendingEventBytes;
+    usage.stringBytes += more.stringBytes;
+    usage.kernelWatches += more.kernelWatches;
+    usage.fileDescriptors += more.fileDescriptors;
+    usage.polledDirectories += more.polledDirectories;
+  }
+  return usage;
+}
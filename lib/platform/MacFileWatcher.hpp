@@ -0,0 +1,98 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "FSEventsFileWatcher.hpp"
+#include "KqueueFileWatcher.hpp"
+
+// Which of our macOS watchers a watch should go to.
+enum class MacBackend {
+  // Whatever the watcher was told to use for watches that don't say.
+  Default,
+  FSEvents,
+  Kqueue,
+  // Directories go to FSEvents and single files to kqueue. FSEvents watches
+  // a big tree with one stream, but everything it reports goes by way of
+  // `fseventsd`; kqueue hears about a change to a file straight from the
+  // kernel, at the price of an fd. Meant for the handful of files an editor
+  // has open.
+  Hybrid
+};
+
+// Gives each watch to FSEvents or kqueue, as asked, and answers for both of
+// them. Each watcher only starts once a watch needs it. The two hand out
+// handles from ranges that don't overlap, so both can report to the same
+// listener, and a handle is enough to tell which one has it.
+class MacFileWatcher {
+public:
+  explicit MacFileWatcher(MacBackend defaultBackend = MacBackend::FSEvents);
+
+  // `sinceWhen` and `resync` only mean something to FSEvents; kqueue can't
+  // replay, and never drops events.
+  efsw::WatchID addWatch(
+    const std::string& path,
+    efsw::FileWatchListener* listener,
+    bool _useRecursion = false,
+    FSEventStreamEventId sinceWhen = 0,
+    MacBackend backend = MacBackend::Default,
+    bool resync = false
+  );
+  void removeWatch(efsw::WatchID handle);
+
+  // Bulk versions of the above. The paths that go to FSEvents still only
+  // rebuild its stream once.
+  std::vector<efsw::WatchID> addWatches(
+    const std::vector<std::string>& paths,
+    efsw::FileWatchListener* listener,
+    bool _useRecursion = false,
+    FSEventStreamEventId sinceWhen = 0,
+    MacBackend backend = MacBackend::Default,
+    bool resync = false
+  );
+  void removeWatches(const std::vector<efsw::WatchID>& handles);
+
+  // The backend for watches added from now on that don't ask for one.
+  void setDefaultBackend(MacBackend backend);
+
+  // See `FSEventsFileWatcher`. The ID is the system's current one until
+  // FSEvents has started.
+  FSEventStreamEventId getLastEventId();
+  void setStreamOptions(double latency, bool noDefer);
+
+  // See `KqueueFileWatcher`. Until kqueue has started, the stats are all
+  // zero but for the budget we'll give it.
+  void setFdBudget(size_t budget);
+  KqueueFdStats getFdStats();
+
+  // What both watchers hold, added up.
+  efsw::MemoryUsage memoryUsage();
+
+  // Where kqueue's handles start. FSEvents counts up from `1`, and would
+  // need a trillion watches to get here.
+  static const efsw::WatchID KqueueHandleBase = 1L << 40;
+
+private:
+  // Settles which watcher `path` goes to. `Hybrid` sends anything but a
+  // directory to kqueue, unless the watch is recursive.
+  MacBackend Resolve(
+    const std::string& path,
+    bool recursive,
+    MacBackend backend
+  );
+  // These start their watcher the first time they're asked for it, and
+  // return `nullptr` otherwise when `start` is `false`.
+  FSEventsFileWatcher* FSEvents(bool start = true);
+  KqueueFileWatcher* Kqueue(bool start = true);
+
+  // Guards everything below. The watchers themselves are never replaced
+  // once they start, so a pointer to one stays good without it.
+  std::mutex mutex;
+  MacBackend defaultBackend;
+  std::unique_ptr<FSEventsFileWatcher> fsEvents;
+  std::unique_ptr<KqueueFileWatcher> kqueue;
+  double streamLatency = 0.;
+  bool streamNoDefer = true;
+  size_t fdBudget = 0;
+};
@@ -0,0 +1,110 @@
+#include "PathTrie.hpp"
+#include <vector>
+
+#ifdef _WIN32
+#define PATH_TRIE_SEPARATOR '\\'
+#else
+#define PATH_TRIE_SEPARATOR '/'
+#endif
+
+// Splits off the next nonempty component of `path`, advancing `path` past it.
+// Returns an empty view when there are no components left.
+static std::string_view NextComponent(std::string_view& path) {
+  while (!path.empty() && path.front() == PATH_TRIE_SEPARATOR) {
+    path.remove_prefix(1);
+  }
+  size_t end = path.find(PATH_TRIE_SEPARATOR);
+  std::string_view component = path.substr(0, end);
+  path.remove_prefix(end == std::string_view::npos ? path.size() : end);
+  return component;
+}
+
+void PathTrie::insert(std::string_view path, efsw::WatchID handle) {
+  Node* node = &root;
+  for (
+    std::string_view component = NextComponent(path);
+    !component.empty();
+    component = NextComponent(path)
+  ) {
+    auto it = node->children.find(component);
+    if (it == node->children.end()) {
+      it = node->children.emplace(
+        std::string(component),
+        std::make_unique<Node>()
+      ).first;
+    }
+    node = it->second.get();
+  }
+  if (node->handle == 0) size++;
+  node->handle = handle;
+}
+
+void PathTrie::erase(std::string_view path, efsw::WatchID handle) {
+  // Remember the way down so we can prune nodes that are no longer needed on
+  // the way back up.
+  std::vector<std::pair<Node*, std::string_view>> trail;
+  Node* node = &root;
+  for (
+    std::string_view component = NextComponent(path);
+    !component.empty();
+    component = NextComponent(path)
+  ) {
+    auto it = node->children.find(component);
+    if (it == node->children.end()) return;
+    trail.emplace_back(node, it->first);
+    node = it->second.get();
+  }
+  if (node->handle != handle || handle == 0) return;
+  node->handle = 0;
+  size--;
+
+  while (!trail.empty()) {
+    Node* parent = trail.back().first;
+    auto it = parent->children.find(trail.back().second);
+    Node* child = it->second.get();
+    if (child->handle != 0 || !child->children.empty()) break;
+    parent->children.erase(it);
+    trail.pop_back();
+  }
+}
+
+efsw::WatchID PathTrie::find(std::string_view path) const {
+  const Node* node = findNode(path, false);
+  return node ? node->handle : 0;
+}
+
+efsw::WatchID PathTrie::findNearestAncestor(std::string_view path) const {
+  const Node* node = findNode(path, true);
+  return node ? node->handle : 0;
+}
+
+const PathTrie::Node* PathTrie::findNode(
+  std::string_view path,
+  bool nearest
+) const {
+  const Node* node = &root;
+  const Node* best = root.handle != 0 ? &root : nullptr;
+  for (
+    std::string_view component = NextComponent(path);
+    !component.empty();
+    component = NextComponent(path)
+  ) {
+    auto it = node->children.find(component);
+    if (it == node->children.end()) {
+      return nearest ? best : nullptr;
+    }
+    node = it->second.get();
+    if (node->handle != 0) best = node;
+  }
+  if (nearest) return best;
+  return node->handle != 0 ? node : nullptr;
+}
+
+size_t PathTrie::nodeBytes(const Node& node) {
+  size_t bytes = efsw::MemoryCost::tree(node.children);
+  for (auto& child : node.children) {
+    bytes += sizeof(Node) + efsw::MemoryCost::string(child.first) +
+      nodeBytes(*child.second);
+  }
+  return bytes;
+}
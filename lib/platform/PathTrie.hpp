@@ -0,0 +1,51 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "../../vendor/efsw/include/efsw/efsw.hpp"
+#include "../../vendor/efsw/include/efsw/MemoryCost.hpp"
+
+// An index of watched paths keyed on their components, so that looking up a
+// path means walking one node per directory rather than hashing (and first
+// allocating) a whole path string.
+//
+// Lookups take `std::string_view`s and never allocate. Besides exact matches,
+// the trie can find the nearest watched ancestor of a path, which is what
+// recursive watching would need.
+class PathTrie {
+public:
+  // Associates `path` with `handle`, replacing any handle it already had.
+  void insert(std::string_view path, efsw::WatchID handle);
+
+  // Removes the association for `path`, but only if it currently belongs to
+  // `handle`; another handle may have claimed the same path since.
+  void erase(std::string_view path, efsw::WatchID handle);
+
+  // Returns the handle for exactly `path`, or `0` if there isn't one.
+  efsw::WatchID find(std::string_view path) const;
+
+  // Returns the handle for `path` or its nearest watched ancestor, or `0` if
+  // there isn't one.
+  efsw::WatchID findNearestAncestor(std::string_view path) const;
+
+  bool empty() const { return size == 0; }
+
+  // Roughly how many bytes the nodes and their names hold.
+  size_t memoryUsage() const { return nodeBytes(root); }
+
+private:
+  struct Node {
+    // `std::less<>` lets us look up children by `std::string_view` without
+    // building a `std::string` first.
+    std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+    efsw::WatchID handle = 0;
+  };
+
+  const Node* findNode(std::string_view path, bool nearest) const;
+  static size_t nodeBytes(const Node& node);
+
+  Node root;
+  size_t size = 0;
+};
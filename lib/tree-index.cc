@@ -0,0 +1,566 @@
+#include "tree-index.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// An index file is a header, then one record per entry in the order that
+// `RefreshTreeIndex` lists them (so everything below a directory comes right
+// after it), then all of their names back to back. The root comes first, and
+// its name is its whole path. Everything is in the host's byte order; an
+// index from a machine with a different one fails the magic number check and
+// is simply rebuilt.
+static const uint32_t kIndexMagic = 0x50575449; // "PWTI"
+static const uint32_t kIndexVersion = 1;
+
+struct IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t eventId;
+  // When the walk that wrote the index started, in Unix seconds.
+  int64_t listedAt;
+  uint64_t count;
+  uint64_t namesSize;
+};
+
+struct IndexRecord {
+  uint64_t inode;
+  int64_t modifiedNs;
+  uint64_t size;
+  uint32_t nameOffset;
+  uint32_t nameLength;
+  // The first record after everything below this one; for anything but a
+  // directory, that's the very next record.
+  uint32_t subtreeEnd;
+  uint8_t type;
+  uint8_t padding[3];
+};
+
+// How close to the time it was listed a directory may have been modified
+// before we stop trusting its listing. Some filesystems only keep times to
+// the second (or two), so a change made just after we looked might not have
+// moved the time at all.
+static const int64_t kRacySeconds = 2;
+
+static const size_t kNoRecord = static_cast<size_t>(-1);
+
+#ifdef _WIN32
+static std::wstring ToWide(const std::string &path) {
+  int length = MultiByteToWideChar(CP_UTF8, 0, path.data(),
+                                   static_cast<int>(path.size()), nullptr, 0);
+  std::wstring result(length, L'\0');
+  MultiByteToWideChar(CP_UTF8, 0, path.data(), static_cast<int>(path.size()),
+                      &result[0], length);
+  return result;
+}
+
+static std::string FromWide(const wchar_t *path) {
+  int length =
+      WideCharToMultiByte(CP_UTF8, 0, path, -1, nullptr, 0, nullptr, nullptr);
+  if (length <= 1)
+    return std::string();
+  std::string result(length - 1, '\0');
+  WideCharToMultiByte(CP_UTF8, 0, path, -1, &result[0], length, nullptr,
+                      nullptr);
+  return result;
+}
+
+// `FILETIME`s count hundreds of nanoseconds from 1601.
+static int64_t UnixNs(FILETIME time) {
+  uint64_t ticks =
+      (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+  return (static_cast<int64_t>(ticks) - 116444736000000000LL) * 100;
+}
+
+static void FillEntry(DWORD attributes, DWORD reparseTag, FILETIME modified,
+                      DWORD sizeHigh, DWORD sizeLow, TreeEntry &entry) {
+  // Node treats junctions as links too.
+  if ((attributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+      (reparseTag == IO_REPARSE_TAG_SYMLINK ||
+       reparseTag == IO_REPARSE_TAG_MOUNT_POINT)) {
+    entry.type = kTreeSymlink;
+  } else {
+    entry.type = (attributes & FILE_ATTRIBUTE_DIRECTORY) ? kTreeDirectory
+                                                          : kTreeFile;
+  }
+  entry.inode = 0;
+  entry.modifiedNs = UnixNs(modified);
+  entry.size = (uint64_t(sizeHigh) << 32) | sizeLow;
+}
+
+static int StatEntry(const std::string &path, TreeEntry &entry, bool) {
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesExW(ToWide(path).c_str(), GetFileExInfoStandard,
+                            &data))
+    return GetLastError();
+  // The attributes don't say what kind of reparse point this is, and it's
+  // only ever a directory we're checking, so take it at its word.
+  FillEntry(data.dwFileAttributes & ~FILE_ATTRIBUTE_REPARSE_POINT, 0,
+            data.ftLastWriteTime, data.nFileSizeHigh, data.nFileSizeLow,
+            entry);
+  return 0;
+}
+
+// Lists a directory's entries, leaving each one's name in `path`.
+static int ListEntries(const std::string &dirPath,
+                       std::vector<TreeEntry> &children) {
+  std::wstring dir = ToWide(dirPath);
+  if (!dir.empty() && dir.back() != L'\\' && dir.back() != L'/')
+    dir += L'\\';
+  WIN32_FIND_DATAW data;
+  HANDLE find =
+      FindFirstFileExW((dir + L"*").c_str(), FindExInfoBasic, &data,
+                       FindExSearchNameMatch, nullptr,
+                       FIND_FIRST_EX_LARGE_FETCH);
+  if (find == INVALID_HANDLE_VALUE)
+    return GetLastError();
+
+  do {
+    if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0)
+      continue;
+    TreeEntry entry;
+    entry.path = FromWide(data.cFileName);
+    FillEntry(data.dwFileAttributes, data.dwReserved0, data.ftLastWriteTime,
+              data.nFileSizeHigh, data.nFileSizeLow, entry);
+    children.push_back(std::move(entry));
+  } while (FindNextFileW(find, &data));
+
+  DWORD error = GetLastError();
+  FindClose(find);
+  return error == ERROR_NO_MORE_FILES ? 0 : error;
+}
+#else
+static void FillEntry(const struct stat &info, TreeEntry &entry) {
+  if (S_ISDIR(info.st_mode)) {
+    entry.type = kTreeDirectory;
+  } else if (S_ISREG(info.st_mode)) {
+    entry.type = kTreeFile;
+  } else if (S_ISLNK(info.st_mode)) {
+    entry.type = kTreeSymlink;
+  } else {
+    entry.type = 0;
+  }
+#ifdef __APPLE__
+  const struct timespec &modified = info.st_mtimespec;
+#else
+  const struct timespec &modified = info.st_mtim;
+#endif
+  entry.inode = static_cast<uint64_t>(info.st_ino);
+  entry.modifiedNs =
+      int64_t(modified.tv_sec) * 1000000000LL + modified.tv_nsec;
+  entry.size = static_cast<uint64_t>(info.st_size);
+}
+
+// Only the root's links are followed.
+static int StatEntry(const std::string &path, TreeEntry &entry,
+                     bool followLinks) {
+  struct stat info;
+  if ((followLinks ? stat(path.c_str(), &info)
+                   : lstat(path.c_str(), &info)) != 0)
+    return errno;
+  FillEntry(info, entry);
+  return 0;
+}
+
+// Lists a directory's entries, leaving each one's name in `path`. Each entry
+// costs an `fstatat` relative to the open directory, which doesn't follow
+// links.
+static int ListEntries(const std::string &dirPath,
+                       std::vector<TreeEntry> &children) {
+  int fd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return errno;
+  DIR *dir = fdopendir(fd);
+  if (!dir) {
+    int error = errno;
+    close(fd);
+    return error;
+  }
+
+  int error = 0;
+  for (;;) {
+    errno = 0;
+    struct dirent *found = readdir(dir);
+    if (!found) {
+      error = errno;
+      break;
+    }
+    const char *name = found->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    struct stat info;
+    // Already gone again.
+    if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+      continue;
+    TreeEntry entry;
+    entry.path = name;
+    FillEntry(info, entry);
+    children.push_back(std::move(entry));
+  }
+
+  closedir(dir);
+  return error;
+}
+#endif
+
+// An index file, mapped into memory so that the records we don't need are
+// never read from disk.
+class MappedIndex {
+public:
+  explicit MappedIndex(const std::string &path);
+  ~MappedIndex() { Close(); }
+
+  // Whether the file is a well-formed index of `root`.
+  bool IsValidFor(const std::string &root) const;
+  const IndexHeader &Header() const {
+    return *reinterpret_cast<const IndexHeader *>(data);
+  }
+  const IndexRecord &Record(size_t i) const { return records[i]; }
+  std::string Name(size_t i) const {
+    return std::string(names + records[i].nameOffset, records[i].nameLength);
+  }
+  // Unmaps the file. Windows won't let us replace it while it's mapped.
+  void Close();
+
+private:
+  bool Validate() const;
+
+  const char *data = nullptr;
+  size_t size = 0;
+  const IndexRecord *records = nullptr;
+  const char *names = nullptr;
+  bool valid = false;
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+#endif
+};
+
+MappedIndex::MappedIndex(const std::string &path) {
+#ifdef _WIN32
+  file = CreateFileW(ToWide(path).c_str(), GENERIC_READ, FILE_SHARE_READ,
+                     nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return;
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    return;
+  mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapping)
+    return;
+  data = static_cast<const char *>(
+      MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (!data)
+    return;
+  size = static_cast<size_t>(fileSize.QuadPart);
+#else
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    return;
+  }
+  void *mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ,
+                      MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return;
+  data = static_cast<const char *>(mapped);
+  size = static_cast<size_t>(info.st_size);
+#endif
+  valid = Validate();
+}
+
+void MappedIndex::Close() {
+#ifdef _WIN32
+  if (data)
+    UnmapViewOfFile(data);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file != INVALID_HANDLE_VALUE)
+    CloseHandle(file);
+  mapping = nullptr;
+  file = INVALID_HANDLE_VALUE;
+#else
+  if (data)
+    munmap(const_cast<char *>(data), size);
+#endif
+  data = nullptr;
+  size = 0;
+  valid = false;
+}
+
+// Checks everything that walking the records relies on, so that a truncated
+// or mangled file is ignored rather than read past its end.
+bool MappedIndex::Validate() const {
+  if (size < sizeof(IndexHeader))
+    return false;
+  const IndexHeader &header = Header();
+  if (header.magic != kIndexMagic || header.version != kIndexVersion ||
+      header.count == 0 || header.count > UINT32_MAX)
+    return false;
+  uint64_t recordsSize = header.count * sizeof(IndexRecord);
+  if (header.namesSize > size ||
+      sizeof(IndexHeader) + recordsSize + header.namesSize != size)
+    return false;
+
+  const_cast<MappedIndex *>(this)->records =
+      reinterpret_cast<const IndexRecord *>(data + sizeof(IndexHeader));
+  const_cast<MappedIndex *>(this)->names =
+      data + sizeof(IndexHeader) + recordsSize;
+
+  // Each subtree has to sit entirely inside its parent's.
+  std::vector<uint32_t> ends;
+  for (uint32_t i = 0; i < header.count; i++) {
+    const IndexRecord &record = records[i];
+    if (uint64_t(record.nameOffset) + record.nameLength > header.namesSize)
+      return false;
+    while (!ends.empty() && ends.back() <= i)
+      ends.pop_back();
+    if (i > 0 && ends.empty())
+      return false;
+    if (record.subtreeEnd <= i || record.subtreeEnd > header.count ||
+        (!ends.empty() && record.subtreeEnd > ends.back()))
+      return false;
+    if (record.type == kTreeDirectory) {
+      ends.push_back(record.subtreeEnd);
+    } else if (record.subtreeEnd != i + 1) {
+      return false;
+    }
+  }
+  return records[0].type == kTreeDirectory;
+}
+
+bool MappedIndex::IsValidFor(const std::string &root) const {
+  return valid && Name(0) == root;
+}
+
+static std::string JoinPath(const std::string &dir, const std::string &name) {
+  return dir.empty() ? name : dir + '/' + name;
+}
+
+// Walks a tree, taking the listings of directories that haven't changed from
+// an old index, and keeps what it finds in the order the index stores it.
+class TreeWalker {
+public:
+  TreeWalker(const std::string &root, const MappedIndex *index,
+             TreeIndexResult &result)
+      : root(root), index(index), result(result) {
+    rootPrefix = root.empty() || root.back() != '/' ? root + '/' : root;
+  }
+
+  size_t Add(TreeEntry entry) {
+    entries.push_back(std::move(entry));
+    subtreeEnds.push_back(static_cast<uint32_t>(entries.size()));
+    return entries.size() - 1;
+  }
+  // Lists the directory at `entries[self]`, whose old record (if it had one)
+  // is `record`.
+  void Walk(size_t self, size_t record);
+
+  std::vector<TreeEntry> entries;
+  std::vector<uint32_t> subtreeEnds;
+
+private:
+  bool IsUnchanged(size_t record, const TreeEntry &dir) const;
+  void WalkFromIndex(size_t self, size_t record);
+  void WalkFromDisk(size_t self, size_t record);
+
+  const std::string &root;
+  std::string rootPrefix;
+  const MappedIndex *index;
+  TreeIndexResult &result;
+};
+
+bool TreeWalker::IsUnchanged(size_t record, const TreeEntry &dir) const {
+  if (!index || record == kNoRecord)
+    return false;
+  const IndexRecord &old = index->Record(record);
+  int64_t modifiedAt = dir.modifiedNs / 1000000000LL;
+  return old.type == kTreeDirectory && old.inode == dir.inode &&
+         old.modifiedNs == dir.modifiedNs &&
+         modifiedAt + kRacySeconds < index->Header().listedAt;
+}
+
+void TreeWalker::Walk(size_t self, size_t record) {
+  if (IsUnchanged(record, entries[self])) {
+    WalkFromIndex(self, record);
+  } else {
+    WalkFromDisk(self, record);
+  }
+  subtreeEnds[self] = static_cast<uint32_t>(entries.size());
+}
+
+// The directory's own `stat` says its listing is still good. Files come
+// straight from the index, but directories get a `stat` of their own, since
+// what's inside them can change without their parent noticing.
+void TreeWalker::WalkFromIndex(size_t self, size_t record) {
+  result.directoriesChecked++;
+  std::string relative = entries[self].path;
+  size_t end = index->Record(record).subtreeEnd;
+  for (size_t i = record + 1; i < end;) {
+    const IndexRecord &old = index->Record(i);
+    TreeEntry child;
+    child.path = JoinPath(relative, index->Name(i));
+    if (old.type != kTreeDirectory) {
+      child.type = old.type;
+      child.inode = old.inode;
+      child.modifiedNs = old.modifiedNs;
+      child.size = old.size;
+      Add(std::move(child));
+      i++;
+      continue;
+    }
+    if (StatEntry(rootPrefix + child.path, child, false) == 0) {
+      bool isDirectory = child.type == kTreeDirectory;
+      size_t added = Add(std::move(child));
+      if (isDirectory)
+        Walk(added, i);
+    }
+    i = old.subtreeEnd;
+  }
+}
+
+void TreeWalker::WalkFromDisk(size_t self, size_t record) {
+  result.directoriesRead++;
+  std::string relative = entries[self].path;
+
+  // Whatever the index knew about the subdirectories might still be good.
+  std::unordered_map<std::string, size_t> known;
+  if (index && record != kNoRecord) {
+    size_t end = index->Record(record).subtreeEnd;
+    for (size_t i = record + 1; i < end; i = index->Record(i).subtreeEnd) {
+      if (index->Record(i).type == kTreeDirectory)
+        known.emplace(index->Name(i), i);
+    }
+  }
+
+  std::vector<TreeEntry> children;
+  // A directory we can't read is listed as empty, like one that's gone.
+  ListEntries(relative.empty() ? root : rootPrefix + relative, children);
+  std::sort(children.begin(), children.end(),
+            [](const TreeEntry &a, const TreeEntry &b) {
+              return a.path < b.path;
+            });
+
+  for (auto &child : children) {
+    auto old = known.find(child.path);
+    size_t oldRecord = old == known.end() ? kNoRecord : old->second;
+    child.path = JoinPath(relative, child.path);
+    bool isDirectory = child.type == kTreeDirectory;
+    size_t added = Add(std::move(child));
+    if (isDirectory)
+      Walk(added, oldRecord);
+  }
+}
+
+static std::string BaseName(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Writes the index next to where it belongs and then moves it into place, so
+// that a reader never sees half of one.
+static bool WriteIndex(const std::string &indexPath, const std::string &root,
+                       uint64_t eventId, int64_t listedAt,
+                       const TreeWalker &walker) {
+  std::vector<IndexRecord> records(walker.entries.size());
+  std::string names;
+  for (size_t i = 0; i < walker.entries.size(); i++) {
+    const TreeEntry &entry = walker.entries[i];
+    std::string name = i == 0 ? root : BaseName(entry.path);
+    IndexRecord &record = records[i];
+    memset(&record, 0, sizeof(record));
+    record.inode = entry.inode;
+    record.modifiedNs = entry.modifiedNs;
+    record.size = entry.size;
+    record.nameOffset = static_cast<uint32_t>(names.size());
+    record.nameLength = static_cast<uint32_t>(name.size());
+    record.subtreeEnd = walker.subtreeEnds[i];
+    record.type = entry.type;
+    names += name;
+    if (names.size() > UINT32_MAX)
+      return false;
+  }
+
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kIndexMagic;
+  header.version = kIndexVersion;
+  header.eventId = eventId;
+  header.listedAt = listedAt;
+  header.count = records.size();
+  header.namesSize = names.size();
+
+  std::string temporary = indexPath + ".tmp";
+#ifdef _WIN32
+  FILE *out = _wfopen(ToWide(temporary).c_str(), L"wb");
+#else
+  FILE *out = fopen(temporary.c_str(), "wb");
+#endif
+  if (!out)
+    return false;
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+            fwrite(records.data(), sizeof(IndexRecord), records.size(),
+                   out) == records.size() &&
+            fwrite(names.data(), 1, names.size(), out) == names.size();
+  ok = fclose(out) == 0 && ok;
+#ifdef _WIN32
+  ok = ok && MoveFileExW(ToWide(temporary).c_str(), ToWide(indexPath).c_str(),
+                         MOVEFILE_REPLACE_EXISTING);
+  if (!ok)
+    DeleteFileW(ToWide(temporary).c_str());
+#else
+  ok = ok && rename(temporary.c_str(), indexPath.c_str()) == 0;
+  if (!ok)
+    unlink(temporary.c_str());
+#endif
+  return ok;
+}
+
+int RefreshTreeIndex(const std::string &root, const std::string &indexPath,
+                     uint64_t eventId, TreeIndexResult &result) {
+  int64_t listedAt = static_cast<int64_t>(time(nullptr));
+
+  TreeEntry top;
+  if (int error = StatEntry(root, top, true))
+    return error;
+  if (top.type != kTreeDirectory) {
+#ifdef _WIN32
+    return ERROR_DIRECTORY;
+#else
+    return ENOTDIR;
+#endif
+  }
+
+  MappedIndex index(indexPath);
+  const MappedIndex *usable = index.IsValidFor(root) ? &index : nullptr;
+  if (usable)
+    result.eventId = usable->Header().eventId;
+
+  TreeWalker walker(root, usable, result);
+  walker.Add(std::move(top));
+  walker.Walk(0, usable ? 0 : kNoRecord);
+  index.Close();
+
+  WriteIndex(indexPath, root, eventId, listedAt, walker);
+
+  // The root itself is only there for the index's sake.
+  result.entries.assign(std::make_move_iterator(walker.entries.begin() + 1),
+                        std::make_move_iterator(walker.entries.end()));
+  return 0;
+}
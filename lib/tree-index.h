@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a `TreeEntry` is. These are the same bits `listDirectory` reports,
+// except that links are never followed, so a link only has `kTreeSymlink`.
+static const uint8_t kTreeFile = 1;
+static const uint8_t kTreeDirectory = 2;
+static const uint8_t kTreeSymlink = 4;
+
+// One file, directory or link below an indexed root.
+struct TreeEntry {
+  // Relative to the root, with `/` between names.
+  std::string path;
+  uint8_t type = 0;
+  // Always `0` on Windows, where finding out costs a handle per file.
+  uint64_t inode = 0;
+  // Nanoseconds since the Unix epoch.
+  int64_t modifiedNs = 0;
+  uint64_t size = 0;
+};
+
+// What `RefreshTreeIndex` found.
+struct TreeIndexResult {
+  // Everything below the root, parents before children and siblings in byte
+  // order of their names.
+  std::vector<TreeEntry> entries;
+  // The resume point that was saved with the index we started from, or `0`
+  // if there wasn't a usable one.
+  uint64_t eventId = 0;
+  // Directories whose listings we took from the index after one `stat`
+  // showed they hadn't changed, and directories we had to read again.
+  size_t directoriesChecked = 0;
+  size_t directoriesRead = 0;
+};
+
+// Lists everything below `root`, using the index file at `indexPath` (if
+// there is one, and it was written for `root`) to skip reading directories
+// that haven't changed since. Then writes an up-to-date index there, along
+// with `eventId` as its resume point.
+//
+// A directory's listing is only taken from the index when its inode and
+// modification time match and it wasn't modified within a couple of seconds
+// of being listed, since coarse timestamps can't tell those changes apart.
+// Note that editing a file in place doesn't touch its directory, so the
+// sizes and times of files in unchanged directories are as of the last
+// index; watching with the saved `eventId` catches those up where the
+// backend can replay history.
+//
+// Returns `0`, or the `errno` (a Win32 error code on Windows) that kept us
+// from listing `root`. Failing to read or write the index isn't an error.
+int RefreshTreeIndex(const std::string &root, const std::string &indexPath,
+                     uint64_t eventId, TreeIndexResult &result);
@@ -0,0 +1,227 @@
+// Measures how fast the native watcher sets up watches and delivers events,
+// so that regressions in the hot path show up before a release does.
+//
+//   node scripts/bench.js [--backend=NAME] [--dirs=N] [--events=N] [--json]
+//
+// `--backend` picks among the backends that can be chosen at runtime:
+// `inotify`, `io_uring` and `fanotify` on Linux. Elsewhere, the backend is
+// whichever one the module was built with (FSEvents or kqueue on macOS,
+// `ReadDirectoryChangesW` on Windows), and `--backend` is only a label.
+//
+// Each run reports:
+//
+//   * how long it takes to watch `--dirs` sibling directories one at a time,
+//     and to watch a tree of that many directories with a single recursive
+//     watch;
+//   * how much the process's RSS grows per watched directory;
+//   * end-to-end throughput, from a worker thread writing `--events` files to
+//     our callback hearing about them;
+//   * how much main-thread time each event costs, measured as event-loop
+//     utilization while the worker writes.
+const { Worker } = require('node:worker_threads');
+const { performance } = require('node:perf_hooks');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+
+const PathWatcher = require('../src/main');
+
+let binding;
+try {
+  binding = require('../build/Debug/pathwatcher.node');
+} catch (err) {
+  binding = require('../build/Release/pathwatcher.node');
+}
+
+const BACKEND_OPTIONS = {
+  inotify: { linuxFanotify: false, linuxIoUring: false },
+  io_uring: { linuxFanotify: false, linuxIoUring: true },
+  fanotify: { linuxFanotify: true, linuxIoUring: false }
+};
+
+function parseArgs (argv) {
+  let args = {
+    backend: process.platform === 'linux' ? 'inotify' : process.platform,
+    dirs: 1000,
+    events: 10000,
+    json: false
+  };
+  for (let arg of argv) {
+    let [key, value] = arg.replace(/^--/, '').split('=');
+    if (key === 'json') {
+      args.json = true;
+    } else if (key === 'backend') {
+      args.backend = value;
+    } else if (key === 'dirs' || key === 'events') {
+      args[key] = Math.max(1, parseInt(value, 10) || 0);
+    } else {
+      throw new Error(`Unknown option: ${arg}`);
+    }
+  }
+  return args;
+}
+
+function wait (ms) {
+  return new Promise(resolve => setTimeout(resolve, ms));
+}
+
+function makeTempDir () {
+  return fs.realpathSync(fs.mkdtempSync(path.join(os.tmpdir(), 'pathwatcher-bench-')));
+}
+
+function makeFlatDirs (root, count) {
+  let dirs = [];
+  for (let i = 0; i < count; i++) {
+    let dir = path.join(root, `dir-${i}`);
+    fs.mkdirSync(dir);
+    dirs.push(dir);
+  }
+  return dirs;
+}
+
+// Builds a tree of `count` directories, ten to a parent.
+function makeTree (root, count) {
+  let queue = [root];
+  let made = 0;
+  while (made < count) {
+    let parent = queue.shift();
+    for (let i = 0; i < 10 && made < count; i++, made++) {
+      let dir = path.join(parent, `d${i}`);
+      fs.mkdirSync(dir);
+      queue.push(dir);
+    }
+  }
+}
+
+function rssMiB () {
+  if (global.gc) global.gc();
+  return process.memoryUsage().rss / (1024 * 1024);
+}
+
+async function measureFlatSetup (root, count) {
+  let dirs = makeFlatDirs(root, count);
+  let rssBefore = rssMiB();
+  let start = performance.now();
+  let watchers = dirs.map(dir => PathWatcher.watch(dir, () => {}));
+  let elapsed = performance.now() - start;
+  // Give the backend a moment to finish anything it does in the background.
+  await wait(200);
+  let rssAfter = rssMiB();
+  for (let watcher of watchers) watcher.close();
+  await wait(200);
+  return {
+    totalMs: elapsed,
+    perDirUs: (elapsed * 1000) / count,
+    rssPerDirKiB: ((rssAfter - rssBefore) * 1024) / count
+  };
+}
+
+async function measureRecursiveSetup (root, count) {
+  makeTree(root, count);
+  // The binding is only set up once something has been watched through the
+  // public API, so make sure that's happened.
+  let primer = PathWatcher.watch(path.dirname(root), () => {});
+  let start = performance.now();
+  let handle = binding.watch(root, true);
+  let elapsed = performance.now() - start;
+  binding.unwatch(handle);
+  primer.close();
+  await wait(200);
+  return { totalMs: elapsed, perDirUs: (elapsed * 1000) / count };
+}
+
+// Runs in a worker so that the main thread does nothing but handle events.
+const WRITER = `
+const { parentPort, workerData } = require('node:worker_threads');
+const fs = require('fs');
+const path = require('path');
+for (let i = 0; i < workerData.count; i++) {
+  fs.writeFileSync(path.join(workerData.dir, 'file-' + i), '');
+}
+parentPort.postMessage('done');
+`;
+
+async function measureThroughput (root, count) {
+  let dir = path.join(root, 'events');
+  fs.mkdirSync(dir);
+
+  let received = 0;
+  let lastEventAt = 0;
+  let watcher = PathWatcher.watch(dir, () => {
+    received++;
+    lastEventAt = performance.now();
+  });
+  await wait(200);
+
+  let eluBefore = performance.eventLoopUtilization();
+  let start = performance.now();
+  let worker = new Worker(WRITER, { eval: true, workerData: { dir, count } });
+  await new Promise((resolve, reject) => {
+    worker.on('message', resolve);
+    worker.on('error', reject);
+  });
+
+  // Wait until events stop arriving. Some backends coalesce, so we can't
+  // count on hearing about every single file.
+  let idleSince = performance.now();
+  let lastCount = -1;
+  while (performance.now() - idleSince < 1000 && received < count) {
+    if (received !== lastCount) {
+      lastCount = received;
+      idleSince = performance.now();
+    }
+    await wait(20);
+  }
+  let elu = performance.eventLoopUtilization(eluBefore);
+  watcher.close();
+  await wait(200);
+
+  let elapsedMs = (lastEventAt || performance.now()) - start;
+  return {
+    written: count,
+    received,
+    eventsPerSecond: received / (elapsedMs / 1000),
+    mainThreadUsPerEvent: received ? (elu.active * 1000) / received : 0
+  };
+}
+
+function report (args, results) {
+  if (args.json) {
+    console.log(JSON.stringify({ ...args, ...results }, null, 2));
+    return;
+  }
+  let { flat, recursive, throughput } = results;
+  console.log(`backend: ${args.backend} (${process.platform}, node ${process.version})`);
+  console.log(`watch ${args.dirs} dirs, flat:      ${flat.totalMs.toFixed(1)} ms (${flat.perDirUs.toFixed(1)} µs/dir)`);
+  console.log(`watch ${args.dirs} dirs, recursive: ${recursive.totalMs.toFixed(1)} ms (${recursive.perDirUs.toFixed(1)} µs/dir)`);
+  console.log(`RSS per watched dir:         ${flat.rssPerDirKiB.toFixed(2)} KiB`);
+  console.log(`events:                      ${throughput.received}/${throughput.written} received`);
+  console.log(`throughput:                  ${throughput.eventsPerSecond.toFixed(0)} events/s`);
+  console.log(`main-thread time per event:  ${throughput.mainThreadUsPerEvent.toFixed(2)} µs`);
+}
+
+(async () => {
+  let args = parseArgs(process.argv.slice(2));
+  let options = BACKEND_OPTIONS[args.backend];
+  if (process.platform === 'linux' && !options) {
+    throw new Error(`Unknown backend: ${args.backend}`);
+  }
+  if (options) PathWatcher.configure(options);
+
+  let root = makeTempDir();
+  try {
+    let flatRoot = path.join(root, 'flat');
+    let treeRoot = path.join(root, 'tree');
+    fs.mkdirSync(flatRoot);
+    fs.mkdirSync(treeRoot);
+    let results = {
+      flat: await measureFlatSetup(flatRoot, args.dirs),
+      recursive: await measureRecursiveSetup(treeRoot, args.dirs),
+      throughput: await measureThroughput(root, args.events)
+    };
+    report(args, results);
+  } finally {
+    PathWatcher.closeAllWatchers();
+    fs.rmSync(root, { recursive: true, force: true });
+  }
+})();
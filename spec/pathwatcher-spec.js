@@ -3,6 +3,13 @@ const fs = require('fs-plus');
 const path = require('path');
 const temp = require('temp');
 
+let binding;
+try {
+  binding = require('../build/Debug/pathwatcher.node');
+} catch (err) {
+  binding = require('../build/Release/pathwatcher.node');
+}
+
 temp.track();
 
 function EMPTY() {}
@@ -47,6 +54,705 @@ describe('PathWatcher', () => {
     });
   });
 
+  describe('configure', () => {
+    afterEach(() => {
+      PathWatcher.configure({
+        batchWindowMs: 50,
+        nonBlocking: true,
+        packedBatches: true,
+        handleEventsPerSecond: 0,
+        handleEventBurst: 0,
+        changeLogSize: 0,
+        pullDelivery: false,
+        rootRelativePaths: false,
+        collectStats: false
+      });
+    });
+
+    it('still delivers events when batching is turned off', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ batchWindowMs: 0, nonBlocking: false });
+
+      let done = false;
+      PathWatcher.watch(tempFile, (type) => {
+        expect(type).toBe('change');
+        done = true;
+      });
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+    });
+
+    it('delivers the same events whether or not batches are packed', async () => {
+      let unicodeFile = path.join(tempDir, 'fïlé-日本-😀');
+      fs.writeFileSync(unicodeFile, '');
+
+      for (let packedBatches of [true, false]) {
+        PathWatcher.closeAllWatchers();
+        PathWatcher.configure({ batchWindowMs: 50, nonBlocking: true, packedBatches });
+
+        // The native side watches the parent directory, so this only fires
+        // if the file's path survived the trip intact.
+        let events = [];
+        PathWatcher.watch(unicodeFile, (type) => events.push(type));
+        fs.writeFileSync(unicodeFile, `changed ${packedBatches}`);
+        await condition(() => events.length > 0);
+        expect(events[0]).toBe('change');
+      }
+      fs.removeSync(unicodeFile);
+    });
+
+    it('delivers whole paths with rootRelativePaths', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({
+        batchWindowMs: 50,
+        nonBlocking: true,
+        packedBatches: false,
+        rootRelativePaths: true
+      });
+
+      let paths = [];
+      PathWatcher.watch(tempDir, (type, filePath) => paths.push(filePath));
+      fs.writeFileSync(path.join(tempDir, 'relative'), '');
+      await condition(() => paths.length > 0);
+      expect(paths[0]).toBe(
+        path.join(fs.realpathSync(tempDir), 'relative')
+      );
+    });
+
+    it('sums up the events a watcher sends past its rate limit', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({
+        handleEventsPerSecond: 1,
+        handleEventBurst: 1,
+        collectStats: true
+      });
+
+      // Events inside a watched directory all reach us as `change`s, so the
+      // summary looks like any other.
+      let count = 0;
+      PathWatcher.watch(tempDir, () => count++);
+      for (let i = 0; i < 20; i++) {
+        fs.writeFileSync(path.join(tempDir, `noisy-${i}`), '');
+      }
+      await condition(() => PathWatcher.getStats().eventsThrottled > 0);
+      await condition(() => count > 1);
+      expect(count).toBeLessThan(20);
+    });
+
+    it('sends high-priority events ahead of the batch window', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ batchWindowMs: 3000 });
+
+      let changedAt = null;
+      let watcher = PathWatcher.watch(tempFile, () => changedAt = Date.now());
+      watcher.setHighPriority();
+      let writtenAt = Date.now();
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => changedAt !== null);
+      expect(changedAt - writtenAt).toBeLessThan(2000);
+    });
+
+    it('holds events for drain when pullDelivery is on', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ pullDelivery: true });
+
+      let notifications = 0;
+      let sub = PathWatcher.onEventsAvailable(() => notifications++);
+      let events = [];
+      PathWatcher.watch(tempFile, (type) => events.push(type));
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => notifications > 0);
+      fs.writeFileSync(tempFile, 'changed again');
+      await wait(200);
+      // Only one notification until we drain, and nothing delivered yet.
+      expect(notifications).toBe(1);
+      expect(events).toEqual([]);
+
+      expect(PathWatcher.drain()).toBeGreaterThan(0);
+      expect(events[0]).toBe('change');
+      sub.dispose();
+    });
+
+    it('answers getChangesSince from the change log', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ changeLogSize: 100 });
+
+      let count = 0;
+      let watcher = PathWatcher.watch(tempDir, () => count++);
+      let { cursor, freshInstance } = watcher.getChangesSince(null);
+      expect(freshInstance).toBe(true);
+
+      let changed = path.join(tempDir, 'logged');
+      fs.writeFileSync(changed, 'one');
+      await condition(() => count > 0);
+      fs.writeFileSync(changed, 'two');
+      await wait(200);
+
+      let changes = watcher.getChangesSince(cursor);
+      expect(changes.freshInstance).toBe(false);
+      // However many events it took, the path is only listed once.
+      expect(changes.paths.filter(p => p.endsWith('logged')).length).toBe(1);
+      expect(watcher.getChangesSince(changes.cursor).paths).toEqual([]);
+      fs.removeSync(changed);
+    });
+  });
+
+  describe('getEventPoolStats', () => {
+    it('reports how event batches have been used', async () => {
+      let done = false;
+      PathWatcher.watch(tempFile, () => done = true);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+
+      let stats = PathWatcher.getEventPoolStats();
+      expect(stats.allocated).toBeGreaterThan(0);
+      expect(stats.inUseHighWater).toBeGreaterThan(0);
+      expect(stats.eventsHighWater).toBeGreaterThan(0);
+      expect(stats.pathBytesHighWater).toBeGreaterThan(0);
+    });
+  });
+
+  describe('watchAsync', () => {
+    it('resolves with a watcher that fires the callback', async () => {
+      let done = false;
+      let watcher = await PathWatcher.watchAsync(tempFile, () => done = true);
+      expect(PathWatcher.getWatchedPaths()).toContain(watcher.normalizedPath);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+    });
+
+    it('delivers what happened before it resolved', async () => {
+      const { Worker } = require('node:worker_threads');
+      // A worker keeps writing, whatever the main thread is up to, until the
+      // watch resolves, so nearly all it writes happens while the watch is
+      // being set up.
+      let stop = new Int32Array(new SharedArrayBuffer(4));
+      let writer = new Worker(`
+        const fs = require('fs');
+        const { workerData } = require('node:worker_threads');
+        for (let i = 0; Atomics.load(workerData.stop, 0) === 0; i++) {
+          fs.writeFileSync(workerData.file, String(i));
+        }
+      `, { eval: true, workerData: { file: tempFile, stop } });
+
+      let changes = 0;
+      let promise = PathWatcher.watchAsync(tempDir, () => changes++);
+      promise.then(() => Atomics.store(stop, 0, 1));
+      await promise;
+      await new Promise((resolve) => writer.on('exit', resolve));
+      await condition(() => changes > 0);
+    });
+  });
+
+  describe('when a path is watched again right after being unwatched', () => {
+    it('gets a working watch, not the one being torn down', async () => {
+      let done = false;
+      PathWatcher.watch(tempFile, EMPTY).close();
+      let watcher = PathWatcher.watch(tempFile, () => done = true);
+      expect(PathWatcher.getWatchedPaths()).toContain(watcher.normalizedPath);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+    });
+
+    it('does so with watchAsync too', async () => {
+      let done = false;
+      (await PathWatcher.watchAsync(tempFile, EMPTY)).close();
+      let watcher = await PathWatcher.watchAsync(tempFile, () => done = true);
+      expect(PathWatcher.getWatchedPaths()).toContain(watcher.normalizedPath);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+    });
+  });
+
+  describe('getTrace', () => {
+    afterEach(() => PathWatcher.setTracing(false));
+
+    it('returns the messages recorded while tracing was on', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.getTrace({ clear: true });
+      expect(PathWatcher.getTrace()).toEqual([]);
+      PathWatcher.setTracing(true);
+
+      let changed = false;
+      PathWatcher.watch(tempFile, () => changed = true);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => changed);
+
+      let trace = PathWatcher.getTrace({ clear: true });
+      for (let message of trace) expect(typeof message).toBe('string');
+      if (process.platform === 'linux') {
+        // Starting the backend and adding the watch both leave a message.
+        expect(trace.some(m => m.includes('Using backend'))).toBe(true);
+        expect(
+          trace.some(m => m.includes('Added') &&
+            m.includes(path.basename(tempDir)))
+        ).toBe(true);
+      }
+      expect(PathWatcher.getTrace()).toEqual([]);
+    });
+
+    it('records nothing while tracing is off', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.setTracing(false);
+      PathWatcher.getTrace({ clear: true });
+
+      let changed = false;
+      PathWatcher.watch(tempFile, () => changed = true);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => changed);
+
+      expect(PathWatcher.getTrace()).toEqual([]);
+    });
+  });
+
+  describe('digestFile', () => {
+    it('resolves with the SHA-1 digest of the file', async () => {
+      fs.writeFileSync(tempFile, 'x');
+      expect(await PathWatcher.digestFile(tempFile)).toBe(
+        '11f6ad8ec52a2984abaafd7c3b516503785c2072'
+      );
+    });
+  });
+
+  describe('when watching with the digest option', () => {
+    it('leaves out changes that keep the same contents', async () => {
+      let changes = 0;
+      PathWatcher.watch(tempFile, () => changes++, { digest: true });
+      fs.writeFileSync(tempFile, 'first');
+      await condition(() => changes === 1);
+
+      fs.writeFileSync(tempFile, 'first');
+      await wait(200);
+      expect(changes).toBe(1);
+
+      fs.writeFileSync(tempFile, 'second');
+      await condition(() => changes === 2);
+    });
+  });
+
+  describe('when watching with the fingerprint option', () => {
+    it('still reports changes to the file', async () => {
+      let changes = 0;
+      PathWatcher.watch(tempFile, () => changes++, { fingerprint: true });
+      fs.writeFileSync(tempFile, 'first');
+      await condition(() => changes === 1);
+      fs.writeFileSync(tempFile, 'second, and longer');
+      await condition(() => changes === 2);
+    });
+
+    if (process.platform !== 'win32') {
+      it('leaves out a repeat once the write is well behind it #darwin #linux', async () => {
+        let changes = 0;
+        PathWatcher.watch(tempFile, () => changes++, { fingerprint: true });
+        fs.writeFileSync(tempFile, 'written');
+        await condition(() => changes > 0);
+
+        // The fingerprint taken for that change was too early to vouch for
+        // the file, but once the write is long enough ago, a change to its
+        // mode alone doesn't count.
+        await wait(4500);
+        let seen = changes;
+        fs.chmodSync(tempFile, 0o600);
+        await wait(500);
+        expect(changes).toBe(seen);
+      }, 10000);
+    }
+  });
+
+  describe('when watching with the backend option', () => {
+    it('reports changes whichever backend it picks', async () => {
+      for (let backend of ['fsevents', 'kqueue', 'hybrid']) {
+        let changes = 0;
+        let watcher = PathWatcher.watch(tempFile, () => changes++, { backend });
+        fs.writeFileSync(tempFile, backend);
+        await condition(() => changes > 0);
+        watcher.close();
+      }
+    });
+  });
+
+  describe('when watching with the tuning option', () => {
+    if (process.platform === 'linux') {
+      it('only reports finished writes with writeCompleteOnly #linux', async () => {
+        let changes = 0;
+        PathWatcher.watch(tempFile, (type) => {
+          if (type === 'change') changes++;
+        }, { tuning: { writeCompleteOnly: true } });
+
+        // Two writes, each of which would be an IN_MODIFY, and one close
+        let fd = fs.openSync(tempFile, 'w');
+        fs.writeSync(fd, 'first half');
+        await wait(100);
+        fs.writeSync(fd, ', second half');
+        fs.closeSync(fd);
+
+        await condition(() => changes > 0);
+        await wait(300);
+        expect(changes).toBe(1);
+      });
+    }
+
+    if (process.platform === 'linux') {
+      it('only reports finished writes with linuxWriteCompleteOnly #linux', async () => {
+        PathWatcher.configure({ linuxWriteCompleteOnly: true });
+        try {
+          let changes = 0;
+          PathWatcher.watch(tempFile, (type) => {
+            if (type === 'change') changes++;
+          });
+
+          let fd = fs.openSync(tempFile, 'w');
+          for (let i = 0; i < 5; i++) {
+            fs.writeSync(fd, `chunk ${i}\n`);
+            await wait(50);
+          }
+          fs.closeSync(fd);
+
+          await condition(() => changes > 0);
+          await wait(300);
+          expect(changes).toBe(1);
+        } finally {
+          PathWatcher.configure({ linuxWriteCompleteOnly: false });
+        }
+      });
+    }
+
+    it('still reports changes with resyncOnOverflow', async () => {
+      let changed = false;
+      PathWatcher.watch(tempFile, () => changed = true, {
+        tuning: { resyncOnOverflow: true }
+      });
+
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => changed);
+    });
+
+    if (process.platform === 'darwin') {
+      it('reports renames in a directory it resyncs #darwin', async () => {
+        let changed = false;
+        PathWatcher.watch(tempDir, () => changed = true, {
+          tuning: { resyncOnOverflow: true }
+        });
+
+        fs.renameSync(tempFile, path.join(tempDir, 'moved.txt'));
+        await condition(() => changed);
+      });
+    }
+
+    it('keys the same settings the same way in any order', () => {
+      let first = PathWatcher.watch(tempFile, EMPTY, {
+        tuning: { writeCompleteOnly: true, pollIntervalMs: 500 }
+      });
+      let second = PathWatcher.watch(tempFile, EMPTY, {
+        tuning: { pollIntervalMs: 500, writeCompleteOnly: true, unknown: 1 }
+      });
+      expect(second.native).toBe(first.native);
+    });
+
+    it('still reports changes with the polling settings', async () => {
+      let changed = false;
+      let watcher = PathWatcher.watch(tempDir, () => changed = true, {
+        tuning: {
+          incrementalScan: true,
+          pollIntervalMs: 100,
+          maxPollIntervalMs: 400,
+          scanBudget: 8,
+          scanThreads: 2
+        }
+      });
+      expect(watcher.native.tuning).toEqual({
+        incrementalScan: true,
+        pollIntervalMs: 100,
+        maxPollIntervalMs: 400,
+        scanBudget: 8,
+        scanThreads: 2
+      });
+
+      fs.writeFileSync(path.join(tempDir, 'polled'), '');
+      await condition(() => changed);
+      fs.removeSync(path.join(tempDir, 'polled'));
+    });
+
+    it('rate-limits one watch of a path that another watches unlimited', async () => {
+      let limited = 0;
+      let unlimited = 0;
+      PathWatcher.watch(tempDir, () => unlimited++);
+      PathWatcher.watch(tempDir, () => limited++, {
+        tuning: { handleEventsPerSecond: 1, handleEventBurst: 1 }
+      });
+      for (let i = 0; i < 20; i++) {
+        fs.writeFileSync(path.join(tempDir, `noisy-${i}`), '');
+      }
+
+      await condition(() => unlimited >= 20 && limited > 1);
+      expect(limited).toBeLessThan(20);
+    });
+
+    it('refuses a path that is already watched untuned', async () => {
+      let untuned = 0;
+      PathWatcher.watch(tempFile, () => untuned++);
+      let error;
+      try {
+        PathWatcher.watch(tempFile, EMPTY, {
+          tuning: { writeCompleteOnly: true }
+        });
+      } catch (err) {
+        error = err;
+      }
+      expect(error.code).toBe(-2);
+
+      // The watch that was there first still works.
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => untuned > 0);
+    });
+  });
+
+  describe('listDirectory', () => {
+    it('resolves with the names and types of the entries', async () => {
+      let { names, types } = await PathWatcher.listDirectory(tempDir);
+      let index = names.indexOf('file');
+      expect(index).not.toBe(-1);
+      expect(types[index]).toBe(PathWatcher.ENTRY_FILE);
+    });
+
+    it('rejects with a code when the directory does not exist', async () => {
+      let error;
+      try {
+        await PathWatcher.listDirectory(path.join(tempDir, 'nope'));
+      } catch (err) {
+        error = err;
+      }
+      expect(error.code).toBe('ENOENT');
+    });
+  });
+
+  describe('loadTreeIndex', () => {
+    it('only reads directories that changed since the last load', async () => {
+      let root = temp.mkdirSync('node-pathwatcher-tree');
+      let indexPath = path.join(tempDir, 'tree-index');
+      fs.mkdirSync(path.join(root, 'a', 'b'), { recursive: true });
+      fs.mkdirSync(path.join(root, 'c'));
+      fs.writeFileSync(path.join(root, 'a', 'file'), 'x');
+      // Directories changed a moment ago are always read again.
+      let anHourAgo = new Date(Date.now() - 3600 * 1000);
+      for (let dir of ['a/b', 'a', 'c', '.']) {
+        fs.utimesSync(path.join(root, dir), anHourAgo, anHourAgo);
+      }
+
+      let first = await PathWatcher.loadTreeIndex(root, indexPath);
+      expect(first.paths).toEqual(['a', 'a/b', 'a/file', 'c']);
+      expect(first.types[2]).toBe(PathWatcher.ENTRY_FILE);
+      expect(first.sizes[2]).toBe(1);
+      expect(first.directoriesRead).toBe(4);
+
+      let second = await PathWatcher.loadTreeIndex(root, indexPath);
+      expect(second.paths).toEqual(first.paths);
+      expect(second.directoriesRead).toBe(0);
+
+      fs.writeFileSync(path.join(root, 'c', 'new'), '');
+      let third = await PathWatcher.loadTreeIndex(root, indexPath);
+      expect(third.paths).toEqual(['a', 'a/b', 'a/file', 'c', 'c/new']);
+      expect(third.directoriesRead).toBe(1);
+    });
+  });
+
+  describe('getLastEventId', () => {
+    it('returns a BigInt or null', () => {
+      let id = PathWatcher.getLastEventId();
+      expect(id === null || typeof id === 'bigint').toBe(true);
+    });
+
+    it('accepts its result when watching a path', async () => {
+      let done = false;
+      let id = PathWatcher.getLastEventId();
+      PathWatcher.watch(tempFile, () => done = true, { sinceEventId: id });
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+    });
+  });
+
+  describe('getFdStats', () => {
+    it('returns null except on macOS', () => {
+      PathWatcher.watch(tempFile, EMPTY);
+      let stats = PathWatcher.getFdStats();
+      if (process.platform !== 'darwin') {
+        expect(stats).toBeNull();
+        return;
+      }
+      expect(stats.budget).toEqual(jasmine.any(Number));
+      expect(stats.evictions).toBeGreaterThanOrEqual(0);
+      expect(stats.promotions).toBeGreaterThanOrEqual(0);
+    });
+
+    if (process.platform === 'darwin') {
+      it('counts kqueue watches on the kqueue backend #darwin', () => {
+        PathWatcher.watch(tempFile, EMPTY, { backend: 'kqueue' });
+        let stats = PathWatcher.getFdStats();
+        expect(stats.kqueueWatches + stats.polledWatches).toBeGreaterThan(0);
+      });
+    }
+  });
+
+  describe('getStats', () => {
+    afterEach(() => {
+      PathWatcher.configure({ collectStats: false });
+    });
+
+    it('reports delivery stats once they are turned on', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ collectStats: true });
+
+      let done = false;
+      PathWatcher.watch(tempFile, () => done = true);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+
+      let stats = PathWatcher.getStats();
+      expect(stats.eventsReceived).toBeGreaterThan(0);
+      expect(stats.eventsDelivered).toBeGreaterThan(0);
+      expect(stats.deliveryLatency.count).toBeGreaterThan(0);
+      expect(stats.handles.length).toBeGreaterThan(0);
+      expect(typeof stats.handles[0].handle).toBe('bigint');
+    });
+
+    it('forgets a handle once it is unwatched', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ collectStats: true });
+      let otherDir = path.join(tempDir, 'stats-other');
+      fs.makeTreeSync(otherDir);
+
+      let changes = 0;
+      let watcher = PathWatcher.watch(tempFile, () => changes++);
+      PathWatcher.watch(otherDir, () => changes++);
+      fs.writeFileSync(tempFile, 'changed');
+      fs.writeFileSync(path.join(otherDir, 'file'), 'changed');
+      await condition(() => PathWatcher.getStats().handles.length === 2);
+
+      watcher.close();
+      expect(PathWatcher.getStats().handles.length).toBe(1);
+
+      PathWatcher.closeAllWatchers();
+      expect(PathWatcher.getStats().queueDepth).toBe(0);
+      fs.removeSync(otherDir);
+    });
+  });
+
+  describe('with the smallHandles option', () => {
+    afterEach(() => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ smallHandles: false, collectStats: false });
+    });
+
+    it('numbers handles and still delivers events', async () => {
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ smallHandles: true, collectStats: true });
+
+      let done = false;
+      PathWatcher.watch(tempFile, () => done = true);
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => done);
+
+      let stats = PathWatcher.getStats();
+      expect(typeof stats.handles[0].handle).toBe('number');
+    });
+  });
+
+  describe('with the sharedBackend option', () => {
+    let worker = null;
+
+    afterEach(async () => {
+      if (worker) await worker.terminate();
+      worker = null;
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ sharedBackend: false });
+    });
+
+    it('delivers a shared watch’s events to every thread', async () => {
+      const { Worker } = require('node:worker_threads');
+      PathWatcher.closeAllWatchers();
+      PathWatcher.configure({ sharedBackend: true });
+
+      let changes = 0;
+      PathWatcher.watch(tempFile, () => changes++);
+
+      // The worker watches the same file through the same backend, and says
+      // so for each change it hears about.
+      worker = new Worker(`
+        const { parentPort, workerData } = require('node:worker_threads');
+        const PathWatcher = require(workerData.main);
+        PathWatcher.configure({ sharedBackend: true });
+        PathWatcher.watch(workerData.file, () => parentPort.postMessage('change'));
+        parentPort.postMessage('ready');
+      `, {
+        eval: true,
+        workerData: { main: require.resolve('../src/main'), file: tempFile }
+      });
+      let messages = [];
+      worker.on('message', (message) => messages.push(message));
+      await condition(() => messages.includes('ready'));
+
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => changes > 0 && messages.includes('change'));
+
+      // The main thread's subscription outlives the worker's.
+      await worker.terminate();
+      worker = null;
+      let seen = changes;
+      fs.writeFileSync(tempFile, 'changed again');
+      await condition(() => changes > seen);
+    });
+
+    if (process.platform === 'linux') {
+      it('leaves a tuned child its own watch under a recursive parent #linux', async () => {
+        PathWatcher.closeAllWatchers();
+        PathWatcher.configure({ sharedBackend: true });
+        let childDir = path.join(tempDir, 'tuned');
+        let childFile = path.join(childDir, 'file');
+        fs.makeTreeSync(childDir);
+        fs.writeFileSync(childFile, '');
+
+        try {
+          let changes = 0;
+          PathWatcher.watch(childFile, (type) => {
+            if (type === 'change') changes++;
+          }, { tuning: { writeCompleteOnly: true } });
+          let parentEvents = 0;
+          PathWatcher.watch(tempDir, () => parentEvents++, { recursive: true });
+
+          // The child still only hears about the finished write.
+          let fd = fs.openSync(childFile, 'w');
+          fs.writeSync(fd, 'first half');
+          await wait(100);
+          fs.writeSync(fd, ', second half');
+          fs.closeSync(fd);
+          await condition(() => changes > 0);
+          await wait(300);
+          expect(changes).toBe(1);
+
+          fs.writeFileSync(path.join(tempDir, 'beside'), '');
+          await condition(() => parentEvents > 0);
+        } finally {
+          fs.removeSync(childDir);
+          fs.removeSync(path.join(tempDir, 'beside'));
+        }
+      });
+    }
+  });
+
+  describe('getMemoryUsage', () => {
+    it('counts what the watchers hold', () => {
+      let before = PathWatcher.getMemoryUsage();
+      PathWatcher.watch(tempFile, EMPTY);
+      let after = PathWatcher.getMemoryUsage();
+      expect(after.totalBytes).toBeGreaterThan(before.totalBytes);
+      expect(after.listenerBytes).toBeGreaterThan(0);
+      if (process.platform === 'linux') {
+        expect(after.kernelWatches).toBeGreaterThan(0);
+        expect(after.fileDescriptors).toBeGreaterThan(0);
+      }
+    });
+  });
+
   describe('closeAllWatchers', () => {
     it('closes all watched paths', () => {
       let realTempFilePath = fs.realpathSync(tempFile);
@@ -116,6 +822,57 @@ describe('PathWatcher', () => {
     });
   });
 
+  describe('when a sibling of a watched file changes', () => {
+    it('does not fire the callback', async () => {
+      let siblingFile = path.join(tempDir, 'sibling');
+      let events = [];
+      PathWatcher.watch(tempFile, (type) => events.push(type));
+
+      fs.writeFileSync(siblingFile, 'created');
+      fs.writeFileSync(siblingFile, 'changed');
+      fs.unlinkSync(siblingFile);
+      await wait(300);
+      expect(events).toEqual([]);
+
+      fs.writeFileSync(tempFile, 'changed');
+      await condition(() => events.length > 0);
+      expect(events[0]).toBe('change');
+    });
+  });
+
+  if (process.platform === 'linux') {
+    describe('with the precise option #linux', () => {
+      it('follows the file when a new one is renamed over it', async () => {
+        let events = [];
+        PathWatcher.watch(tempFile, (type) => events.push(type), {
+          precise: true
+        });
+
+        // What an editor does when it saves atomically
+        let saved = path.join(tempDir, 'file.tmp');
+        fs.writeFileSync(saved, 'saved');
+        fs.renameSync(saved, tempFile);
+        await condition(() => events.includes('change'));
+
+        // The watch is on the new inode now, not the one that was replaced
+        events = [];
+        fs.writeFileSync(tempFile, 'changed again');
+        await condition(() => events.includes('change'));
+        expect(events).not.toContain('delete');
+      });
+
+      it('reports the file being deleted', async () => {
+        let events = [];
+        PathWatcher.watch(tempFile, (type) => events.push(type), {
+          precise: true
+        });
+
+        fs.unlinkSync(tempFile);
+        await condition(() => events.includes('delete'));
+      });
+    });
+  }
+
   describe('when a watched path is changed', () => {
     it('fires the callback with the event type and empty path', async () => {
       let eventType;
@@ -174,6 +931,36 @@ describe('PathWatcher', () => {
     });
   }
 
+  if (process.platform === 'darwin') {
+    describe('when watched directories fall in nested shards #darwin', () => {
+      it('reports a change in the inner one only once', async () => {
+        // Shards are keyed by the first three components of a path, so a
+        // watch two components deep gets a stream of its own that also
+        // covers the temp directory's shard.
+        let realTempDir = fs.realpathSync(tempDir);
+        let outer = realTempDir.split(path.sep).slice(0, 3).join(path.sep);
+        let count = 0;
+        let countChange = () => count++;
+
+        PathWatcher.watch(realTempDir, countChange);
+        fs.writeFileSync(path.join(realTempDir, 'sharded'), 'alone');
+        await condition(() => count > 0);
+        await wait(500);
+        let alone = count;
+        PathWatcher.closeAllWatchers();
+        await wait(100);
+
+        count = 0;
+        PathWatcher.watch(outer, EMPTY);
+        PathWatcher.watch(realTempDir, countChange);
+        fs.writeFileSync(path.join(realTempDir, 'sharded-again'), 'nested');
+        await condition(() => count > 0);
+        await wait(500);
+        expect(count).toBe(alone);
+      });
+    });
+  }
+
   describe('when a file under a watched directory is deleted', () => {
     it('fires the callback with the change event and empty path', async () => {
       let fileUnderDir = path.join(tempDir, 'file');
@@ -193,6 +980,231 @@ describe('PathWatcher', () => {
     });
   });
 
+  describe('when watching a directory recursively', () => {
+    let treeDir;
+    beforeEach(() => {
+      treeDir = path.join(tempDir, 'tree');
+      fs.makeTreeSync(path.join(treeDir, 'a', 'b'));
+    });
+    afterEach(() => fs.removeSync(treeDir));
+
+    it('reports changes below its children', async () => {
+      let events = [];
+      PathWatcher.watch(treeDir, (type, filePath) => {
+        events.push([type, filePath]);
+      }, { recursive: true });
+
+      fs.writeFileSync(path.join(treeDir, 'a', 'b', 'deep'), '');
+      await condition(() => events.length > 0);
+      expect(events[0]).toEqual(['change', '']);
+    });
+
+    it('reports what mkdir -p creates and fills at once', async () => {
+      PathWatcher.configure({ changeLogSize: 100 });
+      try {
+        let watcher = PathWatcher.watch(treeDir, EMPTY, { recursive: true });
+        let { cursor } = watcher.getChangesSince(null);
+        let leaf = path.join(treeDir, 'n', 'o', 'p', 'leaf');
+        let top = path.join(treeDir, 'n', 'top');
+
+        // Nothing below `n` is watched until its creation has been read, by
+        // which time all of it is already there.
+        fs.mkdirSync(path.dirname(leaf), { recursive: true });
+        fs.writeFileSync(leaf, '');
+        fs.writeFileSync(top, '');
+
+        let seen = new Set();
+        await condition(() => {
+          let changes = watcher.getChangesSince(cursor);
+          cursor = changes.cursor;
+          for (let changed of changes.paths) seen.add(fs.realpathSync(changed));
+          return seen.has(fs.realpathSync(leaf)) &&
+            seen.has(fs.realpathSync(top));
+        });
+      } finally {
+        PathWatcher.configure({ changeLogSize: 0 });
+      }
+    });
+
+    it('is armed right away without armInBackground', async () => {
+      let watcher = PathWatcher.watch(treeDir, EMPTY, { recursive: true });
+      expect(watcher.native.armed).toBe(true);
+      await watcher.whenArmed();
+    });
+
+    it('sends armed once the tree is watched with armInBackground', async () => {
+      let types = [];
+      let watcher = PathWatcher.watch(treeDir, (type) => types.push(type), {
+        recursive: true,
+        armInBackground: true
+      });
+      await watcher.whenArmed();
+      expect(watcher.native.armed).toBe(true);
+
+      // Armed means the deepest directory is watched, and the event itself
+      // never reaches the callback.
+      fs.writeFileSync(path.join(treeDir, 'a', 'b', 'deep'), '');
+      await condition(() => types.length > 0);
+      expect(types).not.toContain('armed');
+    });
+
+    it('watches the first levels right away with armDepth', async () => {
+      let types = [];
+      let watcher = PathWatcher.watch(treeDir, (type) => types.push(type), {
+        recursive: true,
+        armInBackground: true,
+        armDepth: 1
+      });
+      expect(watcher.native.armDepth).toBe(1);
+
+      // `a` is one level down, so it's watched before `watch` returns.
+      fs.writeFileSync(path.join(treeDir, 'a', 'shallow'), '');
+      await condition(() => types.length > 0);
+
+      await watcher.whenArmed();
+      expect(watcher.native.armed).toBe(true);
+    });
+
+    it('resolves whenArmed from watchAsync, too', async () => {
+      let watcher = await PathWatcher.watchAsync(treeDir, EMPTY, {
+        recursive: true,
+        armInBackground: true
+      });
+      await watcher.whenArmed();
+      expect(watcher.native.armed).toBe(true);
+    });
+
+    it('does not share a watch made without recursive', () => {
+      let flat = PathWatcher.watch(treeDir, EMPTY);
+      let deep = PathWatcher.watch(treeDir, EMPTY, { recursive: true });
+      expect(deep.native).not.toBe(flat.native);
+    });
+  });
+
+  describe('with exclude and include patterns', () => {
+    let treeDir;
+    beforeEach(() => {
+      treeDir = path.join(tempDir, 'filtered');
+      fs.makeTreeSync(path.join(treeDir, 'node_modules', 'x'));
+      fs.makeTreeSync(path.join(treeDir, 'src'));
+    });
+    afterEach(() => fs.removeSync(treeDir));
+
+    it('drops the changes they rule out', async () => {
+      let events = 0;
+      PathWatcher.watch(treeDir, () => events++, {
+        recursive: true,
+        exclude: ['node_modules'],
+        include: ['*.js']
+      });
+
+      fs.writeFileSync(path.join(treeDir, 'node_modules', 'x', 'a.js'), '');
+      fs.writeFileSync(path.join(treeDir, 'src', 'a.css'), '');
+      await wait(300);
+      expect(events).toBe(0);
+
+      fs.writeFileSync(path.join(treeDir, 'src', 'a.js'), '');
+      await condition(() => events > 0);
+    });
+
+    it('does not share a watch with an unfiltered one', () => {
+      let plain = PathWatcher.watch(treeDir, EMPTY, { recursive: true });
+      let filtered = PathWatcher.watch(treeDir, EMPTY, {
+        recursive: true,
+        exclude: ['node_modules']
+      });
+      expect(filtered.native).not.toBe(plain.native);
+    });
+  });
+
+  describe('when a path is inside a recursive watch', () => {
+    let treeDir, childDir;
+    beforeEach(() => {
+      treeDir = path.join(tempDir, 'covering');
+      childDir = path.join(treeDir, 'a');
+      fs.makeTreeSync(path.join(childDir, 'b'));
+    });
+    afterEach(() => fs.removeSync(treeDir));
+
+    it('shares the covering watch #linux', async () => {
+      if (process.platform !== 'linux') return;
+      let rootEvents = 0;
+      let childEvents = 0;
+      PathWatcher.watch(treeDir, () => rootEvents++, { recursive: true });
+      let watches = PathWatcher.getMemoryUsage().kernelWatches;
+      PathWatcher.watch(childDir, () => childEvents++);
+      expect(PathWatcher.getMemoryUsage().kernelWatches).toBe(watches);
+
+      // A plain watch only hears about its own entries, even though the
+      // covering watch sees further down.
+      fs.writeFileSync(path.join(childDir, 'b', 'deep'), '');
+      await condition(() => rootEvents > 0);
+      await wait(100);
+      expect(childEvents).toBe(0);
+
+      fs.writeFileSync(path.join(childDir, 'file'), '');
+      await condition(() => childEvents > 0);
+    });
+
+    it('keeps delivering to covered watches once the covering one closes', async () => {
+      let rootEvents = 0;
+      let childEvents = 0;
+      let before = PathWatcher.getMemoryUsage().kernelWatches;
+      let root = PathWatcher.watch(treeDir, () => rootEvents++, {
+        recursive: true
+      });
+      let child = PathWatcher.watch(childDir, () => childEvents++);
+      root.close();
+
+      fs.writeFileSync(path.join(childDir, 'file'), '');
+      await condition(() => childEvents > 0);
+      expect(rootEvents).toBe(0);
+
+      child.close();
+      if (process.platform === 'linux') {
+        await condition(
+          () => PathWatcher.getMemoryUsage().kernelWatches === before
+        );
+      }
+    });
+
+    it('folds the paths of watchMany into their recursive ancestor #linux', () => {
+      if (process.platform !== 'linux') return;
+      // Make sure the binding's callback is set.
+      PathWatcher.watch(tempFile, EMPTY);
+      let before = PathWatcher.getMemoryUsage().kernelWatches;
+      // `covering`, `a` and `b`, however many of them are asked for.
+      let handles = binding.watchMany(
+        [path.join(childDir, 'b'), treeDir, childDir],
+        true
+      );
+      expect(handles.length).toBe(3);
+      expect(new Set(handles).size).toBe(3);
+      for (let handle of handles) expect(handle).not.toEqual(jasmine.any(Error));
+      expect(PathWatcher.getMemoryUsage().kernelWatches).toBe(before + 3);
+      binding.unwatchMany(handles);
+    });
+
+    it('gives every path of watchMany the options watch would', () => {
+      PathWatcher.watch(treeDir, EMPTY);
+      // The same arguments as `watch` after the path: not recursive, no
+      // event ID, not armed in the background, then patterns and tuning.
+      let handles = binding.watchMany(
+        [childDir, treeDir],
+        false,
+        undefined,
+        false,
+        { exclude: ['*.log'], include: [], writeCompleteOnly: true }
+      );
+      expect(handles[0]).not.toEqual(jasmine.any(Error));
+      // `treeDir` is already watched without them, so, just as with
+      // `watch`, it can't be watched with them too.
+      expect(handles[1]).toEqual(jasmine.any(Error));
+      expect(handles[1].code).toBe(-2);
+      binding.unwatchMany([handles[0]]);
+    });
+  });
+
   describe('when a new file is created under a watched directory', () => {
     it('fires the callback with the change event and empty path', async () => {
       let newFile = path.join(tempDir, 'file');
@@ -230,6 +1242,48 @@ describe('PathWatcher', () => {
     });
   });
 
+  describe('when a watched file is renamed and then changed', () => {
+    it('follows the file without replacing its native watcher', async () => {
+      let events = [];
+      let watcher = PathWatcher.watch(tempFile, (type) => events.push(type));
+      let native = watcher.native;
+
+      let renamed = path.join(tempDir, 'renamed-file');
+      fs.renameSync(tempFile, renamed);
+      await condition(() => events.includes('rename'));
+
+      fs.writeFileSync(renamed, 'changed');
+      await condition(() => events.includes('change'));
+      expect(watcher.native).toBe(native);
+      fs.unlinkSync(renamed);
+    });
+  });
+
+  describe('when many files under a watched directory change at once', () => {
+    it('delivers events for each of them', async () => {
+      let dir = path.join(tempDir, 'many');
+      fs.mkdirSync(dir);
+      let fileNames = [];
+      for (let i = 0; i < 50; i++) {
+        let fileName = path.join(dir, `file-${i}`);
+        fs.writeFileSync(fileName, '');
+        fileNames.push(fileName);
+      }
+      await wait(100);
+
+      let seen = new Set();
+      let watchers = fileNames.map((fileName) => {
+        return PathWatcher.watch(fileName, () => seen.add(fileName));
+      });
+
+      for (let fileName of fileNames) {
+        fs.writeFileSync(fileName, 'changed');
+      }
+      await condition(() => seen.size === fileNames.length);
+      for (let watcher of watchers) watcher.close();
+    });
+  });
+
   describe('when an exception is thrown in the closed watcher’s callback', () => {
     it('does not crash', async () => {
       let done = false;
@@ -0,0 +1,342 @@
+// Puts a recursive native watcher under known workloads and checks what it
+// reports against what was actually done, so that batching, coalescing and
+// overflow handling can be judged by how many changes go unreported and how
+// late the rest arrive.
+//
+//   node spec/soak.js [--backend=NAME|all] [--workload=NAME|all] [--count=N]
+//                     [--rate=N] [--batch-window=MS] [--queue-size=N]
+//                     [--settle=MS] [--json]
+//
+// `--backend` works as it does for `scripts/bench.js`; `all` runs every
+// backend that can be picked at runtime on this platform. The workloads are:
+//
+//   * `bulk`: creates `--count` files in one directory, then deletes them;
+//   * `renames`: creates `--count` files, then renames each of them, taking
+//     turns between a rename in place and a move to a sibling directory;
+//   * `atomic`: saves ten files `--count` times between them the way editors
+//     do, by writing a temporary file and renaming it over the target;
+//   * `mkdirp`: makes `--count` chains of nested directories, eight deep, as
+//     `mkdir -p` would, and writes a file at the bottom of each.
+//
+// A worker thread does the work, at most `--rate` operations per second
+// (`0`, the default, meaning as fast as it can), and notes when it did each
+// one. An operation counts as reported once an event names its path after
+// it was done; several operations on one path can share an event, since
+// backends are allowed to coalesce. For the same reason, a file that was
+// created and removed without any event naming it counts as reported: a
+// batch that holds both of them coalesces them away. Whatever else is never
+// reported within `--settle` milliseconds of the last event is lost.
+// `--batch-window` and `--queue-size` set `batchWindowMs` and
+// `maxQueueSize`, to see how those change things.
+//
+// Exits with a nonzero status if anything was lost without an `overflow`
+// event owning up to it.
+const { Worker } = require('node:worker_threads');
+const { performance } = require('node:perf_hooks');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+
+let binding;
+try {
+  binding = require('../build/Debug/pathwatcher.node');
+} catch (err) {
+  binding = require('../build/Release/pathwatcher.node');
+}
+
+const BACKEND_OPTIONS = {
+  inotify: { linuxFanotify: false, linuxIoUring: false },
+  io_uring: { linuxFanotify: false, linuxIoUring: true },
+  fanotify: { linuxFanotify: true, linuxIoUring: false }
+};
+
+const WORKLOADS = ['bulk', 'renames', 'atomic', 'mkdirp'];
+
+function parseArgs (argv) {
+  let args = {
+    backend: process.platform === 'linux' ? 'inotify' : process.platform,
+    workload: 'all',
+    count: 2000,
+    rate: 0,
+    batchWindow: 50,
+    queueSize: 10000,
+    settle: 1000,
+    json: false
+  };
+  for (let arg of argv) {
+    let [key, value] = arg.replace(/^--/, '').split('=');
+    if (key === 'json') {
+      args.json = true;
+    } else if (key === 'backend' || key === 'workload') {
+      args[key] = value;
+    } else if (key === 'count') {
+      args.count = Math.max(1, parseInt(value, 10) || 0);
+    } else if (key === 'rate' || key === 'settle') {
+      args[key] = Math.max(0, parseInt(value, 10) || 0);
+    } else if (key === 'batch-window') {
+      args.batchWindow = Math.max(0, parseInt(value, 10) || 0);
+    } else if (key === 'queue-size') {
+      args.queueSize = Math.max(1, parseInt(value, 10) || 0);
+    } else {
+      throw new Error(`Unknown option: ${arg}`);
+    }
+  }
+  return args;
+}
+
+function wait (ms) {
+  return new Promise(resolve => setTimeout(resolve, ms));
+}
+
+// A clock that the worker and the main thread agree on.
+function now () {
+  return performance.timeOrigin + performance.now();
+}
+
+function makeTempDir () {
+  return fs.realpathSync(fs.mkdtempSync(path.join(os.tmpdir(), 'pathwatcher-soak-')));
+}
+
+// Runs in a worker, so that the main thread does nothing but handle events.
+// Posts back the operations it did, as `[path, time, removed]`, where `path`
+// is the one an event should name afterwards and `removed` says whether the
+// operation removed it.
+const WRITER = `
+const { parentPort, workerData } = require('node:worker_threads');
+const { performance } = require('node:perf_hooks');
+const fs = require('fs');
+const path = require('path');
+
+const { workload, dir, count, rate } = workerData;
+const sleeper = new Int32Array(new SharedArrayBuffer(4));
+const ops = [];
+const start = performance.timeOrigin + performance.now();
+
+function did (filePath, removed = false) {
+  let at = performance.timeOrigin + performance.now();
+  ops.push([filePath, at, removed]);
+  if (rate > 0) {
+    // Keep to the rate on average, without letting a slow stretch turn into
+    // a burst afterwards.
+    let due = start + (ops.length * 1000) / rate;
+    if (due > at) Atomics.wait(sleeper, 0, 0, due - at);
+  }
+}
+
+if (workload === 'bulk') {
+  for (let i = 0; i < count; i++) {
+    let file = path.join(dir, 'file-' + i);
+    fs.writeFileSync(file, '');
+    did(file);
+  }
+  for (let i = 0; i < count; i++) {
+    let file = path.join(dir, 'file-' + i);
+    fs.unlinkSync(file);
+    did(file, true);
+  }
+} else if (workload === 'renames') {
+  let moved = path.join(dir, 'moved');
+  fs.mkdirSync(moved);
+  for (let i = 0; i < count; i++) {
+    let file = path.join(dir, 'file-' + i);
+    fs.writeFileSync(file, '');
+    did(file);
+  }
+  for (let i = 0; i < count; i++) {
+    let from = path.join(dir, 'file-' + i);
+    let to = i % 2 === 0
+      ? path.join(dir, 'renamed-' + i)
+      : path.join(moved, 'file-' + i);
+    fs.renameSync(from, to);
+    did(to);
+  }
+} else if (workload === 'atomic') {
+  for (let i = 0; i < count; i++) {
+    let file = path.join(dir, 'file-' + (i % 10));
+    let temp = path.join(dir, '.file-' + (i % 10) + '.tmp');
+    fs.writeFileSync(temp, String(i));
+    fs.renameSync(temp, file);
+    did(file);
+  }
+} else if (workload === 'mkdirp') {
+  for (let i = 0; i < count; i++) {
+    let chain = path.join(dir, 'deep-' + i, 'a', 'b', 'c', 'd', 'e', 'f', 'g');
+    fs.mkdirSync(chain, { recursive: true });
+    let at = path.join(dir, 'deep-' + i);
+    for (let name of ['', 'a', 'b', 'c', 'd', 'e', 'f', 'g']) {
+      at = path.join(at, name);
+      did(at);
+    }
+    let file = path.join(chain, 'leaf');
+    fs.writeFileSync(file, '');
+    did(file);
+  }
+}
+parentPort.postMessage(ops);
+`;
+
+function percentile (sorted, p) {
+  if (sorted.length === 0) return 0;
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+async function runWorkload (args, root, workload) {
+  let dir = path.join(root, workload);
+  fs.mkdirSync(dir);
+
+  // Every event, as `[path, oldPath, time]`, until the worker tells us what
+  // it did.
+  let events = [];
+  let overflows = 0;
+  let lastEventAt = now();
+  let onEvent = (action, handle, filePath, oldFilePath) => {
+    if (Array.isArray(action)) {
+      for (let event of action) onEvent(...event);
+      return;
+    }
+    lastEventAt = now();
+    if (action === 'overflow') {
+      overflows++;
+    } else if (action !== 'armed' && action !== 'throttled') {
+      events.push([filePath, oldFilePath, lastEventAt]);
+    }
+  };
+  binding.setCallback(onEvent, {
+    batchWindowMs: args.batchWindow,
+    maxQueueSize: args.queueSize,
+    nonBlocking: true,
+    ...(BACKEND_OPTIONS[args.backend] || {})
+  });
+
+  let handle = binding.watch(dir, true);
+  await wait(200);
+
+  let worker = new Worker(WRITER, {
+    eval: true,
+    workerData: { workload, dir, count: args.count, rate: args.rate }
+  });
+  let ops = await new Promise((resolve, reject) => {
+    worker.on('message', resolve);
+    worker.on('error', reject);
+  });
+  let doneAt = now();
+  while (now() - Math.max(lastEventAt, doneAt) < args.settle) {
+    await wait(20);
+  }
+  binding.unwatch(handle);
+
+  // The operations on each path, in the order they were done, how many of
+  // them the events have accounted for so far, and whether the last one
+  // removed the path.
+  let byPath = new Map();
+  for (let [filePath, at, removed] of ops) {
+    let entry = byPath.get(filePath);
+    if (!entry) {
+      entry = { times: [], reported: 0, removed: false };
+      byPath.set(filePath, entry);
+    }
+    entry.times.push(at);
+    entry.removed = removed;
+  }
+  let latencies = [];
+  let report = (filePath, at) => {
+    let entry = filePath && byPath.get(filePath);
+    if (!entry) return;
+    while (
+      entry.reported < entry.times.length &&
+      entry.times[entry.reported] <= at
+    ) {
+      latencies.push(at - entry.times[entry.reported++]);
+    }
+  };
+  for (let [filePath, oldFilePath, at] of events) {
+    report(filePath, at);
+    report(oldFilePath, at);
+  }
+  latencies.sort((a, b) => a - b);
+
+  // Paths that came and went without a single event were coalesced away.
+  let coalesced = 0;
+  for (let entry of byPath.values()) {
+    if (entry.reported === 0 && entry.removed) coalesced += entry.times.length;
+  }
+
+  let lost = ops.length - latencies.length - coalesced;
+  return {
+    operations: ops.length,
+    events: events.length,
+    overflows,
+    coalesced,
+    lost,
+    lossRate: lost / ops.length,
+    latencyMs: {
+      p50: percentile(latencies, 0.5),
+      p90: percentile(latencies, 0.9),
+      p99: percentile(latencies, 0.99),
+      max: latencies.length ? latencies[latencies.length - 1] : 0
+    }
+  };
+}
+
+function printReport (args, results) {
+  console.log(`count ${args.count}, rate ${args.rate || 'unlimited'}/s, batch window ${args.batchWindow} ms, queue ${args.queueSize} (${process.platform}, node ${process.version})`);
+  for (let [backend, workloads] of Object.entries(results)) {
+    console.log(`${backend}:`);
+    for (let [workload, r] of Object.entries(workloads)) {
+      let { p50, p90, p99, max } = r.latencyMs;
+      console.log(
+        `  ${workload.padEnd(8)} lost ${r.lost}/${r.operations} ` +
+        `(${(r.lossRate * 100).toFixed(2)}%), ${r.coalesced} coalesced, ` +
+        `${r.overflows} overflows, ` +
+        `${r.events} events; latency p50 ${p50.toFixed(1)} ms, ` +
+        `p90 ${p90.toFixed(1)} ms, p99 ${p99.toFixed(1)} ms, ` +
+        `max ${max.toFixed(1)} ms`
+      );
+    }
+  }
+}
+
+(async () => {
+  let args = parseArgs(process.argv.slice(2));
+  let backends = [args.backend];
+  if (args.backend === 'all') {
+    backends = process.platform === 'linux'
+      ? Object.keys(BACKEND_OPTIONS)
+      : [process.platform];
+  } else if (process.platform === 'linux' && !BACKEND_OPTIONS[args.backend]) {
+    throw new Error(`Unknown backend: ${args.backend}`);
+  }
+  let workloads = args.workload === 'all' ? WORKLOADS : [args.workload];
+  for (let workload of workloads) {
+    if (!WORKLOADS.includes(workload)) {
+      throw new Error(`Unknown workload: ${workload}`);
+    }
+  }
+
+  let results = {};
+  let unexplained = false;
+  for (let backend of backends) {
+    results[backend] = {};
+    for (let workload of workloads) {
+      let root = makeTempDir();
+      try {
+        let result = await runWorkload(
+          { ...args, backend },
+          root,
+          workload
+        );
+        results[backend][workload] = result;
+        if (result.lost > 0 && result.overflows === 0) unexplained = true;
+      } finally {
+        fs.rmSync(root, { recursive: true, force: true });
+      }
+    }
+  }
+
+  if (args.json) {
+    console.log(JSON.stringify({ ...args, results }, null, 2));
+  } else {
+    printReport(args, results);
+  }
+  if (unexplained) process.exitCode = 1;
+})();
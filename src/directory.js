@@ -1,7 +1,6 @@
 const Path = require('path');
 const FS = require('fs-plus');
 const Grim = require('grim');
-const async = require('async');
 const { Emitter, Disposable } = require('event-kit');
 
 const File = require('./file');
@@ -313,70 +312,31 @@ class Directory {
   //   * `error` An {Error}, may be null.
   //   * `entries` An {Array} of {File} and {Directory} objects.
   getEntries (callback) {
-    FS.list(this.path, (error, entries) => {
-      if (error) return callback(error);
-
-      let directories = [];
-      let files = [];
-
-      let addEntry = (entryPath, stat, symlink, innerCallback) => {
-        if (stat?.isDirectory()) {
-          directories.push(new Directory(entryPath, symlink));
-        } else if (stat?.isFile()) {
-          files.push(new File(entryPath, symlink))
-        }
-        return innerCallback();
-      };
-
-      let statEntry = (entryPath, innerCallback) => {
-        FS.lstat(entryPath, (_error, stat) => {
-          if (stat?.isSymbolicLink()) {
-            FS.stat(entryPath, (_error, stat) => {
-              addEntry(entryPath, stat, true, innerCallback)
-            });
-          } else {
-            addEntry(entryPath, stat, false, innerCallback);
-          }
-        });
-      };
-
-      return async.eachLimit(
-        entries,
-        1,
-        statEntry,
-        function() {
-          return callback(null, directories.concat(files));
-        }
-      );
-    });
+    PathWatcher ??= require('./main');
+    PathWatcher.listDirectory(this.path).then(
+      (listing) => {
+        let entries = this.entriesFromListing(listing);
+        process.nextTick(callback, null, entries);
+      },
+      (error) => process.nextTick(callback, error)
+    );
   }
 
   // Public: Reads file entries in this directory from disk synchronously.
   //
   // Returns an {Array} of {File} and {Directory} objects.
   getEntriesSync () {
-    let directories = [];
-    let files = [];
-    for (let entryPath of FS.listSync(this.path)) {
-      let stat;
-      let symlink = false;
-      try {
-        stat = FS.lstatSync(entryPath);
-        symlink = stat.isSymbolicLink();
-        if (symlink) {
-          stat = FS.statSync(entryPath);
-        }
-      } catch (_err) {}
-      if (stat?.isDirectory()) {
-        directories.push(new Directory(entryPath, symlink));
-      } else if (stat?.isFile()) {
-        files.push(new File(entryPath, symlink));
-      }
+    PathWatcher ??= require('./main');
+    let listing;
+    try {
+      listing = PathWatcher.listDirectorySync(this.path);
+    } catch (_err) {
+      // Like `fs-plus`'s `listSync`, treat a directory we can't read as empty.
+      return [];
     }
-    return directories.concat(files);
+    return this.entriesFromListing(listing);
   }
 
-
   // Public: Determines if the given path (real or symbolic) is inside this
   // directory. This method does not actually check if the path exists; it just
   // checks if the path is under this directory.
@@ -437,6 +397,24 @@ class Directory {
     this.watchSubscription &&= null;
   }
 
+  // Turns what `listDirectory` found into {Directory} and {File} objects,
+  // directories first. Anything else (sockets, broken links and the like) is
+  // left out.
+  entriesFromListing ({ names, types }) {
+    let directories = [];
+    let files = [];
+    for (let i = 0; i < names.length; i++) {
+      let entryPath = Path.join(this.path, names[i]);
+      let symlink = (types[i] & PathWatcher.ENTRY_SYMLINK) !== 0;
+      if (types[i] & PathWatcher.ENTRY_DIRECTORY) {
+        directories.push(new Directory(entryPath, symlink));
+      } else if (types[i] & PathWatcher.ENTRY_FILE) {
+        files.push(new File(entryPath, symlink));
+      }
+    }
+    return directories.concat(files);
+  }
+
   // Does the given full path start with the given prefix?
   isPathPrefixOf (prefix, fullPath) {
     return fullPath.startsWith(prefix) && fullPath[prefix.length] === Path.sep;
@@ -191,7 +191,17 @@ class File {
     if (this.digest != null) {
       return this.digest;
     }
-    await this.read();
+    if (!this.canDigestNatively()) {
+      await this.read();
+      return this.digest;
+    }
+    PathWatcher ??= require('./main');
+    try {
+      this.digest = await PathWatcher.digestFile(this.getPath());
+    } catch (error) {
+      if (error.code !== 'ENOENT') throw error;
+      this.setDigest(null);
+    }
     return this.digest;
   }
 
@@ -205,6 +215,13 @@ class File {
     return this.digest;
   }
 
+  // The native side hashes a file's bytes, without reading it all in. That
+  // comes out the same as hashing its contents (as `setDigest` does) only
+  // when they're UTF-8; otherwise, we have to decode them first.
+  canDigestNatively () {
+    return this.getEncoding() === 'utf8';
+  }
+
 
   setDigest (contents) {
     this.digest = crypto
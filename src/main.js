@@ -45,6 +45,21 @@ function isDirectory (filePath) {
 
 let NativeWatcherId = 1;
 
+// The settings `tuning` can have, and the type the native side reads each
+// one as. Anything else is ignored there, so it's left out here too.
+const TUNING_TYPES = {
+  resyncOnOverflow: 'boolean',
+  writeCompleteOnly: 'boolean',
+  incrementalScan: 'boolean',
+  pollIntervalMs: 'number',
+  maxPollIntervalMs: 'number',
+  scanBudget: 'number',
+  scanThreads: 'number',
+  winBufferSize: 'number',
+  handleEventsPerSecond: 'number',
+  handleEventBurst: 'number'
+};
+
 // A “native” watcher instance that is responsible for managing watchers on
 // various directories.
 //
@@ -63,21 +78,76 @@ class NativeWatcher {
   // inactive whenever its last consumer unsubscribes.
   static INSTANCES = new Map();
 
+  // The same active instances, indexed by handle, for handles that are
+  // numbers (see the `smallHandles` option). Looking one of these up is a
+  // plain array access, rather than a `Map` lookup keyed by a `BigInt`.
+  static BY_NUMBER = [];
+
+  // Returns the active instance for a handle the native side gave us, if
+  // there is one.
+  static forHandle (handle) {
+    if (typeof handle === 'number') return this.BY_NUMBER[handle];
+    return this.INSTANCES.get(handle);
+  }
+
   // Given a path, returns whatever existing active `NativeWatcher` is already
   // watching that path, or creates one if it doesn’t yet exist.
   //
   // It is important that we don’t ask the bindings to create a new watcher for
   // a native path that already exists, so this helps us prevent that from
   // happening.
-  static findOrCreate (normalizedPath, options) {
+  //
+  // A watcher with `exclude` or `include` patterns only ever matches a request
+  // for the same patterns; it'd drop events an unfiltered consumer expects.
+  // Likewise for one with `tuning`, which the native side watches with, and
+  // for a recursive one.
+  // The same goes for one that compares digests or fingerprints, that asked
+  // for a particular backend, or that only watches one file in its directory.
+  static findOrCreate (normalizedPath, options = {}) {
+    let patternKey = NativeWatcher.patternKey(options);
+    let digest = options.digest ?? false;
+    let fingerprint = options.fingerprint ?? false;
+    let backend = options.backend ?? null;
+    let file = options.file ?? null;
+    let recursive = options.recursive ?? false;
     for (let instance of this.INSTANCES.values()) {
-      if (instance.normalizedPath === normalizedPath) {
+      if (
+        instance.normalizedPath === normalizedPath &&
+        instance.recursive === recursive &&
+        instance.patternKey === patternKey &&
+        instance.digest === digest &&
+        instance.fingerprint === fingerprint &&
+        instance.backend === backend &&
+        instance.file === file
+      ) {
         return instance;
       }
     }
     return new NativeWatcher(normalizedPath, options);
   }
 
+  static patternKey ({ exclude = [], include = [], tuning = null } = {}) {
+    tuning = NativeWatcher.normalizeTuning(tuning);
+    if (exclude.length === 0 && include.length === 0 && tuning === null) {
+      return null;
+    }
+    return JSON.stringify([exclude, include, tuning]);
+  }
+
+  // Returns the settings in `tuning` that the native side reads, always in
+  // the same order, so that two objects asking for the same thing make the
+  // same key. Returns `null` when there aren't any.
+  static normalizeTuning (tuning) {
+    if (tuning === null || typeof tuning !== 'object') return null;
+    let result = null;
+    for (let [name, type] of Object.entries(TUNING_TYPES)) {
+      if (typeof tuning[name] !== type) continue;
+      result ??= {};
+      result[name] = tuning[name];
+    }
+    return result;
+  }
+
   // Returns the number of active `NativeWatcher` instances. Depending on
   // platform, a higher number may or may not be more demanding of the
   // operating system.
@@ -85,13 +155,79 @@ class NativeWatcher {
     return this.INSTANCES.size;
   }
 
-  constructor(normalizedPath, { recursive = false } = {}) {
+  constructor(
+    normalizedPath,
+    {
+      recursive = false,
+      sinceEventId = null,
+      armInBackground = false,
+      armDepth = 0,
+      exclude = [],
+      include = [],
+      digest = false,
+      fingerprint = false,
+      backend = null,
+      file = null,
+      tuning = null
+    } = {}
+  ) {
     this.id = NativeWatcherId++;
     this.normalizedPath = normalizedPath;
     this.emitter = new Emitter();
     this.subs = new CompositeDisposable();
     this.recursive = recursive;
+    this.sinceEventId = sinceEventId;
+    // Whether a recursive watcher should return right away and finish
+    // watching its subdirectories in the background. Either way, `did-arm`
+    // fires once the whole tree is being watched.
+    this.armInBackground = armInBackground;
+    // With `armInBackground`, how many levels of subdirectories to watch
+    // before returning anyway, so that the shallow part of a big tree (where
+    // most of the activity tends to be) is covered from the start.
+    this.armDepth = armDepth;
+    // Glob patterns, relative to `normalizedPath`, that the native side uses
+    // to drop events (and, on Linux, to skip whole directories) before they
+    // ever reach us. Recursive watchers are the ones they matter for.
+    this.exclude = exclude;
+    this.include = include;
+    // Settings for the backend, like how often to poll, that apply to this
+    // watch alone (see the `tuning` option of `watch`), or `null`.
+    this.tuning = NativeWatcher.normalizeTuning(tuning);
+    this.patternKey = NativeWatcher.patternKey({
+      exclude,
+      include,
+      tuning
+    });
+    // Whether the native side should hold back `change` events for files
+    // whose contents hash the same as they did before, or (more cheaply)
+    // whose size, modification time and inode are the same.
+    this.digest = digest;
+    this.fingerprint = fingerprint;
+    // On macOS, the backend to watch with (`fsevents`, `kqueue` or `hybrid`),
+    // or `null` for the one `configure` picked.
+    this.backend = backend;
+    // On Linux, the name of the one file in `normalizedPath` to watch by
+    // itself (see the `precise` option of `watch`), or `null` to watch the
+    // whole directory.
+    this.file = file;
+    this.armed = false;
     this.running = false;
+    // While `startAsync` waits on the native side, the promise it returned,
+    // and whether to stop again as soon as it's done.
+    this.starting = null;
+    this.stopWhenStarted = false;
+    // For each `did-change` subscription, a function returning the one path
+    // that subscriber cares about (or `null` if it needs every event).
+    this.pathFilters = new Map();
+    this.pathFilterKey = null;
+    // For each `did-change` subscription, a function returning whether that
+    // subscriber's events should skip ahead of bulk traffic.
+    this.priorities = new Map();
+    this.priorityKey = false;
+    // For each `PathWatcher` subscribed by way of a subject (see
+    // `onDidChange`), keyed by its ID: the function describing its subject,
+    // and its callbacks.
+    this.subjects = new Map();
   }
 
   get path () {
@@ -99,37 +235,254 @@ class NativeWatcher {
   }
 
   get listenerCount () {
-    return this.emitter.listenerCountForEventName('did-change');
+    let count = this.emitter.listenerCountForEventName('did-change');
+    for (let { callbacks } of this.subjects.values()) count += callbacks.size;
+    return count;
   }
 
   start () {
     if (this.running) return;
+    if (this.starting) {
+      // We'll be running soon enough, and someone still wants us to be.
+      this.stopWhenStarted = false;
+      return;
+    }
     if (!fs.existsSync(this.normalizedPath)) {
       // We can't start a watcher on a path that doesn't exist.
       return;
     }
-    this.handle = binding.watch(this.normalizedPath, this.recursive);
+    this.didStart(binding.watch(...this.watchArguments()));
+  }
+
+  // Like `start`, but the native side sets up the watch on a worker thread,
+  // so a big recursive tree or an FSEvents stream restart doesn't hold up the
+  // main thread. Resolves once we're running.
+  startAsync () {
+    if (this.running) return Promise.resolve();
+    if (this.starting) return this.starting;
+    if (!fs.existsSync(this.normalizedPath)) return Promise.resolve();
+    this.starting = binding.watchAsync(...this.watchArguments()).then(
+      (handle) => {
+        this.starting = null;
+        if (this.stopWhenStarted) {
+          // Everyone lost interest while we were waiting.
+          this.stopWhenStarted = false;
+          binding.unwatchAsync(handle);
+          return;
+        }
+        this.didStart(handle);
+      },
+      (err) => {
+        this.starting = null;
+        this.stopWhenStarted = false;
+        throw err;
+      }
+    );
+    return this.starting;
+  }
+
+  watchArguments () {
+    return [
+      this.normalizedPath,
+      this.recursive,
+      this.sinceEventId ?? undefined,
+      this.armInBackground,
+      this.patternKey === null
+        ? undefined
+        : { ...this.tuning, exclude: this.exclude, include: this.include },
+      this.digest,
+      this.fingerprint,
+      this.armDepth,
+      this.backend ?? undefined,
+      this.file ?? undefined
+    ];
+  }
+
+  didStart (handle) {
+    this.handle = handle;
+    // Only the first start should replay history; if we stop and start again
+    // later, we'd just be repeating ourselves.
+    this.sinceEventId = null;
     NativeWatcher.INSTANCES.set(this.handle, this);
+    if (typeof handle === 'number') NativeWatcher.BY_NUMBER[handle] = this;
     this.running = true;
+    // The native side knows nothing of our subscribers yet.
+    if (this.emitter.listenerCountForEventName('did-change') > 0) {
+      this.subscribe(0);
+    }
+    for (let id of this.subjects.keys()) this.subscribe(id);
+    // A new handle starts out unfiltered, in the bulk lane.
+    this.pathFilterKey = null;
+    this.updatePathFilter();
+    this.priorityKey = false;
+    this.updatePriority();
+    this.armed = !this.armInBackground;
     this.emitter.emit('did-start');
+    if (this.armed) this.emitter.emit('did-arm');
   }
 
   onDidStart (callback) {
     return this.emitter.on('did-start', callback);
   }
 
-  onDidChange (callback) {
+  // Fires once every directory this watcher covers is being watched. For a
+  // watcher that isn't armed in the background, that's as soon as it starts.
+  onDidArm (callback) {
+    return this.emitter.on('did-arm', callback);
+  }
+
+  // Resolves once this watcher has been armed (see `onDidArm`).
+  whenArmed () {
+    if (this.armed) return Promise.resolve();
+    return new Promise((resolve) => {
+      let sub = this.onDidArm(() => {
+        sub.dispose();
+        resolve();
+      });
+    });
+  }
+
+  // `pathFilter`, if given, is a function that returns the path this
+  // subscriber cares about. When every subscriber has one, the native side
+  // only sends us the events that involve those paths. `isHighPriority`, if
+  // given, says whether the subscriber's events should go through the native
+  // side's priority lane.
+  //
+  // `subject`, if given, is a function describing what a `PathWatcher` is
+  // watching: `{ id, watchedPath, targetPath, watchingParent, isDirectory }`.
+  // The native side then translates our events for it (see
+  // `lib/event-subject.h`) and the callback gets them ready to pass on.
+  // Otherwise, it gets every event as the backend reported it.
+  onDidChange (
+    callback,
+    pathFilter = null,
+    isHighPriority = null,
+    subject = null
+  ) {
     this.start();
 
+    let sub = subject
+      ? this.addSubjectCallback(callback, subject)
+      : this.addCallback(callback);
+    this.pathFilters.set(sub, pathFilter);
+    this.priorities.set(sub, isHighPriority);
+    this.updatePathFilter();
+    this.updatePriority();
+    return new Disposable(() => {
+      sub.dispose();
+      this.pathFilters.delete(sub);
+      this.priorities.delete(sub);
+      if (this.listenerCount === 0) {
+        this.stop();
+      } else {
+        this.updatePathFilter();
+        this.updatePriority();
+      }
+    });
+  }
+
+  addCallback (callback) {
     let sub = this.emitter.on('did-change', callback);
+    if (this.emitter.listenerCountForEventName('did-change') === 1) {
+      this.subscribe(0);
+    }
     return new Disposable(() => {
       sub.dispose();
       if (this.emitter.listenerCountForEventName('did-change') === 0) {
-        this.stop();
+        this.unsubscribe(0);
       }
     });
   }
 
+  addSubjectCallback (callback, subject) {
+    let { id } = subject();
+    let entry = this.subjects.get(id);
+    if (!entry) {
+      entry = { subject, callbacks: new Set() };
+      this.subjects.set(id, entry);
+      this.subscribe(id);
+    }
+    // Wrapped so that the same callback can be added twice.
+    let listener = { callback };
+    entry.callbacks.add(listener);
+    return new Disposable(() => {
+      entry.callbacks.delete(listener);
+      if (entry.callbacks.size > 0 || this.subjects.get(id) !== entry) return;
+      this.subjects.delete(id);
+      this.unsubscribe(id);
+    });
+  }
+
+  // Tells the native side about subscriber `id`: a subject's `PathWatcher`,
+  // or `0` for the callbacks that want every event.
+  subscribe (id) {
+    if (!this.running) return;
+    if (id === 0) {
+      binding.subscribe(this.handle, 0);
+      return;
+    }
+    let subject = this.subjects.get(id).subject();
+    binding.subscribe(
+      this.handle,
+      id,
+      subject.watchedPath,
+      subject.targetPath,
+      subject.watchingParent,
+      subject.isDirectory
+    );
+  }
+
+  unsubscribe (id) {
+    if (!this.running) return;
+    binding.unsubscribe(this.handle, id);
+  }
+
+  // Tells the native side which paths our subscribers care about, so that it
+  // can skip sending us events for all the others. One subscriber without a
+  // path filter means we need everything, and so does having no subscribers
+  // yet: an empty filter would drop the events of whoever subscribes next
+  // until we got around to updating it.
+  updatePathFilter () {
+    if (!this.running) return;
+    let paths = [];
+    for (let pathFilter of this.pathFilters.values()) {
+      let filterPath = pathFilter ? pathFilter() : null;
+      if (filterPath == null) {
+        paths = null;
+        break;
+      }
+      paths.push(filterPath);
+    }
+    if (paths?.length === 0) paths = null;
+    let key = paths ? paths.join('\0') : null;
+    if (key === this.pathFilterKey) return;
+    this.pathFilterKey = key;
+    binding.setPathFilter(this.handle, paths);
+  }
+
+  // Tells the native side which events should skip ahead of bulk traffic:
+  // all of ours if a high-priority subscriber wants every event, or else the
+  // ones involving the paths high-priority subscribers filter for.
+  updatePriority () {
+    if (!this.running) return;
+    let paths = [];
+    for (let [sub, isHighPriority] of this.priorities) {
+      if (!isHighPriority?.()) continue;
+      let pathFilter = this.pathFilters.get(sub);
+      let filterPath = pathFilter ? pathFilter() : null;
+      if (filterPath == null) {
+        paths = true;
+        break;
+      }
+      paths.push(filterPath);
+    }
+    if (Array.isArray(paths) && paths.length === 0) paths = false;
+    let key = Array.isArray(paths) ? paths.join('\0') : paths;
+    if (key === this.priorityKey) return;
+    this.priorityKey = key;
+    binding.setPriority(this.handle, paths);
+  }
+
   onShouldDetach (callback) {
     return this.emitter.on('should-detach', callback);
   }
@@ -147,22 +500,49 @@ class NativeWatcher {
   }
 
   stop (shutdown = false) {
+    if (this.starting) this.stopWhenStarted = true;
     if (this.running) {
       this.emitter.emit('will-stop', shutdown);
-      binding.unwatch(this.handle);
+      // Events for the handle stop right away either way. Unless we're
+      // shutting down, there's no reason to wait for the backend to finish
+      // tearing its watch down, which can take a while.
+      if (shutdown) {
+        binding.unwatch(this.handle);
+      } else {
+        binding.unwatchAsync(this.handle);
+      }
       this.running = false;
       this.emitter.emit('did-stop', shutdown);
     }
 
     NativeWatcher.INSTANCES.delete(this.handle);
+    if (NativeWatcher.BY_NUMBER[this.handle] === this) {
+      NativeWatcher.BY_NUMBER[this.handle] = undefined;
+    }
   }
 
   dispose () {
     this.emitter.dispose();
   }
 
-  onEvent (event) {
-    this.emitter.emit('did-change', event);
+  // `subscriber` is the ID of the `PathWatcher` the native side translated
+  // `event` for, or `0` if it didn't.
+  onEvent (event, subscriber = 0) {
+    if (event.action === 'armed') {
+      this.armed = true;
+      this.emitter.emit('did-arm');
+      return;
+    }
+    if (subscriber === 0) {
+      this.emitter.emit('did-change', event);
+      return;
+    }
+    let entry = this.subjects.get(subscriber);
+    if (!entry) return;
+    // A callback can unsubscribe, or subscribe someone new.
+    for (let listener of Array.from(entry.callbacks)) {
+      if (entry.callbacks.has(listener)) listener.callback(event);
+    }
   }
 
   onError (err) {
@@ -197,9 +577,32 @@ let PathWatcherId = 10;
 // is atomic and results in no missed filesystem events. The old watcher will
 // be disposed of once no `PathWatcher`s are listening to it anymore.
 class PathWatcher {
-  constructor (watchedPath) {
+  constructor (
+    watchedPath,
+    {
+      sinceEventId = null,
+      recursive = false,
+      armInBackground = false,
+      armDepth = 0,
+      exclude = [],
+      include = [],
+      digest = false,
+      fingerprint = false,
+      backend = null,
+      precise = false,
+      tuning = null
+    } = {}
+  ) {
     this.id = PathWatcherId++;
     this.watchedPath = watchedPath;
+    this.sinceEventId = sinceEventId;
+    this.armInBackground = armInBackground;
+    this.armDepth = armDepth;
+    this.digest = digest;
+    this.fingerprint = fingerprint;
+    this.backend = backend;
+    this.precise = precise;
+    this.tuning = tuning;
 
     this.normalizePath = null;
     this.native = null;
@@ -228,6 +631,11 @@ class PathWatcher {
     } catch (err) {
       this.isDirectory = false;
     }
+    // Only a directory has anything below it to watch, or to match patterns
+    // against.
+    this.recursive = recursive && this.isDirectory;
+    this.exclude = this.isDirectory ? exclude : [];
+    this.include = this.isDirectory ? include : [];
     // try {
     //   this.normalizedPath = fs.realpathSync(watchedPath) ?? watchedPath;
     // } catch (err) {
@@ -257,9 +665,36 @@ class PathWatcher {
       this.rejectStartPromise = reject;
     });
 
+    // When we're watching a file by way of its parent directory, the native
+    // side can leave out every event that doesn't involve that file.
+    this.pathFilter = () => {
+      return this.isWatchingParent ? this.originalNormalizedPath : null;
+    };
+    // See `setHighPriority`.
+    this.highPriority = false;
+    this.isHighPriority = () => this.highPriority;
+    // What the native side needs to translate our events (see
+    // `NativeWatcher::onDidChange`).
+    this.subject = () => ({
+      id: this.id,
+      watchedPath: this.normalizedPath,
+      targetPath: this.originalNormalizedPath,
+      watchingParent: this.isWatchingParent,
+      isDirectory: this.isDirectory
+    });
+
     this.active = true;
   }
 
+  // With the `precise` option, the name of the file the native side should
+  // watch by itself rather than through everything else in its directory.
+  // Only inotify can, so elsewhere this is `null`.
+  preciseFile () {
+    if (!this.precise || !this.isWatchingParent) return null;
+    if (process.platform !== 'linux') return null;
+    return path.basename(this.originalNormalizedPath);
+  }
+
   getNormalizedPath() {
     return this.normalizedPath;
   }
@@ -274,14 +709,29 @@ class PathWatcher {
     if (this.native) {
       let sub = this.native.onDidChange(event => {
         this.onNativeEvent(event, callback);
-      });
+      }, this.pathFilter, this.isHighPriority, this.subject);
       this.changeCallbacks.set(callback, sub);
       this.native.start();
     } else {
       // We don't have a native watcher yet, so we’ll ask the registry to
       // assign one to us. This could be a brand-new instance or one that was
       // already watching one of our ancestor folders.
-      this.native = NativeWatcher.findOrCreate(this.normalizedPath);
+      this.native = NativeWatcher.findOrCreate(
+        this.normalizedPath,
+        {
+          sinceEventId: this.sinceEventId,
+          recursive: this.recursive,
+          armInBackground: this.armInBackground,
+          armDepth: this.armDepth,
+          exclude: this.exclude,
+          include: this.include,
+          digest: this.digest,
+          fingerprint: this.fingerprint,
+          backend: this.backend,
+          file: this.preciseFile(),
+          tuning: this.tuning
+        }
+      );
       this.onDidChange(callback);
     }
 
@@ -292,6 +742,13 @@ class PathWatcher {
     });
   }
 
+  // Resolves once everything this watcher covers is being watched. Only a
+  // recursive watcher with `armInBackground` has to wait for that; any other
+  // is armed as soon as it starts.
+  whenArmed () {
+    return this.native ? this.native.whenArmed() : Promise.resolve();
+  }
+
   onDidError (callback) {
     return this.emitter.on('did-error', callback);
   }
@@ -313,7 +770,7 @@ class PathWatcher {
     for (let [callback, formerSub] of this.changeCallbacks) {
       let newSub = native.onDidChange(event => {
         return this.onNativeEvent(event, callback);
-      });
+      }, this.pathFilter, this.isHighPriority, this.subject);
       this.changeCallbacks.set(callback, newSub);
       formerSub.dispose();
     }
@@ -373,224 +830,95 @@ class PathWatcher {
 
     let stats = fs.statSync(this.normalizedPath);
     this.isWatchingParent = !stats.isDirectory();
+    this.recursive = this.recursive && stats.isDirectory();
 
     this.originalNormalizedPath = this.normalizedPath;
     if (!stats.isDirectory()) {
       this.normalizedPath = path.dirname(this.normalizedPath);
     }
 
-    this.native = NativeWatcher.findOrCreate(this.normalizedPath);
+    this.native = NativeWatcher.findOrCreate(
+      this.normalizedPath,
+      {
+        recursive: this.recursive,
+        armInBackground: this.armInBackground,
+        armDepth: this.armDepth,
+        exclude: this.exclude,
+        include: this.include,
+        digest: this.digest,
+        fingerprint: this.fingerprint,
+        backend: this.backend,
+        file: this.preciseFile(),
+        tuning: this.tuning
+      }
+    );
     this.active = true;
   }
 
   onNativeEvent (event, callback) {
-    // console.debug(
-    //   'PathWatcher::onNativeEvent',
-    //   event,
-    //   'for watcher of path:',
-    //   this.originalNormalizedPath
-    // );
-
-    let isWatchedPath = (eventPath) => {
-      if (eventPath === this.normalizedPath) return true;
-      return eventPath?.startsWith(sep(this.normalizedPath));
+    // The native side has already turned the event into one for our
+    // callbacks (see `lib/event-subject.h`), including what happens to a file
+    // or directory when its parent is the one being watched, or when it's
+    // renamed out from under us. When it followed a rename of the path we care
+    // about, it tells us where to in `oldPath`, and we follow it too.
+    if (event.oldPath && event.oldPath !== this.originalNormalizedPath) {
+      this.moveToPath(event.oldPath);
     }
+    callback(event.action, event.path);
+  }
 
-    // Does `event.path` match the exact path our `PathWatcher` cares about?
-    let eventPathIsEqual = this.originalNormalizedPath === event.path;
-    // Does `event.oldPath` match the exact path our `PathWatcher` cares about?
-    let eventOldPathIsEqual = this.originalNormalizedPath === event.oldPath;
-
-    // Is `event.path` somewhere within the folder that this `PathWatcher` is
-    // monitoring?
-    let newWatched = isWatchedPath(event.path);
-    // Is `event.oldPath` somewhere within the folder that this `PathWatcher`
-    // is monitoring?
-    let oldWatched = isWatchedPath(event.oldPath);
-
-    let newEvent = { ...event };
-
-    if (!newWatched && !oldWatched) {
-      return;
-    }
-
-    switch (newEvent.action) {
-      case 'rename':
-        // This event needs no alteration… as long as it relates to the file
-        // we care about.
-        if (!eventPathIsEqual && !eventOldPathIsEqual) {
-          return;
-        }
-        break;
-      case 'change':
-        // Must relate to the file we care about.
-        if (!eventPathIsEqual) return;
-        if (!this.isWatchingParent) {
-          newEvent.path = '';
-        }
-        break;
-      case 'delete':
-        if (!eventPathIsEqual) return;
-        if (this.isDirectory) {
-          // Do nothing. If you're watching a directory, you don't get notified
-          // when the directory gets deleted. This matches existing behavior.
-          return;
-        }
-        break;
-      case 'create':
-        // Must relate to the file we care about.
-        if (!eventPathIsEqual) return;
-        break;
-      case 'child-create':
-        if (!this.isWatchingParent) {
-          if (eventPathIsEqual) {
-            // We're watching a directory and this is a create event for the
-            // directory itself. This should be fixed in the bindings, but for
-            // now we can switch the event type in the JS.
-            newEvent.action = 'create';
-          } else {
-            newEvent.action = 'change';
-            newEvent.path = '';
-          }
-          break;
-        } else if (eventPathIsEqual) {
-          newEvent.action = 'create';
-        }
-        break;
-      case 'child-delete':
-        if (!this.isWatchingParent) {
-          newEvent.action = 'change';
-          newEvent.path = '';
-        } else if (eventPathIsEqual) {
-          newEvent.action = 'delete';
-        }
-        break;
-      case 'child-rename':
-        // TODO: Laziness in the native addon means that even events that
-        // happen to the directory itself are reported as `child-rename`
-        // instead of `rename`. We can fix this in the JS for now, but it
-        // should eventually be fixed in the C++.
-
-        // First, weed out the cases that can't possibly affect us.
-        let pathIsInvolved = eventPathIsEqual || eventOldPathIsEqual;
-
-        // The only cases for which we should return early are the ones where
-        // (a) we're watching a file, and (b) this event doesn't involve it
-        // in any way.
-        if (this.isWatchingParent && !pathIsInvolved) {
-          return;
-        }
-
-        if (!this.isWatchingParent && !pathIsInvolved) {
-          // We're watching a directory and these events involve something
-          // inside of the directory.
-          if (
-            path.dirname(event.path) === this.normalizedPath ||
-            path.dirname(event.oldPath) === this.normalizedPath
-          ) {
-            // This is a direct child of the directory, so we'll fire an
-            // event.
-            newEvent.action = 'change';
-            newEvent.path = '';
-          } else {
-            // Changes in ancestors or descendants do not concern us, so
-            // we'll return early.
-            //
-            // TODO: Changes in ancestors might, actually; they might need to
-            // be treated as folder deletions/creations.
-            return;
-          }
-        } else {
-          // We're left with cases where
-          //
-          // * We're watching a directory and that directory is named by the
-          //   event, or
-          // * We're watching a file (via a directory watch) and that file is
-          //   named by the event.
-          //
-          // Those cases are handled identically.
-
-          if (newWatched && this.originalNormalizedPath !== event.path) {
-            // The file/directory we care about has moved to a new destination
-            // and that destination is visible to this watcher. That means we
-            // can simply update the path we care about and keep path-watching.
-            this.moveToPath(event.path);
-          }
-
-          let isSameDirectory = !this.isWatchingParent &&
-            path.dirname(event.path) == path.dirname(event.oldPath);
-
-          if ((oldWatched && newWatched) || isSameDirectory) {
-            // We can keep tabs on both file paths from here, so this will
-            // be treated as a rename.
-            newEvent.action = 'rename';
-          } else if (oldWatched && !newWatched) {
-            // We're moving the file to a place we're not observing, so
-            // we'll treat it as a deletion.
-            newEvent.action = 'delete';
-          } else if (!oldWatched && newWatched) {
-            // The file came from someplace we're not watching, so it might
-            // as well be a file creation.
-            newEvent.action = 'create';
-          }
-        }
-        break;
-      case 'child-change':
-        if (!this.isWatchingParent) {
-          // We are watching a directory.
-          if (eventPathIsEqual) {
-            // This makes no sense; we won't fire a `child-change` on a
-            // directory. Ignore it.
-            return;
-          } else {
-            newEvent.action = 'change';
-            newEvent.path = '';
-          }
-        } else {
-          if (eventPathIsEqual) {
-            newEvent.action = 'change';
-            newEvent.path = '';
-          } else {
-            return;
-          }
-        }
-        break;
-    } // end switch
-
-    if (eventPathIsEqual && newEvent.action === 'create') {
-      // This file or directory already existed; we checked. Any `create`
-      // event for it is spurious.
-      return;
-    }
+  // Follows the file or directory we care about to the new path the native
+  // side reported for it. The backends pair up both halves of a rename by
+  // identity (a cookie, file handle or inode, depending on platform), so this
+  // is still the same entry: a file stays a file and a directory stays a
+  // directory, and there's no need to look at the disk again. Our native
+  // watcher keeps running; only the path we filter for changes.
+  moveToPath (newPath) {
+    this.originalNormalizedPath = newPath;
+    // When we watch a file by way of its parent directory, the native
+    // watcher's path filter has already followed it.
+    this.normalizedPath = this.isWatchingParent
+      ? path.dirname(newPath)
+      : newPath;
+    this.native?.updatePathFilter();
+    this.native?.updatePriority();
+  }
 
-    if (eventPathIsEqual && newEvent.action === 'delete') {
-      // Specs require that a `delete` action carry a path of `null`.
-      //
-      // NOTE: We might want to revisit this and change what the specs test!
-      newEvent.path = null;
-      // newEvent.path = newEvent.action === 'delete' ? null : newEvent.path;
-    }
-    // console.debug(
-    //   'FINAL EVENT ACTION:',
-    //   newEvent.action,
-    //   'PATH',
-    //   newEvent.path
-    // );
-    callback(newEvent.action, newEvent.path);
+  // Marks this watcher's events (say, for a file open in an editor) as high
+  // priority. While batching, the native side sends them through a lane of
+  // their own that doesn't wait for the batch window and gets ahead of bulk
+  // traffic like an `npm install`.
+  setHighPriority (highPriority = true) {
+    this.highPriority = !!highPriority;
+    this.native?.updatePriority();
   }
 
-  moveToPath (newPath) {
-    this.isWatchingParent = !isDirectory(newPath);
-    if (this.isWatchingParent) {
-      // Watching a directory just because we care about a specific file inside
-      // it.
-      this.originalNormalizedPath = newPath;
-      this.normalizedPath = path.dirname(newPath);
-    } else {
-      // Actually watching a directory.
-      this.originalNormalizedPath = newPath;
-      this.normalizedPath = newPath;
+  // Polls for what changed under this watcher since `cursor` (a `BigInt` from
+  // an earlier call, or `null` the first time). Returns `{ paths, cursor,
+  // freshInstance }`: the paths that changed, each once, and the cursor to
+  // pass next time. When `freshInstance` is set, the native side can't say
+  // what changed (its log has wrapped, the watcher overflowed or was moved to
+  // another native watcher, or this is the first call) and the caller should
+  // rescan. With `maxPaths`, at most that many paths come back at a time.
+  // Needs the `changeLogSize` option.
+  getChangesSince (cursor = null, { maxPaths = 0 } = {}) {
+    if (!NATIVE_OPTIONS.changeLogSize) {
+      throw new Error('Change logs need the `changeLogSize` option');
     }
+    let changes = this.native?.running
+      ? binding.getChangesSince(this.native.handle, cursor ?? 0n, maxPaths)
+      : null;
+    if (!changes) return { paths: [], cursor: 0n, freshInstance: true };
+
+    // Our native watcher may be watching more than we are.
+    changes.paths = changes.paths.filter((changedPath) => {
+      if (this.isWatchingParent) {
+        return changedPath === this.originalNormalizedPath;
+      }
+      return changedPath === this.normalizedPath ||
+        changedPath.startsWith(sep(this.normalizedPath));
+    });
+    return changes;
   }
 
   dispose () {
@@ -617,28 +945,204 @@ class WatcherEvent {
   }
 }
 
-function DEFAULT_CALLBACK(action, handle, filePath, oldFilePath) {
-  if (!NativeWatcher.INSTANCES.has(handle)) {
+// Options for the native side. These control how long it should collect
+// filesystem events before handing them to us as a batch, and how large a
+// batch is allowed to get before it's delivered early. Batching keeps us from
+// being flooded with thousands of individual callbacks during something like
+// a large `git checkout`.
+//
+// In non-blocking mode, the native side never waits on us; if we fall too far
+// behind, it drops events and sends an `overflow` event for each affected
+// watcher instead.
+//
+// Consumers can change any of these via `configure`.
+const NATIVE_OPTIONS = {
+  batchWindowMs: 50,
+  batchMaxSize: 1000,
+  nonBlocking: true,
+  maxQueueSize: 10000,
+  packedBatches: true
+};
+
+// Event names, indexed by the codes used in packed batches. Must be kept in
+// the same order as `kEventNames` in `lib/core.cc`.
+const PACKED_EVENT_NAMES = [
+  'unknown', 'create', 'child-create', 'delete', 'child-delete', 'change',
+  'child-change', 'rename', 'child-rename', 'overflow', 'armed', 'throttled'
+];
+const PACKED_RECORD_SIZE = 7;
+// The path length that stands for a path of `null`.
+const PACKED_NULL_PATH = 0xFFFFFFFF;
+
+// Unpacks a batch in the binary form described in `lib/core.cc`: a header of
+// event and handle counts, the handles, and then one record per event that
+// refers to its paths by offset and length within `paths`, and to the
+// subscriber it was translated for. We only slice out paths for events whose
+// watchers are still around.
+//
+// With `smallHandles`, no handles are listed, and each record holds its
+// handle itself. A batch with events in it always lists at least one handle
+// otherwise, so that's how we tell.
+function dispatchPackedBatch (buffer, paths) {
+  let [eventCount, handleCount] = new Uint32Array(buffer, 0, 2);
+  let handles = Array.from(new BigInt64Array(buffer, 8, handleCount));
+  let numbered = handleCount === 0;
+  let records = new Uint32Array(
+    buffer,
+    8 + handleCount * 8,
+    eventCount * PACKED_RECORD_SIZE
+  );
+
+  for (let i = 0; i < records.length; i += PACKED_RECORD_SIZE) {
+    // Checked for every event, since handling one event can stop a watcher.
+    let watcher = numbered
+      ? NativeWatcher.BY_NUMBER[records[i + 1]]
+      : NativeWatcher.INSTANCES.get(handles[records[i + 1]]);
+    if (!watcher) continue;
+    let start = records[i + 2];
+    let length = records[i + 3];
+    let filePath = length === PACKED_NULL_PATH
+      ? null
+      : paths.slice(start, start + length);
+    let oldStart = records[i + 4];
+    let oldFilePath = paths.slice(oldStart, oldStart + records[i + 5]);
+    let action = PACKED_EVENT_NAMES[records[i]];
+    watcher.onEvent(
+      new WatcherEvent(action, filePath, oldFilePath),
+      records[i + 6]
+    );
+  }
+}
+
+// Subscribers to `onEventsAvailable`, for the `pullDelivery` option.
+const PULL_EMITTER = new Emitter();
+
+function DEFAULT_CALLBACK(
+  action,
+  handle,
+  filePath,
+  oldFilePath,
+  root,
+  subscriber = 0
+) {
+  if (action === undefined) {
+    // Pull mode: the native side has events waiting for `drain`. If nobody
+    // is scheduling that for themselves, we drain right away.
+    if (PULL_EMITTER.listenerCountForEventName('events-available') > 0) {
+      PULL_EMITTER.emit('events-available');
+    } else {
+      drain();
+    }
+    return;
+  }
+
+  if (action instanceof ArrayBuffer) {
+    // A packed batch; `handle` is the string of paths it refers to.
+    dispatchPackedBatch(action, handle);
+    return;
+  }
+
+  if (Array.isArray(action)) {
+    // A batch of events, each of which is an array of the arguments we'd
+    // otherwise have received individually.
+    for (let args of action) {
+      DEFAULT_CALLBACK(...args);
+    }
+    return;
+  }
+
+  let watcher = NativeWatcher.forHandle(handle);
+  if (!watcher) {
     // Might be a stray callback from a `NativeWatcher` that has already
     // stopped.
     return;
   }
 
-  let watcher = NativeWatcher.INSTANCES.get(handle);
+  if (root !== undefined) {
+    // With `rootRelativePaths`, the paths come without the watched path that
+    // they're under. It's the same string every time, so joining them back
+    // together doesn't have to copy it.
+    filePath = root + filePath;
+    if (oldFilePath) oldFilePath = root + oldFilePath;
+  }
   let event = new WatcherEvent(action, filePath, oldFilePath);
-  watcher.onEvent(event);
+  watcher.onEvent(event, subscriber);
 }
 
-function watch (pathToWatch, callback) {
-  if (!initialized) {
-    binding.setCallback(DEFAULT_CALLBACK);
-    initialized = true;
-  }
-  let watcher = new PathWatcher(path.resolve(pathToWatch));
+function initialize () {
+  if (initialized) return;
+  binding.setCallback(DEFAULT_CALLBACK, NATIVE_OPTIONS);
+  initialized = true;
+}
+
+function watch (pathToWatch, callback, options = {}) {
+  initialize();
+  let watcher = new PathWatcher(path.resolve(pathToWatch), options);
   watcher.onDidChange(callback);
   return watcher;
 }
 
+// Like `watch`, but resolves with the watcher once it's watching, and never
+// blocks the main thread on the backend setting up a watch.
+async function watchAsync (pathToWatch, callback, options = {}) {
+  initialize();
+  let watcher = new PathWatcher(path.resolve(pathToWatch), options);
+  let native = NativeWatcher.findOrCreate(
+    watcher.normalizedPath,
+    {
+      sinceEventId: watcher.sinceEventId,
+      recursive: watcher.recursive,
+      armInBackground: watcher.armInBackground,
+      armDepth: watcher.armDepth,
+      exclude: watcher.exclude,
+      include: watcher.include,
+      digest: watcher.digest,
+      fingerprint: watcher.fingerprint,
+      backend: watcher.backend,
+      file: watcher.preciseFile(),
+      tuning: watcher.tuning
+    }
+  );
+  await native.startAsync();
+  // The native watcher is running by now, so subscribing has nothing left to
+  // start.
+  watcher.native = native;
+  watcher.onDidChange(callback);
+  return watcher;
+}
+
+// With the `pullDelivery` option, takes the events the native side is holding
+// and dispatches them to their watchers, up to about `maxEvents` of them
+// (batches aren't split, and the oldest one always comes through). Returns
+// how many events were dispatched.
+function drain (maxEvents = 0) {
+  if (!initialized) return 0;
+  let result = binding.drain(maxEvents);
+  if (!result) return 0;
+  if (result[0] instanceof ArrayBuffer) {
+    dispatchPackedBatch(result[0], result[1]);
+    return new Uint32Array(result[0], 0, 1)[0];
+  }
+  DEFAULT_CALLBACK(result);
+  return result.length;
+}
+
+// With the `pullDelivery` option, calls `callback` when events are waiting to
+// be drained, and then not again until the next `drain`. While anyone is
+// subscribed, it's up to them to call `drain`.
+function onEventsAvailable (callback) {
+  return PULL_EMITTER.on('events-available', callback);
+}
+
+// Adjust the options that govern the native watcher. See the README for the
+// full list.
+function configure (options = {}) {
+  Object.assign(NATIVE_OPTIONS, options);
+  if (initialized) {
+    binding.setCallback(DEFAULT_CALLBACK, NATIVE_OPTIONS);
+  }
+}
+
 let isClosingAllWatchers = false;
 function closeAllWatchers () {
   isClosingAllWatchers = true;
@@ -646,6 +1150,7 @@ function closeAllWatchers () {
     watcher.stop(true);
   }
   NativeWatcher.INSTANCES.clear();
+  NativeWatcher.BY_NUMBER.length = 0;
   isClosingAllWatchers = false;
 }
 
@@ -655,13 +1160,115 @@ function getWatchedPaths () {
   return result
 }
 
+// Reports how the native event batch pool has been used. Mostly useful for
+// tuning and diagnostics.
+function getEventPoolStats () {
+  return binding.getEventPoolStats();
+}
+
+// Returns a `BigInt` marking the current point in the filesystem's event
+// history, or `null` if the current backend can't replay history. Pass it to
+// `watch` later (even in a later session) to hear about changes since. On
+// Windows, the NTFS journal backend keeps a history per volume, so it needs
+// `path` to know which; FSEvents ignores it.
+function getLastEventId (path) {
+  return binding.getLastEventId(path);
+}
+
+// Reports how the macOS kqueue backend is spending its file-descriptor
+// budget, or `null` on other backends.
+function getFdStats () {
+  return binding.getFdStats();
+}
+
+// Reports the counters and timings the native layer keeps when the
+// `collectStats` option is on, or `null` if it never has been.
+function getStats () {
+  return binding.getStats();
+}
+
+// Reports roughly how much memory the native layer is holding, along with
+// how many kernel watches and file descriptors it uses.
+function getMemoryUsage () {
+  return binding.getMemoryUsage();
+}
+
+// The bits `listDirectory` reports for each entry. A link has
+// `ENTRY_SYMLINK` set along with whatever its target is.
+const ENTRY_FILE = 1;
+const ENTRY_DIRECTORY = 2;
+const ENTRY_SYMLINK = 4;
+
+// Starts or stops recording the native watchers' debug messages in a small
+// ring buffer, for `getTrace` to hand back. Costs next to nothing while off,
+// which it is by default.
+function setTracing (enabled) {
+  binding.setTraceEnabled(!!enabled);
+}
+
+// Returns the most recent debug messages recorded since tracing was turned
+// on, oldest first. Pass `{ clear: true }` to start over afterward.
+function getTrace ({ clear = false } = {}) {
+  return binding.getTrace(clear);
+}
+
+// Reads a directory and finds out what each entry is, following links, in a
+// single trip to the thread pool. Resolves with `{ names, types }`: the
+// entries' names and a `Uint8Array` of `ENTRY_*` bits to go with them.
+function listDirectory (dirPath) {
+  return binding.listDirectoryAsync(dirPath);
+}
+
+// Like `listDirectory`, but blocks until it's done.
+function listDirectorySync (dirPath) {
+  return binding.listDirectory(dirPath);
+}
+
+// Resolves with the SHA-1 digest of a file's contents, as hex. The file is
+// read off the main thread, a piece at a time, so it never has to fit in
+// memory all at once.
+function digestFile (filePath) {
+  return binding.digestFileAsync(filePath);
+}
+
+// Lists everything below `rootPath`, using the index file at `indexPath` that
+// the last call left behind to skip reading directories that haven't changed,
+// and then brings the index up to date. Resolves with `{ paths, types, sizes,
+// mtimes, eventId, directoriesChecked, directoriesRead }`: paths relative to
+// the root, with `ENTRY_*` bits, sizes and modification times (in
+// milliseconds) to go with them, and the `eventId` saved with the old index,
+// if there was one. `eventId` defaults to `getLastEventId()`; pass the old one
+// as `sinceEventId` when watching to hear about what changed in between.
+function loadTreeIndex (rootPath, indexPath, { eventId } = {}) {
+  if (eventId === undefined) eventId = getLastEventId(rootPath) ?? 0n;
+  return binding.loadTreeIndexAsync(rootPath, indexPath, eventId);
+}
+
 const File = require('./file');
 const Directory = require('./directory');
 
 module.exports = {
   watch,
+  watchAsync,
+  configure,
   closeAllWatchers,
   getWatchedPaths,
+  getEventPoolStats,
+  getLastEventId,
+  getFdStats,
+  getStats,
+  getMemoryUsage,
+  setTracing,
+  getTrace,
+  listDirectory,
+  listDirectorySync,
+  digestFile,
+  loadTreeIndex,
+  drain,
+  onEventsAvailable,
+  ENTRY_FILE,
+  ENTRY_DIRECTORY,
+  ENTRY_SYMLINK,
   File,
   Directory
 };